@@ -62,6 +62,7 @@ typedef unsigned char method_t;
 method_t method = 1;                    /* the method we are using in our requests */
 
 coap_block_t block = { .num = 0, .m = 0, .szx = 6 };
+unsigned int fetch_window = 0;          /* concurrent Block2 requests, 0 if unused */
 
 unsigned int wait_seconds = 90;		/* default timeout in seconds */
 unsigned int wait_ms = 0;
@@ -532,6 +533,29 @@ message_handler(struct coap_context_t *ctx,
   ready = coap_check_option(received, COAP_OPTION_SUBSCRIPTION, &opt_iter) == NULL;
 }
 
+static void
+fetch_handler(coap_session_t *session UNUSED_PARAM,
+              unsigned char code,
+              size_t offset UNUSED_PARAM,
+              const uint8_t *data,
+              size_t length,
+              int last,
+              void *app_ptr UNUSED_PARAM) {
+  if (COAP_RESPONSE_CLASS(code) == 2) {
+    if (length)
+      append_to_output(data, length);
+  } else if (code) {
+    fprintf(stderr, "%d.%02d\n", (code >> 5), code & 0x1F);
+  } else {
+    fprintf(stderr, "block transfer failed\n");
+  }
+
+  wait_ms = wait_seconds * 1000;
+  wait_ms_reset = 1;
+  if (last)
+    ready = 1;
+}
+
 static void
 usage( const char *program, const char *version) {
   const char *p;
@@ -545,7 +569,7 @@ usage( const char *program, const char *version) {
      "usage: %s [-A type...] [-t type] [-b [num,]size] [-B seconds] [-e text]\n"
      "\t\t[-m method] [-N] [-o file] [-P addr[:port]] [-p port]\n"
      "\t\t[-s duration] [-O num,text] [-T string] [-v num] [-a addr] [-U]\n\n"
-     "\t\t[-u user] [-k key] URI\n\n"
+     "\t\t[-u user] [-k key] [-w num] URI\n\n"
      "\tURI can be an absolute or relative coap URI,\n"
      "\t-a addr\tthe local interface address to use\n"
      "\t-A type...\taccepted media types as comma-separated list of\n"
@@ -570,6 +594,8 @@ usage( const char *program, const char *version) {
      "\t-u user\t\tuser identity for pre-shared key mode. This argument\n"
      "\t       \t\trequires DTLS with PSK to be available.\n"
      "\t-v num\t\tverbosity level (default: 3)\n"
+     "\t-w num\t\tkeep up to num Block2 requests outstanding in GET\n"
+     "\t       \t\trequests (use only with servers that allow it)\n"
      "\t-O num,text\tadd option num with contents text to request\n"
      "\t-P addr[:port]\tuse proxy (automatically adds Proxy-Uri option to\n"
      "\t\t\trequest)\n"
@@ -1111,8 +1137,9 @@ main(int argc, char **argv) {
   unsigned char user[MAX_USER + 1], key[MAX_KEY];
   ssize_t user_length = 0, key_length = 0;
   int create_uri_opts = 1;
+  coap_opt_iterator_t opt_iter;
 
-  while ((opt = getopt(argc, argv, "Na:b:e:f:g:k:m:p:s:t:o:v:A:B:O:P:T:u:U:l:")) != -1) {
+  while ((opt = getopt(argc, argv, "Na:b:e:f:g:k:m:p:s:t:o:v:w:A:B:O:P:T:u:U:l:")) != -1) {
     switch (opt) {
     case 'a':
       strncpy(node_str, optarg, NI_MAXHOST - 1);
@@ -1189,6 +1216,9 @@ main(int argc, char **argv) {
     case 'v':
       log_level = strtol(optarg, NULL, 10);
       break;
+    case 'w':
+      fetch_window = atoi(optarg);
+      break;
     case 'l':
       if (!coap_debug_set_packet_loss(optarg)) {
 	usage(argv[0], LIBCOAP_PACKAGE_VERSION);
@@ -1305,7 +1335,18 @@ main(int argc, char **argv) {
   }
 #endif
 
-  tid = coap_send(session, pdu);
+  if (fetch_window && method == COAP_REQUEST_GET
+      && !coap_check_option(pdu, COAP_OPTION_SUBSCRIPTION, &opt_iter)) {
+    /* let the library fetch the blocks */
+    coap_block_fetch_t *fetch = coap_block_fetch(session, pdu, block.szx,
+                                                 fetch_window, fetch_handler,
+                                                 NULL);
+    coap_delete_pdu(pdu);
+    if (!fetch)
+      goto finish;
+  } else {
+    tid = coap_send(session, pdu);
+  }
 
   wait_ms = wait_seconds * 1000;
   debug("timeout is set to %u seconds\n", wait_seconds);
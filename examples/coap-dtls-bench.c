@@ -0,0 +1,616 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 * -*- */
+
+/* coap-dtls-bench -- handshake rates, latency and throughput of the DTLS
+ * library over loopback
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#include "getopt.c"
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <coap/coap.h>
+#include <coap/coap_dtls.h>
+
+/* The suites benchmarked by default, each on its own. */
+#define DEFAULT_CIPHERS "PSK-AES128-GCM-SHA256:PSK-AES256-GCM-SHA384:" \
+  "PSK-AES128-CCM8:PSK-AES128-CCM:PSK-CHACHA20-POLY1305:PSK-AES128-CBC-SHA256"
+
+/* The benchmarks run by default. */
+#define DEFAULT_BENCHMARKS "ciphers,handshake,resume,latency,throughput"
+
+/* The payload sizes of the throughput benchmark by default. */
+#define DEFAULT_SIZES "16,64,256,1024"
+
+#define DEADLINE 5              /* seconds to wait for a handshake or response */
+
+static const uint8_t key[] = "secretPSK";
+
+static unsigned char *payload;
+static size_t payload_size = 64;
+
+static int connected;           /* number of ends that have connected */
+static int responses;           /* number of responses received */
+static size_t received;         /* bytes of payload received */
+
+static int csv;                 /* set for machine-readable output */
+
+/* Returns a monotonic time in microseconds. The ticks of libcoap are too
+ * coarse for the latency of a single request. */
+static double
+now_us(void) {
+#ifdef _WIN32
+  LARGE_INTEGER count, frequency;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (double)count.QuadPart * 1e6 / (double)frequency.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#endif
+}
+
+/* Prints a result of benchmark for parameter, e.g. a cipher suite or a
+ * payload size. */
+static void
+report(const char *benchmark, const char *parameter,
+       const char *metric, double value, const char *unit) {
+  if (csv)
+    printf("%s,%s,%s,%s,%.3f,%s\n", coap_dtls_get_library(),
+           benchmark, parameter, metric, value, unit);
+  else
+    printf("%-10s %-28s %-14s %12.1f %s\n",
+           benchmark, parameter, metric, value, unit);
+}
+
+static void
+hnd_get(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *session, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  (void)ctx;
+  (void)resource;
+  (void)session;
+  (void)request;
+  (void)token;
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_data(response, (unsigned int)payload_size, payload);
+}
+
+static void
+response_handler(coap_context_t *ctx, coap_session_t *session,
+                 coap_pdu_t *sent, coap_pdu_t *received_pdu,
+                 const coap_tid_t id) {
+  size_t length;
+  unsigned char *data;
+  (void)ctx;
+  (void)session;
+  (void)sent;
+  (void)id;
+
+  if (coap_get_data(received_pdu, &length, &data))
+    received += length;
+  responses++;
+}
+
+static int
+event_handler(coap_context_t *ctx, coap_event_t event, void *data) {
+  (void)ctx;
+  (void)data;
+
+  if (event == COAP_EVENT_DTLS_CONNECTED)
+    connected++;
+  return 0;
+}
+
+/* Runs both contexts until *counter has reached value. Returns 1 on
+ * success, 0 if DEADLINE has passed. A context that has nothing to do
+ * waits for a millisecond, so the client is not run once the server has
+ * reached value. */
+static int
+run_until(coap_context_t *server, coap_context_t *client,
+          int *counter, int value) {
+  coap_tick_t start, now;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server, 1);
+    if (*counter < value)
+      coap_run_once(client, 1);
+    if (*counter >= value)
+      return 1;
+    coap_ticks(&now);
+  } while (now - start < DEADLINE * COAP_TICKS_PER_SECOND);
+  return 0;
+}
+
+/* Creates a context that offers cipher, or the default suites of the DTLS
+ * library if cipher is NULL. */
+static coap_context_t *
+new_context(const char *cipher, int server) {
+  coap_context_t *ctx = coap_new_context(NULL);
+
+  if (!ctx)
+    return NULL;
+  if (cipher && !coap_dtls_set_ciphers(ctx, cipher, server)) {
+    coap_free_context(ctx);
+    return NULL;
+  }
+  coap_set_event_handler(ctx, event_handler);
+  if (!server)
+    coap_register_response_handler(ctx, response_handler);
+  return ctx;
+}
+
+/* Creates a server at addr with the benchmark resource. */
+static coap_context_t *
+new_server(const char *cipher, coap_address_t *addr) {
+  coap_context_t *server = new_context(cipher, 1);
+  coap_resource_t *r;
+
+  if (!server)
+    return NULL;
+  coap_context_set_psk(server, "", key, sizeof(key) - 1);
+  if (!coap_new_endpoint(server, addr, COAP_PROTO_DTLS)) {
+    coap_free_context(server);
+    return NULL;
+  }
+  r = coap_resource_init((unsigned char *)"bench", 5, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server, r);
+  return server;
+}
+
+/* Connects a new session of client to the server. */
+static coap_session_t *
+connect_session(coap_context_t *server, coap_context_t *client,
+                coap_address_t *addr) {
+  coap_session_t *session;
+
+  connected = 0;
+  session = coap_new_client_session_psk(client, NULL, addr, COAP_PROTO_DTLS,
+                                        "bench", key, sizeof(key) - 1);
+  if (session && !run_until(server, client, &connected, 2)) {
+    coap_session_release(session);
+    session = NULL;
+  }
+  return session;
+}
+
+/* Releases the client context and then the server context if not NULL.
+ * The server takes the close_notify alerts of the client in between. */
+static void
+free_contexts(coap_context_t *server, coap_context_t *client) {
+  coap_free_context(client);
+  if (server) {
+    coap_run_once(server, 10);
+    coap_free_context(server);
+  }
+}
+
+/* Sends a request for the benchmark resource and waits for the response.
+ * Returns 1 on success, 0 on error. */
+static int
+request(coap_context_t *server, coap_context_t *client,
+        coap_session_t *session) {
+  coap_pdu_t *pdu = coap_new_pdu(session);
+
+  if (!pdu)
+    return 0;
+  pdu->hdr->type = COAP_MESSAGE_CON;
+  pdu->hdr->code = COAP_REQUEST_GET;
+  pdu->hdr->id = coap_new_message_id(client);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 5,
+                  (const unsigned char *)"bench");
+  responses = 0;
+  return coap_send(session, pdu) != COAP_INVALID_TID
+    && run_until(server, client, &responses, 1);
+}
+
+/* Sends count requests one after another. If latency is not NULL, the
+ * round-trip time of each request is stored in it. Returns the number of
+ * seconds taken or a negative value on error. */
+static double
+exchange(coap_context_t *server, coap_context_t *client,
+         coap_session_t *session, unsigned int count, double *latency) {
+  double start, sent;
+  unsigned int n;
+
+  received = 0;
+  start = now_us();
+  for (n = 0; n < count; n++) {
+    sent = latency ? now_us() : 0;
+    if (!request(server, client, session))
+      return -1;
+    if (latency)
+      latency[n] = now_us() - sent;
+  }
+  return (now_us() - start) / 1e6;
+}
+
+/* Measures the records per second exchanged with cipher, which is the
+ * only suite offered by the client and accepted by the server. */
+static int
+bench_cipher(const char *cipher, coap_address_t *addr, unsigned int count) {
+  coap_context_t *server, *client = NULL;
+  coap_session_t *session = NULL;
+  double seconds;
+  int result = 0;
+
+  server = new_server(cipher, addr);
+  if (server)
+    client = new_context(cipher, 0);
+  if (!server || !client) {
+    fprintf(stderr, "%s: not supported\n", cipher);
+    free_contexts(NULL, server);
+    return 1;
+  }
+
+  session = connect_session(server, client, addr);
+  if (!session) {
+    fprintf(stderr, "%s: handshake failed\n", cipher);
+    goto finish;
+  }
+
+  seconds = exchange(server, client, session, count, NULL);
+  if (seconds < 0) {
+    fprintf(stderr, "%s: exchange failed\n", cipher);
+    goto finish;
+  }
+
+  /* a request and its piggybacked response per exchange */
+  report("ciphers", coap_dtls_get_cipher(session), "records",
+         seconds > 0 ? 2 * count / seconds : 0, "1/s");
+  report("ciphers", coap_dtls_get_cipher(session), "overhead",
+         coap_dtls_get_overhead(session), "bytes");
+  result = 1;
+
+ finish:
+  if (session)
+    coap_session_release(session);
+  free_contexts(server, client);
+  return result;
+}
+
+/* Measures the rate of full handshakes if resume is 0, else that of
+ * handshakes that resume the session of the first one. */
+static int
+bench_handshake(int resume, coap_address_t *addr, unsigned int count) {
+  const char *benchmark = resume ? "resume" : "handshake";
+  coap_context_t *server, *client = NULL;
+  coap_session_t *session;
+  coap_dtls_handshake_stats_t before, after;
+  double start, seconds = 0;
+  unsigned int n;
+  int result = 0;
+
+  server = new_server(NULL, addr);
+  if (!server)
+    return 0;
+
+  /* sessions are resumed only by libraries that count handshakes */
+  if (!coap_dtls_get_handshake_stats(server, &before) && resume) {
+    fprintf(stderr, "%s: not supported\n", benchmark);
+    result = 1;
+    goto finish;
+  }
+
+  if (resume) {
+    client = new_context(NULL, 0);
+    session = client ? connect_session(server, client, addr) : NULL;
+    if (!session)
+      goto finish;
+    coap_session_release(session);
+    coap_run_once(server, 10);
+  }
+
+  coap_dtls_get_handshake_stats(server, &before);
+  for (n = 0; n < count; n++) {
+    if (!resume) {
+      client = new_context(NULL, 0);
+      if (!client)
+        goto finish;
+    }
+    start = now_us();
+    session = connect_session(server, client, addr);
+    seconds += (now_us() - start) / 1e6;
+    if (!session) {
+      fprintf(stderr, "%s: handshake failed\n", benchmark);
+      goto finish;
+    }
+    /* the server takes the close_notify alert outside of the time taken */
+    coap_session_release(session);
+    if (!resume) {
+      coap_free_context(client);
+      client = NULL;
+    }
+    coap_run_once(server, 10);
+  }
+
+  if (coap_dtls_get_handshake_stats(server, &after)
+      && after.resumed - before.resumed != (resume ? count : 0)) {
+    fprintf(stderr, "%s: %lu of %u handshakes resumed\n", benchmark,
+            after.resumed - before.resumed, count);
+    goto finish;
+  }
+
+  report(benchmark, "default", "handshakes",
+         seconds > 0 ? count / seconds : 0, "1/s");
+  report(benchmark, "default", "mean",
+         count ? seconds * 1e3 / count : 0, "ms");
+  result = 1;
+
+ finish:
+  free_contexts(server, client);
+  return result;
+}
+
+static int
+compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Measures percentiles of the round-trip time of a request. */
+static int
+bench_latency(coap_address_t *addr, unsigned int count) {
+  static const struct {
+    const char *name;
+    double fraction;
+  } percentiles[] = {
+    { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p99.9", 0.999 },
+    { "max", 1.0 }
+  };
+  coap_context_t *server, *client = NULL;
+  coap_session_t *session = NULL;
+  double *latency;
+  unsigned int n;
+  size_t i;
+  int result = 0;
+
+  if (!count)
+    return 1;
+  latency = (double *)malloc(count * sizeof(double));
+  server = new_server(NULL, addr);
+  if (server)
+    client = new_context(NULL, 0);
+  if (latency && client)
+    session = connect_session(server, client, addr);
+  if (!session || exchange(server, client, session, count, latency) < 0) {
+    fprintf(stderr, "latency: exchange failed\n");
+    goto finish;
+  }
+
+  qsort(latency, count, sizeof(double), compare_double);
+  for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+    n = (unsigned int)(percentiles[i].fraction * count);
+    report("latency", coap_dtls_get_cipher(session), percentiles[i].name,
+           latency[n < count ? n : count - 1], "us");
+  }
+  result = 1;
+
+ finish:
+  if (session)
+    coap_session_release(session);
+  free_contexts(server, client);
+  free(latency);
+  return result;
+}
+
+/* Measures the payload delivered per second in responses of each of the
+ * comma-separated sizes. */
+static int
+bench_throughput(char *sizes, coap_address_t *addr, unsigned int count) {
+  coap_context_t *server, *client = NULL;
+  coap_session_t *session = NULL;
+  char *size, *next, parameter[16];
+  double seconds;
+  int result = 0;
+
+  server = new_server(NULL, addr);
+  if (server)
+    client = new_context(NULL, 0);
+  if (client)
+    session = connect_session(server, client, addr);
+  if (!session) {
+    fprintf(stderr, "throughput: handshake failed\n");
+    goto finish;
+  }
+
+  for (size = sizes; size; size = next) {
+    next = strchr(size, ',');
+    if (next)
+      *next++ = '\0';
+    payload_size = (size_t)strtoul(size, NULL, 10);
+    seconds = exchange(server, client, session, count, NULL);
+    if (seconds < 0) {
+      fprintf(stderr, "throughput: exchange failed\n");
+      goto finish;
+    }
+    if (received != payload_size * count)
+      fprintf(stderr, "throughput: %u bytes do not fit into a response\n",
+              (unsigned int)payload_size);
+
+    snprintf(parameter, sizeof(parameter), "%u", (unsigned int)payload_size);
+    report("throughput", parameter, "requests",
+           seconds > 0 ? count / seconds : 0, "1/s");
+    report("throughput", parameter, "payload",
+           seconds > 0 ? received / seconds / 1e3 : 0, "kB/s");
+  }
+  result = 1;
+
+ finish:
+  if (session)
+    coap_session_release(session);
+  free_contexts(server, client);
+  return result;
+}
+
+static void
+usage(const char *program, const char *version) {
+  const char *p;
+
+  p = strrchr(program, '/');
+  if (p)
+    program = ++p;
+
+  fprintf(stderr, "%s v%s -- benchmark of the DTLS library\n"
+     "(c) 2017 Olaf Bergmann <bergmann@tzi.org>\n\n"
+     "usage: %s [-b benchmarks] [-c ciphers] [-f] [-h count] [-n count]\n"
+     "\t\t[-p port] [-s sizes] [-v num]\n\n"
+     "\t-b benchmarks\tcomma-separated list of ciphers, handshake, resume,\n"
+     "\t\t\tlatency and throughput (default: all)\n"
+     "\t-c ciphers\tcolon-separated list of the suites to benchmark\n"
+     "\t-f\t\tprint comma-separated values: library, benchmark,\n"
+     "\t\t\tparameter, metric, value and unit\n"
+     "\t-h count\tnumber of handshakes (default: 200)\n"
+     "\t-n count\tnumber of requests per measurement (default: 10000)\n"
+     "\t-p port\t\tfirst loopback port of the servers (default: 20220)\n"
+     "\t-s sizes\tcomma-separated payload sizes of the responses\n"
+     "\t\t\t(default: " DEFAULT_SIZES ")\n"
+     "\t-v num\t\tverbosity level (default: 3)\n",
+    program, version, program);
+}
+
+/* Returns 1 if name is in the comma-separated list of benchmarks. */
+static int
+selected(const char *benchmarks, const char *name) {
+  size_t length = strlen(name);
+  const char *p;
+
+  for (p = benchmarks; p; p = strchr(p, ',')) {
+    if (*p == ',')
+      p++;
+    if (strncmp(p, name, length) == 0 && (p[length] == ',' || !p[length]))
+      return 1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv) {
+  const char *benchmarks = DEFAULT_BENCHMARKS;
+  char *ciphers = NULL, *cipher, *next;
+  char *sizes = NULL;
+  unsigned int count = 10000, handshakes = 200;
+  int port = 20220;
+  coap_address_t addr;
+  coap_log_t log_level = LOG_WARNING;
+  int opt, result = 0;
+
+  while ((opt = getopt(argc, argv, "b:c:fh:n:p:s:v:")) != -1) {
+    switch (opt) {
+    case 'b':
+      benchmarks = optarg;
+      break;
+    case 'c':
+      ciphers = optarg;
+      break;
+    case 'f':
+      csv = 1;
+      break;
+    case 'h':
+      handshakes = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      count = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 's':
+      sizes = optarg;
+      break;
+    case 'v':
+      log_level = strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0], LIBCOAP_PACKAGE_VERSION);
+      exit(1);
+    }
+  }
+
+  coap_startup();
+  coap_dtls_set_log_level(log_level);
+  coap_set_log_level(log_level);
+
+  if (!coap_dtls_is_supported()) {
+    fprintf(stderr, "DTLS is not supported\n");
+    return 1;
+  }
+
+  /* large enough for any size of the throughput benchmark */
+  payload = (unsigned char *)calloc(1, COAP_MAX_PDU_SIZE);
+  ciphers = strdup(ciphers ? ciphers : DEFAULT_CIPHERS);
+  sizes = strdup(sizes ? sizes : DEFAULT_SIZES);
+  if (!payload || !ciphers || !sizes)
+    return 1;
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (csv)
+    printf("library,benchmark,parameter,metric,value,unit\n");
+
+  /* a new port for each server, as the last may still be in use */
+  if (selected(benchmarks, "ciphers")) {
+    for (cipher = ciphers; cipher; cipher = next) {
+      next = strchr(cipher, ':');
+      if (next)
+        *next++ = '\0';
+      addr.addr.sin.sin_port = htons(port++);
+      if (*cipher && !bench_cipher(cipher, &addr, count))
+        result = 1;
+    }
+  }
+
+  if (selected(benchmarks, "handshake")) {
+    addr.addr.sin.sin_port = htons(port++);
+    if (!bench_handshake(0, &addr, handshakes))
+      result = 1;
+  }
+
+  if (selected(benchmarks, "resume")) {
+    addr.addr.sin.sin_port = htons(port++);
+    if (!bench_handshake(1, &addr, handshakes))
+      result = 1;
+  }
+
+  if (selected(benchmarks, "latency")) {
+    payload_size = 64;
+    addr.addr.sin.sin_port = htons(port++);
+    if (!bench_latency(&addr, count))
+      result = 1;
+  }
+
+  if (selected(benchmarks, "throughput")) {
+    addr.addr.sin.sin_port = htons(port++);
+    if (!bench_throughput(sizes, &addr, count))
+      result = 1;
+  }
+
+  free(sizes);
+  free(ciphers);
+  free(payload);
+  return result;
+}
@@ -52,6 +52,9 @@ struct coap_resource_t *time_resource = NULL;
 /* This variable is used to mimic long-running tasks that require
  * asynchronous responses. */
 static coap_async_state_t *async = NULL;
+
+/* Seconds after which a pending asynchronous transaction is dropped. */
+#define ASYNC_TIMEOUT 300
 #endif /* WITHOUT_ASYNC */
 
 #ifdef __GNUC__
@@ -249,17 +252,13 @@ check_async(coap_context_t *ctx,
             const coap_endpoint_t *local_if,
             coap_tick_t now) {
   coap_pdu_t *response;
-  coap_async_state_t *tmp;
 
   size_t size = sizeof(coap_hdr_t) + 13;
 
   if (!async || now < async->created + (unsigned long)async->appdata)
     return;
 
-  response = coap_pdu_init(async->flags & COAP_ASYNC_CONFIRM
-             ? COAP_MESSAGE_CON
-             : COAP_MESSAGE_NON,
-             COAP_RESPONSE_CODE(205), 0, size);
+  response = coap_pdu_init(0, COAP_RESPONSE_CODE(205), 0, size);
   if (!response) {
     debug("check_async: insufficient memory, we'll try later\n");
     async->appdata =
@@ -267,57 +266,72 @@ check_async(coap_context_t *ctx,
     return;
   }
 
-  response->hdr->id = coap_new_message_id(ctx);
-
-  if (async->tokenlen)
-    coap_add_token(response, async->tokenlen, async->token);
-
   coap_add_data(response, 4, (unsigned char *)"done");
 
-  if (coap_send(async->session, response) == COAP_INVALID_TID) {
-    debug("check_async: cannot send response for message %d\n",
-    ntohs(response->hdr->id));
-  }
-  coap_remove_async(ctx, async->session, async->id, &tmp);
-  coap_free_async(async);
+  /* answers all identical requests that arrived in the meantime */
+  if (!coap_async_complete(ctx, async, response))
+    debug("check_async: cannot send response\n");
   async = NULL;
 }
+
+/* Drops a transaction whose client has asked for an excessive delay. */
+static void
+async_expired(coap_context_t *ctx UNUSED_PARAM, coap_async_state_t *state) {
+  if (state == async)
+    async = NULL;
+}
 #endif /* WITHOUT_ASYNC */
 
+static const coap_static_attr_t index_attrs[] = {
+  COAP_STATIC_ATTR("ct", "0"),
+  COAP_STATIC_ATTR("title", "\"General Info\""),
+  COAP_STATIC_ATTR_END
+};
+
+static const coap_static_attr_t time_attrs[] = {
+  COAP_STATIC_ATTR("ct", "0"),
+  COAP_STATIC_ATTR("title", "\"Internal Clock\""),
+  COAP_STATIC_ATTR("rt", "\"Ticks\""),
+  COAP_STATIC_ATTR("if", "\"clock\""),
+  COAP_STATIC_ATTR_END
+};
+
+/* handlers for GET, POST, PUT, DELETE */
+static const coap_static_resource_t static_resources[] = {
+  { { 0, NULL }, 0, 0,
+    { hnd_get_index }, index_attrs },
+  { COAP_STR_LITERAL("time"), COAP_RESOURCE_FLAGS_NOTIFY_CON, 1,
+    { hnd_get_time, NULL, hnd_put_time, hnd_delete_time }, time_attrs }
+};
+
+#define NUM_STATIC_RESOURCES \
+  (sizeof(static_resources) / sizeof(static_resources[0]))
+
+static coap_resource_t static_storage[NUM_STATIC_RESOURCES];
+
 static void
 init_resources(coap_context_t *ctx) {
+#ifndef WITHOUT_ASYNC
   coap_resource_t *r;
-
-  r = coap_resource_init(NULL, 0, 0);
-  coap_register_handler(r, COAP_REQUEST_GET, hnd_get_index);
-
-  coap_add_attr(r, (unsigned char *)"ct", 2, (unsigned char *)"0", 1, 0);
-  coap_add_attr(r, (unsigned char *)"title", 5, (unsigned char *)"\"General Info\"", 14, 0);
-  coap_add_resource(ctx, r);
+#endif /* WITHOUT_ASYNC */
 
   /* store clock base to use in /time */
   my_clock_base = clock_offset;
 
-  r = coap_resource_init((unsigned char *)"time", 4, COAP_RESOURCE_FLAGS_NOTIFY_CON);
-  coap_register_handler(r, COAP_REQUEST_GET, hnd_get_time);
-  coap_register_handler(r, COAP_REQUEST_PUT, hnd_put_time);
-  coap_register_handler(r, COAP_REQUEST_DELETE, hnd_delete_time);
-
-  coap_add_attr(r, (unsigned char *)"ct", 2, (unsigned char *)"0", 1, 0);
-  coap_add_attr(r, (unsigned char *)"title", 5, (unsigned char *)"\"Internal Clock\"", 16, 0);
-  coap_add_attr(r, (unsigned char *)"rt", 2, (unsigned char *)"\"Ticks\"", 7, 0);
-  r->observable = 1;
-  coap_add_attr(r, (unsigned char *)"if", 2, (unsigned char *)"\"clock\"", 7, 0);
-
-  coap_add_resource(ctx, r);
-  time_resource = r;
+  coap_add_static_resources(ctx, static_resources, NUM_STATIC_RESOURCES,
+                            static_storage);
+  time_resource = &static_storage[1];
 
 #ifndef WITHOUT_ASYNC
-  r = coap_resource_init((unsigned char *)"async", 5, 0);
+  r = coap_resource_init((unsigned char *)"async", 5,
+                         COAP_RESOURCE_FLAGS_COALESCE);
   coap_register_handler(r, COAP_REQUEST_GET, hnd_get_async);
 
   coap_add_attr(r, (unsigned char *)"ct", 2, (unsigned char *)"0", 1, 0);
   coap_add_resource(ctx, r);
+
+  coap_context_set_async_timeout(ctx, ASYNC_TIMEOUT);
+  coap_register_async_expire_handler(ctx, async_expired);
 #endif /* WITHOUT_ASYNC */
 }
 
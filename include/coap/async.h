@@ -16,6 +16,7 @@
 #define _COAP_ASYNC_H_
 
 #include "net.h"
+#include "uthash.h"
 
 #ifndef WITHOUT_ASYNC
 
@@ -27,6 +28,13 @@
  * used to generate a separate response in case a result of an operation cannot
  * be delivered in time, or the resource has been explicitly subscribed to with
  * the option @c observe.
+ *
+ * The states registered with a context are indexed by session and
+ * transaction id. If an expiry timeout has been set with
+ * coap_context_set_async_timeout(), states that have not been touched
+ * for that time are removed by coap_write() and passed to the handler
+ * set with coap_register_async_expire_handler() before they are
+ * released.
  */
 typedef struct coap_async_state_t {
   unsigned char flags;  /**< holds the flags to control behaviour */
@@ -47,6 +55,19 @@ typedef struct coap_async_state_t {
   coap_session_t *session;	   /**< transaction session */
   coap_tid_t id;                   /**< transaction id */
   struct coap_async_state_t *next; /**< internally used for linking */
+  UT_hash_handle hh;               /**< hash handle (for internal use only) */
+  /** key of hh, made of session and id (for internal use only) */
+  unsigned char hkey[sizeof(coap_session_t *) + sizeof(coap_tid_t)];
+
+  /**
+   * The resource of a GET request that accepts identical requests to be
+   * coalesced with it (see COAP_RESOURCE_FLAGS_COALESCE), or @c NULL.
+   */
+  struct coap_resource_t *resource;
+  struct coap_async_state_t *coalesced; /**< parked requests to answer */
+  UT_hash_handle chh;              /**< hash handle of coalescing requests */
+  unsigned char *key;              /**< cache key of a coalescing request */
+  size_t keylen;                   /**< length of the cache key */
   size_t tokenlen;                 /**< length of the token */
   unsigned char token[];           /**< the token to use in a response */
 } coap_async_state_t;
@@ -109,10 +130,75 @@ int coap_remove_async(coap_context_t *context,
                       coap_tid_t id,
                       coap_async_state_t **s);
 
+/**
+ * Sends the result of the asynchronous transaction @p s to the requester
+ * and to all requests that have been coalesced with @p s. Each receiver
+ * gets a copy of @p response with its own token and a new message id,
+ * sent confirmable if the respective request was confirmable. Code,
+ * options and payload are taken from @p response, its header and token
+ * are ignored. @p s is removed from @p context and released, as is
+ * @p response.
+ *
+ * @param context  The context where @p s is registered.
+ * @param s        The asynchronous transaction to complete.
+ * @param response The response to send.
+ *
+ * @return The number of responses that have been passed to coap_send().
+ */
+int coap_async_complete(coap_context_t *context,
+                        coap_async_state_t *s,
+                        coap_pdu_t *response);
+
+/**
+ * Parks @p request if an identical GET request on @p resource is being
+ * handled asynchronously. A parked request is answered when the pending
+ * transaction is completed with coap_async_complete(). This function is
+ * called for requests on resources with COAP_RESOURCE_FLAGS_COALESCE set
+ * before the GET handler is invoked.
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource that was requested.
+ * @param session  The session the request was received on.
+ * @param request  The request.
+ *
+ * @return @c 1 if @p request has been parked and the handler must not be
+ *         invoked, @c 0 otherwise.
+ */
+int coap_async_coalesce(coap_context_t *context,
+                        struct coap_resource_t *resource,
+                        coap_session_t *session,
+                        coap_pdu_t *request);
+
+/**
+ * Allows identical GET requests to be coalesced with @p request if the
+ * GET handler of @p resource has registered @p request for asynchronous
+ * handling.
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource that was requested.
+ * @param session  The session the request was received on.
+ * @param request  The request that has been passed to the GET handler.
+ */
+void coap_async_enable_coalescing(coap_context_t *context,
+                                  struct coap_resource_t *resource,
+                                  coap_session_t *session,
+                                  coap_pdu_t *request);
+
+/**
+ * Stops coalescing requests for @p resource. Requests that have been parked
+ * already are still answered by coap_async_complete().
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource that is deleted.
+ */
+void coap_async_detach_resource(coap_context_t *context,
+                                struct coap_resource_t *resource);
+
 /**
  * Releases the memory that was allocated by coap_async_state_init() for the
  * object @p s. The registered application data will be released automatically
- * if COAP_ASYNC_RELEASE_DATA is set.
+ * if COAP_ASYNC_RELEASE_DATA is set. Requests coalesced with @p s are
+ * released without being answered.
  *
  * @param state The object to delete.
  */
@@ -135,15 +221,68 @@ coap_free_async(coap_async_state_t *state);
 coap_async_state_t *coap_find_async(coap_context_t *context, coap_session_t *session, coap_tid_t id);
 
 /**
- * Updates the time stamp of @p s.
+ * Updates the time stamp of @p s. This restarts the expiry timeout of
+ * @p s.
  *
  * @param s The state object to update.
  */
 COAP_STATIC_INLINE void
 coap_touch_async(coap_async_state_t *s) { coap_ticks(&s->created); }
 
+/**
+ * Sets the time after which asynchronous states of @p context that have
+ * not been completed or touched expire. A value of @c 0 (the default)
+ * disables expiry.
+ *
+ * @param context The CoAP context.
+ * @param seconds The expiry timeout in seconds.
+ */
+void coap_context_set_async_timeout(coap_context_t *context,
+                                    unsigned int seconds);
+
+/**
+ * Registers a handler that is called for each asynchronous state of
+ * @p context that expires, and for each state that is still registered
+ * when @p context is released. The handler may release the application
+ * data of the state but must not release the state itself. Requests
+ * coalesced with the state are released without being answered.
+ *
+ * @param context The CoAP context.
+ * @param handler The handler to call or @c NULL.
+ */
+COAP_STATIC_INLINE void
+coap_register_async_expire_handler(coap_context_t *context,
+                                   coap_async_expire_handler_t handler) {
+  context->async_expire_handler = handler;
+}
+
+/**
+ * Removes and releases the asynchronous states of @p context that have
+ * expired. This function is called by coap_write().
+ *
+ * @param context The CoAP context.
+ * @param now     The current time.
+ *
+ * @return The time of the next expiry or @c 0 if there is none.
+ */
+coap_tick_t coap_check_async_timeouts(coap_context_t *context,
+                                      coap_tick_t now);
+
+/**
+ * Removes and releases all asynchronous states of @p context. This
+ * function is called by coap_free_context().
+ *
+ * @param context The CoAP context.
+ */
+void coap_free_all_async(coap_context_t *context);
+
 /** @} */
 
+#else /* WITHOUT_ASYNC */
+
+#define coap_check_async_timeouts(Context, Now) 0
+#define coap_free_all_async(Context)
+
 #endif /*  WITHOUT_ASYNC */
 
 #endif /* _COAP_ASYNC_H_ */
@@ -13,6 +13,34 @@
 #include "encode.h"
 #include "option.h"
 #include "pdu.h"
+#include "coap_session.h"
+
+/* Large responses rely on dynamic memory for the transfer state. */
+#if !defined(WITHOUT_LARGE_RESPONSE) \
+  && (defined(WITHOUT_BLOCK) || defined(WITH_CONTIKI) || defined(WITH_LWIP))
+#define WITHOUT_LARGE_RESPONSE
+#endif
+
+/* Likewise, reassembly of Block1 requests needs dynamic memory. */
+#if !defined(WITHOUT_LARGE_REQUEST) \
+  && (defined(WITHOUT_BLOCK) || defined(WITH_CONTIKI) || defined(WITH_LWIP))
+#define WITHOUT_LARGE_REQUEST
+#endif
+
+/* Concurrent Block2 fetches buffer blocks that arrive out of order. */
+#if !defined(WITHOUT_BLOCK_FETCH) \
+  && (defined(WITHOUT_BLOCK) || defined(WITH_CONTIKI) || defined(WITH_LWIP))
+#define WITHOUT_BLOCK_FETCH
+#endif
+
+/* Q-Block transfers (RFC 9177) extend the three engines above. */
+#if !defined(WITHOUT_Q_BLOCK) \
+  && (defined(WITHOUT_LARGE_RESPONSE) || defined(WITHOUT_LARGE_REQUEST) \
+      || defined(WITHOUT_BLOCK_FETCH))
+#define WITHOUT_Q_BLOCK
+#endif
+
+struct coap_resource_t;
 
 /**
  * @defgroup block Block Transfer
@@ -132,6 +160,569 @@ int coap_add_block(coap_pdu_t *pdu,
                    const unsigned char *data,
                    unsigned int block_num,
                    unsigned char block_szx);
+
+#ifndef COAP_BLOCK_PDU_OVERHEAD
+/**
+ * Space reserved by coap_session_max_block_szx() for the header, token
+ * and options of a message that carries a block.
+ */
+#define COAP_BLOCK_PDU_OVERHEAD 64
+#endif /* COAP_BLOCK_PDU_OVERHEAD */
+
+/**
+ * Returns the largest block size, as SZX value, whose blocks fit into a
+ * message on @p session with COAP_BLOCK_PDU_OVERHEAD bytes to spare. The
+ * result follows the session MTU, e.g. when it is lowered by path MTU
+ * discovery, and does not exceed COAP_MAX_BLOCK_SZX.
+ *
+ * @param session The session.
+ *
+ * @return The largest suitable SZX value, @c 0 if even the smallest
+ *         blocks do not fit.
+ */
+unsigned int coap_session_max_block_szx(coap_session_t *session);
+
+/**
+ * Callback that releases the data passed to coap_add_data_large_response()
+ * once the library does not need it anymore.
+ *
+ * @param session The session the data was sent on.
+ * @param app_ptr The application pointer passed with the data.
+ */
+typedef void (*coap_release_large_data_t)(coap_session_t *session,
+                                          void *app_ptr);
+
+#ifndef COAP_LARGE_RESPONSE_TIMEOUT
+/**
+ * Number of seconds a large response is kept for subsequent Block2
+ * requests after the last block has been requested.
+ */
+#define COAP_LARGE_RESPONSE_TIMEOUT 30
+#endif /* COAP_LARGE_RESPONSE_TIMEOUT */
+
+#ifndef COAP_MAX_LARGE_RESPONSES
+/** Maximum number of large responses kept per session. */
+#define COAP_MAX_LARGE_RESPONSES 4
+#endif /* COAP_MAX_LARGE_RESPONSES */
+
+#ifndef WITHOUT_LARGE_RESPONSE
+
+/**
+ * Adds the representation @p data of @p length bytes to @p response,
+ * using Block2 when it does not fit into a single message. The caller
+ * sets the response code and any options (e.g. Content-Format, Max-Age)
+ * before. The library adds ETag (unless set already), Block2 and Size2
+ * as needed and keeps the representation for subsequent Block2 requests
+ * with the same token or ETag on @p session, which are then answered
+ * without calling the handler again. The block size requested by the
+ * client is reduced if it does not fit into the session's PDU size.
+ *
+ * The representation is released when its last block has been sent, after
+ * COAP_LARGE_RESPONSE_TIMEOUT seconds without a request, or when the
+ * session is closed.
+ *
+ * @param resource The resource the request was made to.
+ * @param session  The session the request was received on.
+ * @param request  The request.
+ * @param response The response to fill.
+ * @param length   The length of @p data.
+ * @param data     The complete representation.
+ * @param release  Function to release @p data when it is no longer
+ *                 needed. If @c NULL, @p data is copied and the caller
+ *                 keeps ownership.
+ * @param app_ptr  Application pointer passed to @p release.
+ *
+ * @return @c 1 on success, @c 0 on error. In case of error, @p release
+ *         has been called already.
+ */
+int coap_add_data_large_response(struct coap_resource_t *resource,
+                                 coap_session_t *session,
+                                 coap_pdu_t *request,
+                                 coap_pdu_t *response,
+                                 size_t length,
+                                 const uint8_t *data,
+                                 coap_release_large_data_t release,
+                                 void *app_ptr);
+
+/**
+ * Fills @p response with the next block of a representation that has been
+ * added with coap_add_data_large_response() if @p request is a GET for
+ * a block other than the first with a matching token or ETag.
+ *
+ * @param resource The resource the request was made to.
+ * @param session  The session the request was received on.
+ * @param request  The request.
+ * @param response The response with its token already set.
+ *
+ * @return @c 1 if @p response has been filled, @c 0 otherwise.
+ */
+int coap_large_response_get(struct coap_resource_t *resource,
+                            coap_session_t *session,
+                            coap_pdu_t *request,
+                            coap_pdu_t *response);
+
+/**
+ * Releases all large responses that are kept for @p session.
+ *
+ * @param session The session.
+ */
+void coap_free_large_responses(coap_session_t *session);
+
+#else /* WITHOUT_LARGE_RESPONSE */
+
+#define coap_large_response_get(Resource, Session, Request, Response) 0
+#define coap_free_large_responses(Session)
+
+#endif /* WITHOUT_LARGE_RESPONSE */
+
+/**
+ * Callback that receives the payload of a Block1 transfer that is
+ * reassembled by the library. The blocks are passed in order, each exactly
+ * once. @p app_ptr is @c NULL for the first block and may be set by the
+ * sink to refer to its own state, e.g. a file descriptor. The same value is
+ * passed for subsequent blocks, returned by coap_get_data_large_request()
+ * and finally passed to the release callback set with
+ * coap_context_set_large_request_sink().
+ *
+ * @param session  The session the request was received on.
+ * @param resource The resource the request was made to.
+ * @param request  The request that carries the block.
+ * @param offset   The offset of @p data within the body.
+ * @param data     The payload of the block.
+ * @param length   The length of @p data.
+ * @param app_ptr  The application pointer of the transfer.
+ *
+ * @return @c 1 on success, @c 0 to abort the transfer with 5.00.
+ */
+typedef int (*coap_large_request_sink_t)(coap_session_t *session,
+                                         struct coap_resource_t *resource,
+                                         coap_pdu_t *request,
+                                         size_t offset,
+                                         const uint8_t *data,
+                                         size_t length,
+                                         void **app_ptr);
+
+#ifndef COAP_LARGE_REQUEST_TIMEOUT
+/**
+ * Number of seconds a partially received Block1 transfer is kept after
+ * its last block.
+ */
+#define COAP_LARGE_REQUEST_TIMEOUT 60
+#endif /* COAP_LARGE_REQUEST_TIMEOUT */
+
+#ifndef COAP_LARGE_REQUEST_DEFAULT_MAX_SIZE
+/** Default maximum body size of a reassembled Block1 transfer. */
+#define COAP_LARGE_REQUEST_DEFAULT_MAX_SIZE (64 * 1024)
+#endif /* COAP_LARGE_REQUEST_DEFAULT_MAX_SIZE */
+
+#ifndef COAP_LARGE_REQUEST_DEFAULT_MAX_TRANSFERS
+/** Default maximum number of concurrent Block1 transfers per context. */
+#define COAP_LARGE_REQUEST_DEFAULT_MAX_TRANSFERS 8
+#endif /* COAP_LARGE_REQUEST_DEFAULT_MAX_TRANSFERS */
+
+#ifndef WITHOUT_LARGE_REQUEST
+
+struct coap_context_t;
+
+/**
+ * Sets the sink for Block1 transfers to resources that have the flag
+ * COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1 set. Without a sink, the library
+ * buffers the body in memory. With a sink, each block is passed on as it
+ * arrives and only the transfer state is kept, so that the memory needed
+ * does not depend on the body size.
+ *
+ * @param context The CoAP context.
+ * @param sink    The sink or @c NULL to buffer bodies in memory.
+ * @param release Called with the sink's application pointer when a
+ *                transfer is finished or aborted. May be @c NULL.
+ */
+void coap_context_set_large_request_sink(struct coap_context_t *context,
+                                         coap_large_request_sink_t sink,
+                                         coap_release_large_data_t release);
+
+/**
+ * Limits Block1 transfers that are reassembled by the library. Requests
+ * with a larger body are rejected with 4.13 and a Size1 option, new
+ * transfers beyond @p max_transfers are rejected with 5.03. A value of
+ * @c 0 selects COAP_LARGE_REQUEST_DEFAULT_MAX_SIZE or
+ * COAP_LARGE_REQUEST_DEFAULT_MAX_TRANSFERS, respectively.
+ *
+ * @param context       The CoAP context.
+ * @param max_size      The maximum body size in bytes.
+ * @param max_transfers The maximum number of concurrent transfers.
+ */
+void coap_context_set_large_request_limits(struct coap_context_t *context,
+                                           size_t max_size,
+                                           unsigned int max_transfers);
+
+/**
+ * Retrieves the body of a request in the handler of a resource that has
+ * the flag COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1 set. For a reassembled
+ * Block1 transfer, @p length is the total body size and @p data points to
+ * the buffered body, or is @c NULL if a sink has consumed the blocks, in
+ * which case @p app_ptr is the sink's application pointer. For requests
+ * without Block1, the payload of @p request is returned.
+ *
+ * @param session The session the request was received on.
+ * @param request The request passed to the handler.
+ * @param length  Set to the length of the body.
+ * @param data    Set to the body or @c NULL.
+ * @param app_ptr Set to the sink's application pointer or @c NULL.
+ *
+ * @return @c 1 if there is a body, @c 0 otherwise.
+ */
+int coap_get_data_large_request(coap_session_t *session,
+                                coap_pdu_t *request,
+                                size_t *length,
+                                const uint8_t **data,
+                                void **app_ptr);
+
+/**
+ * Handles a request carrying a Block1 option for @p resource if the
+ * resource has the flag COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1 set. Blocks
+ * other than the last are acknowledged with 2.31 Continue in @p response.
+ * Errors are reported in @p response as well. When the last block has
+ * been received, the handler must be called.
+ *
+ * @param resource The resource the request was made to.
+ * @param session  The session the request was received on.
+ * @param request  The request.
+ * @param response The response with its token already set.
+ *
+ * @return @c 1 if @p response has been filled, @c 0 if the handler must
+ *         be called.
+ */
+int coap_large_request_receive(struct coap_resource_t *resource,
+                               coap_session_t *session,
+                               coap_pdu_t *request,
+                               coap_pdu_t *response);
+
+/**
+ * Completes a reassembled Block1 transfer after the handler has been
+ * called for @p request. A Block1 option is added to @p response unless
+ * the handler has done so, and the transfer state is released.
+ *
+ * @param session  The session the request was received on.
+ * @param request  The request.
+ * @param response The response created by the handler.
+ */
+void coap_large_request_finish(coap_session_t *session,
+                               coap_pdu_t *request,
+                               coap_pdu_t *response);
+
+/**
+ * Aborts all Block1 transfers that are in progress on @p session.
+ *
+ * @param session The session.
+ */
+void coap_free_large_requests(coap_session_t *session);
+
+#else /* WITHOUT_LARGE_REQUEST */
+
+#define coap_large_request_receive(Resource, Session, Request, Response) 0
+#define coap_large_request_finish(Session, Request, Response)
+#define coap_free_large_requests(Session)
+
+#endif /* WITHOUT_LARGE_REQUEST */
+
+/** State of a Block2 transfer started with coap_block_fetch(). */
+typedef struct coap_block_fetch_t coap_block_fetch_t;
+
+/**
+ * Callback that receives the body of a Block2 transfer started with
+ * coap_block_fetch(). The body is passed in order, regardless of the order
+ * in which the blocks arrive. The last call has @p last set, after which
+ * the transfer is released. If the transfer fails, the handler is called
+ * with the response code of the failed request (or @c 0 if no response
+ * could be obtained), no data and @p last set. If the representation
+ * changes during the transfer, i.e. its ETag differs, the transfer is
+ * restarted and the handler is called with @p offset @c 0 again.
+ *
+ * @param session The session the transfer runs on.
+ * @param code    The response code.
+ * @param offset  The offset of @p data within the body.
+ * @param data    The next part of the body or @c NULL.
+ * @param length  The length of @p data.
+ * @param last    @c 1 if the transfer is finished, @c 0 otherwise.
+ * @param app_ptr The application pointer passed to coap_block_fetch().
+ */
+typedef void (*coap_block_fetch_handler_t)(coap_session_t *session,
+                                           unsigned char code,
+                                           size_t offset,
+                                           const uint8_t *data,
+                                           size_t length,
+                                           int last,
+                                           void *app_ptr);
+
+#ifndef COAP_BLOCK_FETCH_DEFAULT_WINDOW
+/**
+ * Default number of block requests that coap_block_fetch() keeps
+ * outstanding. This is NSTART as defined in RFC 7252, Section 4.7.
+ */
+#define COAP_BLOCK_FETCH_DEFAULT_WINDOW 1
+#endif /* COAP_BLOCK_FETCH_DEFAULT_WINDOW */
+
+#ifndef COAP_BLOCK_FETCH_MAX_WINDOW
+/** Upper bound for the window of coap_block_fetch(). */
+#define COAP_BLOCK_FETCH_MAX_WINDOW 16
+#endif /* COAP_BLOCK_FETCH_MAX_WINDOW */
+
+#ifndef COAP_BLOCK_FETCH_MAX_RESTARTS
+/** Number of times a transfer is restarted when the ETag changes. */
+#define COAP_BLOCK_FETCH_MAX_RESTARTS 3
+#endif /* COAP_BLOCK_FETCH_MAX_RESTARTS */
+
+#ifndef WITHOUT_BLOCK_FETCH
+
+/**
+ * Starts a Block2 transfer of the representation requested by @p request
+ * on @p session. The first block is requested alone to learn the block
+ * size, the ETag and, if the server sends Size2, the total size. Then up
+ * to @p window requests for subsequent blocks are kept outstanding, each
+ * with its own token, and blocks that arrive out of order are buffered
+ * until they can be passed to @p handler.
+ *
+ * A @p window larger than COAP_BLOCK_FETCH_DEFAULT_WINDOW exceeds NSTART
+ * and should only be used for servers that are known to cope with it
+ * (RFC 7252, Section 4.7). Responses to the block requests are consumed
+ * by the library and not passed to the context's response handler.
+ *
+ * @param session The session to use.
+ * @param request The request without Block2 option. Its message type,
+ *                code and options are copied to each block request, its
+ *                token and message id are ignored. The caller keeps
+ *                ownership.
+ * @param szx     The preferred block size, which is reduced to
+ *                coap_session_max_block_szx() and which the server may
+ *                reduce further.
+ * @param window  The number of outstanding requests. @c 0 selects
+ *                COAP_BLOCK_FETCH_DEFAULT_WINDOW, values above
+ *                COAP_BLOCK_FETCH_MAX_WINDOW are reduced.
+ * @param handler The handler that receives the body.
+ * @param app_ptr Application pointer passed to @p handler.
+ *
+ * @return The transfer or @c NULL on error.
+ */
+coap_block_fetch_t *coap_block_fetch(coap_session_t *session,
+                                     coap_pdu_t *request,
+                                     unsigned int szx,
+                                     unsigned int window,
+                                     coap_block_fetch_handler_t handler,
+                                     void *app_ptr);
+
+/**
+ * Aborts the transfer @p fetch without calling its handler. This function
+ * must not be called for a transfer that has been finished already or
+ * from within its handler.
+ *
+ * @param fetch The transfer to abort.
+ */
+void coap_block_fetch_cancel(coap_block_fetch_t *fetch);
+
+/**
+ * Passes @p received to the Block2 transfer on @p session that it belongs
+ * to, if any.
+ *
+ * @param session  The session the response was received on.
+ * @param received The response.
+ *
+ * @return @c 1 if @p received has been consumed, @c 0 otherwise.
+ */
+int coap_block_fetch_response(coap_session_t *session, coap_pdu_t *received);
+
+/**
+ * Aborts all Block2 transfers on @p session without calling their
+ * handlers.
+ *
+ * @param session The session.
+ */
+void coap_free_block_fetches(coap_session_t *session);
+
+#else /* WITHOUT_BLOCK_FETCH */
+
+#define coap_block_fetch_response(Session, Received) 0
+#define coap_free_block_fetches(Session)
+
+#endif /* WITHOUT_BLOCK_FETCH */
+
+#ifndef COAP_Q_BLOCK_MAX_PAYLOADS
+/**
+ * Number of blocks of a Q-Block transfer that are sent in one burst
+ * before the sender waits for feedback (MAX_PAYLOADS, RFC 9177,
+ * Section 7.2).
+ */
+#define COAP_Q_BLOCK_MAX_PAYLOADS 10
+#endif /* COAP_Q_BLOCK_MAX_PAYLOADS */
+
+#ifndef COAP_NON_TIMEOUT
+/**
+ * Default NON_TIMEOUT in milliseconds. A Q-Block1 sender waits this long
+ * for feedback on a set before it sends the last block again, a Q-Block2
+ * server before it sends the next set unasked. Receivers wait twice as
+ * long (NON_RECEIVE_TIMEOUT) for missing blocks before they ask for them.
+ */
+#define COAP_NON_TIMEOUT 2000
+#endif /* COAP_NON_TIMEOUT */
+
+#ifndef COAP_NON_MAX_RETRANSMIT
+/**
+ * Number of consecutive timeouts after which a Q-Block transfer is
+ * abandoned (NON_MAX_RETRANSMIT).
+ */
+#define COAP_NON_MAX_RETRANSMIT 4
+#endif /* COAP_NON_MAX_RETRANSMIT */
+
+/** State of a Q-Block1 transfer started with coap_q_block_send(). */
+typedef struct coap_q_block_send_t coap_q_block_send_t;
+
+/**
+ * Callback that receives the final response to a Q-Block1 transfer, i.e.
+ * the response created by the server's handler or an error. If no
+ * response could be obtained, @p code is @c 0 and @p response is @c NULL.
+ * The transfer is released after the handler has returned.
+ *
+ * @param session  The session the transfer runs on.
+ * @param code     The response code.
+ * @param response The response or @c NULL.
+ * @param app_ptr  The application pointer passed to coap_q_block_send().
+ */
+typedef void (*coap_q_block_send_handler_t)(coap_session_t *session,
+                                            unsigned char code,
+                                            coap_pdu_t *response,
+                                            void *app_ptr);
+
+#ifndef WITHOUT_Q_BLOCK
+
+struct coap_context_t;
+
+/**
+ * Sets NON_TIMEOUT for Q-Block transfers started on sessions of
+ * @p context. A value of @c 0 selects COAP_NON_TIMEOUT.
+ *
+ * @param context      The CoAP context.
+ * @param milliseconds The timeout in milliseconds.
+ */
+void coap_context_set_non_timeout(struct coap_context_t *context,
+                                  unsigned int milliseconds);
+
+/**
+ * Starts a Q-Block2 transfer (RFC 9177) of the representation requested
+ * by @p request on @p session. The server sends the blocks in sets of
+ * COAP_Q_BLOCK_MAX_PAYLOADS without waiting for a request per block. When
+ * a set is complete, the next set is requested. Blocks that have not
+ * arrived after NON_RECEIVE_TIMEOUT are requested again, several in one
+ * request. If the server rejects Q-Block2 with 4.02, the transfer falls
+ * back to coap_block_fetch() with a window of one.
+ *
+ * @p request should be a NON request, responses are passed to @p handler
+ * as for coap_block_fetch().
+ *
+ * @param session The session to use.
+ * @param request The request without Block2 and Q-Block2 options. The
+ *                caller keeps ownership.
+ * @param szx     The preferred block size, which is reduced to
+ *                coap_session_max_block_szx() and which the server may
+ *                reduce further.
+ * @param handler The handler that receives the body.
+ * @param app_ptr Application pointer passed to @p handler.
+ *
+ * @return The transfer or @c NULL on error.
+ */
+coap_block_fetch_t *coap_q_block_fetch(coap_session_t *session,
+                                       coap_pdu_t *request,
+                                       unsigned int szx,
+                                       coap_block_fetch_handler_t handler,
+                                       void *app_ptr);
+
+/**
+ * Sends @p data as body of @p request in a Q-Block1 transfer (RFC 9177).
+ * All blocks use the same token and are sent in sets of
+ * COAP_Q_BLOCK_MAX_PAYLOADS. The server acknowledges a complete set with
+ * 2.31 Continue, upon which the next set is sent, and reports missing
+ * blocks with 4.08 and a list of block numbers, which are sent again. If
+ * there is no feedback within NON_TIMEOUT, the last block of the set is
+ * sent again to solicit it.
+ *
+ * @param session The session to use.
+ * @param request The request without payload. Its message type, code and
+ *                options are copied to each block, its token and message
+ *                id are ignored. The caller keeps ownership.
+ * @param szx     The block size, which is reduced if the blocks do not
+ *                fit into the session's PDU size.
+ * @param length  The length of @p data.
+ * @param data    The body.
+ * @param release Function to release @p data when the transfer is over.
+ *                If @c NULL, @p data is copied and the caller keeps
+ *                ownership.
+ * @param handler The handler that receives the final response.
+ * @param app_ptr Application pointer passed to @p handler and @p release.
+ *
+ * @return The transfer or @c NULL on error. In case of error, @p release
+ *         has been called already.
+ */
+coap_q_block_send_t *coap_q_block_send(coap_session_t *session,
+                                       coap_pdu_t *request,
+                                       unsigned int szx,
+                                       size_t length,
+                                       const uint8_t *data,
+                                       coap_release_large_data_t release,
+                                       coap_q_block_send_handler_t handler,
+                                       void *app_ptr);
+
+/**
+ * Aborts the transfer @p send without calling its handler. This function
+ * must not be called for a transfer that has been finished already or
+ * from within its handler.
+ *
+ * @param send The transfer to abort.
+ */
+void coap_q_block_send_cancel(coap_q_block_send_t *send);
+
+/**
+ * Passes @p received to the Q-Block1 transfer on @p session that it
+ * belongs to, if any.
+ *
+ * @param session  The session the response was received on.
+ * @param received The response.
+ *
+ * @return @c 1 if @p received has been consumed, @c 0 otherwise.
+ */
+int coap_q_block_send_response(coap_session_t *session,
+                               coap_pdu_t *received);
+
+/**
+ * Aborts all Q-Block1 transfers on @p session without calling their
+ * handlers.
+ *
+ * @param session The session.
+ */
+void coap_free_q_block_sends(coap_session_t *session);
+
+/**
+ * Handles the timers of the Q-Block transfers on @p session. As client,
+ * it requests missing blocks of Q-Block2 transfers, sends the last block
+ * of the current set of Q-Block1 transfers again, and abandons transfers
+ * after COAP_NON_MAX_RETRANSMIT timeouts without progress. As server, it
+ * reports Q-Block1 blocks that are missing after NON_RECEIVE_TIMEOUT and
+ * pushes the next Q-Block2 set when the client has not asked for it
+ * within NON_TIMEOUT.
+ *
+ * @param session The session.
+ * @param now     The current time.
+ *
+ * @return The time of the next timeout or @c 0 if there is none.
+ */
+coap_tick_t coap_q_block_check_timeouts(coap_session_t *session,
+                                        coap_tick_t now);
+
+#else /* WITHOUT_Q_BLOCK */
+
+#define coap_q_block_send_response(Session, Received) 0
+#define coap_free_q_block_sends(Session)
+#define coap_q_block_check_timeouts(Session, Now) 0
+
+#endif /* WITHOUT_Q_BLOCK */
+
 /**@}*/
 
 #endif /* _COAP_BLOCK_H_ */
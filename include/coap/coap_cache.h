@@ -0,0 +1,143 @@
+/*
+ * coap_cache.h -- server-side cache for responses to GET requests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_cache.h
+ * @brief Server-side cache for responses to GET requests
+ */
+
+#ifndef _COAP_CACHE_H_
+#define _COAP_CACHE_H_
+
+#include "net.h"
+#include "resource.h"
+
+/* The response cache relies on dynamic memory for its entries. */
+#if !defined(WITHOUT_CACHE) && (defined(WITH_CONTIKI) || defined(WITH_LWIP))
+#define WITHOUT_CACHE
+#endif
+
+/**
+ * @defgroup cache Response Cache
+ * @{
+ * Responses to GET requests on resources marked as @c cacheable are kept
+ * by the context for the time given in their Max-Age option. Repeated
+ * requests are answered from the cache without invoking the resource's
+ * GET handler, and requests carrying a matching ETag option are answered
+ * with 2.03 Valid. Entries are keyed by the resource and all request
+ * options that are part of the cache key (RFC 7252, Section 5.4.6) except
+ * Uri-Path and ETag, i.e. mainly Accept and Uri-Query. Requests with
+ * Observe, Block1, Block2, Q-Block1 or Q-Block2 options always bypass the
+ * cache.
+ *
+ * Entries for a resource are invalidated when the resource is marked
+ * dirty or deleted.
+ */
+
+/** Default maximum number of entries in a context's response cache. */
+#ifndef COAP_CACHE_DEFAULT_SIZE
+#define COAP_CACHE_DEFAULT_SIZE 32
+#endif
+
+/** Max-Age in seconds assumed for responses without Max-Age option. */
+#define COAP_CACHE_DEFAULT_MAX_AGE 60
+
+/** Maximum size of a key created by coap_cache_key(). */
+#define COAP_CACHE_KEY_MAX_SIZE 256
+
+/**
+ * Writes the cache key for @p request on @p resource to @p key. Requests
+ * with equal keys can be satisfied by the same response. The key consists
+ * of the resource pointer followed by type, length and value of each
+ * request option that is part of the cache key. Uri-Path is implied by
+ * @p resource and ETag is used for validation only.
+ *
+ * @param resource The resource that was requested.
+ * @param request  The request.
+ * @param key      Storage for at least COAP_CACHE_KEY_MAX_SIZE bytes.
+ *
+ * @return The length of the key or @c 0 if it would exceed
+ *         COAP_CACHE_KEY_MAX_SIZE bytes.
+ */
+size_t coap_cache_key(coap_resource_t *resource, coap_pdu_t *request,
+                      unsigned char *key);
+
+#ifndef WITHOUT_CACHE
+
+/**
+ * Sets the maximum number of responses held in the response cache of
+ * @p context. When the cache is full, expired entries are removed first,
+ * then the oldest entry. A value of @c 0 selects COAP_CACHE_DEFAULT_SIZE.
+ *
+ * @param context     The CoAP context.
+ * @param max_entries The maximum number of cached responses.
+ */
+void coap_context_set_cache_size(coap_context_t *context, size_t max_entries);
+
+/**
+ * Fills @p response from the response cache of @p context if it holds a
+ * fresh entry for @p request on @p resource. The message type, id and
+ * token of @p response are left untouched. Entries for a dirty resource
+ * are discarded before the lookup.
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource that was requested.
+ * @param request  The GET request.
+ * @param response The response with its token already set.
+ *
+ * @return @c 1 if @p response was filled from the cache, @c 0 otherwise.
+ */
+int coap_cache_get(coap_context_t *context, coap_resource_t *resource,
+                   coap_pdu_t *request, coap_pdu_t *response);
+
+/**
+ * Stores a copy of @p response to @p request in the response cache if
+ * both are cacheable. Only 2.05 responses without Observe and Block2
+ * options and with a non-zero Max-Age are stored. If @p request carries
+ * an ETag option that matches the response's ETag, @p response is turned
+ * into a 2.03 Valid response.
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource that was requested.
+ * @param request  The GET request.
+ * @param response The response created by the resource's GET handler.
+ */
+void coap_cache_put(coap_context_t *context, coap_resource_t *resource,
+                    coap_pdu_t *request, coap_pdu_t *response);
+
+/**
+ * Removes all cached responses for @p resource from the cache of
+ * @p context.
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource whose entries are invalidated.
+ */
+void coap_cache_invalidate(coap_context_t *context, coap_resource_t *resource);
+
+/**
+ * Removes all entries from the response cache of @p context and releases
+ * their storage.
+ *
+ * @param context The CoAP context.
+ */
+void coap_cache_free(coap_context_t *context);
+
+#else /* WITHOUT_CACHE */
+
+#define coap_context_set_cache_size(Context, Max) ((void)(Context), (void)(Max))
+#define coap_cache_get(Context, Resource, Request, Response) 0
+#define coap_cache_put(Context, Resource, Request, Response)
+#define coap_cache_invalidate(Context, Resource)
+#define coap_cache_free(Context)
+
+#endif /* WITHOUT_CACHE */
+
+/** @} */
+
+#endif /* _COAP_CACHE_H_ */
@@ -0,0 +1,129 @@
+/*
+ * coap_completion.h -- completion of asynchronous transactions from
+ *                      other threads
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_completion.h
+ * @brief Completion of asynchronous transactions from other threads
+ */
+
+#ifndef _COAP_COMPLETION_H_
+#define _COAP_COMPLETION_H_
+
+#include "async.h"
+#include "net.h"
+
+/* The completion queue needs atomic operations and a file descriptor to
+ * wake up the event loop. */
+#if !defined(WITHOUT_COMPLETION_QUEUE) \
+  && (defined(WITH_CONTIKI) || defined(WITH_LWIP) || defined(_WIN32) \
+      || defined(WITHOUT_ASYNC) || !defined(__ATOMIC_ACQ_REL))
+#define WITHOUT_COMPLETION_QUEUE
+#endif
+
+/**
+ * @defgroup completion Completion Queue
+ * @{
+ * Except for coap_async_post_completion(), no function of libcoap may be
+ * called outside the thread that runs the event loop of a context. A
+ * handler that passes slow work to other threads registers the request
+ * with coap_register_async() and hands the session and id of the state
+ * to the worker. When the work is done, the worker calls
+ * coap_async_post_completion() with the result, which is queued without
+ * locks. The queue wakes up coap_run_once() through a file descriptor
+ * that coap_write() adds to the sockets to wait for. The loop thread
+ * then takes all completions posted so far at once and answers each
+ * transaction with coap_async_complete().
+ *
+ * Completions for transactions that have been completed or have expired
+ * in the meantime are dropped.
+ */
+
+struct coap_completion_queue_t;
+
+#ifndef WITHOUT_COMPLETION_QUEUE
+
+/**
+ * Enables coap_async_post_completion() for @p context. This function
+ * must be called from the loop thread before any other thread posts a
+ * completion. The queue is released by coap_free_context(), which must
+ * not be called before all threads have stopped posting to it.
+ *
+ * @param context The CoAP context.
+ *
+ * @return @c 1 on success or if the queue exists already, @c 0 on error.
+ */
+int coap_context_enable_completion_queue(coap_context_t *context);
+
+/**
+ * Posts the result of the asynchronous transaction identified by
+ * @p session and @p id to the completion queue of @p context. This
+ * function may be called from any thread. The session and id are those
+ * of the coap_async_state_t returned by coap_register_async() and must be
+ * read in the loop thread before the work is passed on, as the state may
+ * be released at any time. @p data is copied.
+ *
+ * @param context        The CoAP context with an enabled completion queue.
+ * @param session        The session of the asynchronous transaction.
+ * @param id             The id of the asynchronous transaction.
+ * @param code           The response code.
+ * @param content_format The Content-Format of @p data or @c -1 to omit
+ *                       the Content-Format option.
+ * @param data           The payload of the response or @c NULL.
+ * @param length         The length of @p data.
+ *
+ * @return @c 1 if the completion has been queued, @c 0 on error.
+ */
+int coap_async_post_completion(coap_context_t *context,
+                               coap_session_t *session,
+                               coap_tid_t id,
+                               unsigned char code,
+                               int content_format,
+                               const uint8_t *data,
+                               size_t length);
+
+/**
+ * Answers the asynchronous transactions of all completions posted to
+ * @p context so far, in the order they have been posted. This function is
+ * called by coap_read() when the queue has signalled new completions.
+ *
+ * @param context The CoAP context.
+ *
+ * @return The number of completions taken from the queue.
+ */
+unsigned int coap_completion_queue_drain(coap_context_t *context);
+
+/**
+ * Returns the socket that signals new completions for @p context or
+ * @c NULL if the completion queue is not enabled.
+ *
+ * @param context The CoAP context.
+ */
+coap_socket_t *coap_completion_queue_socket(coap_context_t *context);
+
+/**
+ * Releases the completion queue of @p context. Pending completions are
+ * dropped. This function is called by coap_free_context().
+ *
+ * @param context The CoAP context.
+ */
+void coap_free_completion_queue(coap_context_t *context);
+
+#else /* WITHOUT_COMPLETION_QUEUE */
+
+#define coap_context_enable_completion_queue(Context) ((void)(Context), 0)
+#define coap_completion_queue_drain(Context) 0
+#define coap_completion_queue_socket(Context) NULL
+#define coap_free_completion_queue(Context)
+
+#endif /* WITHOUT_COMPLETION_QUEUE */
+
+/** @} */
+
+#endif /* _COAP_COMPLETION_H_ */
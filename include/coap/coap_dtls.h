@@ -20,6 +20,44 @@
  * @{
  */
 
+#ifndef COAP_DTLS_SESSION_CACHE_SIZE
+/** Maximum number of sessions a server keeps for resumption by id. */
+#define COAP_DTLS_SESSION_CACHE_SIZE 256
+#endif /* COAP_DTLS_SESSION_CACHE_SIZE */
+
+#ifndef COAP_DTLS_CLIENT_SESSIONS
+/**
+ * Maximum number of sessions a client keeps to resume them, one for each
+ * server, local interface and PSK identity and key.
+ */
+#define COAP_DTLS_CLIENT_SESSIONS 16
+#endif /* COAP_DTLS_CLIENT_SESSIONS */
+
+#ifndef COAP_DTLS_SESSION_LIFETIME
+/** Number of seconds after which a session cannot be resumed anymore. */
+#define COAP_DTLS_SESSION_LIFETIME 7200
+#endif /* COAP_DTLS_SESSION_LIFETIME */
+
+/** Numbers of DTLS handshakes completed by a context. */
+typedef struct coap_dtls_handshake_stats_t {
+  unsigned long full;     /**< handshakes that have created a new session */
+  unsigned long resumed;  /**< handshakes that have resumed a session */
+} coap_dtls_handshake_stats_t;
+
+/**
+ * PSK cipher suites with AES-GCM first, for hosts that have instructions
+ * for AES and carry-less multiplication.
+ */
+#define COAP_DTLS_CIPHERS_PSK_GCM \
+  "PSK-AES128-GCM-SHA256:PSK-AES256-GCM-SHA384:PSK-AES128-CCM8:PSK-AES128-CCM"
+
+/**
+ * PSK cipher suites with AES-CCM-8 first, which adds the fewest bytes to
+ * each record and is the suite of constrained peers (RFC 7925).
+ */
+#define COAP_DTLS_CIPHERS_PSK_CCM8 \
+  "PSK-AES128-CCM8:PSK-AES256-CCM8:PSK-AES128-GCM-SHA256:PSK-AES128-CCM"
+
 /** Returns 1 if support for DTLS is enabled, or 0 otherwise. */
 int coap_dtls_is_supported(void);
 
@@ -141,6 +179,129 @@ int coap_dtls_hello(coap_session_t *session,
                     const uint8_t *data,
                     size_t data_len);
 
+/**
+ * Retrieves the numbers of full and resumed DTLS handshakes completed by
+ * @p coap_context, both as client and as server. A client resumes the
+ * last session with a server when it connects to the same address again,
+ * even after the coap_session_t of that session has been released.
+ *
+ * @param coap_context The CoAP context.
+ * @param stats        Set to the numbers of handshakes.
+ * @return 1 on success, or 0 if the DTLS library does not resume sessions
+ *         or no DTLS context exists. @p stats is zero then.
+ */
+int coap_dtls_get_handshake_stats(struct coap_context_t *coap_context,
+                                  coap_dtls_handshake_stats_t *stats);
+
+/**
+ * Starts @p count threads that run the handshakes of new server sessions
+ * of @p coap_context, so that the event loop keeps serving established
+ * sessions while many clients connect. The records of a session are
+ * processed by the workers in order until its handshake has completed or
+ * failed; what they send and report is taken over by the loop thread in
+ * coap_read(). The default PSK callback is run by the worker, with the
+ * keystore and key the context has when the handshake starts, so a
+ * keystore lookup that blocks holds up that handshake only. Any other PSK
+ * callback set for the context is called by the loop thread while the
+ * worker waits for it. Once started, the workers run until the context is
+ * released. A session may be released
+ * while a worker processes one of its records, whose SSL state is then
+ * freed when the worker is done.
+ *
+ * @param coap_context The CoAP context.
+ * @param count        The number of threads.
+ * @return 1 on success or if the workers have been started already, 0 if
+ *         the DTLS library does not support workers or on error.
+ */
+int coap_dtls_set_handshake_workers(struct coap_context_t *coap_context,
+                                    unsigned int count);
+
+/**
+ * Returns the socket that signals records processed by the handshake
+ * workers, or NULL if no workers have been started.
+ * @param dtls_context The DTLS context
+ */
+coap_socket_t *coap_dtls_get_worker_socket(void *dtls_context);
+
+/**
+ * Continues with the sessions whose records the handshake workers have
+ * processed. Called by coap_read() when the worker socket is readable.
+ * @param dtls_context The DTLS context
+ */
+void coap_dtls_handle_workers(void *dtls_context);
+
+/**
+ * Reduces the memory that the DTLS library holds for the sessions of
+ * @p coap_context. Once the handshake of a session has completed, the
+ * buffers to receive and send records are allocated only while a record
+ * is processed.
+ *
+ * If @p idle_timeout is not zero, the DTLS state of an established
+ * session is released after @p idle_timeout seconds without traffic. The
+ * peer is notified with a close_notify alert. The session itself is kept
+ * with its observers, asynchronous states and block transfers. A client
+ * connects again when it next sends. A server drops what it sends until
+ * its client has done so, which sets up the kept session again; it frees
+ * the session once it has timed out as any other. The handshake then
+ * resumes the session if the DTLS library supports that (see
+ * coap_dtls_get_handshake_stats()).
+ *
+ * @param coap_context The CoAP context.
+ * @param enable       1 to enable the low-memory mode, 0 to disable it.
+ * @param idle_timeout The number of seconds after which the DTLS state of
+ *                     an idle session is released, or 0 to keep it.
+ * @return 1 on success, or 0 if no DTLS context exists.
+ */
+int coap_dtls_set_low_memory(struct coap_context_t *coap_context,
+                             int enable, unsigned int idle_timeout);
+
+/**
+ * Returns a lower bound of the bytes that the DTLS library holds for
+ * @p session, or 0 if it has no DTLS state or the DTLS library cannot
+ * tell. Only memory that the session is known to hold is counted, such
+ * as the buffers for its records and plaintext. The state of the DTLS
+ * library itself depends on its version and the cipher suite and is not
+ * measured, so the actual use is higher. The estimate is meant to compare
+ * sessions and modes, e.g. with and without coap_dtls_set_low_memory().
+ *
+ * @param session   The CoAP session
+ * @return The estimate in bytes.
+ */
+size_t coap_dtls_estimate_session_memory(coap_session_t *session);
+
+/**
+ * Sets the cipher suites that @p coap_context offers to servers and
+ * accepts from clients, for the sessions created from now on. The suites
+ * are named as by OpenSSL and separated by colons, most preferred first,
+ * e.g. COAP_DTLS_CIPHERS_PSK_GCM or COAP_DTLS_CIPHERS_PSK_CCM8. Only the
+ * PSK suites are used, as libcoap has no certificates to authenticate
+ * with. Suites that the DTLS library does not know are skipped.
+ *
+ * @param coap_context      The CoAP context.
+ * @param ciphers           The cipher suites or NULL for the default of the
+ *                          DTLS library.
+ * @param server_preference 1 if a server picks the first suite of
+ *                          @p ciphers that the client offers, 0 if it
+ *                          follows the preference of the client.
+ * @return 1 on success, or 0 if the DTLS library supports none of
+ *         @p ciphers, in which case the suites are unchanged.
+ */
+int coap_dtls_set_ciphers(struct coap_context_t *coap_context,
+                          const char *ciphers, int server_preference);
+
+/**
+ * Returns the name and version of the DTLS library, e.g. for reports.
+ */
+const char *coap_dtls_get_library(void);
+
+/**
+ * Returns the name of the cipher suite negotiated for @p session, or NULL
+ * if the handshake has not completed.
+ *
+ * @param session   The CoAP session
+ */
+const char *coap_dtls_get_cipher(coap_session_t *session);
+
 /**
  * Get DTLS overhead over cleartext PDUs.
  *
@@ -0,0 +1,129 @@
+/*
+ * coap_file.h -- resources that serve the contents of a file
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_file.h
+ * @brief Resources that serve the contents of a file
+ */
+
+#ifndef _COAP_FILE_H_
+#define _COAP_FILE_H_
+
+#include "block.h"
+#include "resource.h"
+
+/* File resources need a file system and are served with Block2. */
+#if !defined(WITHOUT_FILE_RESOURCE) \
+  && (defined(WITH_CONTIKI) || defined(WITH_LWIP) \
+      || defined(WITHOUT_LARGE_RESPONSE))
+#define WITHOUT_FILE_RESOURCE
+#endif
+
+/**
+ * @defgroup file_resource File Resources
+ * @{
+ * A file resource answers GET requests with the contents of a file. The
+ * file is mapped into memory once (or read into a buffer where mmap() is
+ * not available) and its ETag, the first COAP_FILE_ETAG_LENGTH bytes of
+ * the SHA-256 digest of the contents (a 64-bit FNV-1a hash in builds
+ * without OpenSSL), is computed when it is loaded. Responses
+ * are created with coap_add_data_large_response() referring to the mapped
+ * contents, so Block2 transfers of the same file to any number of clients
+ * share a single copy. Requests with an ETag option matching the current
+ * contents are answered with 2.03 Valid.
+ *
+ * The file is checked for modification on each GET request that is not
+ * served from a kept representation. A changed file is loaded again and
+ * the resource is marked dirty. Transfers in progress continue with the
+ * contents they have started with, which are released when the last of
+ * them has completed. If the file cannot be read, requests are answered
+ * with 4.04 Not Found.
+ *
+ * Mapped contents are not a snapshot: the pages follow writes to the
+ * file, and reading beyond the end of a truncated file raises SIGBUS.
+ * A new version of a file must therefore be written to a temporary file
+ * and renamed into place. A file that is modified in place anyway is
+ * detected by its size and modification time before its contents are
+ * served again. The contents are then dropped together with transfers
+ * that refer to them, and a warning is logged. Detection is best effort:
+ * a write that keeps the size within the resolution of the modification
+ * time, or one that happens while a block is being copied, goes
+ * unnoticed.
+ */
+
+struct coap_file_t;
+
+/** Length of the ETag of file resources. */
+#define COAP_FILE_ETAG_LENGTH 8
+
+#ifndef WITHOUT_FILE_RESOURCE
+
+/**
+ * Creates a resource for @p uri that serves the file @p path. The
+ * resource is released with coap_delete_resource() like any other.
+ * The file is loaded on the first request.
+ *
+ * @param uri            The URI path of the new resource.
+ * @param len            The length of @p uri.
+ * @param path           The name of the file to serve, copied.
+ * @param content_format The Content-Format of the file or @c -1 to omit
+ *                       the Content-Format option.
+ * @param flags          Flags for memory management as for
+ *                       coap_resource_init().
+ *
+ * @return A pointer to the new resource or @c NULL on error.
+ */
+coap_resource_t *coap_resource_init_file(const unsigned char *uri,
+                                         size_t len,
+                                         const char *path,
+                                         int content_format,
+                                         int flags);
+
+/**
+ * Loads the file of @p resource again if it has changed since it was
+ * last loaded.
+ *
+ * @param resource The file resource.
+ *
+ * @return @c 1 if the file has been loaded, @c 0 if it is unchanged or
+ *         cannot be read.
+ */
+int coap_resource_check_file(coap_resource_t *resource);
+
+/**
+ * Checks data that has been passed to coap_add_data_large_response()
+ * with @p release and @p app_ptr before it is served again. Data of file
+ * resources fails the check when the file has been modified in place.
+ *
+ * @param release The release function of the data.
+ * @param app_ptr The application pointer passed to @p release.
+ *
+ * @return @c 0 if the data must not be served anymore, @c 1 otherwise.
+ */
+int coap_file_data_intact(coap_release_large_data_t release, void *app_ptr);
+
+/**
+ * Releases the file of a resource created by coap_resource_init_file().
+ * The contents are unmapped when no transfer refers to them anymore.
+ * This function is called by coap_delete_resource().
+ *
+ * @param file The file to release or @c NULL.
+ */
+void coap_free_file(struct coap_file_t *file);
+
+#else /* WITHOUT_FILE_RESOURCE */
+
+#define coap_free_file(File)
+#define coap_file_data_intact(Release, AppPtr) 1
+
+#endif /* WITHOUT_FILE_RESOURCE */
+
+/** @} */
+
+#endif /* _COAP_FILE_H_ */
@@ -0,0 +1,159 @@
+/*
+ * coap_hello.h -- rate limit of DTLS ClientHello messages
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_hello.h
+ * @brief Rate limit of DTLS ClientHello messages
+ */
+
+#ifndef _COAP_HELLO_H_
+#define _COAP_HELLO_H_
+
+#include <string.h>
+
+#include "address.h"
+#include "coap_time.h"
+#include "net.h"
+
+/* Constrained platforms do not serve enough clients to need a limit. */
+#if !defined(WITHOUT_HELLO_LIMIT) \
+  && (defined(WITH_CONTIKI) || defined(WITH_LWIP))
+#define WITHOUT_HELLO_LIMIT
+#endif
+
+/**
+ * @defgroup hello DTLS Hello Limit
+ * @{
+ * Each datagram that does not belong to a DTLS session is passed to
+ * coap_dtls_hello(), which computes an HMAC to answer a ClientHello with a
+ * cookie or to verify the cookie of a repeated ClientHello. Spoofed
+ * ClientHello messages can therefore keep the event loop busy without
+ * ever completing a handshake.
+ *
+ * When a limit has been set with coap_context_set_hello_limit(), such
+ * datagrams are dropped before any cryptographic work is done if
+ *   - the sources with the same network prefix as the sender have used up
+ *     their token bucket, which is refilled with @c rate datagrams per
+ *     second up to @c burst datagrams,
+ *   - all sources together have used up the global bucket, which is
+ *     COAP_HELLO_GLOBAL_PREFIXES times as large and refilled as fast, or
+ *   - @c max_handshakes handshakes of the context are in progress, i.e.
+ *     cookies have been verified but the handshakes have not finished.
+ *
+ * A client needs two datagrams for a handshake, the ClientHello and the
+ * repeated ClientHello with the cookie. Prefixes are compared over
+ * COAP_HELLO_PREFIX_V4 bits of IPv4 and COAP_HELLO_PREFIX_V6 bits of IPv6
+ * addresses. At most COAP_HELLO_MAX_PREFIXES buckets are kept, the least
+ * recently used bucket is removed when a new one is needed. A new bucket
+ * gets no more credit than the global bucket has left, so that senders
+ * cannot escape their limit by using many prefixes.
+ */
+
+#ifndef COAP_HELLO_PREFIX_V4
+/** Number of bits of IPv4 addresses that share a bucket. */
+#define COAP_HELLO_PREFIX_V4 24
+#endif /* COAP_HELLO_PREFIX_V4 */
+
+#ifndef COAP_HELLO_PREFIX_V6
+/** Number of bits of IPv6 addresses that share a bucket. */
+#define COAP_HELLO_PREFIX_V6 64
+#endif /* COAP_HELLO_PREFIX_V6 */
+
+#ifndef COAP_HELLO_MAX_PREFIXES
+/** Maximum number of prefixes with a bucket. */
+#define COAP_HELLO_MAX_PREFIXES 1024
+#endif /* COAP_HELLO_MAX_PREFIXES */
+
+#ifndef COAP_HELLO_GLOBAL_PREFIXES
+/** Number of prefixes at full rate that the global bucket allows. */
+#define COAP_HELLO_GLOBAL_PREFIXES 16
+#endif /* COAP_HELLO_GLOBAL_PREFIXES */
+
+/** Counters of the datagrams passed to the hello limit. */
+typedef struct coap_hello_stats_t {
+  unsigned long received;       /**< datagrams that do not belong to a session */
+  unsigned long dropped_rate;   /**< dropped as the bucket was empty */
+  unsigned long dropped_busy;   /**< dropped as max_handshakes were in progress */
+  unsigned long cookies;        /**< answered with a cookie or ignored */
+  unsigned long verified;       /**< with a valid cookie, starting a handshake */
+} coap_hello_stats_t;
+
+struct coap_hello_limit_t;
+
+#ifndef WITHOUT_HELLO_LIMIT
+
+/**
+ * Limits the datagrams of @p context that are passed to coap_dtls_hello().
+ * Buckets of an earlier limit are removed, the counters are kept.
+ *
+ * @param context        The CoAP context.
+ * @param rate           The datagrams per second and prefix, @c 0 for no
+ *                       limit.
+ * @param burst          The size of the buckets in datagrams. A value
+ *                       lower than two is raised to two.
+ * @param max_handshakes The number of handshakes in progress above which
+ *                       all datagrams are dropped, @c 0 for no limit.
+ *
+ * @return @c 1 on success, @c 0 on error.
+ */
+int coap_context_set_hello_limit(coap_context_t *context,
+                                 unsigned int rate,
+                                 unsigned int burst,
+                                 unsigned int max_handshakes);
+
+/**
+ * Copies the counters of @p context to @p stats. The counters are zero
+ * if no limit has been set with coap_context_set_hello_limit().
+ *
+ * @param context The CoAP context.
+ * @param stats   The counters.
+ */
+void coap_context_get_hello_stats(coap_context_t *context,
+                                  coap_hello_stats_t *stats);
+
+/**
+ * Checks if a datagram from @p src that does not belong to a session may
+ * be passed to coap_dtls_hello(). This function is called by coap_read().
+ *
+ * @param context The CoAP context.
+ * @param src     The address of the sender.
+ * @param now     The current time.
+ *
+ * @return @c 1 if the datagram is accepted, @c 0 if it must be dropped.
+ */
+int coap_hello_admit(coap_context_t *context, const coap_address_t *src,
+                     coap_tick_t now);
+
+/**
+ * Counts the @p result of coap_dtls_hello() for a datagram accepted by
+ * coap_hello_admit().
+ */
+void coap_hello_count(coap_context_t *context, int result);
+
+/**
+ * Releases the limit of @p context. This function is called by
+ * coap_free_context().
+ */
+void coap_free_hello_limit(coap_context_t *context);
+
+#else /* WITHOUT_HELLO_LIMIT */
+
+#define coap_context_set_hello_limit(Context,Rate,Burst,MaxHandshakes) \
+  ((void)(Context), 0)
+#define coap_context_get_hello_stats(Context,Stats) \
+  ((void)(Context), memset((Stats), 0, sizeof(coap_hello_stats_t)))
+#define coap_hello_admit(Context,Src,Now) 1
+#define coap_hello_count(Context,Result)
+#define coap_free_hello_limit(Context)
+
+#endif /* WITHOUT_HELLO_LIMIT */
+
+/** @} */
+
+#endif /* _COAP_HELLO_H_ */
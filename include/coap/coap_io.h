@@ -16,6 +16,7 @@
 #include "address.h"
 
 #ifndef COAP_RXBUFFER_SIZE
+/** Default size of the receive buffers of endpoints and client sessions. */
 #define COAP_RXBUFFER_SIZE 1472
 #endif /* COAP_RXBUFFER_SIZE */
 
@@ -55,6 +56,7 @@ typedef struct coap_socket_t {
 #define COAP_SOCKET_NOT_EMPTY   0x0001  /**< the socket is not empty */
 #define COAP_SOCKET_BOUND       0x0002  /**< the socket is bound */
 #define COAP_SOCKET_CONNECTED   0x0004  /**< the socket is connected */
+#define COAP_SOCKET_PMTU        0x0008  /**< path MTU discovery is enabled on the socket */
 #define COAP_SOCKET_WANT_DATA   0x0010  /**< non blocking socket is waiting for reading */
 #define COAP_SOCKET_WANT_WRITE  0x0020  /**< non blocking socket is waiting for writing */
 #define COAP_SOCKET_HAS_DATA    0x0100  /**< non blocking socket can now read without blocking */
@@ -78,6 +80,51 @@ coap_socket_bind_udp( coap_socket_t *sock,
 
 void coap_socket_close( coap_socket_t *sock );
 
+/**
+ * Enables or disables path MTU discovery on @p sock. When enabled, the
+ * Don't Fragment bit is set on outgoing datagrams and ICMP errors are
+ * queued on the socket to be read with coap_socket_read_error().
+ *
+ * @param sock   The socket.
+ * @param addr   An address of the socket's family.
+ * @param enable @c 1 to enable path MTU discovery, @c 0 to disable it.
+ *
+ * @return @c 1 on success, @c 0 if path MTU discovery is not supported.
+ */
+int coap_socket_set_pmtu_discovery( coap_socket_t *sock,
+                                    const coap_address_t *addr,
+                                    int enable );
+
+/**
+ * Returns the maximum size of a message that can be sent on the connected
+ * socket @p sock without fragmentation, i.e. the path MTU known to the
+ * kernel minus IP and UDP overhead.
+ *
+ * @param sock The connected socket.
+ * @param addr The peer address of @p sock.
+ *
+ * @return The maximum message size or @c 0 if it is unknown.
+ */
+unsigned int coap_socket_get_path_mtu( coap_socket_t *sock,
+                                       const coap_address_t *addr );
+
+/**
+ * Reads the next error from the error queue of a socket that has path MTU
+ * discovery enabled. If the error was caused by a datagram that was too
+ * big, @p *mtu is set to the maximum message size towards @p dst, i.e. the
+ * reported path MTU minus IP and UDP overhead. Otherwise, @p *mtu is
+ * @c 0. Errors raised by the local stack do not identify the peer and
+ * set @p dst->size to @c 0.
+ *
+ * @param sock The socket.
+ * @param dst  The destination of the datagram that caused the error.
+ * @param mtu  The maximum message size towards @p dst or @c 0.
+ *
+ * @return @c 1 if an error has been read, @c 0 if the queue is empty.
+ */
+int coap_socket_read_error( coap_socket_t *sock, coap_address_t *dst,
+                            unsigned int *mtu );
+
 ssize_t
 coap_socket_send( coap_socket_t *sock, struct coap_session_t *session,
                   const uint8_t *data, size_t data_len );
@@ -161,7 +208,8 @@ struct coap_packet_t {
   coap_address_t dst;	      /**< the packet's destination address */
   int ifindex;                /**< the interface index */
   size_t length;              /**< length of payload */
-  unsigned char payload[COAP_RXBUFFER_SIZE]; /**< payload */
+  size_t size;                /**< size of the payload buffer */
+  unsigned char *payload;     /**< payload, the receive buffer of the socket's owner */
 };
 #endif
 typedef struct coap_packet_t coap_packet_t;
@@ -0,0 +1,239 @@
+/*
+ * coap_keystore.h -- store of pre-shared keys for DTLS servers
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_keystore.h
+ * @brief Store of pre-shared keys for DTLS servers
+ */
+
+#ifndef _COAP_KEYSTORE_H_
+#define _COAP_KEYSTORE_H_
+
+#include "coap_time.h"
+#include "net.h"
+
+/* Key files need a file system. */
+#if !defined(WITHOUT_KEYSTORE) \
+  && (defined(WITH_CONTIKI) || defined(WITH_LWIP))
+#define WITHOUT_KEYSTORE
+#endif
+
+/**
+ * @defgroup keystore PSK Keystore
+ * @{
+ * A keystore maps PSK identities to keys with a hash table. Keys are added
+ * one by one with coap_keystore_add() or loaded from a key file with
+ * coap_keystore_load_file(). Each line of a key file holds an identity,
+ * followed by white space and the key in hexadecimal digits. Empty lines
+ * and lines starting with @c # are ignored. The I/O loop of the context
+ * that a keystore is set for checks the file every
+ * COAP_KEYSTORE_CHECK_INTERVAL seconds and loads it again when it has
+ * changed, so lookups never wait for the file. Other users of a keystore
+ * call coap_keystore_check_file() or coap_keystore_check_timeout().
+ *
+ * Identities that are not in the store may be passed to a lookup function
+ * of the application, e.g. to query a database. Its results are kept in a
+ * cache of limited size, from which the least recently used entry is
+ * removed when it is full. Unknown identities are cached as well, so that
+ * clients that retry a failed handshake do not cause a lookup each time.
+ *
+ * When a keystore has been set with coap_context_set_keystore(), the
+ * default PSK callback of the context resolves client identities with
+ * coap_keystore_lookup(). A keystore may be used by several threads. The
+ * DTLS handshake workers look up keys themselves, so only the worker of
+ * a handshake waits for the lookup function. Without workers, lookups
+ * are done by the thread of the I/O loop.
+ */
+
+#ifndef COAP_KEYSTORE_CHECK_INTERVAL
+/** Minimum number of seconds between two checks of the key file. */
+#define COAP_KEYSTORE_CHECK_INTERVAL 1
+#endif /* COAP_KEYSTORE_CHECK_INTERVAL */
+
+#ifndef COAP_KEYSTORE_CACHE_SIZE
+/** Default number of results of the lookup function kept. */
+#define COAP_KEYSTORE_CACHE_SIZE 1024
+#endif /* COAP_KEYSTORE_CACHE_SIZE */
+
+#ifndef COAP_KEYSTORE_CACHE_LIFETIME
+/** Default number of seconds a result of the lookup function is kept. */
+#define COAP_KEYSTORE_CACHE_LIFETIME 300
+#endif /* COAP_KEYSTORE_CACHE_LIFETIME */
+
+/** Maximum length of a key in a keystore. */
+#define COAP_KEYSTORE_MAX_KEY_LENGTH 64
+
+typedef struct coap_keystore_t coap_keystore_t;
+
+/**
+ * Looks up the key for an identity that is not in a keystore. This
+ * function may block, which holds up the I/O loop unless the handshakes
+ * are run by workers. It is called without any lock held, possibly by
+ * several threads at a time.
+ *
+ * @param identity     The PSK identity of the client.
+ * @param identity_len The length of @p identity.
+ * @param key          The buffer to copy the key to.
+ * @param max_key_len  The size of @p key.
+ * @param arg          The argument given to coap_keystore_set_lookup().
+ *
+ * @return The length of the key or @c 0 if the identity is unknown.
+ */
+typedef size_t (*coap_keystore_lookup_t)(const uint8_t *identity,
+                                         size_t identity_len,
+                                         uint8_t *key, size_t max_key_len,
+                                         void *arg);
+
+#ifndef WITHOUT_KEYSTORE
+
+/**
+ * Creates an empty keystore.
+ *
+ * @return The new keystore or @c NULL on error.
+ */
+coap_keystore_t *coap_new_keystore(void);
+
+/**
+ * Releases @p keystore and all keys it contains. If references have been
+ * taken with coap_keystore_reference(), one of them is dropped instead.
+ *
+ * @param keystore The keystore to release or @c NULL.
+ */
+void coap_free_keystore(coap_keystore_t *keystore);
+
+/**
+ * Takes a reference to @p keystore, which keeps it alive until the
+ * reference is dropped with coap_free_keystore(). The DTLS handshake
+ * workers use this while they look up keys.
+ *
+ * @param keystore The keystore.
+ *
+ * @return @p keystore.
+ */
+coap_keystore_t *coap_keystore_reference(coap_keystore_t *keystore);
+
+/**
+ * Adds the key for @p identity to @p keystore, replacing a key that has
+ * been stored for the identity before.
+ *
+ * @param keystore     The keystore.
+ * @param identity     The PSK identity.
+ * @param identity_len The length of @p identity.
+ * @param key          The key.
+ * @param key_len      The length of @p key, at most
+ *                     COAP_KEYSTORE_MAX_KEY_LENGTH.
+ *
+ * @return @c 1 on success, @c 0 on error.
+ */
+int coap_keystore_add(coap_keystore_t *keystore,
+                      const uint8_t *identity, size_t identity_len,
+                      const uint8_t *key, size_t key_len);
+
+/**
+ * Removes the key for @p identity from @p keystore.
+ *
+ * @return @c 1 if a key has been removed, @c 0 otherwise.
+ */
+int coap_keystore_remove(coap_keystore_t *keystore,
+                         const uint8_t *identity, size_t identity_len);
+
+/**
+ * Loads the keys of the key file @p path into @p keystore. Keys loaded
+ * from an earlier version of the file are replaced. The file is loaded
+ * again whenever it has changed.
+ *
+ * @param keystore The keystore.
+ * @param path     The name of the key file, copied.
+ *
+ * @return The number of keys loaded or @c -1 if the file cannot be read
+ *         or is malformed, in which case the keystore is unchanged.
+ */
+int coap_keystore_load_file(coap_keystore_t *keystore, const char *path);
+
+/**
+ * Loads the key file of @p keystore again if it has changed since it was
+ * last loaded.
+ *
+ * @param keystore The keystore.
+ *
+ * @return @c 1 if the file has been loaded, @c 0 if it is unchanged or
+ *         cannot be read.
+ */
+int coap_keystore_check_file(coap_keystore_t *keystore);
+
+/**
+ * Checks the key file of @p keystore if COAP_KEYSTORE_CHECK_INTERVAL
+ * seconds have passed since the last check. Called by the I/O loop for
+ * the keystore of a context.
+ *
+ * @param keystore The keystore.
+ * @param now      The current time.
+ *
+ * @return The time of the next check or @c 0 if there is no key file.
+ */
+coap_tick_t coap_keystore_check_timeout(coap_keystore_t *keystore,
+                                        coap_tick_t now);
+
+/**
+ * Sets the function to look up identities that are not in @p keystore.
+ * Results are kept for @p lifetime seconds in a cache of @p cache_size
+ * entries. The cache is cleared.
+ *
+ * @param keystore   The keystore.
+ * @param lookup     The lookup function or @c NULL.
+ * @param arg        The argument passed to @p lookup.
+ * @param cache_size The number of results to keep, @c 0 to keep none.
+ * @param lifetime   The number of seconds to keep a result.
+ */
+void coap_keystore_set_lookup(coap_keystore_t *keystore,
+                              coap_keystore_lookup_t lookup, void *arg,
+                              unsigned int cache_size,
+                              unsigned int lifetime);
+
+/**
+ * Copies the key for @p identity to @p key.
+ *
+ * @param keystore     The keystore.
+ * @param identity     The PSK identity.
+ * @param identity_len The length of @p identity.
+ * @param key          The buffer to copy the key to.
+ * @param max_key_len  The size of @p key.
+ *
+ * @return The length of the key or @c 0 if the identity is unknown or the
+ *         key does not fit into @p key.
+ */
+size_t coap_keystore_lookup(coap_keystore_t *keystore,
+                            const uint8_t *identity, size_t identity_len,
+                            uint8_t *key, size_t max_key_len);
+
+/**
+ * Resolves the PSK identities of clients of @p context with @p keystore.
+ * The context takes over @p keystore and releases it with
+ * coap_free_context(). A keystore set before is released. Identities that
+ * are not known to the keystore get the key set with
+ * coap_context_set_psk().
+ *
+ * @param context  The CoAP context.
+ * @param keystore The keystore or @c NULL.
+ */
+void coap_context_set_keystore(coap_context_t *context,
+                               coap_keystore_t *keystore);
+
+#else /* WITHOUT_KEYSTORE */
+
+#define coap_free_keystore(Keystore)
+#define coap_keystore_reference(Keystore) NULL
+#define coap_keystore_check_timeout(Keystore,Now) 0
+#define coap_keystore_lookup(Keystore,Identity,IdentityLen,Key,MaxKeyLen) 0
+
+#endif /* WITHOUT_KEYSTORE */
+
+/** @} */
+
+#endif /* _COAP_KEYSTORE_H_ */
@@ -45,27 +45,46 @@ typedef uint8_t coap_session_state_t;
 #define COAP_SESSION_STATE_HANDSHAKE	2
 #define COAP_SESSION_STATE_ESTABLISHED	3
 
+/**
+ * The number of bytes that a session holds for the DTLS library, for the
+ * state that it keeps with the session rather than with its DTLS state.
+ */
+#define COAP_DTLS_SESSION_DATA_SIZE 160
+
 typedef struct coap_session_t {
   struct coap_session_t *next;
   coap_proto_t proto;		  /**< protocol used */
   coap_session_type_t type;	  /**< client or server side socket */
   coap_session_state_t state;	  /**< current state of relationaship with peer */
-  uint8_t ref;			  /**< reference count from queues */
+  unsigned int ref;		  /**< reference count from queues and async states */
   uint16_t mtu;			  /**< path mtu */
+  uint16_t max_mtu;		  /**< upper bound for mtu, set by the application */
   uint16_t tls_overhead;	  /**< overhead of TLS layer */
   coap_address_t remote_addr;     /**< remote address and port */
   coap_address_t local_addr;	  /**< local address and port */
   int ifindex;                    /**< interface index */
   coap_socket_t sock;		  /**< socket object for the session, if any */
+  size_t rx_buffer_size;	  /**< size of the receive buffer for sock */
+  uint8_t *rx_buffer;		  /**< receive buffer for sock, allocated on first read */
   struct coap_endpoint_t *endpoint;	  /**< session's endpoint */
   struct coap_context_t *context;	  /**< session's context */
   void *tls;			  /**< security parameters */
+  int tls_released;		  /**< set while the DTLS state of a server session is released when idle */
   struct coap_queue_t *sendqueue; /**< list of messages waiting to be sent */
   coap_tick_t last_rx_tx;
   uint8_t *psk_identity;
   size_t psk_identity_len;
   uint8_t *psk_key;
   size_t psk_key_len;
+  struct coap_large_response_t *large_responses; /**< representations kept for Block2 requests */
+  struct coap_large_request_t *large_requests; /**< Block1 transfers in progress */
+  struct coap_block_fetch_t *block_fetches; /**< Block2 transfers started by coap_block_fetch() */
+  struct coap_q_block_send_t *q_block_sends; /**< Q-Block1 transfers started by coap_q_block_send() */
+  union {
+    void *ptr;
+    uint64_t u64;
+    uint8_t data[COAP_DTLS_SESSION_DATA_SIZE];
+  } tls_data;			  /**< kept for the DTLS library, see COAP_DTLS_SESSION_DATA_SIZE */
 } coap_session_t;
 
 /**
@@ -115,6 +134,56 @@ void coap_session_connected(coap_session_t *session);
 */
 void coap_session_set_mtu(coap_session_t *session, unsigned mtu);
 
+/**
+* Set the size of the receive buffer of a client session, i.e. the largest
+* datagram that can be received on the session's socket. Larger datagrams
+* are discarded. The buffer is allocated from the PDU storage when the first
+* datagram is read. Server sessions use the receive buffer of their
+* endpoint, see coap_endpoint_set_rx_buffer_size(). To send larger messages,
+* raise the MTU with coap_session_set_mtu() as well.
+*
+* @param session The CoAP client session.
+* @param size receive buffer size of at most COAP_MAX_PDU_SIZE bytes, or 0
+*             for COAP_RXBUFFER_SIZE
+* @return 1 on success, 0 if @p size is invalid or the session has no
+*         socket of its own
+*/
+int coap_session_set_rx_buffer_size(coap_session_t *session, size_t size);
+
+/**
+* Update the session MTU from a discovered path MTU. The session MTU is set
+* to @p mtu but never exceeds the value set with coap_session_set_mtu() or
+* coap_endpoint_set_default_mtu(), as the peer may not accept larger
+* messages. DTLS sessions are notified of the change.
+*
+* @param session The CoAP session.
+* @param mtu maximum message size towards the peer, excluding IP and UDP
+*            overhead
+*/
+void coap_session_set_path_mtu(coap_session_t *session, unsigned mtu);
+
+/**
+* Enable or disable path MTU discovery on the socket of a client session.
+* Datagrams are sent with the Don't Fragment bit set and the session MTU
+* follows the path MTU reported by the kernel, see coap_session_set_path_mtu().
+* Server sessions use the setting of their endpoint, see
+* coap_endpoint_set_pmtu_discovery().
+*
+* @param session The CoAP client session.
+* @param enable 1 to enable path MTU discovery, 0 to disable it
+* @return 1 on success, 0 if the session has no socket of its own or path
+*         MTU discovery is not supported on this platform
+*/
+int coap_session_set_pmtu_discovery(coap_session_t *session, int enable);
+
+/**
+* Process the errors queued on the socket of a client session that has path
+* MTU discovery enabled.
+*
+* @param session The CoAP client session.
+*/
+void coap_session_read_errors(coap_session_t *session);
+
 /**
  * Get maximum acceptable PDU size
  *
@@ -197,6 +266,8 @@ typedef struct coap_endpoint_t {
   coap_proto_t proto;		  /**< protocol used on this interface */
   uint16_t default_mtu; 	  /**< default mtu for this interface */
   coap_socket_t sock;		  /**< socket object for the interface, if any */
+  size_t rx_buffer_size;	  /**< size of the receive buffer for sock */
+  uint8_t *rx_buffer;		  /**< receive buffer for sock, allocated on first read */
   coap_address_t bind_addr;	  /**< local interface address */
   coap_session_t *sessions;	  /**< list of active sessions */
   coap_session_t hello;		  /**< special session of DTLS hello messages */
@@ -221,6 +292,42 @@ coap_endpoint_t *coap_new_endpoint(struct coap_context_t *context, const coap_ad
 */
 void coap_endpoint_set_default_mtu(coap_endpoint_t *ep, unsigned mtu);
 
+/**
+* Set the size of the endpoint's receive buffer, i.e. the largest datagram
+* that can be received by the endpoint's sessions. Larger datagrams are
+* discarded. The buffer is allocated from the PDU storage when the first
+* datagram is read. To send larger messages, raise the default MTU with
+* coap_endpoint_set_default_mtu() as well.
+*
+* @param ep The CoAP endpoint.
+* @param size receive buffer size of at most COAP_MAX_PDU_SIZE bytes, or 0
+*             for COAP_RXBUFFER_SIZE
+* @return 1 on success, 0 if @p size is invalid
+*/
+int coap_endpoint_set_rx_buffer_size(coap_endpoint_t *ep, size_t size);
+
+/**
+* Enable or disable path MTU discovery on the endpoint's socket. When
+* enabled, the MTU of each server session follows the path MTU to its peer
+* as reported by ICMP errors, see coap_session_set_path_mtu().
+*
+* @param ep The CoAP endpoint.
+* @param enable 1 to enable path MTU discovery, 0 to disable it
+* @return 1 on success, 0 if path MTU discovery is not supported on this
+*         platform
+*/
+int coap_endpoint_set_pmtu_discovery(coap_endpoint_t *ep, int enable);
+
+/**
+* Process the errors queued on the endpoint's socket that has path MTU
+* discovery enabled. Errors raised by the local stack, which do not identify
+* the peer, are applied to @p sender.
+*
+* @param ep The CoAP endpoint.
+* @param sender The session whose datagram has just failed to be sent, or NULL.
+*/
+void coap_endpoint_read_errors(coap_endpoint_t *ep, coap_session_t *sender);
+
 void coap_free_endpoint(coap_endpoint_t *ep);
 
 
@@ -29,6 +29,7 @@
 #include "option.h"
 #include "pdu.h"
 #include "prng.h"
+#include "block.h"
 #include "coap_session.h"
 
 struct coap_queue_t;
@@ -60,6 +61,13 @@ struct coap_resource_t;
 struct coap_context_t;
 #ifndef WITHOUT_ASYNC
 struct coap_async_state_t;
+
+/**
+ * Handler that is called when an asynchronous state expires or is
+ * released with its context (see coap_register_async_expire_handler()).
+ */
+typedef void (*coap_async_expire_handler_t)(struct coap_context_t *context,
+                                            struct coap_async_state_t *state);
 #endif
 
 /** Message handler that is used as call-back in coap_context_t */
@@ -79,11 +87,65 @@ typedef struct {
 typedef struct coap_context_t {
   coap_opt_filter_t known_options;
   struct coap_resource_t *resources; /**< hash table or list of known resources */
+  struct coap_resource_class_t *resource_classes; /**< list of resource classes */
+  /**
+   * Inverted index from attribute name and value token to the
+   * resources carrying them. Used for query filters on
+   * .well-known/core (not maintained when WITHOUT_ATTR_INDEX is set).
+   */
+  struct coap_attr_index_t *attr_index;
+  /**
+   * Set when an attribute could not be added to attr_index. Query
+   * filters then search all resources instead. */
+  int attr_index_incomplete;
+  unsigned long resource_seq; /**< sequence number of the last resource added */
+  /**
+   * Cached responses to GET requests on cacheable resources (not used
+   * when WITHOUT_CACHE is set).
+   */
+  struct coap_cache_entry_t *cache;
+  size_t cache_max_entries; /**< Maximum number of cached responses. 0 means use default. */
+
+  /**
+   * Sink for Block1 transfers that are reassembled by the library (not
+   * used when WITHOUT_LARGE_REQUEST is set).
+   */
+  coap_large_request_sink_t large_request_sink;
+  coap_release_large_data_t large_request_release;
+  size_t max_large_request_size; /**< Maximum body size of Block1 transfers. 0 means use default. */
+  unsigned int max_large_requests; /**< Maximum number of Block1 transfers. 0 means use default. */
+  unsigned int large_requests;  /**< Number of Block1 transfers in progress. */
+
+  unsigned int non_timeout; /**< NON_TIMEOUT of Q-Block transfers in milliseconds. 0 means use default. */
+
+  /**
+   * Requests collected for batch handlers, followed by as many entries
+   * of scratch space. */
+  struct coap_batch_request_t *batch;
+  size_t batch_count;            /**< Number of requests in batch. */
+  size_t batch_size;             /**< Number of requests batch can hold. */
+  unsigned int batch_max_requests; /**< Maximum number of requests in a batch. 0 means use default. */
+  unsigned int batch_max_delay;  /**< Maximum collection time of a batch in milliseconds. 0 means use default. */
+  coap_tick_t batch_start;       /**< Time the first request of batch was collected. */
 
 #ifndef WITHOUT_ASYNC
   /**
-   * list of asynchronous transactions */
+   * hash table of asynchronous transactions, indexed by session and
+   * transaction id */
   struct coap_async_state_t *async_state;
+  /**
+   * hash table of the asynchronous transactions that identical GET
+   * requests are coalesced with, indexed by cache key (which includes
+   * the resource) */
+  struct coap_async_state_t *async_coalesce;
+  unsigned int async_timeout; /**< Expiry of asynchronous states in seconds. 0 means never. */
+  coap_tick_t async_next_expiry; /**< No state expires before this time. */
+  coap_async_expire_handler_t async_expire_handler;
+
+  /**
+   * Results of asynchronous transactions posted by other threads (not
+   * used when WITHOUT_COMPLETION_QUEUE is set). */
+  struct coap_completion_queue_t *completion_queue;
 #endif /* WITHOUT_ASYNC */
 
   /**
@@ -140,10 +202,14 @@ typedef struct coap_context_t {
   size_t psk_hint_len;
   uint8_t *psk_key;
   size_t psk_key_len;
+  struct coap_keystore_t *keystore; /**< keys of client identities, set by coap_context_set_keystore() */
+  struct coap_hello_limit_t *hello_limit; /**< limit of DTLS hello messages, set by coap_context_set_hello_limit() */
+  unsigned int dtls_handshakes;    /**< number of DTLS server handshakes in progress */
 
   unsigned int session_timeout;	   /**< Number of seconds of inactivity after which an unused session will be closed. 0 means use default. */
   unsigned int max_idle_sessions;  /**< Maximum number of simultaneous unused sessions per endpoint. 0 means no maximum. */
   unsigned int keepalive_interval; /**< Minimum interval before sending a keepalive message. 0 means disabled. */
+  unsigned int dtls_idle_timeout;  /**< Number of seconds of inactivity after which the DTLS state of a session is released. 0 means never. */
 
   void *app;                    /**< application-specific data */
 } coap_context_t;
@@ -206,6 +272,18 @@ coap_context_t *coap_new_context(const coap_address_t *listen_addr);
 void coap_context_set_psk( coap_context_t *ctx, const char *hint,
                            const uint8_t *key, size_t key_len );
 
+/**
+ * The default server PSK callback of a context. It looks up @p identity
+ * in the keystore set with coap_context_set_keystore() and falls back to
+ * the key set with coap_context_set_psk().
+ *
+ * @return The length of the key copied to @p psk or @c 0 if there is none.
+ */
+size_t coap_get_context_server_psk(const coap_session_t *session,
+                                   const uint8_t *identity,
+                                   size_t identity_len,
+                                   uint8_t *psk, size_t max_psk_len);
+
 /**
  * Returns a new message id and updates @p context->message_id accordingly. The
  * message id is returned in network byte order to make it easier to read in
@@ -405,6 +483,23 @@ int coap_run_once( coap_context_t *ctx, unsigned int timeout_ms );
  */
 int coap_handle_message(coap_context_t *ctx, coap_session_t *session, uint8_t *data, size_t data_len);
 
+/**
+ * Parses and interprets a CoAP message of @p length bytes that has been
+ * received into the storage of *@p pdu, e.g. by a DTLS library decrypting
+ * it in place. The message is not copied. The PDU is left to the caller,
+ * to receive the next message into, unless the context has kept it, e.g.
+ * for a batch handler. *@p pdu is set to @c NULL then.
+ *
+ * @param ctx     The current CoAP context.
+ * @param session The session the message has been received on.
+ * @param pdu     The PDU holding the message.
+ * @param length  The length of the message.
+ *
+ * @return       @c 0 if message was handled successfully, or less than zero on
+ *               error.
+ */
+int coap_handle_message_pdu(coap_context_t *ctx, coap_session_t *session, coap_pdu_t **pdu, size_t length);
+
 /**
  * Invokes the event handler of @p context for the given @p event and
  * @p data.
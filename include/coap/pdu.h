@@ -29,6 +29,9 @@ struct coap_session_t;
 #ifndef COAP_DEFAULT_PDU_SIZE
 #define COAP_DEFAULT_PDU_SIZE      1152 /* default maximum size of a CoAP PDU */
 #endif /* COAP_DEFAULT_PDU_SIZE */
+#ifndef COAP_MAX_PDU_SIZE
+#define COAP_MAX_PDU_SIZE         65507 /* largest CoAP PDU, the maximum UDP payload over IPv4 */
+#endif /* COAP_MAX_PDU_SIZE */
 
 #define COAP_DEFAULT_VERSION      1 /* version of CoAP supported */
 #define COAP_DEFAULT_SCHEME  "coap" /* the default scheme for CoAP URIs */
@@ -86,6 +89,12 @@ struct coap_session_t;
 
 #define COAP_OPTION_BLOCK2         23 /* C, uint, 0--3 B, (none) */
 #define COAP_OPTION_BLOCK1         27 /* C, uint, 0--3 B, (none) */
+#define COAP_OPTION_SIZE2          28 /* E, uint, 0--4 B, (none) */
+
+/* option types from RFC 9177 */
+
+#define COAP_OPTION_Q_BLOCK1       19 /* C, uint, 0--3 B, (none) */
+#define COAP_OPTION_Q_BLOCK2       31 /* C, uint, 0--3 B, (none) */
 
 /* selected option types from RFC 7967 */
 
@@ -156,6 +165,7 @@ char *coap_response_phrase(unsigned char code);
 #define COAP_MEDIATYPE_APPLICATION_EXI           47 /* application/exi  */
 #define COAP_MEDIATYPE_APPLICATION_JSON          50 /* application/json  */
 #define COAP_MEDIATYPE_APPLICATION_CBOR          60 /* application/cbor  */
+#define COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ  272 /* application/missing-blocks+cbor-seq */
 
 /* Note that identifiers for registered media types are in the range 0-65535. We
  * use an unallocated type here and hope for the best. */
@@ -345,7 +355,8 @@ void coap_delete_pdu(coap_pdu_t *);
  * @param length The actual size of @p data.
  * @param result The PDU structure to fill. Note that the structure must
  *               provide space for at least @p length bytes to hold the
- *               entire CoAP PDU.
+ *               entire CoAP PDU. @p data may point to the storage of
+ *               @p result, in which case the PDU is parsed in place.
  *
  * @return       A value greater than zero on success or @c 0 on error.
  */
@@ -383,6 +394,18 @@ size_t coap_add_option(coap_pdu_t *pdu,
                        unsigned int len,
                        const unsigned char *data);
 
+/**
+ * Inserts option of given type into @p pdu at the position required by the
+ * option order. Unlike coap_add_option(), this function can be used after
+ * options with a higher type or data have been added already. Options that
+ * follow the new option and the data are moved. This function returns the
+ * number of bytes written or @c 0 on error. On error, @p pdu is unchanged.
+ */
+size_t coap_insert_option(coap_pdu_t *pdu,
+                          unsigned short type,
+                          unsigned int len,
+                          const unsigned char *data);
+
 /**
  * Adds option of given type to pdu that is passed as first parameter, but does
  * not write a value. It works like coap_add_option with respect to calling
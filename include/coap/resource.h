@@ -16,6 +16,15 @@
 #define _COAP_RESOURCE_H_
 
 # include <assert.h>
+# include <stddef.h>
+
+#if defined(WITHOUT_QUERY_FILTER) || defined(WITH_CONTIKI) || defined(WITH_LWIP)
+/* The attribute index is used for query filters only and needs
+ * dynamic memory which is not available on constrained platforms. */
+#ifndef WITHOUT_ATTR_INDEX
+#define WITHOUT_ATTR_INDEX 1
+#endif /* WITHOUT_ATTR_INDEX */
+#endif
 
 #ifndef COAP_RESOURCE_CHECK_TIME
 /** The interval in seconds to check if resources have changed. */
@@ -46,11 +55,49 @@ typedef void (*coap_method_handler_t)
    str * /* token */,
    coap_pdu_t * /* response */);
 
+struct coap_resource_t;
+
+/**
+ * A request collected for the batch handler of a resource (see
+ * coap_register_batch_handler()).
+ */
+typedef struct coap_batch_request_t {
+  coap_session_t *session;          /**< the session of the request */
+  struct coap_resource_t *resource; /**< the requested resource */
+  coap_pdu_t *request;              /**< the request */
+  coap_pdu_t *response;             /**< sent if its code has been set */
+} coap_batch_request_t;
+
+/**
+ * Definition of batch handler function (@sa coap_register_batch_handler()).
+ * The handler may set code, options and payload of the response of each
+ * request. Responses whose code has been left at @c 0 are not sent.
+ */
+typedef void (*coap_batch_handler_t)
+  (coap_context_t  *,
+   struct coap_resource_t *,
+   coap_batch_request_t * /* requests */,
+   size_t /* count */);
+
+#ifndef COAP_BATCH_DEFAULT_SIZE
+/** Default maximum number of requests passed to a batch handler at once. */
+#define COAP_BATCH_DEFAULT_SIZE 64
+#endif /* COAP_BATCH_DEFAULT_SIZE */
+
+#ifndef COAP_BATCH_DEFAULT_DELAY
+/** Default time in milliseconds that coap_read() collects requests for a
+ *  batch. */
+#define COAP_BATCH_DEFAULT_DELAY 2
+#endif /* COAP_BATCH_DEFAULT_DELAY */
+
 #define COAP_ATTR_FLAGS_RELEASE_NAME  0x1
 #define COAP_ATTR_FLAGS_RELEASE_VALUE 0x2
 
 typedef struct coap_attr_t {
   struct coap_attr_t *next;
+  struct coap_resource_t *resource; /**< the resource this attribute belongs to */
+  struct coap_resource_class_t *rclass; /**< the class this attribute belongs to */
+  struct coap_attr_posting_t *postings; /**< entries in the attribute index */
   str name;
   str value;
   int flags;
@@ -71,6 +118,84 @@ typedef struct coap_attr_t {
  */
 #define COAP_RESOURCE_FLAGS_NOTIFY_CON  0x2
 
+/**
+ * GET requests that arrive while an identical GET is being handled
+ * asynchronously are parked and answered with the result of the first
+ * request. The application must complete asynchronous GET requests on this
+ * resource with coap_async_complete().
+ */
+#define COAP_RESOURCE_FLAGS_COALESCE    0x4
+
+/**
+ * Requests with a Block1 option are reassembled by the library, which
+ * sends 2.31 Continue responses and calls the handler once with the
+ * complete body. The handler retrieves the body with
+ * coap_get_data_large_request().
+ */
+#define COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1 0x8
+
+/** The number of request methods that a resource can handle. */
+#define COAP_RESOURCE_MAX_HANDLERS 7
+
+/**
+ * A resource class holds the method handlers and link attributes that
+ * are shared by any number of compact resources created with
+ * coap_resource_init_compact(). Resource classes are registered with
+ * coap_add_resource_class() and released together with the context.
+ */
+typedef struct coap_resource_class_t {
+  struct coap_resource_class_t *next;
+  unsigned int observable:1;     /**< resources of this class can be observed */
+  int flags;                     /**< flags for new resources of this class */
+
+  /** Handlers for all resources of this class (@sa coap_resource_t). */
+  coap_method_handler_t handler[COAP_RESOURCE_MAX_HANDLERS];
+
+  coap_attr_t *link_attr;  /**< attributes shared by all resources of this class */
+  struct coap_resource_t *resources; /**< registered resources of this class */
+  size_t count;                      /**< number of registered resources */
+  struct coap_context_t *context;    /**< the context this class belongs to */
+} coap_resource_class_t;
+
+/**
+ * A link attribute of a static resource. Static attributes are
+ * ordinary attributes that are never linked or released, hence
+ * coap_find_attr() returns them like any other attribute. Use
+ * COAP_STATIC_ATTR() to initialize them.
+ */
+typedef coap_attr_t coap_static_attr_t;
+
+/**
+ * Initializer for a coap_static_attr_t with the string literals @p N as
+ * name and @p V as value.
+ */
+#define COAP_STATIC_ATTR(N,V) \
+  { NULL, NULL, NULL, NULL, COAP_STR_LITERAL(N), COAP_STR_LITERAL(V), 0 }
+
+/** Initializer for the entry that terminates a table of static attributes. */
+#define COAP_STATIC_ATTR_END \
+  { NULL, NULL, NULL, NULL, { 0, NULL }, { 0, NULL }, 0 }
+
+/**
+ * Description of a resource that is defined at compile time. Tables
+ * of static resources can be declared @c const and are registered with
+ * coap_add_static_resources() without allocating memory.
+ */
+typedef struct coap_static_resource_t {
+  str uri;                       /**< the URI path of the resource */
+  int flags;                     /**< resource flags (see coap_resource_init()) */
+  unsigned int observable:1;     /**< can be observed */
+
+  /** Handlers for the request methods (@sa coap_resource_t). */
+  coap_method_handler_t handler[COAP_RESOURCE_MAX_HANDLERS];
+
+  /**
+   * Link attributes of the resource, terminated by
+   * COAP_STATIC_ATTR_END, or @c NULL if none.
+   */
+  const coap_static_attr_t *link_attr;
+} coap_static_resource_t;
+
 typedef struct coap_resource_t {
   unsigned int dirty:1;          /**< set to 1 if resource has changed */
   unsigned int partiallydirty:1; /**< set to 1 if some subscribers have not yet
@@ -78,15 +203,6 @@ typedef struct coap_resource_t {
   unsigned int observable:1;     /**< can be observed */
   unsigned int cacheable:1;      /**< can be cached */
 
-  /**
-   * Used to store handlers for the seven coap methods @c GET, @c POST, @c PUT,
-   * @c DELETE, @c FETCH, @c PATCH and @c IPATCH.
-   * coap_dispatch() will pass incoming requests to the handler
-   * that corresponds to its request method or generate a 4.05 response if no
-   * handler is available.
-   */
-  coap_method_handler_t handler[7];
-
   coap_key_t key;                /**< the actual key bytes for this resource */
 
 #ifdef COAP_RESOURCES_NOHASH
@@ -98,6 +214,28 @@ typedef struct coap_resource_t {
   coap_attr_t *link_attr; /**< attributes to be included with the link format */
   coap_subscription_t *subscribers;  /**< list of observers for this resource */
 
+  /**
+   * The context this resource has been registered with by
+   * coap_add_resource() or @c NULL if not registered. Used to keep
+   * the context's attribute index up to date.
+   */
+  struct coap_context_t *context;
+
+  /**
+   * Order in which the resource was added to its context. Resources
+   * found in the attribute index are listed in this order, which is
+   * that of context->resources.
+   */
+  unsigned long seq;
+
+  /**
+   * The class of a compact resource or @c NULL. Compact resources
+   * share the handlers and link attributes of their class.
+   */
+  coap_resource_class_t *rclass;
+  struct coap_resource_t *class_prev; /**< previous resource of rclass */
+  struct coap_resource_t *class_next; /**< next resource of rclass */
+
   /**
    * Request URI for this resource. This field will point into the static
    * memory.
@@ -105,8 +243,48 @@ typedef struct coap_resource_t {
   str uri;
   int flags;
 
+  /*
+   * Compact resources end here: coap_resource_init_compact() allocates
+   * COAP_RESOURCE_COMPACT_SIZE bytes followed by the URI. The fields
+   * below must not be used when rclass is set.
+   */
+
+  /**
+   * Used to store handlers for the seven coap methods @c GET, @c POST, @c PUT,
+   * @c DELETE, @c FETCH, @c PATCH and @c IPATCH.
+   * coap_dispatch() will pass incoming requests to the handler
+   * that corresponds to its request method or generate a 4.05 response if no
+   * handler is available. Compact resources use the handlers of their
+   * resource class instead (see coap_resource_get_handler()).
+   */
+  coap_method_handler_t handler[COAP_RESOURCE_MAX_HANDLERS];
+
+  /**
+   * Handler for NON requests that are collected and passed on in batches
+   * or @c NULL (see coap_register_batch_handler()).
+   */
+  coap_batch_handler_t batch_handler;
+
+  /**
+   * The description of a static resource or @c NULL. Static resources
+   * use the handlers and link attributes of their description.
+   */
+  const coap_static_resource_t *desc;
+
+  /**
+   * The file served by a resource created with coap_resource_init_file()
+   * or @c NULL.
+   */
+  struct coap_file_t *file;
+
 } coap_resource_t;
 
+/**
+ * Number of bytes of a compact resource, which has no storage for the
+ * fields of coap_resource_t from handler on.
+ */
+#define COAP_RESOURCE_COMPACT_SIZE offsetof(coap_resource_t, handler)
+
 /**
  * Creates a new resource object and initializes the link field to the string
  * of length @p len. This function returns the new coap_resource_t object.
@@ -121,6 +299,102 @@ coap_resource_t *coap_resource_init(const unsigned char *uri,
                                     size_t len, int flags);
 
 
+/**
+ * Registers the @p count static resources in @p table with @p context.
+ * The caller provides the storage for the registered resources which
+ * must be valid for the lifetime of @p context, e.g. a static array
+ * of @p count coap_resource_t objects. No memory is allocated for the
+ * resources (except for the attribute index). Static resources stay
+ * registered until the context is freed; coap_delete_resource() does
+ * not remove them.
+ *
+ * @param context  The context to use.
+ * @param table    The resource descriptions. The table is not copied
+ *                 and must be valid for the lifetime of @p context.
+ * @param count    The number of elements in @p table.
+ * @param storage  Storage for @p count resource objects.
+ */
+void coap_add_static_resources(coap_context_t *context,
+                               const coap_static_resource_t *table,
+                               size_t count,
+                               coap_resource_t *storage);
+
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+/* Resource classes and compact resources need dynamic memory. */
+
+/**
+ * Creates a compact resource of class @p rclass. The resource uses the
+ * method handlers and link attributes of @p rclass. The URI is copied
+ * into the storage that is allocated for the resource itself, hence
+ * the caller does not need to keep @p uri. Further attributes may be
+ * added with coap_add_attr(); these are printed before the attributes
+ * of the class.
+ *
+ * @param rclass The resource class which must have been registered
+ *               with coap_add_resource_class().
+ * @param uri    The URI path of the new resource.
+ * @param len    The length of @p uri.
+ *
+ * @return       A pointer to the new object or @c NULL on error.
+ */
+coap_resource_t *coap_resource_init_compact(coap_resource_class_t *rclass,
+                                            const unsigned char *uri,
+                                            size_t len);
+
+/**
+ * Creates a new resource class. The @p flags are used for all
+ * resources of this class.
+ *
+ * @param flags  Flags for the resources of this class (see
+ *               coap_resource_init()).
+ *
+ * @return       A pointer to the new object or @c NULL on error.
+ */
+coap_resource_class_t *coap_resource_class_init(int flags);
+
+/**
+ * Registers the given resource class with @p context. The storage
+ * allocated for @p rclass is released when the context is freed.
+ *
+ * @param context The context to use.
+ * @param rclass  The resource class to store.
+ */
+void coap_add_resource_class(coap_context_t *context,
+                             coap_resource_class_t *rclass);
+
+/**
+ * Registers a new attribute with the given resource class. The
+ * attribute is included in the link description of every resource of
+ * @p rclass. See coap_add_attr() for the parameters.
+ *
+ * @return         A pointer to the new attribute or @c NULL on error.
+ */
+coap_attr_t *coap_resource_class_add_attr(coap_resource_class_t *rclass,
+                                          const unsigned char *name,
+                                          size_t nlen,
+                                          const unsigned char *val,
+                                          size_t vlen,
+                                          int flags);
+
+/**
+ * Registers the specified @p handler as message handler for the request
+ * type @p method for all resources of @p rclass.
+ *
+ * @param rclass   The resource class for which the handler shall be
+ *                 registered.
+ * @param method   The CoAP request method to handle.
+ * @param handler  The handler to register with @p rclass.
+ */
+COAP_STATIC_INLINE void
+coap_resource_class_register_handler(coap_resource_class_t *rclass,
+                                     unsigned char method,
+                                     coap_method_handler_t handler) {
+  assert(rclass);
+  assert(method > 0 && (size_t)(method-1) < COAP_RESOURCE_MAX_HANDLERS);
+  rclass->handler[method-1] = handler;
+}
+#endif /* !WITH_CONTIKI && !WITH_LWIP */
+
 /**
  * Sets the notification message type of resource @p r to given
  * @p mode which must be one of @c COAP_RESOURCE_FLAGS_NOTIFY_NON
@@ -143,7 +417,7 @@ void coap_add_resource(coap_context_t *context, coap_resource_t *resource);
 
 /**
  * Deletes a resource identified by @p key. The storage allocated for that
- * resource is freed.
+ * resource is freed. Static resources are not deleted.
  *
  * @param context  The context where the resources are stored.
  * @param key      The unique key for the resource to delete.
@@ -154,7 +428,8 @@ void coap_add_resource(coap_context_t *context, coap_resource_t *resource);
 int coap_delete_resource(coap_context_t *context, coap_key_t key);
 
 /**
- * Deletes all resources from given @p context and frees their storage.
+ * Deletes all resources and resource classes from given @p context and
+ * frees their storage.
  *
  * @param context The CoAP context with the resources to be deleted.
  */
@@ -185,7 +460,10 @@ coap_attr_t *coap_add_attr(coap_resource_t *resource,
 
 /**
  * Returns @p resource's coap_attr_t object with given @p name if found, @c NULL
- * otherwise.
+ * otherwise. For compact resources, the attributes of the resource class are
+ * searched as well, for static resources the attributes of their
+ * coap_static_resource_t. As these may be shared with other resources, the
+ * result must not be modified.
  *
  * @param resource The resource to search for attribute @p name.
  * @param name     Name of the requested attribute.
@@ -193,12 +471,14 @@ coap_attr_t *coap_add_attr(coap_resource_t *resource,
  * @return         The first attribute with specified @p name or @c NULL if none
  *                 was found.
  */
-coap_attr_t *coap_find_attr(coap_resource_t *resource,
-                            const unsigned char *name,
-                            size_t nlen);
+const coap_attr_t *coap_find_attr(const coap_resource_t *resource,
+                                  const unsigned char *name,
+                                  size_t nlen);
 
 /**
- * Deletes an attribute.
+ * Deletes an attribute. The attribute is removed from the resource (or
+ * resource class) it has been registered with and from the attribute
+ * index of the context.
  *
  * @param attr Pointer to a previously created attribute.
  *
@@ -249,7 +529,8 @@ coap_print_status_t coap_print_link(const coap_resource_t *resource,
 
 /**
  * Registers the specified @p handler as message handler for the request type @p
- * method
+ * method. This must not be used for compact or static resources whose
+ * handlers are defined by their resource class or description.
  *
  * @param resource The resource for which the handler shall be registered.
  * @param method   The CoAP request method to handle.
@@ -260,10 +541,112 @@ coap_register_handler(coap_resource_t *resource,
                       unsigned char method,
                       coap_method_handler_t handler) {
   assert(resource);
-  assert(method > 0 && (size_t)(method-1) < sizeof(resource->handler)/sizeof(coap_method_handler_t));
+  assert(!resource->rclass && !resource->desc);
+  assert(method > 0 && (size_t)(method-1) < COAP_RESOURCE_MAX_HANDLERS);
   resource->handler[method-1] = handler;
 }
 
+/**
+ * Returns the handler of @p resource for the request type @p method or
+ * @c NULL if none has been registered. Compact resources are handled by
+ * their resource class and static resources by their description.
+ *
+ * @param resource The resource.
+ * @param method   The CoAP request method.
+ *
+ * @return The handler or @c NULL.
+ */
+COAP_STATIC_INLINE coap_method_handler_t
+coap_resource_get_handler(const coap_resource_t *resource,
+                          unsigned char method) {
+  if (method == 0 || (size_t)(method-1) >= COAP_RESOURCE_MAX_HANDLERS)
+    return NULL;
+  if (resource->rclass)
+    return resource->rclass->handler[method-1];
+  if (resource->desc)
+    return resource->desc->handler[method-1];
+  return resource->handler[method-1];
+}
+
+/**
+ * Registers @p handler to handle the NON requests for @p resource in
+ * batches. Instead of calling the method handler for each request, the
+ * requests received by one call to coap_read() are collected, and the
+ * batch handler is called once with all requests for @p resource, in the
+ * order of arrival. The responses are sent when the handler has returned.
+ * While requests are collected, coap_read() keeps reading datagrams that
+ * are available on the same endpoint, up to the limits set with
+ * coap_context_set_batch_limits().
+ *
+ * Confirmable requests, multicast requests and requests with Observe or
+ * block options are passed to the method handlers as usual. Compact
+ * resources cannot have a batch handler.
+ *
+ * @param resource The resource.
+ * @param handler  The batch handler or @c NULL to pass each request to
+ *                 the method handlers.
+ */
+COAP_STATIC_INLINE void
+coap_register_batch_handler(coap_resource_t *resource,
+                            coap_batch_handler_t handler) {
+  assert(resource);
+  assert(!resource->rclass);
+  resource->batch_handler = handler;
+}
+
+/**
+ * Returns the batch handler of @p resource or @c NULL if none has been
+ * registered. Compact resources have no batch handler.
+ */
+COAP_STATIC_INLINE coap_batch_handler_t
+coap_resource_get_batch_handler(const coap_resource_t *resource) {
+  return resource->rclass ? NULL : resource->batch_handler;
+}
+
+/**
+ * Sets the limits of batches for batch handlers of @p context. A batch
+ * is passed to the handlers when it holds @p max_requests requests, or
+ * when coap_read() has read all available datagrams or collected
+ * requests for @p max_delay milliseconds. A value of @c 0 selects
+ * COAP_BATCH_DEFAULT_SIZE or COAP_BATCH_DEFAULT_DELAY, respectively.
+ * Pending requests are passed to the handlers first.
+ *
+ * @param context      The CoAP context.
+ * @param max_requests The maximum number of requests in a batch.
+ * @param max_delay    The maximum collection time in milliseconds.
+ */
+void coap_context_set_batch_limits(coap_context_t *context,
+                                   unsigned int max_requests,
+                                   unsigned int max_delay);
+
+/**
+ * Passes the requests collected for batch handlers of @p context to the
+ * handlers and sends the responses. This function is called by
+ * coap_read().
+ *
+ * @param context The CoAP context.
+ */
+void coap_batch_flush(coap_context_t *context);
+
+/**
+ * Drops the requests collected for the batch handler of @p resource. This
+ * function is called when @p resource is deleted.
+ *
+ * @param context  The CoAP context.
+ * @param resource The resource.
+ */
+void coap_batch_detach_resource(coap_context_t *context,
+                                struct coap_resource_t *resource);
+
+/**
+ * Drops all requests collected for batch handlers of @p context and
+ * releases the batch storage. This function is called by
+ * coap_free_context().
+ *
+ * @param context The CoAP context.
+ */
+void coap_batch_free(coap_context_t *context);
+
 /**
  * Returns the resource identified by the unique string @p key. If no resource
  * was found, this function returns @c NULL.
@@ -19,6 +19,9 @@ typedef struct {
 
 #define COAP_SET_STR(st,l,v) { (st)->length = (l), (st)->s = (v); }
 
+/** Initializer for a str object that refers to the string literal @p v. */
+#define COAP_STR_LITERAL(v) { sizeof(v) - 1, (unsigned char *)(v) }
+
 /**
  * Returns a new string object with at least size bytes storage allocated. The
  * string must be released using coap_delete_string();
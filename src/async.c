@@ -16,24 +16,60 @@
 #include "coap_config.h"
 #include "coap.h"
 #include "async.h"
+#include "coap_cache.h"
 #include "debug.h"
 #include "mem.h"
+#include "resource.h"
 #include "utlist.h"
+#include "uthash.h"
 
-coap_async_state_t *
-coap_register_async(coap_context_t *context, coap_session_t *session,
-		    coap_pdu_t *request, unsigned char flags, void *data) {
-  coap_async_state_t *s;
-  coap_tid_t id = ntohs( request->hdr->id );
+/** Stores the hash key of (@p session, @p id) in @p key. */
+static void
+async_make_key(unsigned char key[sizeof(coap_session_t *) + sizeof(coap_tid_t)],
+               coap_session_t *session, coap_tid_t id) {
+  memcpy(key, &session, sizeof(coap_session_t *));
+  memcpy(key + sizeof(coap_session_t *), &id, sizeof(coap_tid_t));
+}
 
-  LL_SEARCH_PAIR(context->async_state,s,session,session,id,id);
+/**
+ * Stores the cache key of @p request on @p resource in @p key, which
+ * starts with the resource. Returns the length of the key or @c 0 if
+ * @p request cannot be coalesced.
+ */
+static size_t
+async_coalesce_key(unsigned char key[COAP_CACHE_KEY_MAX_SIZE],
+                   coap_resource_t *resource, coap_pdu_t *request) {
+  coap_opt_iterator_t opt_iter;
 
-  if (s != NULL) {
-    /* We must return NULL here as the caller must know that he is
-     * responsible for releasing @p data. */
-    debug("asynchronous state for transaction %d already registered\n", id);
-    return NULL;
+  if (!(resource->flags & COAP_RESOURCE_FLAGS_COALESCE)
+      || request->hdr->code != COAP_REQUEST_GET
+      || coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter))
+    return 0;
+
+  return coap_cache_key(resource, request, key);
+}
+
+/**
+ * Removes @p s from the hash tables of @p context. Requests are no longer
+ * coalesced with @p s.
+ */
+static void
+async_unlink(coap_context_t *context, coap_async_state_t *s) {
+  HASH_DELETE(hh, context->async_state, s);
+  if (s->resource) {
+    HASH_DELETE(chh, context->async_coalesce, s);
+    s->resource = NULL;
   }
+}
+
+/**
+ * Creates a state object for @p request received on @p session. Returns
+ * the new object or @c NULL on error.
+ */
+static coap_async_state_t *
+async_new_state(coap_session_t *session, coap_pdu_t *request,
+                unsigned char flags, void *data) {
+  coap_async_state_t *s;
 
   /* store information for handling the asynchronous task */
   s = (coap_async_state_t *)coap_malloc(sizeof(coap_async_state_t) + 
@@ -52,7 +88,8 @@ coap_register_async(coap_context_t *context, coap_session_t *session,
 
   s->appdata = data;
   s->session = coap_session_reference( session );
-  s->id = id;
+  s->id = ntohs( request->hdr->id );
+  async_make_key(s->hkey, session, s->id);
 
   if (request->hdr->token_length) {
     s->tokenlen = request->hdr->token_length;
@@ -61,15 +98,47 @@ coap_register_async(coap_context_t *context, coap_session_t *session,
     
   coap_touch_async(s);
 
-  LL_PREPEND(context->async_state, s);
+  return s;
+}
+
+coap_async_state_t *
+coap_register_async(coap_context_t *context, coap_session_t *session,
+		    coap_pdu_t *request, unsigned char flags, void *data) {
+  coap_async_state_t *s;
+  coap_tid_t id = ntohs( request->hdr->id );
+
+  s = coap_find_async(context, session, id);
+
+  if (s != NULL) {
+    /* We must return NULL here as the caller must know that he is
+     * responsible for releasing @p data. */
+    debug("asynchronous state for transaction %d already registered\n", id);
+    return NULL;
+  }
+
+  s = async_new_state(session, request, flags, data);
+  if (!s)
+    return NULL;
+
+  HASH_ADD(hh, context->async_state, hkey, sizeof(s->hkey), s);
+
+  if (context->async_timeout > 0) {
+    coap_tick_t expiry =
+      s->created + context->async_timeout * COAP_TICKS_PER_SECOND;
+    if (context->async_next_expiry == 0 || expiry < context->async_next_expiry)
+      context->async_next_expiry = expiry;
+  }
 
   return s;
 }
 
 coap_async_state_t *
 coap_find_async(coap_context_t *context, coap_session_t *session, coap_tid_t id) {
+  unsigned char key[sizeof(coap_session_t *) + sizeof(coap_tid_t)];
   coap_async_state_t *tmp;
-  LL_SEARCH_PAIR(context->async_state,tmp,session,session,id,id);
+
+  async_make_key(key, session, id);
+  HASH_FIND(hh, context->async_state, key, sizeof(key), tmp);
   return tmp;
 }
 
@@ -79,14 +148,220 @@ coap_remove_async(coap_context_t *context, coap_session_t *session,
   coap_async_state_t *tmp = coap_find_async(context, session, id);
 
   if (tmp)
-    LL_DELETE(context->async_state,tmp);
+    async_unlink(context, tmp);
 
   *s = tmp;
   return tmp != NULL;
 }
 
+/**
+ * Sends a copy of @p response to the requester of @p s. Returns @c 1 if
+ * the copy has been passed to coap_send(), @c 0 otherwise.
+ */
+static int
+async_send_copy(coap_context_t *context, coap_async_state_t *s,
+                coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_pdu_t *pdu;
+  size_t len;
+  unsigned char *data;
+
+  pdu = coap_pdu_init(s->flags & COAP_ASYNC_CONFIRM
+                      ? COAP_MESSAGE_CON
+                      : COAP_MESSAGE_NON,
+                      response->hdr->code, coap_new_message_id(context),
+                      coap_session_max_pdu_size(s->session));
+  if (!pdu || !coap_add_token(pdu, s->tokenlen, s->token))
+    goto error;
+
+  coap_option_iterator_init(response, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (!coap_add_option(pdu, opt_iter.type,
+                         coap_opt_length(option), coap_opt_value(option)))
+      goto error;
+  }
+
+  if (coap_get_data(response, &len, &data)
+      && !coap_add_data(pdu, (unsigned int)len, data))
+    goto error;
+
+  return coap_send(s->session, pdu) != COAP_INVALID_TID;
+
+ error:
+  debug("coap_async_complete: cannot create response for transaction %d\n",
+        s->id);
+  coap_delete_pdu(pdu);
+  return 0;
+}
+
+int
+coap_async_complete(coap_context_t *context, coap_async_state_t *s,
+                    coap_pdu_t *response) {
+  coap_async_state_t *tmp, *rtmp;
+  int sent = 0;
+
+  assert(s);
+  assert(response);
+
+  /* s may have been removed with coap_remove_async() already */
+  if (coap_find_async(context, s->session, s->id) == s)
+    async_unlink(context, s);
+
+  LL_FOREACH_SAFE(s->coalesced, tmp, rtmp) {
+    sent += async_send_copy(context, tmp, response);
+    LL_DELETE(s->coalesced, tmp);
+    coap_free_async(tmp);
+  }
+
+  sent += async_send_copy(context, s, response);
+
+  coap_free_async(s);
+  coap_delete_pdu(response);
+  return sent;
+}
+
+int
+coap_async_coalesce(coap_context_t *context, coap_resource_t *resource,
+                    coap_session_t *session, coap_pdu_t *request) {
+  unsigned char key[COAP_CACHE_KEY_MAX_SIZE];
+  size_t keylen;
+  coap_async_state_t *s, *tmp;
+  coap_tid_t id = ntohs( request->hdr->id );
+
+  keylen = async_coalesce_key(key, resource, request);
+  if (!keylen)
+    return 0;
+
+  HASH_FIND(chh, context->async_coalesce, key, keylen, s);
+  if (!s)
+    return 0;
+
+  /* a retransmission of a request that is pending already */
+  if (s->session == session && s->id == id)
+    return 1;
+  LL_SEARCH_PAIR(s->coalesced, tmp, session, session, id, id);
+  if (tmp)
+    return 1;
+
+  tmp = async_new_state(session, request, 0, NULL);
+  if (!tmp)
+    return 0;
+
+  debug("coalesced transaction %d with pending transaction %d\n", id, s->id);
+  LL_APPEND(s->coalesced, tmp);
+  return 1;
+}
+
+void
+coap_async_enable_coalescing(coap_context_t *context,
+                             coap_resource_t *resource,
+                             coap_session_t *session, coap_pdu_t *request) {
+  unsigned char key[COAP_CACHE_KEY_MAX_SIZE];
+  size_t keylen;
+  coap_async_state_t *s, *tmp;
+
+  s = coap_find_async(context, session, ntohs( request->hdr->id ));
+  if (!s || s->key)
+    return;
+
+  keylen = async_coalesce_key(key, resource, request);
+  if (!keylen)
+    return;
+
+  /* identical requests are coalesced with the older transaction */
+  HASH_FIND(chh, context->async_coalesce, key, keylen, tmp);
+  if (tmp)
+    return;
+
+  s->key = (unsigned char *)coap_malloc(keylen);
+  if (!s->key)
+    return;
+
+  memcpy(s->key, key, keylen);
+  s->keylen = keylen;
+  s->resource = resource;
+  HASH_ADD_KEYPTR(chh, context->async_coalesce, s->key, s->keylen, s);
+}
+
+void
+coap_async_detach_resource(coap_context_t *context,
+                           coap_resource_t *resource) {
+  coap_async_state_t *s, *tmp;
+
+  HASH_ITER(chh, context->async_coalesce, s, tmp) {
+    if (s->resource == resource) {
+      HASH_DELETE(chh, context->async_coalesce, s);
+      s->resource = NULL;
+    }
+  }
+}
+
+void
+coap_context_set_async_timeout(coap_context_t *context,
+                               unsigned int seconds) {
+  assert(context);
+  context->async_timeout = seconds;
+  /* recomputed by the next call to coap_check_async_timeouts() */
+  context->async_next_expiry = 0;
+}
+
+/** Removes @p s from @p context, calls the expire handler and releases it. */
+static void
+async_expire(coap_context_t *context, coap_async_state_t *s) {
+  async_unlink(context, s);
+  if (context->async_expire_handler)
+    context->async_expire_handler(context, s);
+  coap_free_async(s);
+}
+
+coap_tick_t
+coap_check_async_timeouts(coap_context_t *context, coap_tick_t now) {
+  coap_async_state_t *s, *tmp;
+  coap_tick_t timeout, expiry;
+
+  if (context->async_timeout == 0 || !context->async_state)
+    return 0;
+
+  /* states are touched only forward in time, so no state expires before
+   * the earliest expiry computed by the last scan */
+  if (context->async_next_expiry > now)
+    return context->async_next_expiry;
+
+  timeout = context->async_timeout * COAP_TICKS_PER_SECOND;
+  context->async_next_expiry = 0;
+  HASH_ITER(hh, context->async_state, s, tmp) {
+    expiry = s->created + timeout;
+    if (expiry <= now) {
+      debug("asynchronous state for transaction %d expired\n", s->id);
+      async_expire(context, s);
+    } else if (context->async_next_expiry == 0
+               || expiry < context->async_next_expiry) {
+      context->async_next_expiry = expiry;
+    }
+  }
+
+  return context->async_next_expiry;
+}
+
+void
+coap_free_all_async(coap_context_t *context) {
+  coap_async_state_t *s, *tmp;
+
+  HASH_ITER(hh, context->async_state, s, tmp) {
+    async_expire(context, s);
+  }
+}
+
 void 
 coap_free_async(coap_async_state_t *s) {
+  coap_async_state_t *tmp, *rtmp;
+
+  LL_FOREACH_SAFE(s->coalesced, tmp, rtmp) {
+    coap_free_async(tmp);
+  }
+  if (s->key)
+    coap_free(s->key);
   if ( s->session )
     coap_session_release( s->session );
   if (s && (s->flags & COAP_ASYNC_RELEASE_DATA) != 0)
@@ -15,6 +15,11 @@
 #include "libcoap.h"
 #include "debug.h"
 #include "block.h"
+#include "coap_file.h"
+#include "mem.h"
+#include "prng.h"
+#include "resource.h"
+#include "utlist.h"
 
 #if (COAP_DEFAULT_PDU_SIZE - 6) < (1 << (COAP_MAX_BLOCK_SZX + 4))
 #error "COAP_MAX_BLOCK_SZX too large"
@@ -24,6 +29,10 @@
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
 #ifndef WITHOUT_BLOCK
 unsigned int
 coap_opt_block_num(const coap_opt_t *block_opt) {
@@ -142,4 +151,2534 @@ coap_add_block(coap_pdu_t *pdu, unsigned int len, const unsigned char *data,
 		       min(len - start, (1U << (block_szx + 4))),
 		       data + start);
 }
+
+unsigned int
+coap_session_max_block_szx(coap_session_t *session) {
+  size_t avail = coap_session_max_pdu_size(session);
+  unsigned int szx = COAP_MAX_BLOCK_SZX;
+
+  avail = avail > COAP_BLOCK_PDU_OVERHEAD ? avail - COAP_BLOCK_PDU_OVERHEAD : 0;
+  while (szx > 0 && ((size_t)1 << (szx + 4)) > avail)
+    szx--;
+  return szx;
+}
+
+#ifndef WITHOUT_Q_BLOCK
+
+/** NON_TIMEOUT as defined in RFC 9177, Section 7.2. */
+COAP_STATIC_INLINE coap_tick_t
+non_timeout(coap_context_t *context) {
+  unsigned int ms = context->non_timeout
+    ? context->non_timeout : COAP_NON_TIMEOUT;
+
+  return ((coap_tick_t)ms * COAP_TICKS_PER_SECOND + 999) / 1000;
+}
+
+/** NON_RECEIVE_TIMEOUT as defined in RFC 9177, Section 7.2. */
+COAP_STATIC_INLINE coap_tick_t
+non_receive_timeout(coap_context_t *context) {
+  return 2 * non_timeout(context);
+}
+
+#endif /* WITHOUT_Q_BLOCK */
+
+#ifndef WITHOUT_LARGE_RESPONSE
+
+/*
+ * Space to reserve for the Block2 and Size2 options and the payload
+ * marker, including a margin for options after Block2 whose encoding
+ * grows when their delta changes.
+ */
+#define COAP_LARGE_RESPONSE_OVERHEAD 16
+
+typedef struct coap_large_response_t {
+  struct coap_large_response_t *next;
+  struct coap_resource_t *resource; /**< the resource that was requested */
+  coap_pdu_t *pdu;              /**< code and options of the response */
+  size_t length;                /**< length of data */
+  const uint8_t *data;          /**< the representation */
+  coap_release_large_data_t release; /**< releases data, if set */
+  void *app_ptr;                /**< argument for release */
+  coap_tick_t last_used;        /**< time of the last request */
+  size_t token_length;
+  unsigned char token[8];       /**< token of the initial request */
+  unsigned int q_next;          /**< next Q-Block2 set to push, 0 if none */
+  unsigned int q_szx;           /**< block size of the pushed sets */
+  unsigned int q_pushes;        /**< sets pushed since the last set request */
+  coap_tick_t q_timeout;        /**< time to push the next set */
+  size_t q_token_length;
+  unsigned char q_token[8];     /**< token of the last set request */
+} coap_large_response_t;
+
+static void
+large_response_free(coap_session_t *session, coap_large_response_t *lg) {
+  if (lg->release)
+    lg->release(session, lg->app_ptr);
+  else
+    coap_free((void *)lg->data);
+  coap_delete_pdu(lg->pdu);
+  coap_free(lg);
+}
+
+static void
+large_response_delete(coap_session_t *session, coap_large_response_t *lg) {
+  LL_DELETE(session->large_responses, lg);
+  large_response_free(session, lg);
+}
+
+/** Removes large responses from @p session that have not been used
+ *  for COAP_LARGE_RESPONSE_TIMEOUT seconds. */
+static void
+large_response_expire(coap_session_t *session, coap_tick_t now) {
+  coap_large_response_t *lg, *tmp;
+
+  LL_FOREACH_SAFE(session->large_responses, lg, tmp) {
+    if (lg->last_used + COAP_LARGE_RESPONSE_TIMEOUT * COAP_TICKS_PER_SECOND
+        <= now)
+      large_response_delete(session, lg);
+  }
+}
+
+/** Returns @c 1 if the ETag of @p lg is @p etag of @p length bytes. */
+static int
+large_response_etag_is(coap_large_response_t *lg, const uint8_t *etag,
+                       size_t length) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option = coap_check_option(lg->pdu, COAP_OPTION_ETAG, &opt_iter);
+
+  return option && coap_opt_length(option) == length
+    && memcmp(coap_opt_value(option), etag, length) == 0;
+}
+
+/** Returns @c 1 if @p request refers to the representation in @p lg. */
+static int
+large_response_matches(coap_large_response_t *lg,
+                       struct coap_resource_t *resource, coap_pdu_t *request) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *etag, *option;
+
+  if (lg->resource != resource)
+    return 0;
+
+  if (lg->token_length == request->hdr->token_length
+      && memcmp(lg->token, request->hdr->token, lg->token_length) == 0)
+    return 1;
+
+  etag = coap_check_option(lg->pdu, COAP_OPTION_ETAG, &opt_iter);
+  if (!etag)
+    return 0;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_ETAG);
+  coap_option_iterator_init(request, &opt_iter, filter);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_opt_length(option) == coap_opt_length(etag)
+        && memcmp(coap_opt_value(option), coap_opt_value(etag),
+                  coap_opt_length(etag)) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Fills @p response with the block of @p lg that is requested in
+ * @p block. Everything after the token of @p response is replaced.
+ * @p type is the option that carries the block number, i.e.
+ * COAP_OPTION_BLOCK2 or COAP_OPTION_Q_BLOCK2.
+ *
+ * @return @c 1 if more blocks follow, @c 0 for the final block, or
+ *         @c -1 on error. In the latter case, @p response holds an error
+ *         code.
+ */
+static int
+large_response_block(coap_large_response_t *lg, coap_block_t *block,
+                     unsigned short type, coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  struct {
+    unsigned short type;
+    unsigned int value;
+  } add[2];
+  size_t offset, avail, block_size;
+  unsigned int szx = min(block->szx, COAP_MAX_BLOCK_SZX);
+  int n, count, done = 0;
+
+  response->length = sizeof(coap_hdr_t) + response->hdr->token_length;
+  response->max_delta = 0;
+  response->data = NULL;
+  response->hdr->code = lg->pdu->hdr->code;
+
+  offset = (size_t)block->num << (block->szx + 4);
+  if (offset >= lg->length) {
+    debug("illegal block requested\n");
+    response->hdr->code = COAP_RESPONSE_CODE(402);
+    return -1;
+  }
+
+  /* reduce the block size until the block fits into response */
+  avail = response->max_size;
+  if (avail > response->length + (lg->pdu->length - sizeof(coap_hdr_t))
+      + COAP_LARGE_RESPONSE_OVERHEAD)
+    avail -= response->length + (lg->pdu->length - sizeof(coap_hdr_t))
+      + COAP_LARGE_RESPONSE_OVERHEAD;
+  else
+    avail = 0;
+
+  while (szx > 0 && ((size_t)1 << (szx + 4)) > avail)
+    szx--;
+  if (((size_t)1 << (szx + 4)) > avail) {
+    debug("not enough space, even the smallest block does not fit\n");
+    response->hdr->code = COAP_RESPONSE_CODE(500);
+    return -1;
+  }
+
+  block_size = (size_t)1 << (szx + 4);
+  block->szx = szx;
+  block->num = (unsigned int)(offset >> (szx + 4));
+  block->m = offset + block_size < lg->length;
+
+  /* the block option and Size2 (first block only) in ascending order */
+  add[0].type = type;
+  add[0].value = (block->num << 4) | (block->m << 3) | block->szx;
+  count = 1;
+  if (block->num == 0) {
+    add[1].type = COAP_OPTION_SIZE2;
+    add[1].value = (unsigned int)lg->length;
+    if (add[1].type < add[0].type) {
+      add[1] = add[0];
+      add[0].type = COAP_OPTION_SIZE2;
+      add[0].value = (unsigned int)lg->length;
+    }
+    count = 2;
+  }
+
+  coap_option_iterator_init(lg->pdu, &opt_iter, COAP_OPT_ALL);
+  do {
+    option = coap_option_next(&opt_iter);
+
+    for (n = done; n < count; n++) {
+      unsigned char buf[4];
+
+      if (option && opt_iter.type <= add[n].type)
+        break;
+      if (!coap_add_option(response, add[n].type,
+                           coap_encode_var_bytes(buf, add[n].value), buf))
+        goto error;
+      done++;
+    }
+
+    if (option && !coap_add_option(response, opt_iter.type,
+                                   coap_opt_length(option),
+                                   coap_opt_value(option)))
+      goto error;
+  } while (option);
+
+  if (!coap_add_data(response,
+                     (unsigned int)min(block_size, lg->length - offset),
+                     lg->data + offset))
+    goto error;
+
+  return block->m;
+
+ error:
+  response->length = sizeof(coap_hdr_t) + response->hdr->token_length;
+  response->max_delta = 0;
+  response->data = NULL;
+  response->hdr->code = COAP_RESPONSE_CODE(500);
+  return -1;
+}
+
+#ifndef WITHOUT_Q_BLOCK
+
+/**
+ * Sends block @p block of @p lg as separate NON message with the token
+ * @p token of @p token_length bytes. @p block is adjusted as done by
+ * large_response_block().
+ *
+ * @return @c 1 if more blocks follow, @c 0 for the final block, or
+ *         @c -1 on error.
+ */
+static int
+large_response_q_send(coap_session_t *session, coap_large_response_t *lg,
+                      coap_block_t *block, size_t token_length,
+                      const unsigned char *token, size_t max_size) {
+  coap_pdu_t *pdu;
+  int more;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_NON, 0,
+                      coap_new_message_id(session->context), max_size);
+  if (!pdu || !coap_add_token(pdu, token_length, token)) {
+    coap_delete_pdu(pdu);
+    return -1;
+  }
+
+  more = large_response_block(lg, block, COAP_OPTION_Q_BLOCK2, pdu);
+  if (more < 0) {
+    coap_delete_pdu(pdu);
+    return -1;
+  }
+
+  if (coap_send(session, pdu) == COAP_INVALID_TID)
+    debug("cannot send Q-Block2 block %u\n", block->num);
+  return more;
+}
+
+/**
+ * Answers a request for blocks of @p lg that carries Q-Block2 options.
+ * A Q-Block2 option with the M bit set requests the block and the rest
+ * of its set, i.e. up to COAP_Q_BLOCK_MAX_PAYLOADS blocks, one without
+ * requests that block only, as done to recover missing blocks. The first
+ * block goes into @p response, the others are sent right away as
+ * separate NON messages with the token of @p request. Blocks beyond the
+ * end of the representation are skipped. At most
+ * COAP_Q_BLOCK_MAX_PAYLOADS blocks are sent per request.
+ *
+ * After a request for a set, the next set is pushed by
+ * coap_q_block_check_timeouts() if the client has not asked for it
+ * within NON_TIMEOUT (RFC 9177, Section 4.4).
+ *
+ * @return @c 1 on success or @c -1 on error. In the latter case,
+ *         @p response holds an error code.
+ */
+static int
+large_response_q_blocks(coap_session_t *session, coap_large_response_t *lg,
+                        coap_pdu_t *request, coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *option;
+  coap_block_t block;
+  unsigned int sent = 0, count;
+  int set = 0, more = 0;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_Q_BLOCK2);
+  coap_option_iterator_init(request, &opt_iter, filter);
+  while ((option = coap_option_next(&opt_iter))
+         && sent < COAP_Q_BLOCK_MAX_PAYLOADS) {
+    block.num = coap_opt_block_num(option);
+    block.szx = COAP_OPT_BLOCK_SZX(option);
+    count = COAP_OPT_BLOCK_MORE(option) ? COAP_Q_BLOCK_MAX_PAYLOADS : 1;
+
+    if (block.szx == 7 || block.num > 0xFFFFF)
+      continue;
+
+    set = count > 1;
+    while (count-- && sent < COAP_Q_BLOCK_MAX_PAYLOADS
+           && ((size_t)block.num << (block.szx + 4)) < lg->length) {
+      if (sent)
+        more = large_response_q_send(session, lg, &block,
+                                     request->hdr->token_length,
+                                     request->hdr->token, response->max_size);
+      else
+        more = large_response_block(lg, &block, COAP_OPTION_Q_BLOCK2,
+                                    response);
+      if (more < 0)
+        return sent ? 1 : -1;
+      sent++;
+      block.num++;
+    }
+  }
+
+  if (!sent) {
+    debug("no valid Q-Block2 block requested\n");
+    response->hdr->code = COAP_RESPONSE_CODE(402);
+    return -1;
+  }
+
+  if (set) {
+    /* the next set follows after NON_TIMEOUT unless asked for earlier */
+    coap_tick_t now;
+
+    coap_ticks(&now);
+    lg->q_next = more ? block.num : 0;
+    lg->q_szx = block.szx;
+    lg->q_pushes = 0;
+    lg->q_timeout = now + non_timeout(session->context);
+    lg->q_token_length = request->hdr->token_length;
+    memcpy(lg->q_token, request->hdr->token, lg->q_token_length);
+  }
+  return 1;
+}
+
+/**
+ * Pushes the next set of the Q-Block2 transfer @p lg with the token of
+ * the last request for a set. Pushing stops at the final block and after
+ * COAP_NON_MAX_RETRANSMIT sets without a request from the client.
+ */
+static void
+large_response_q_push(coap_session_t *session, coap_large_response_t *lg,
+                      coap_tick_t now) {
+  coap_block_t block;
+  unsigned int count;
+  int more = 1;
+
+  block.num = lg->q_next;
+  block.szx = lg->q_szx;
+  for (count = 0; count < COAP_Q_BLOCK_MAX_PAYLOADS && more > 0; count++) {
+    more = large_response_q_send(session, lg, &block, lg->q_token_length,
+                                 lg->q_token,
+                                 coap_session_max_pdu_size(session));
+    block.num++;
+  }
+
+  debug("pushed Q-Block2 blocks %u to %u\n", lg->q_next, block.num - 1);
+  lg->q_next = more > 0 && ++lg->q_pushes < COAP_NON_MAX_RETRANSMIT
+    ? block.num : 0;
+  lg->q_timeout = now + non_timeout(session->context);
+}
+
+#endif /* WITHOUT_Q_BLOCK */
+
+/**
+ * Fills @p response with the blocks of @p lg requested in @p block or,
+ * if @p q_block is set, in the Q-Block2 options of @p request.
+ *
+ * @return @c 1 if the representation must be kept for further requests,
+ *         @c 0 if the final Block2 block has been sent, or @c -1 on error.
+ *         Q-Block2 transfers keep the representation until it expires,
+ *         because any block may have to be sent again.
+ */
+static int
+large_response_serve(coap_session_t *session, coap_large_response_t *lg,
+                     coap_block_t *block, int q_block,
+                     coap_pdu_t *request, coap_pdu_t *response) {
+#ifndef WITHOUT_Q_BLOCK
+  if (q_block)
+    return large_response_q_blocks(session, lg, request, response);
+#else /* WITHOUT_Q_BLOCK */
+  (void)session;
+  (void)q_block;
+  (void)request;
+#endif /* WITHOUT_Q_BLOCK */
+  return large_response_block(lg, block, COAP_OPTION_BLOCK2, response);
+}
+
+/**
+ * Creates the template for responses from the code and options of
+ * @p response. The ETag @p etag is added if @p response does not have one.
+ */
+static coap_pdu_t *
+large_response_template(coap_pdu_t *response, const coap_key_t etag) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_pdu_t *pdu;
+  int etag_done;
+
+  pdu = coap_pdu_init(0, response->hdr->code, 0,
+                      response->length - response->hdr->token_length
+                      + 1 + sizeof(coap_key_t) + 8);
+  if (!pdu)
+    return NULL;
+
+  etag_done = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter) != NULL;
+
+  coap_option_iterator_init(response, &opt_iter, COAP_OPT_ALL);
+  do {
+    option = coap_option_next(&opt_iter);
+
+    if (!etag_done && (!option || opt_iter.type > COAP_OPTION_ETAG)) {
+      if (!coap_add_option(pdu, COAP_OPTION_ETAG, sizeof(coap_key_t), etag))
+        goto error;
+      etag_done = 1;
+    }
+
+    /* Block2 and Size2 are set for each block */
+    if (option
+        && opt_iter.type != COAP_OPTION_BLOCK2
+        && opt_iter.type != COAP_OPTION_Q_BLOCK2
+        && opt_iter.type != COAP_OPTION_SIZE2
+        && !coap_add_option(pdu, opt_iter.type, coap_opt_length(option),
+                            coap_opt_value(option)))
+      goto error;
+  } while (option);
+
+  return pdu;
+
+ error:
+  coap_delete_pdu(pdu);
+  return NULL;
+}
+
+int
+coap_add_data_large_response(struct coap_resource_t *resource,
+                             coap_session_t *session,
+                             coap_pdu_t *request,
+                             coap_pdu_t *response,
+                             size_t length,
+                             const uint8_t *data,
+                             coap_release_large_data_t release,
+                             void *app_ptr) {
+  coap_large_response_t *lg, *tmp, *next;
+  coap_block_t block;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_key_t etag;
+  const uint8_t *etag_value = etag;
+  size_t etag_length = sizeof(etag);
+  coap_tick_t now;
+  int count = 0, more, q_block = 0;
+
+  assert(response);
+
+  coap_ticks(&now);
+  large_response_expire(session, now);
+
+  /* a new request for the resource replaces the kept representation */
+  LL_FOREACH_SAFE(session->large_responses, lg, tmp) {
+    if (lg->resource == resource
+        && lg->token_length == request->hdr->token_length
+        && memcmp(lg->token, request->hdr->token, lg->token_length) == 0)
+      large_response_delete(session, lg);
+  }
+
+  /*
+   * Unless set by the application, the ETag is derived from the data so
+   * that it does not change when the handler is called again for an
+   * unchanged representation, e.g. for requests with a new token.
+   */
+  option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+  if (option) {
+    etag_value = coap_opt_value(option);
+    etag_length = coap_opt_length(option);
+  } else {
+    memset(etag, 0, sizeof(etag));
+    coap_hash(data, (unsigned int)length, etag);
+  }
+
+#ifndef WITHOUT_Q_BLOCK
+  q_block = coap_get_block(request, COAP_OPTION_Q_BLOCK2, &block);
+#endif /* WITHOUT_Q_BLOCK */
+
+  if (q_block || coap_get_block(request, COAP_OPTION_BLOCK2, &block)) {
+    /* serve the block from an identical representation if kept */
+    LL_FOREACH(session->large_responses, lg) {
+      if (lg->resource == resource && lg->length == length
+          && large_response_etag_is(lg, etag_value, etag_length)
+          && coap_file_data_intact(lg->release, lg->app_ptr))
+        break;
+    }
+
+    if (lg) {
+      lg->last_used = now;
+      more = large_response_serve(session, lg, &block, q_block,
+                                  request, response);
+      if (more == 0)
+        large_response_delete(session, lg);
+      if (release)
+        release(session, app_ptr);
+      return more >= 0;
+    }
+  } else {
+    /* send everything at once if possible */
+    if (response->length + 1 + length <= response->max_size) {
+      int ok = coap_add_data(response, (unsigned int)length, data);
+      if (release)
+        release(session, app_ptr);
+      return ok;
+    }
+    block.szx = COAP_MAX_BLOCK_SZX;
+  }
+
+  lg = (coap_large_response_t *)coap_malloc(sizeof(coap_large_response_t));
+  if (!lg)
+    goto error;
+  memset(lg, 0, sizeof(coap_large_response_t));
+
+  lg->pdu = large_response_template(response, etag);
+  if (!lg->pdu) {
+    coap_free(lg);
+    goto error;
+  }
+
+  if (release) {
+    lg->data = data;
+  } else {
+    uint8_t *copy = (uint8_t *)coap_malloc(length);
+    if (!copy) {
+      coap_delete_pdu(lg->pdu);
+      coap_free(lg);
+      goto error;
+    }
+    memcpy(copy, data, length);
+    lg->data = copy;
+  }
+
+  lg->resource = resource;
+  lg->length = length;
+  lg->release = release;
+  lg->app_ptr = app_ptr;
+  lg->last_used = now;
+  lg->token_length = request->hdr->token_length;
+  memcpy(lg->token, request->hdr->token, lg->token_length);
+
+  more = large_response_serve(session, lg, &block, q_block, request, response);
+  if (more <= 0) {
+    /* nothing left to transfer */
+    large_response_free(session, lg);
+    return more == 0;
+  }
+
+  /* make room by dropping the oldest representations */
+  LL_FOREACH_SAFE(session->large_responses, tmp, next) {
+    if (++count >= COAP_MAX_LARGE_RESPONSES)
+      large_response_delete(session, tmp);
+  }
+
+  LL_PREPEND(session->large_responses, lg);
+  return 1;
+
+ error:
+  coap_log(LOG_WARNING, "coap_add_data_large_response: insufficient memory\n");
+  response->hdr->code = COAP_RESPONSE_CODE(500);
+  if (release)
+    release(session, app_ptr);
+  return 0;
+}
+
+int
+coap_large_response_get(struct coap_resource_t *resource,
+                        coap_session_t *session,
+                        coap_pdu_t *request,
+                        coap_pdu_t *response) {
+  coap_large_response_t *lg;
+  coap_block_t block;
+  coap_tick_t now;
+  int q_block = 0;
+
+  if (!session->large_responses || request->hdr->code != COAP_REQUEST_GET)
+    return 0;
+
+#ifndef WITHOUT_Q_BLOCK
+  /* a request for the first set goes to the handler for a fresh
+   * representation, requests for missing blocks or later sets do not */
+  q_block = coap_get_block(request, COAP_OPTION_Q_BLOCK2, &block);
+  if (q_block && block.num == 0 && block.m)
+    return 0;
+#endif /* WITHOUT_Q_BLOCK */
+
+  if (!q_block && (!coap_get_block(request, COAP_OPTION_BLOCK2, &block)
+                   || block.num == 0))
+    return 0;
+
+  coap_ticks(&now);
+  large_response_expire(session, now);
+
+  LL_FOREACH(session->large_responses, lg) {
+    if (large_response_matches(lg, resource, request))
+      break;
+  }
+
+  if (!lg)
+    return 0;
+
+  if (!coap_file_data_intact(lg->release, lg->app_ptr)) {
+    /* the handler serves the current version instead */
+    large_response_delete(session, lg);
+    return 0;
+  }
+
+  lg->last_used = now;
+  if (large_response_serve(session, lg, &block, q_block,
+                           request, response) == 0) {
+    /* the final block has been requested */
+    large_response_delete(session, lg);
+  }
+
+  return 1;
+}
+
+void
+coap_free_large_responses(coap_session_t *session) {
+  coap_large_response_t *lg, *tmp;
+
+  LL_FOREACH_SAFE(session->large_responses, lg, tmp) {
+    large_response_free(session, lg);
+  }
+  session->large_responses = NULL;
+}
+
+#endif /* WITHOUT_LARGE_RESPONSE */
+
+#ifndef WITHOUT_BLOCK_FETCH
+
+/** A block that has arrived before its predecessors. */
+typedef struct coap_held_block_t {
+  struct coap_held_block_t *next;
+  unsigned int num;
+  size_t length;
+  uint8_t data[];
+} coap_held_block_t;
+
+/**
+ * Keeps block @p num in the list @p blocks, which is sorted by block
+ * number. Duplicates are ignored.
+ *
+ * @return @c 1 on success, @c 0 if out of memory.
+ */
+static int
+held_block_insert(coap_held_block_t **blocks, unsigned int num,
+                  const uint8_t *data, size_t length) {
+  coap_held_block_t *hb, *prev = NULL;
+
+  LL_FOREACH(*blocks, hb) {
+    if (hb->num == num)
+      return 1;                 /* duplicate */
+    if (hb->num > num)
+      break;
+    prev = hb;
+  }
+
+  hb = (coap_held_block_t *)coap_malloc(sizeof(coap_held_block_t) + length);
+  if (!hb)
+    return 0;
+  hb->num = num;
+  hb->length = length;
+  memcpy(hb->data, data, length);
+
+  /* keep the list sorted by block number */
+  if (prev) {
+    hb->next = prev->next;
+    prev->next = hb;
+  } else {
+    LL_PREPEND(*blocks, hb);
+  }
+  return 1;
+}
+
+/** Returns @c 1 if block @p num is in the list @p blocks. */
+static int
+held_block_find(coap_held_block_t *blocks, unsigned int num) {
+  coap_held_block_t *hb;
+
+  LL_FOREACH(blocks, hb) {
+    if (hb->num == num)
+      return 1;
+    if (hb->num > num)
+      break;
+  }
+  return 0;
+}
+
+static void
+held_blocks_free(coap_held_block_t **blocks) {
+  coap_held_block_t *hb, *tmp;
+
+  LL_FOREACH_SAFE(*blocks, hb, tmp) {
+    coap_free(hb);
+  }
+  *blocks = NULL;
+}
+
+#endif /* WITHOUT_BLOCK_FETCH */
+
+#ifndef WITHOUT_Q_BLOCK
+
+/*
+ * Missing blocks are reported as a CBOR sequence of unsigned integers
+ * (RFC 9177, Section 5).
+ */
+
+/** Encodes @p value as CBOR unsigned integer into @p buf of at least
+ *  5 bytes and returns the number of bytes written. */
+static size_t
+cbor_put_uint(uint8_t *buf, unsigned int value) {
+  if (value < 24) {
+    buf[0] = (uint8_t)value;
+    return 1;
+  } else if (value < 0x100) {
+    buf[0] = 0x18;
+    buf[1] = (uint8_t)value;
+    return 2;
+  } else if (value < 0x10000) {
+    buf[0] = 0x19;
+    buf[1] = (uint8_t)(value >> 8);
+    buf[2] = (uint8_t)value;
+    return 3;
+  }
+  buf[0] = 0x1a;
+  buf[1] = (uint8_t)(value >> 24);
+  buf[2] = (uint8_t)(value >> 16);
+  buf[3] = (uint8_t)(value >> 8);
+  buf[4] = (uint8_t)value;
+  return 5;
+}
+
+/**
+ * Decodes the CBOR unsigned integer at @p *data, advancing @p *data.
+ *
+ * @return @c 1 on success, @c 0 if no unsigned integer of at most 32 bits
+ *         is left before @p end.
+ */
+static int
+cbor_get_uint(const uint8_t **data, const uint8_t *end, unsigned int *value) {
+  const uint8_t *p = *data;
+  size_t length;
+
+  if (p >= end || (*p & 0xe0) != 0)
+    return 0;
+
+  if (*p < 24) {
+    *value = *p;
+    *data = p + 1;
+    return 1;
+  }
+
+  switch (*p) {
+  case 0x18: length = 1; break;
+  case 0x19: length = 2; break;
+  case 0x1a: length = 4; break;
+  default: return 0;
+  }
+  if ((size_t)(end - p) < 1 + length)
+    return 0;
+
+  *value = coap_decode_var_bytes((unsigned char *)p + 1,
+                                 (unsigned int)length);
+  *data = p + 1 + length;
+  return 1;
+}
+
+#endif /* WITHOUT_Q_BLOCK */
+
+#ifndef WITHOUT_LARGE_REQUEST
+
+typedef struct coap_large_request_t {
+  struct coap_large_request_t *next;
+  struct coap_resource_t *resource; /**< the resource the body is sent to */
+  coap_large_request_sink_t sink; /**< receives the blocks, if set */
+  coap_release_large_data_t release; /**< releases app_ptr, if set */
+  void *app_ptr;                /**< application pointer of the sink */
+  uint8_t *data;                /**< buffered body if there is no sink */
+  size_t size;                  /**< allocated size of data */
+  size_t received;              /**< number of bytes received so far */
+  coap_tick_t last_used;        /**< time of the last block */
+  unsigned int num;             /**< number of the last block */
+  unsigned int szx:3;           /**< block size of the last block */
+  unsigned int complete:1;      /**< set when the last block has arrived */
+  unsigned int q_block:1;       /**< set for Q-Block1 transfers */
+  unsigned int reported:1;      /**< set while missing blocks are reported */
+  unsigned int done:1;          /**< set when the handler has been called (Q-Block1) */
+  unsigned char code;           /**< response code of the handler (Q-Block1) */
+  unsigned int end;             /**< number of blocks, if known (Q-Block1) */
+  unsigned int upper;           /**< highest block number seen + 1 (Q-Block1) */
+  struct coap_held_block_t *held; /**< blocks received out of order (Q-Block1) */
+  unsigned int retries;         /**< missing blocks reports without progress */
+  coap_tick_t timeout;          /**< time to report missing blocks, or 0 */
+  size_t token_length;
+  unsigned char token[8];       /**< token of the transfer */
+} coap_large_request_t;
+
+void
+coap_context_set_large_request_sink(coap_context_t *context,
+                                    coap_large_request_sink_t sink,
+                                    coap_release_large_data_t release) {
+  assert(context);
+  context->large_request_sink = sink;
+  context->large_request_release = release;
+}
+
+void
+coap_context_set_large_request_limits(coap_context_t *context,
+                                      size_t max_size,
+                                      unsigned int max_transfers) {
+  assert(context);
+  context->max_large_request_size = max_size;
+  context->max_large_requests = max_transfers;
+}
+
+COAP_STATIC_INLINE size_t
+large_request_max_size(coap_context_t *context) {
+  return context->max_large_request_size
+    ? context->max_large_request_size : COAP_LARGE_REQUEST_DEFAULT_MAX_SIZE;
+}
+
+COAP_STATIC_INLINE unsigned int
+large_request_max_transfers(coap_context_t *context) {
+  return context->max_large_requests
+    ? context->max_large_requests : COAP_LARGE_REQUEST_DEFAULT_MAX_TRANSFERS;
+}
+
+COAP_STATIC_INLINE int
+large_request_token_matches(coap_large_request_t *lr, coap_pdu_t *request) {
+  return lr->token_length == request->hdr->token_length
+    && memcmp(lr->token, request->hdr->token, lr->token_length) == 0;
+}
+
+static void
+large_request_free(coap_session_t *session, coap_large_request_t *lr) {
+  if (lr->release)
+    lr->release(session, lr->app_ptr);
+  if (lr->data)
+    coap_free(lr->data);
+#ifndef WITHOUT_Q_BLOCK
+  held_blocks_free(&lr->held);
+#endif /* WITHOUT_Q_BLOCK */
+  coap_free(lr);
+  session->context->large_requests--;
+}
+
+static void
+large_request_delete(coap_session_t *session, coap_large_request_t *lr) {
+  LL_DELETE(session->large_requests, lr);
+  large_request_free(session, lr);
+}
+
+#ifndef WITHOUT_Q_BLOCK
+/**
+ * Releases the body of the Q-Block1 transfer @p lr but keeps @p lr with
+ * the response @p code of the handler. The final block may be repeated
+ * by the client when the response gets lost, which is then answered
+ * without calling the handler again. The transfer expires like any other.
+ */
+static void
+large_request_done(coap_session_t *session, coap_large_request_t *lr,
+                   unsigned char code) {
+  if (lr->release)
+    lr->release(session, lr->app_ptr);
+  lr->release = NULL;
+  lr->app_ptr = NULL;
+  if (lr->data)
+    coap_free(lr->data);
+  lr->data = NULL;
+  held_blocks_free(&lr->held);
+  lr->complete = 0;
+  lr->done = 1;
+  lr->code = code;
+}
+#endif /* WITHOUT_Q_BLOCK */
+
+/** Aborts transfers on @p session that have not received a block for
+ *  COAP_LARGE_REQUEST_TIMEOUT seconds. */
+static void
+large_request_expire(coap_session_t *session, coap_tick_t now) {
+  coap_large_request_t *lr, *tmp;
+
+  LL_FOREACH_SAFE(session->large_requests, lr, tmp) {
+    if (lr->last_used + COAP_LARGE_REQUEST_TIMEOUT * COAP_TICKS_PER_SECOND
+        <= now) {
+      debug("Block1 transfer timed out\n");
+      large_request_delete(session, lr);
+    }
+  }
+}
+
+/**
+ * Appends @p length bytes from @p data to the buffered body of @p lr.
+ * The buffer is grown to @p hint bytes or twice its size, whatever is
+ * larger, but never beyond @p max_size.
+ *
+ * @return @c 1 on success, @c 0 if out of memory.
+ */
+static int
+large_request_buffer(coap_large_request_t *lr, const uint8_t *data,
+                     size_t length, size_t hint, size_t max_size) {
+  if (lr->received + length > lr->size) {
+    size_t size = max(2 * lr->size, lr->received + length);
+    uint8_t *buf;
+
+    size = min(max(size, hint), max_size);
+    buf = (uint8_t *)coap_malloc(size);
+    if (!buf)
+      return 0;
+    if (lr->data) {
+      memcpy(buf, lr->data, lr->received);
+      coap_free(lr->data);
+    }
+    lr->data = buf;
+    lr->size = size;
+  }
+
+  memcpy(lr->data + lr->received, data, length);
+  return 1;
+}
+
+/**
+ * Passes the next @p length bytes of the body of @p lr to its sink or
+ * appends them to its buffer.
+ *
+ * @return @c 0 on success or the response code of the error.
+ */
+static unsigned char
+large_request_store(coap_session_t *session, coap_large_request_t *lr,
+                    coap_pdu_t *request, const uint8_t *data, size_t length,
+                    size_t hint, size_t max_size) {
+  if (lr->sink) {
+    if (length && !lr->sink(session, lr->resource, request, lr->received,
+                            data, length, &lr->app_ptr)) {
+      debug("Block1 sink failed\n");
+      return COAP_RESPONSE_CODE(500);
+    }
+  } else if (length && !large_request_buffer(lr, data, length,
+                                              hint, max_size)) {
+    coap_log(LOG_WARNING, "coap_large_request_receive: insufficient memory\n");
+    return COAP_RESPONSE_CODE(500);
+  }
+
+  lr->received += length;
+  return 0;
+}
+
+/**
+ * Sets the error @p code in @p response and aborts the transfer @p lr
+ * if given.
+ */
+static int
+large_request_error(coap_session_t *session, coap_large_request_t *lr,
+                    coap_pdu_t *response, unsigned char code) {
+  response->hdr->code = code;
+  if (lr)
+    large_request_delete(session, lr);
+  return 1;
+}
+
+/**
+ * Sets 4.13 with a Size1 option in @p response and aborts the transfer
+ * @p lr if given.
+ */
+static int
+large_request_too_large(coap_session_t *session, coap_large_request_t *lr,
+                        coap_pdu_t *response, size_t max_size) {
+  unsigned char buf[4];
+
+  debug("Block1 transfer exceeds %u bytes\n", (unsigned int)max_size);
+  large_request_error(session, lr, response, COAP_RESPONSE_CODE(413));
+  coap_add_option(response, COAP_OPTION_SIZE1,
+                  coap_encode_var_bytes(buf, (unsigned int)max_size), buf);
+  return 1;
+}
+
+/**
+ * Starts a new transfer of a body of @p size1 bytes (if known) for
+ * @p request to @p resource on @p session.
+ *
+ * @return The transfer or @c NULL, in which case @p response has been
+ *         filled with an error.
+ */
+static coap_large_request_t *
+large_request_new(struct coap_resource_t *resource, coap_session_t *session,
+                  coap_pdu_t *request, coap_pdu_t *response, size_t size1) {
+  coap_context_t *context = session->context;
+  size_t max_size = large_request_max_size(context);
+  coap_large_request_t *lr;
+
+  if (size1 > max_size) {
+    large_request_too_large(session, NULL, response, max_size);
+    return NULL;
+  }
+
+  if (context->large_requests >= large_request_max_transfers(context)) {
+    debug("too many Block1 transfers\n");
+    response->hdr->code = COAP_RESPONSE_CODE(503);
+    return NULL;
+  }
+
+  lr = (coap_large_request_t *)coap_malloc(sizeof(coap_large_request_t));
+  if (!lr) {
+    coap_log(LOG_WARNING, "coap_large_request_receive: insufficient memory\n");
+    response->hdr->code = COAP_RESPONSE_CODE(500);
+    return NULL;
+  }
+  memset(lr, 0, sizeof(coap_large_request_t));
+  lr->resource = resource;
+  lr->sink = context->large_request_sink;
+  if (lr->sink)
+    lr->release = context->large_request_release;
+  lr->token_length = request->hdr->token_length;
+  memcpy(lr->token, request->hdr->token, lr->token_length);
+  context->large_requests++;
+  LL_PREPEND(session->large_requests, lr);
+  return lr;
+}
+
+/** Returns the value of the Size1 option in @p request or @c 0. */
+static size_t
+large_request_size1(coap_pdu_t *request) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option = coap_check_option(request, COAP_OPTION_SIZE1, &opt_iter);
+
+  return option
+    ? coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option))
+    : 0;
+}
+
+#ifndef WITHOUT_Q_BLOCK
+
+/**
+ * Counts the blocks of @p lr that are missing below the highest block
+ * seen. If @p response is given, their numbers are added as payload in
+ * the form of a CBOR sequence, as far as they fit.
+ *
+ * @return The number of missing blocks.
+ */
+static unsigned int
+large_request_missing(coap_large_request_t *lr, coap_pdu_t *response) {
+  unsigned int num, count = 0;
+  uint8_t buf[5 * 2 * COAP_Q_BLOCK_MAX_PAYLOADS];
+  size_t length = 0, avail = sizeof(buf);
+
+  if (response) {
+    unsigned char cf[4];
+
+    coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                    coap_encode_var_bytes(cf,
+                                          COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ),
+                    cf);
+    if (response->max_size < (size_t)response->length + 1 + avail)
+      avail = response->max_size > (size_t)response->length + 1
+        ? response->max_size - response->length - 1 : 0;
+  }
+
+  num = (unsigned int)(lr->received >> (lr->szx + 4));
+  for (; num < lr->upper; num++) {
+    if (held_block_find(lr->held, num))
+      continue;
+    count++;
+    if (response && length + 5 <= avail)
+      length += cbor_put_uint(buf + length, num);
+  }
+
+  if (response && length)
+    coap_add_data(response, (unsigned int)length, buf);
+  return count;
+}
+
+/**
+ * Handles the Q-Block1 block @p block of @p request. Blocks are accepted
+ * in any order and passed on in order. Feedback is given when a block
+ * completes a set (its number is a multiple of COAP_Q_BLOCK_MAX_PAYLOADS
+ * minus one), for the final block, and once reported gaps are closed:
+ * 2.31 Continue if all blocks so far have been received, 4.08 with the
+ * list of missing blocks otherwise. Other blocks are not answered. Gaps
+ * that are not closed within NON_RECEIVE_TIMEOUT are reported again by
+ * coap_q_block_check_timeouts().
+ *
+ * @return @c 1 if @p response has been filled (possibly with code @c 0
+ *         for no response), @c 0 if the handler must be called.
+ */
+static int
+large_request_q_receive(struct coap_resource_t *resource,
+                        coap_session_t *session,
+                        coap_large_request_t *lr,
+                        coap_block_t *block,
+                        coap_pdu_t *request,
+                        coap_pdu_t *response,
+                        coap_tick_t now) {
+  size_t max_size = large_request_max_size(session->context);
+  size_t length, block_size = (size_t)1 << (block->szx + 4);
+  size_t offset = (size_t)block->num << (block->szx + 4);
+  unsigned int next, missing;
+  unsigned char *data;
+  unsigned char buf[4], code;
+  int feedback;
+
+  if (lr && lr->done) {
+    /* repeat the final response if it has been lost */
+    lr->last_used = now;
+    if (block->m || block->num + 1 != lr->end)
+      return 1;
+    response->hdr->code = lr->code;
+    if (COAP_RESPONSE_CLASS(lr->code) == 2)
+      coap_add_option(response, COAP_OPTION_Q_BLOCK1,
+                      coap_encode_var_bytes(buf, (lr->num << 4) | lr->szx),
+                      buf);
+    return 1;
+  }
+
+  if (lr && !lr->q_block) {
+    /* the client has switched from Block1 */
+    large_request_delete(session, lr);
+    lr = NULL;
+  }
+
+  if (!lr) {
+    lr = large_request_new(resource, session, request, response,
+                           large_request_size1(request));
+    if (!lr)
+      return 1;
+    lr->q_block = 1;
+    lr->szx = block->szx;
+    lr->end = (unsigned int)-1;
+  }
+
+  coap_get_data(request, &length, &data);
+
+  if (block->szx != lr->szx
+      || (block->m && length != block_size)
+      || length > block_size
+      || block->num >= lr->end
+      || (!block->m && lr->end != (unsigned int)-1
+          && lr->end != block->num + 1)) {
+    debug("invalid Q-Block1 block\n");
+    return large_request_error(session, lr, response,
+                               COAP_RESPONSE_CODE(400));
+  }
+
+  if (offset + length > max_size || large_request_size1(request) > max_size)
+    return large_request_too_large(session, lr, response, max_size);
+
+  lr->last_used = now;
+  next = (unsigned int)(lr->received >> (lr->szx + 4));
+
+  /* drop blocks too far ahead, they will be reported missing later */
+  if (block->num >= next + 2 * COAP_Q_BLOCK_MAX_PAYLOADS)
+    return 1;
+
+  if (!block->m)
+    lr->end = block->num + 1;
+  lr->upper = max(lr->upper, block->num + 1);
+
+  if (block->num == next) {
+    code = large_request_store(session, lr, request, data, length,
+                               large_request_size1(request), max_size);
+    next++;
+    while (!code && lr->held && lr->held->num == next) {
+      coap_held_block_t *hb = lr->held;
+
+      LL_DELETE(lr->held, hb);
+      code = large_request_store(session, lr, request, hb->data, hb->length,
+                                 0, max_size);
+      coap_free(hb);
+      next++;
+    }
+    if (code)
+      return large_request_error(session, lr, response, code);
+  } else if (block->num > next
+             && !held_block_insert(&lr->held, block->num, data, length)) {
+    coap_log(LOG_WARNING, "coap_large_request_receive: insufficient memory\n");
+    return large_request_error(session, lr, response,
+                               COAP_RESPONSE_CODE(500));
+  }
+
+  if (next >= lr->end) {
+    /* body complete, call the handler */
+    lr->complete = 1;
+    lr->num = lr->end - 1;
+    return 0;
+  }
+
+  /* report gaps again when the blocks do not arrive */
+  missing = large_request_missing(lr, NULL);
+  lr->retries = 0;
+  lr->timeout = missing ? now + non_receive_timeout(session->context) : 0;
+
+  feedback = (block->num % COAP_Q_BLOCK_MAX_PAYLOADS
+              == COAP_Q_BLOCK_MAX_PAYLOADS - 1)
+    || !block->m || (lr->reported && !missing);
+  if (!feedback)
+    return 1;
+
+  if (missing) {
+    debug("Q-Block1 transfer misses %u blocks\n", missing);
+    response->hdr->code = COAP_RESPONSE_CODE(408);
+    large_request_missing(lr, response);
+    lr->reported = 1;
+  } else {
+    response->hdr->code = COAP_RESPONSE_CODE(231);
+    coap_add_option(response, COAP_OPTION_Q_BLOCK1,
+                    coap_encode_var_bytes(buf, ((lr->upper - 1) << 4)
+                                          | (1 << 3) | lr->szx), buf);
+    lr->reported = 0;
+  }
+  return 1;
+}
+
+/**
+ * Sends a 4.08 response with the blocks of the Q-Block1 transfer @p lr
+ * that are still missing after NON_RECEIVE_TIMEOUT. Reporting stops after
+ * COAP_NON_MAX_RETRANSMIT reports without progress, the transfer then
+ * expires.
+ */
+static void
+large_request_q_timeout(coap_session_t *session, coap_large_request_t *lr,
+                        coap_tick_t now) {
+  coap_pdu_t *pdu;
+  unsigned int missing;
+
+  if (++lr->retries > COAP_NON_MAX_RETRANSMIT) {
+    debug("Q-Block1 transfer stalled\n");
+    lr->timeout = 0;
+    return;
+  }
+  lr->timeout = now + non_receive_timeout(session->context);
+
+  pdu = coap_pdu_init(COAP_MESSAGE_NON, COAP_RESPONSE_CODE(408),
+                      coap_new_message_id(session->context),
+                      coap_session_max_pdu_size(session));
+  if (!pdu || !coap_add_token(pdu, lr->token_length, lr->token)) {
+    coap_delete_pdu(pdu);
+    return;
+  }
+
+  missing = large_request_missing(lr, pdu);
+  debug("Q-Block1 transfer still misses %u blocks\n", missing);
+  lr->reported = 1;
+  if (coap_send(session, pdu) == COAP_INVALID_TID)
+    debug("cannot report missing Q-Block1 blocks\n");
+}
+
+#endif /* WITHOUT_Q_BLOCK */
+
+int
+coap_large_request_receive(struct coap_resource_t *resource,
+                           coap_session_t *session,
+                           coap_pdu_t *request,
+                           coap_pdu_t *response) {
+  coap_context_t *context = session->context;
+  coap_large_request_t *lr;
+  coap_block_t block;
+  unsigned char buf[4], code;
+  size_t offset, length;
+  size_t max_size = large_request_max_size(context);
+  unsigned char *data;
+  coap_tick_t now;
+  int q_block = 0;
+
+#ifndef WITHOUT_Q_BLOCK
+  q_block = coap_get_block(request, COAP_OPTION_Q_BLOCK1, &block);
+  if (q_block && !(resource->flags & COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1)) {
+    /* Q-Block1 is supported only where the library reassembles the body */
+    response->hdr->code = COAP_RESPONSE_CODE(402);
+    return 1;
+  }
+#endif /* WITHOUT_Q_BLOCK */
+
+  if (!(resource->flags & COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1)
+      || (!q_block && !coap_get_block(request, COAP_OPTION_BLOCK1, &block)))
+    return 0;
+
+  coap_ticks(&now);
+  large_request_expire(session, now);
+
+  LL_FOREACH(session->large_requests, lr) {
+    if (lr->resource == resource && large_request_token_matches(lr, request))
+      break;
+  }
+
+  if (block.szx == 7) {
+    debug("invalid Block1 size\n");
+    return large_request_error(session, lr, response,
+                               COAP_RESPONSE_CODE(400));
+  }
+
+#ifndef WITHOUT_Q_BLOCK
+  if (q_block)
+    return large_request_q_receive(resource, session, lr, &block,
+                                   request, response, now);
+#endif /* WITHOUT_Q_BLOCK */
+
+  coap_get_data(request, &length, &data);
+  offset = (size_t)block.num << (block.szx + 4);
+
+#ifndef WITHOUT_Q_BLOCK
+  if (lr && lr->done) {
+    /* the client has switched from Q-Block1 */
+    large_request_delete(session, lr);
+    lr = NULL;
+  }
+#endif /* WITHOUT_Q_BLOCK */
+
+  if (block.num == 0) {
+    /* a new transfer or a restart of the current one */
+    if (lr)
+      large_request_delete(session, lr);
+
+    if (length > max_size)
+      return large_request_too_large(session, NULL, response, max_size);
+
+    lr = large_request_new(resource, session, request, response,
+                           large_request_size1(request));
+    if (!lr)
+      return 1;
+  } else if (!lr) {
+    debug("Block1 transfer unknown\n");
+    return large_request_error(session, NULL, response,
+                               COAP_RESPONSE_CODE(408));
+  } else if (offset + length <= lr->received && block.m) {
+    /* retransmission of a block that has been stored already */
+    lr->last_used = now;
+    goto cont;
+  }
+
+  if (offset != lr->received) {
+    debug("Block1 transfer incomplete\n");
+    return large_request_error(session, lr, response,
+                               COAP_RESPONSE_CODE(408));
+  }
+
+  /* all blocks but the last must be of the negotiated size */
+  if (block.m && length != ((size_t)1 << (block.szx + 4))) {
+    debug("invalid Block1 payload size\n");
+    return large_request_error(session, lr, response,
+                               COAP_RESPONSE_CODE(400));
+  }
+
+  if (lr->received + length > max_size)
+    return large_request_too_large(session, lr, response, max_size);
+
+  code = large_request_store(session, lr, request, data, length,
+                             block.num == 0 ? large_request_size1(request) : 0,
+                             max_size);
+  if (code)
+    return large_request_error(session, lr, response, code);
+
+  lr->num = block.num;
+  lr->szx = block.szx;
+  lr->last_used = now;
+
+  if (!block.m) {
+    /* body complete, call the handler */
+    lr->complete = 1;
+    return 0;
+  }
+
+ cont:
+  response->hdr->code = COAP_RESPONSE_CODE(231);
+  coap_add_option(response, COAP_OPTION_BLOCK1,
+                  coap_encode_var_bytes(buf, (block.num << 4)
+                                        | (1 << 3) | block.szx), buf);
+  return 1;
+}
+
+int
+coap_get_data_large_request(coap_session_t *session,
+                            coap_pdu_t *request,
+                            size_t *length,
+                            const uint8_t **data,
+                            void **app_ptr) {
+  coap_large_request_t *lr;
+
+  assert(length);
+  assert(data);
+  assert(app_ptr);
+
+  LL_FOREACH(session->large_requests, lr) {
+    if (lr->complete && large_request_token_matches(lr, request))
+      break;
+  }
+
+  if (!lr) {
+    unsigned char *payload;
+
+    *app_ptr = NULL;
+    if (!coap_get_data(request, length, &payload)) {
+      *data = NULL;
+      return 0;
+    }
+    *data = payload;
+    return 1;
+  }
+
+  *length = lr->received;
+  *data = lr->data;
+  *app_ptr = lr->app_ptr;
+  return lr->received > 0;
+}
+
+void
+coap_large_request_finish(coap_session_t *session,
+                          coap_pdu_t *request,
+                          coap_pdu_t *response) {
+  coap_large_request_t *lr;
+  coap_opt_iterator_t opt_iter;
+  unsigned char buf[4];
+
+  if (!session->large_requests)
+    return;
+
+  LL_FOREACH(session->large_requests, lr) {
+    if (lr->complete && large_request_token_matches(lr, request))
+      break;
+  }
+
+  if (!lr)
+    return;
+
+  /* acknowledge the final block */
+  if (COAP_RESPONSE_CLASS(response->hdr->code) == 2
+      && !coap_check_option(response, COAP_OPTION_BLOCK1, &opt_iter)
+      && !coap_check_option(response, COAP_OPTION_Q_BLOCK1, &opt_iter))
+    coap_insert_option(response,
+                       lr->q_block ? COAP_OPTION_Q_BLOCK1 : COAP_OPTION_BLOCK1,
+                       coap_encode_var_bytes(buf, (lr->num << 4) | lr->szx),
+                       buf);
+
+#ifndef WITHOUT_Q_BLOCK
+  if (lr->q_block) {
+    large_request_done(session, lr, response->hdr->code);
+    return;
+  }
+#endif /* WITHOUT_Q_BLOCK */
+  large_request_delete(session, lr);
+}
+
+void
+coap_free_large_requests(coap_session_t *session) {
+  coap_large_request_t *lr, *tmp;
+
+  LL_FOREACH_SAFE(session->large_requests, lr, tmp) {
+    large_request_free(session, lr);
+  }
+  session->large_requests = NULL;
+}
+
+#endif /* WITHOUT_LARGE_REQUEST */
+
+#ifndef WITHOUT_BLOCK_FETCH
+
+/*
+ * Tokens of block requests consist of the transfer's identifier, its
+ * generation (incremented on restart) and the block number.
+ */
+#define COAP_BLOCK_FETCH_ID_LENGTH    4
+#define COAP_BLOCK_FETCH_TOKEN_LENGTH 8
+
+/** Marks the number of blocks of a transfer as unknown. */
+#define COAP_BLOCK_FETCH_END_UNKNOWN ((unsigned int)-1)
+
+struct coap_block_fetch_t {
+  struct coap_block_fetch_t *next;
+  coap_session_t *session;
+  coap_pdu_t *request;          /**< template for block requests */
+  coap_block_fetch_handler_t handler;
+  void *app_ptr;
+  unsigned int window;          /**< maximum number of outstanding requests */
+  unsigned int outstanding;     /**< number of outstanding requests */
+  unsigned int szx;             /**< block size in use */
+  unsigned int next_num;        /**< next block to request */
+  unsigned int next_deliver;    /**< next block to pass to the handler */
+  unsigned int end;             /**< number of blocks, if known */
+  unsigned int restarts;        /**< number of restarts due to new ETags */
+  size_t delivered;             /**< number of bytes passed to the handler */
+  int finished;                 /**< set when the handler has seen the end */
+  int q_block;                  /**< set for Q-Block2 transfers */
+  unsigned int retries;         /**< timeouts without progress (Q-Block2) */
+  coap_tick_t timeout;          /**< time to request missing blocks (Q-Block2) */
+  unsigned char generation;
+  unsigned char id[COAP_BLOCK_FETCH_ID_LENGTH];
+  size_t etag_length;
+  unsigned char etag[8];        /**< ETag of the representation */
+  coap_held_block_t *blocks;    /**< blocks received out of order */
+};
+
+static void
+block_fetch_token(coap_block_fetch_t *fetch, unsigned int num,
+                  unsigned char *token) {
+  memcpy(token, fetch->id, COAP_BLOCK_FETCH_ID_LENGTH);
+  token[4] = fetch->generation;
+  token[5] = (num >> 16) & 0xff;
+  token[6] = (num >> 8) & 0xff;
+  token[7] = num & 0xff;
+}
+
+/** Stops retransmission of requests that have not been answered yet. */
+static void
+block_fetch_cancel_requests(coap_block_fetch_t *fetch) {
+  unsigned char token[COAP_BLOCK_FETCH_TOKEN_LENGTH];
+  unsigned int num;
+
+  for (num = fetch->next_deliver; num < fetch->next_num; num++) {
+    block_fetch_token(fetch, num, token);
+    coap_cancel_all_messages(fetch->session->context, fetch->session,
+                             token, sizeof(token));
+  }
+}
+
+static void
+block_fetch_reset(coap_block_fetch_t *fetch) {
+  held_blocks_free(&fetch->blocks);
+  fetch->outstanding = 0;
+  fetch->next_num = 0;
+  fetch->next_deliver = 0;
+  fetch->end = COAP_BLOCK_FETCH_END_UNKNOWN;
+  fetch->etag_length = 0;
+  fetch->delivered = 0;
+  fetch->retries = 0;
+}
+
+static void
+block_fetch_free(coap_block_fetch_t *fetch) {
+  block_fetch_reset(fetch);
+  coap_delete_pdu(fetch->request);
+  coap_free(fetch);
+}
+
+static void
+block_fetch_delete(coap_block_fetch_t *fetch) {
+  block_fetch_cancel_requests(fetch);
+  LL_DELETE(fetch->session->block_fetches, fetch);
+  block_fetch_free(fetch);
+}
+
+/** Reports failure with @p code to the handler and releases @p fetch. */
+static void
+block_fetch_fail(coap_block_fetch_t *fetch, unsigned char code) {
+  fetch->handler(fetch->session, code, 0, NULL, 0, 1, fetch->app_ptr);
+  block_fetch_delete(fetch);
+}
+
+/**
+ * Sends a request for the @p count blocks in @p nums of @p fetch, each
+ * in an option of type @p type with the M bit set to @p more. The token
+ * is derived from the first block number. Q-Block2 requests carry the
+ * ETag of the representation once it is known, so that the server can
+ * answer them from the representation it keeps.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+block_fetch_request(coap_block_fetch_t *fetch, unsigned short type,
+                    const unsigned int *nums, unsigned int count, int more) {
+  coap_session_t *session = fetch->session;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_pdu_t *pdu;
+  unsigned char token[COAP_BLOCK_FETCH_TOKEN_LENGTH];
+  unsigned char buf[4];
+  int block_done = 0;
+  int etag_done = !fetch->q_block || !fetch->etag_length;
+  unsigned int n;
+
+  pdu = coap_pdu_init(fetch->request->hdr->type, fetch->request->hdr->code,
+                      coap_new_message_id(session->context),
+                      coap_session_max_pdu_size(session));
+  if (!pdu)
+    return 0;
+
+  block_fetch_token(fetch, nums[0], token);
+  if (!coap_add_token(pdu, sizeof(token), token))
+    goto error;
+
+  coap_option_iterator_init(fetch->request, &opt_iter, COAP_OPT_ALL);
+  do {
+    option = coap_option_next(&opt_iter);
+
+    if (!etag_done && (!option || opt_iter.type > COAP_OPTION_ETAG)) {
+      if (!coap_add_option(pdu, COAP_OPTION_ETAG, fetch->etag_length,
+                           fetch->etag))
+        goto error;
+      etag_done = 2;
+    }
+
+    if (!block_done && (!option || opt_iter.type > type)) {
+      for (n = 0; n < count; n++) {
+        if (!coap_add_option(pdu, type,
+                             coap_encode_var_bytes(buf, (nums[n] << 4)
+                                                   | (more << 3)
+                                                   | fetch->szx),
+                             buf))
+          goto error;
+      }
+      block_done = 1;
+    }
+
+    if (option && opt_iter.type != COAP_OPTION_BLOCK2
+        && opt_iter.type != COAP_OPTION_Q_BLOCK2
+        && !(etag_done == 2 && opt_iter.type == COAP_OPTION_ETAG)
+        && !coap_add_option(pdu, opt_iter.type, coap_opt_length(option),
+                            coap_opt_value(option)))
+      goto error;
+  } while (option);
+
+  debug("request block %u%s\n", nums[0], count > 1 ? " and others" : "");
+  return coap_send(session, pdu) != COAP_INVALID_TID;
+
+ error:
+  coap_delete_pdu(pdu);
+  return 0;
+}
+
+/**
+ * Sends the request for block @p num of @p fetch.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+block_fetch_send(coap_block_fetch_t *fetch, unsigned int num) {
+  if (!block_fetch_request(fetch, COAP_OPTION_BLOCK2, &num, 1, 0))
+    return 0;
+
+  fetch->outstanding++;
+  return 1;
+}
+
+/**
+ * Keeps up to window requests outstanding. Until the first block has
+ * arrived, only the first block is requested.
+ *
+ * @return @c 1 on success, @c 0 if a request could not be sent.
+ */
+static int
+block_fetch_fill_window(coap_block_fetch_t *fetch) {
+  unsigned int window = fetch->next_deliver ? fetch->window : 1;
+
+  while (fetch->outstanding < window && fetch->next_num < fetch->end) {
+    if (!block_fetch_send(fetch, fetch->next_num))
+      return 0;
+    fetch->next_num++;
+  }
+  return 1;
+}
+
+/** Passes block @p num to the handler. */
+static void
+block_fetch_deliver(coap_block_fetch_t *fetch, unsigned int num,
+                    const uint8_t *data, size_t length) {
+  fetch->next_deliver = num + 1;
+  fetch->finished = fetch->next_deliver >= fetch->end;
+  fetch->handler(fetch->session, COAP_RESPONSE_CODE(205), fetch->delivered,
+                 data, length, fetch->finished, fetch->app_ptr);
+  fetch->delivered += length;
+}
+
+/**
+ * Passes block @p num to the handler if it is the next one, followed by
+ * the buffered blocks it is the predecessor of. Otherwise, the block is
+ * buffered.
+ *
+ * @return @c 1 on success, @c 0 if out of memory.
+ */
+static int
+block_fetch_store(coap_block_fetch_t *fetch, unsigned int num,
+                  const uint8_t *data, size_t length) {
+  coap_held_block_t *hb;
+
+  if (num != fetch->next_deliver)
+    return held_block_insert(&fetch->blocks, num, data, length);
+
+  block_fetch_deliver(fetch, num, data, length);
+  while ((hb = fetch->blocks) != NULL && hb->num == fetch->next_deliver) {
+    LL_DELETE(fetch->blocks, hb);
+    block_fetch_deliver(fetch, hb->num, hb->data, hb->length);
+    coap_free(hb);
+  }
+  return 1;
+}
+
+/**
+ * Returns @c 1 if the ETag of @p response matches the representation of
+ * @p fetch. The ETag of the @p first block is remembered.
+ */
+static int
+block_fetch_check_etag(coap_block_fetch_t *fetch, int first,
+                       coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *etag;
+  size_t length = 0;
+  const uint8_t *value = NULL;
+
+  etag = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+  if (etag) {
+    length = min(coap_opt_length(etag), sizeof(fetch->etag));
+    value = coap_opt_value(etag);
+  }
+
+  if (first) {
+    fetch->etag_length = length;
+    if (length)
+      memcpy(fetch->etag, value, length);
+    return 1;
+  }
+
+  return length == fetch->etag_length
+    && (!length || memcmp(value, fetch->etag, length) == 0);
+}
+
+/**
+ * Starts the transfer over after the representation has changed.
+ *
+ * @return @c 1 if the transfer goes on, @c 0 if it has been given up.
+ */
+static int
+block_fetch_restart(coap_block_fetch_t *fetch) {
+  block_fetch_cancel_requests(fetch);
+  if (++fetch->restarts > COAP_BLOCK_FETCH_MAX_RESTARTS) {
+    debug("representation keeps changing, giving up\n");
+    block_fetch_fail(fetch, 0);
+    return 0;
+  }
+  debug("representation has changed, restarting transfer\n");
+  block_fetch_reset(fetch);
+  fetch->generation++;
+  return 1;
+}
+
+#ifndef WITHOUT_Q_BLOCK
+
+void
+coap_context_set_non_timeout(coap_context_t *context,
+                             unsigned int milliseconds) {
+  assert(context);
+  context->non_timeout = milliseconds;
+}
+
+/**
+ * Requests the set of blocks of @p fetch that starts at next_num and
+ * arms the timer for missing blocks.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+block_fetch_q_next_set(coap_block_fetch_t *fetch) {
+  coap_tick_t now;
+
+  if (!block_fetch_request(fetch, COAP_OPTION_Q_BLOCK2, &fetch->next_num,
+                           1, 1))
+    return 0;
+
+  fetch->next_num = min(fetch->next_num + COAP_Q_BLOCK_MAX_PAYLOADS,
+                        fetch->end);
+  coap_ticks(&now);
+  fetch->timeout = now + non_receive_timeout(fetch->session->context);
+  return 1;
+}
+
+/**
+ * Requests the blocks of @p fetch that have not arrived although they
+ * have been requested. If the whole set is missing, it is requested
+ * again as such.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+block_fetch_q_missing(coap_block_fetch_t *fetch, coap_tick_t now) {
+  unsigned int nums[COAP_Q_BLOCK_MAX_PAYLOADS];
+  unsigned int num, count = 0;
+
+  for (num = fetch->next_deliver; num < fetch->next_num
+         && count < COAP_Q_BLOCK_MAX_PAYLOADS; num++) {
+    if (!held_block_find(fetch->blocks, num))
+      nums[count++] = num;
+  }
+
+  fetch->timeout = now + non_receive_timeout(fetch->session->context);
+  if (!count)
+    return 1;
+
+  debug("request %u missing blocks\n", count);
+  if (!fetch->blocks && nums[0] + count == fetch->next_num
+      && count == COAP_Q_BLOCK_MAX_PAYLOADS)
+    return block_fetch_request(fetch, COAP_OPTION_Q_BLOCK2, nums, 1, 1);
+  return block_fetch_request(fetch, COAP_OPTION_Q_BLOCK2, nums, count, 0);
+}
+
+/** Handles a response to a Q-Block2 request of @p fetch. */
+static void
+block_fetch_q_response(coap_block_fetch_t *fetch, unsigned int token_num,
+                       coap_pdu_t *received) {
+  coap_block_t block;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t length;
+  unsigned char *data;
+  int first = fetch->next_deliver == 0 && !fetch->blocks;
+  coap_tick_t now;
+
+  if (COAP_RESPONSE_CLASS(received->hdr->code) != 2) {
+    if (received->hdr->code == COAP_RESPONSE_CODE(402) && first
+        && fetch->next_num <= COAP_Q_BLOCK_MAX_PAYLOADS) {
+      /* the server does not know Q-Block2 */
+      debug("Q-Block2 not supported, falling back to Block2\n");
+      block_fetch_cancel_requests(fetch);
+      block_fetch_reset(fetch);
+      fetch->q_block = 0;
+      fetch->window = 1;
+      fetch->generation++;
+      if (!block_fetch_fill_window(fetch))
+        block_fetch_fail(fetch, 0);
+      return;
+    }
+    /* a set beyond the end of a representation of unknown size */
+    if (received->hdr->code == COAP_RESPONSE_CODE(402) && token_num > 0) {
+      fetch->end = min(fetch->end, token_num);
+      goto next;
+    }
+    block_fetch_fail(fetch, received->hdr->code);
+    return;
+  }
+
+  coap_get_data(received, &length, &data);
+
+  if (!coap_get_block(received, COAP_OPTION_Q_BLOCK2, &block)) {
+    /* the server has sent the complete representation at once */
+    if (!first) {
+      block_fetch_fail(fetch, received->hdr->code);
+      return;
+    }
+    fetch->end = 1;
+    block_fetch_deliver(fetch, 0, data, length);
+    goto next;
+  }
+
+  if (first)
+    fetch->szx = block.szx;
+
+  if (block.szx != fetch->szx) {
+    debug("unexpected Q-Block2 in response\n");
+    block_fetch_fail(fetch, COAP_RESPONSE_CODE(500));
+    return;
+  }
+
+  if (!block_fetch_check_etag(fetch, first, received)) {
+    if (block_fetch_restart(fetch) && !block_fetch_q_next_set(fetch))
+      block_fetch_fail(fetch, 0);
+    return;
+  }
+
+  option = coap_check_option(received, COAP_OPTION_SIZE2, &opt_iter);
+  if (option) {
+    size_t size = coap_decode_var_bytes(coap_opt_value(option),
+                                        coap_opt_length(option));
+    size_t block_size = (size_t)1 << (fetch->szx + 4);
+    if (size)
+      fetch->end = min(fetch->end,
+                       (unsigned int)((size + block_size - 1) / block_size));
+  }
+  if (!block.m)
+    fetch->end = min(fetch->end, block.num + 1);
+  fetch->next_num = min(max(fetch->next_num, block.num + 1), fetch->end);
+
+  if (block.num < fetch->next_deliver || block.num >= fetch->end
+      || held_block_find(fetch->blocks, block.num))
+    return;                     /* duplicate */
+
+  if (!block_fetch_store(fetch, block.num, data, length)) {
+    coap_log(LOG_WARNING, "coap_block_fetch: insufficient memory\n");
+    block_fetch_fail(fetch, 0);
+    return;
+  }
+
+  coap_ticks(&now);
+  fetch->retries = 0;
+  fetch->timeout = now + non_receive_timeout(fetch->session->context);
+
+ next:
+  if (fetch->next_deliver >= fetch->end) {
+    if (!fetch->finished)
+      fetch->handler(fetch->session, COAP_RESPONSE_CODE(205),
+                     fetch->delivered, NULL, 0, 1, fetch->app_ptr);
+    block_fetch_delete(fetch);
+  } else if (fetch->next_deliver >= fetch->next_num) {
+    /* the set is complete, go on with the next one */
+    if (!block_fetch_q_next_set(fetch))
+      block_fetch_fail(fetch, 0);
+  }
+}
+
+/** Handles the timer of the Q-Block2 transfer @p fetch. */
+static void
+block_fetch_q_timeout(coap_block_fetch_t *fetch, coap_tick_t now) {
+  if (++fetch->retries > COAP_NON_MAX_RETRANSMIT) {
+    debug("Q-Block2 transfer timed out\n");
+    block_fetch_fail(fetch, 0);
+    return;
+  }
+
+  if (!block_fetch_q_missing(fetch, now))
+    block_fetch_fail(fetch, 0);
+}
+
+#endif /* WITHOUT_Q_BLOCK */
+
+/**
+ * Creates a transfer for @p request and sends the first request, which
+ * is a Q-Block2 request if @p q_block is set.
+ */
+static coap_block_fetch_t *
+block_fetch_start(coap_session_t *session,
+                  coap_pdu_t *request,
+                  unsigned int szx,
+                  unsigned int window,
+                  int q_block,
+                  coap_block_fetch_handler_t handler,
+                  void *app_ptr) {
+  coap_block_fetch_t *fetch;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  int ok;
+
+  assert(session);
+  assert(request);
+  assert(handler);
+
+  fetch = (coap_block_fetch_t *)coap_malloc(sizeof(coap_block_fetch_t));
+  if (!fetch) {
+    coap_log(LOG_WARNING, "coap_block_fetch: insufficient memory\n");
+    return NULL;
+  }
+  memset(fetch, 0, sizeof(coap_block_fetch_t));
+
+  /* keep a copy of the request's options without token */
+  fetch->request = coap_pdu_init(request->hdr->type, request->hdr->code, 0,
+                                 request->length);
+  if (!fetch->request)
+    goto error;
+  coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (!coap_add_option(fetch->request, opt_iter.type,
+                         coap_opt_length(option), coap_opt_value(option)))
+      goto error;
+  }
+
+  fetch->session = session;
+  fetch->handler = handler;
+  fetch->app_ptr = app_ptr;
+  /* the responses take the reverse path, assumed to have the same MTU */
+  fetch->szx = min(szx, coap_session_max_block_szx(session));
+  fetch->window = window ? min(window, COAP_BLOCK_FETCH_MAX_WINDOW)
+    : COAP_BLOCK_FETCH_DEFAULT_WINDOW;
+  fetch->end = COAP_BLOCK_FETCH_END_UNKNOWN;
+  fetch->q_block = q_block;
+  prng(fetch->id, sizeof(fetch->id));
+
+#ifndef WITHOUT_Q_BLOCK
+  if (q_block)
+    ok = block_fetch_q_next_set(fetch);
+  else
+#endif /* WITHOUT_Q_BLOCK */
+    ok = block_fetch_fill_window(fetch);
+  if (!ok)
+    goto error;
+
+  LL_PREPEND(session->block_fetches, fetch);
+  return fetch;
+
+ error:
+  warn("coap_block_fetch: cannot start transfer\n");
+  block_fetch_free(fetch);
+  return NULL;
+}
+
+coap_block_fetch_t *
+coap_block_fetch(coap_session_t *session,
+                 coap_pdu_t *request,
+                 unsigned int szx,
+                 unsigned int window,
+                 coap_block_fetch_handler_t handler,
+                 void *app_ptr) {
+  return block_fetch_start(session, request, szx, window, 0,
+                           handler, app_ptr);
+}
+
+#ifndef WITHOUT_Q_BLOCK
+coap_block_fetch_t *
+coap_q_block_fetch(coap_session_t *session,
+                   coap_pdu_t *request,
+                   unsigned int szx,
+                   coap_block_fetch_handler_t handler,
+                   void *app_ptr) {
+  return block_fetch_start(session, request, szx, 1, 1, handler, app_ptr);
+}
+#endif /* WITHOUT_Q_BLOCK */
+
+void
+coap_block_fetch_cancel(coap_block_fetch_t *fetch) {
+  if (fetch)
+    block_fetch_delete(fetch);
+}
+
+int
+coap_block_fetch_response(coap_session_t *session, coap_pdu_t *received) {
+  coap_block_fetch_t *fetch;
+  coap_block_t block;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  const unsigned char *token = received->hdr->token;
+  unsigned int num;
+  size_t length;
+  unsigned char *data;
+
+  if (!session->block_fetches
+      || received->hdr->token_length != COAP_BLOCK_FETCH_TOKEN_LENGTH)
+    return 0;
+
+  LL_FOREACH(session->block_fetches, fetch) {
+    if (memcmp(token, fetch->id, COAP_BLOCK_FETCH_ID_LENGTH) == 0)
+      break;
+  }
+
+  if (!fetch)
+    return 0;
+
+  /* drop responses to requests sent before a restart */
+  if (token[4] != fetch->generation)
+    return 1;
+
+  num = (token[5] << 16) | (token[6] << 8) | token[7];
+
+#ifndef WITHOUT_Q_BLOCK
+  if (fetch->q_block) {
+    block_fetch_q_response(fetch, num, received);
+    return 1;
+  }
+#endif /* WITHOUT_Q_BLOCK */
+
+  if (num < fetch->next_deliver || num >= fetch->next_num
+      || held_block_find(fetch->blocks, num))
+    return 1;                   /* duplicate */
+  fetch->outstanding--;
+
+  if (COAP_RESPONSE_CLASS(received->hdr->code) != 2) {
+    /* blocks beyond the end of a representation of unknown size */
+    if (received->hdr->code == COAP_RESPONSE_CODE(402) && num > 0) {
+      fetch->end = min(fetch->end, num);
+      goto next;
+    }
+    block_fetch_fail(fetch, received->hdr->code);
+    return 1;
+  }
+
+  coap_get_data(received, &length, &data);
+
+  if (!coap_get_block(received, COAP_OPTION_BLOCK2, &block)) {
+    /* the server has sent the complete representation at once */
+    if (num == 0) {
+      fetch->end = 1;
+      block_fetch_deliver(fetch, 0, data, length);
+    } else {
+      block_fetch_fail(fetch, received->hdr->code);
+      return 1;
+    }
+    goto next;
+  }
+
+  if (num == 0) {
+    /* adopt the server's block size and learn the total size */
+    fetch->szx = block.szx;
+    option = coap_check_option(received, COAP_OPTION_SIZE2, &opt_iter);
+    if (option) {
+      size_t size = coap_decode_var_bytes(coap_opt_value(option),
+                                          coap_opt_length(option));
+      size_t block_size = (size_t)1 << (fetch->szx + 4);
+      if (size)
+        fetch->end = (unsigned int)((size + block_size - 1) / block_size);
+    }
+  }
+
+  if (block.num != num || block.szx != fetch->szx) {
+    debug("unexpected Block2 in response\n");
+    block_fetch_fail(fetch, COAP_RESPONSE_CODE(500));
+    return 1;
+  }
+
+  if (!block_fetch_check_etag(fetch, num == 0, received)) {
+    if (!block_fetch_restart(fetch))
+      return 1;
+    goto next;
+  }
+
+  if (!block.m)
+    fetch->end = min(fetch->end, num + 1);
+
+  if (!block_fetch_store(fetch, num, data, length)) {
+    coap_log(LOG_WARNING, "coap_block_fetch: insufficient memory\n");
+    block_fetch_fail(fetch, 0);
+    return 1;
+  }
+
+ next:
+  if (fetch->next_deliver >= fetch->end) {
+    /* the end may have been learned from an error response only */
+    if (!fetch->finished)
+      fetch->handler(session, COAP_RESPONSE_CODE(205), fetch->delivered,
+                     NULL, 0, 1, fetch->app_ptr);
+    block_fetch_delete(fetch);
+  } else if (!block_fetch_fill_window(fetch) && !fetch->outstanding) {
+    block_fetch_fail(fetch, 0);
+  }
+
+  return 1;
+}
+
+void
+coap_free_block_fetches(coap_session_t *session) {
+  coap_block_fetch_t *fetch, *tmp;
+
+  LL_FOREACH_SAFE(session->block_fetches, fetch, tmp) {
+    block_fetch_free(fetch);
+  }
+  session->block_fetches = NULL;
+}
+
+#endif /* WITHOUT_BLOCK_FETCH */
+
+#ifndef WITHOUT_Q_BLOCK
+
+struct coap_q_block_send_t {
+  struct coap_q_block_send_t *next;
+  coap_session_t *session;
+  coap_pdu_t *request;          /**< template for the blocks */
+  coap_q_block_send_handler_t handler;
+  coap_release_large_data_t release; /**< releases data, if set */
+  void *app_ptr;
+  size_t length;                /**< length of data */
+  const uint8_t *data;          /**< the body */
+  unsigned int szx;             /**< block size in use */
+  unsigned int end;             /**< number of blocks */
+  unsigned int next_num;        /**< first block of the next set */
+  unsigned int retries;         /**< timeouts without feedback */
+  coap_tick_t timeout;          /**< time to solicit feedback */
+  unsigned char token[COAP_BLOCK_FETCH_TOKEN_LENGTH]; /**< token of all blocks */
+};
+
+static void
+q_block_send_free(coap_q_block_send_t *send) {
+  if (send->release)
+    send->release(send->session, send->app_ptr);
+  else
+    coap_free((void *)send->data);
+  coap_delete_pdu(send->request);
+  coap_free(send);
+}
+
+static void
+q_block_send_delete(coap_q_block_send_t *send) {
+  LL_DELETE(send->session->q_block_sends, send);
+  q_block_send_free(send);
+}
+
+/** Passes the final @p response to the handler and releases @p send. */
+static void
+q_block_send_finish(coap_q_block_send_t *send, unsigned char code,
+                    coap_pdu_t *response) {
+  send->handler(send->session, code, response, send->app_ptr);
+  q_block_send_delete(send);
+}
+
+/**
+ * Sends block @p num of @p send with the options of the request
+ * template, Q-Block1, and Size1 in the first block.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+q_block_send_block(coap_q_block_send_t *send, unsigned int num) {
+  coap_session_t *session = send->session;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_pdu_t *pdu;
+  struct {
+    unsigned short type;
+    unsigned int value;
+  } add[2];
+  int n, count = 1, done = 0;
+  unsigned int more = num + 1 < send->end;
+
+  pdu = coap_pdu_init(send->request->hdr->type, send->request->hdr->code,
+                      coap_new_message_id(session->context),
+                      coap_session_max_pdu_size(session));
+  if (!pdu)
+    return 0;
+
+  if (!coap_add_token(pdu, sizeof(send->token), send->token))
+    goto error;
+
+  add[0].type = COAP_OPTION_Q_BLOCK1;
+  add[0].value = (num << 4) | (more << 3) | send->szx;
+  if (num == 0) {
+    add[1].type = COAP_OPTION_SIZE1;
+    add[1].value = (unsigned int)send->length;
+    count = 2;
+  }
+
+  coap_option_iterator_init(send->request, &opt_iter, COAP_OPT_ALL);
+  do {
+    option = coap_option_next(&opt_iter);
+
+    for (n = done; n < count; n++) {
+      unsigned char buf[4];
+
+      if (option && opt_iter.type <= add[n].type)
+        break;
+      if (!coap_add_option(pdu, add[n].type,
+                           coap_encode_var_bytes(buf, add[n].value), buf))
+        goto error;
+      done++;
+    }
+
+    if (option && opt_iter.type != COAP_OPTION_BLOCK1
+        && opt_iter.type != COAP_OPTION_Q_BLOCK1
+        && opt_iter.type != COAP_OPTION_SIZE1
+        && !coap_add_option(pdu, opt_iter.type, coap_opt_length(option),
+                            coap_opt_value(option)))
+      goto error;
+  } while (option);
+
+  if (send->length && !coap_add_block(pdu, (unsigned int)send->length,
+                                      send->data, num,
+                                      (unsigned char)send->szx))
+    goto error;
+
+  return coap_send(session, pdu) != COAP_INVALID_TID;
+
+ error:
+  coap_delete_pdu(pdu);
+  return 0;
+}
+
+/**
+ * Sends the next set of blocks of @p send and arms the timer for
+ * feedback.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+q_block_send_set(coap_q_block_send_t *send, coap_tick_t now) {
+  unsigned int num, last;
+
+  last = min(send->next_num + COAP_Q_BLOCK_MAX_PAYLOADS, send->end);
+  for (num = send->next_num; num < last; num++) {
+    if (!q_block_send_block(send, num))
+      return 0;
+  }
+
+  debug("sent Q-Block1 blocks %u to %u\n", send->next_num, last - 1);
+  send->next_num = last;
+  send->timeout = now + non_timeout(send->session->context);
+  return 1;
+}
+
+/**
+ * Sends the blocks listed in the 4.08 response @p received again.
+ *
+ * @return @c 1 if @p received lists missing blocks, @c 0 otherwise.
+ */
+static int
+q_block_send_missing(coap_q_block_send_t *send, coap_pdu_t *received) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  const uint8_t *p, *end;
+  size_t length;
+  unsigned char *data;
+  unsigned int num;
+
+  option = coap_check_option(received, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+  if (!option
+      || coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option))
+      != COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ
+      || !coap_get_data(received, &length, &data))
+    return 0;
+
+  p = data;
+  end = data + length;
+  while (cbor_get_uint(&p, end, &num)) {
+    if (num < send->next_num && !q_block_send_block(send, num))
+      debug("cannot send Q-Block1 block %u again\n", num);
+  }
+  return 1;
+}
+
+coap_q_block_send_t *
+coap_q_block_send(coap_session_t *session,
+                  coap_pdu_t *request,
+                  unsigned int szx,
+                  size_t length,
+                  const uint8_t *data,
+                  coap_release_large_data_t release,
+                  coap_q_block_send_handler_t handler,
+                  void *app_ptr) {
+  coap_q_block_send_t *send;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t avail, overhead;
+  coap_tick_t now;
+
+  assert(session);
+  assert(request);
+  assert(handler);
+
+  send = (coap_q_block_send_t *)coap_malloc(sizeof(coap_q_block_send_t));
+  if (!send) {
+    coap_log(LOG_WARNING, "coap_q_block_send: insufficient memory\n");
+    if (release)
+      release(session, app_ptr);
+    return NULL;
+  }
+  memset(send, 0, sizeof(coap_q_block_send_t));
+  send->session = session;
+  send->handler = handler;
+  send->release = release;
+  send->app_ptr = app_ptr;
+  send->length = length;
+
+  if (release) {
+    send->data = data;
+  } else if (length) {
+    uint8_t *copy = (uint8_t *)coap_malloc(length);
+    if (!copy)
+      goto error;
+    memcpy(copy, data, length);
+    send->data = copy;
+  }
+
+  /* keep a copy of the request's options without token */
+  send->request = coap_pdu_init(request->hdr->type, request->hdr->code, 0,
+                                request->length);
+  if (!send->request)
+    goto error;
+  coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (!coap_add_option(send->request, opt_iter.type,
+                         coap_opt_length(option), coap_opt_value(option)))
+      goto error;
+  }
+
+  /* reduce the block size until a block fits into the session's PDUs */
+  overhead = send->request->length + sizeof(send->token)
+    + COAP_LARGE_RESPONSE_OVERHEAD;
+  avail = coap_session_max_pdu_size(session);
+  avail = avail > overhead ? avail - overhead : 0;
+  send->szx = min(szx, COAP_MAX_BLOCK_SZX);
+  while (send->szx > 0 && ((size_t)1 << (send->szx + 4)) > avail)
+    send->szx--;
+  if (((size_t)1 << (send->szx + 4)) > avail) {
+    debug("not enough space, even the smallest block does not fit\n");
+    goto error;
+  }
+
+  send->end = length
+    ? (unsigned int)((length + ((size_t)1 << (send->szx + 4)) - 1)
+                     >> (send->szx + 4))
+    : 1;
+  if (send->end - 1 > 0xFFFFF) {
+    debug("body too large for Q-Block1\n");
+    goto error;
+  }
+  prng(send->token, sizeof(send->token));
+
+  coap_ticks(&now);
+  if (!q_block_send_set(send, now))
+    goto error;
+
+  LL_PREPEND(session->q_block_sends, send);
+  return send;
+
+ error:
+  warn("coap_q_block_send: cannot start transfer\n");
+  q_block_send_free(send);
+  return NULL;
+}
+
+void
+coap_q_block_send_cancel(coap_q_block_send_t *send) {
+  if (send)
+    q_block_send_delete(send);
+}
+
+int
+coap_q_block_send_response(coap_session_t *session, coap_pdu_t *received) {
+  coap_q_block_send_t *send;
+  coap_block_t block;
+  coap_tick_t now;
+
+  if (!session->q_block_sends
+      || received->hdr->token_length != COAP_BLOCK_FETCH_TOKEN_LENGTH)
+    return 0;
+
+  LL_FOREACH(session->q_block_sends, send) {
+    if (memcmp(received->hdr->token, send->token, sizeof(send->token)) == 0)
+      break;
+  }
+
+  if (!send)
+    return 0;
+
+  coap_ticks(&now);
+
+  if (received->hdr->code == COAP_RESPONSE_CODE(231)) {
+    /* the current set is complete, go on with the next one */
+    if (coap_get_block(received, COAP_OPTION_Q_BLOCK1, &block)
+        && block.num + 1 == send->next_num && send->next_num < send->end) {
+      send->retries = 0;
+      if (!q_block_send_set(send, now))
+        q_block_send_finish(send, 0, NULL);
+    }
+    return 1;
+  }
+
+  if (received->hdr->code == COAP_RESPONSE_CODE(408)
+      && q_block_send_missing(send, received)) {
+    send->retries = 0;
+    send->timeout = now + non_timeout(session->context);
+    return 1;
+  }
+
+  q_block_send_finish(send, received->hdr->code, received);
+  return 1;
+}
+
+void
+coap_free_q_block_sends(coap_session_t *session) {
+  coap_q_block_send_t *send, *tmp;
+
+  LL_FOREACH_SAFE(session->q_block_sends, send, tmp) {
+    q_block_send_free(send);
+  }
+  session->q_block_sends = NULL;
+}
+
+coap_tick_t
+coap_q_block_check_timeouts(coap_session_t *session, coap_tick_t now) {
+  coap_block_fetch_t *fetch, *ftmp;
+  coap_q_block_send_t *send, *stmp;
+  coap_large_request_t *lr;
+  coap_large_response_t *lg, *gtmp;
+  coap_tick_t next = 0;
+
+  LL_FOREACH_SAFE(session->block_fetches, fetch, ftmp) {
+    if (fetch->q_block && fetch->timeout <= now)
+      block_fetch_q_timeout(fetch, now);
+  }
+
+  LL_FOREACH_SAFE(session->q_block_sends, send, stmp) {
+    if (send->timeout > now)
+      continue;
+    if (++send->retries > COAP_NON_MAX_RETRANSMIT) {
+      debug("Q-Block1 transfer timed out\n");
+      q_block_send_finish(send, 0, NULL);
+      continue;
+    }
+    /* the last block of a set solicits feedback from the server */
+    send->timeout = now + non_timeout(session->context);
+    if (!q_block_send_block(send, send->next_num - 1))
+      debug("cannot send Q-Block1 block %u again\n", send->next_num - 1);
+  }
+
+  /* server side: report missing Q-Block1 blocks, push Q-Block2 sets */
+  LL_FOREACH(session->large_requests, lr) {
+    if (lr->q_block && !lr->done && !lr->complete
+        && lr->timeout && lr->timeout <= now)
+      large_request_q_timeout(session, lr, now);
+  }
+
+  LL_FOREACH_SAFE(session->large_responses, lg, gtmp) {
+    if (!lg->q_next || lg->q_timeout > now)
+      continue;
+    if (coap_file_data_intact(lg->release, lg->app_ptr))
+      large_response_q_push(session, lg, now);
+    else
+      large_response_delete(session, lg);
+  }
+
+  LL_FOREACH(session->block_fetches, fetch) {
+    if (fetch->q_block && (next == 0 || fetch->timeout < next))
+      next = fetch->timeout;
+  }
+  LL_FOREACH(session->q_block_sends, send) {
+    if (next == 0 || send->timeout < next)
+      next = send->timeout;
+  }
+  LL_FOREACH(session->large_requests, lr) {
+    if (lr->q_block && !lr->done && !lr->complete && lr->timeout
+        && (next == 0 || lr->timeout < next))
+      next = lr->timeout;
+  }
+  LL_FOREACH(session->large_responses, lg) {
+    if (lg->q_next && (next == 0 || lg->q_timeout < next))
+      next = lg->q_timeout;
+  }
+  return next;
+}
+
+#endif /* WITHOUT_Q_BLOCK */
 #endif /* WITHOUT_BLOCK  */
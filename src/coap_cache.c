@@ -0,0 +1,371 @@
+/* coap_cache.c -- server-side cache for responses to GET requests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "coap.h"
+#include "coap_cache.h"
+#include "debug.h"
+#include "encode.h"
+#include "mem.h"
+
+/* Options with the NoCacheKey bit set (RFC 7252, Section 5.4.6). */
+#define COAP_OPTION_NOCACHEKEY(Type) (((Type) & 0x1e) == 0x1c)
+
+size_t
+coap_cache_key(coap_resource_t *resource, coap_pdu_t *request,
+               unsigned char *key) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t length = sizeof(resource);
+
+  memcpy(key, &resource, sizeof(resource));
+
+  coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    unsigned short len;
+
+    /* Uri-Path is covered by the resource, ETag is used for validation */
+    if (opt_iter.type == COAP_OPTION_URI_PATH
+        || opt_iter.type == COAP_OPTION_ETAG
+        || COAP_OPTION_NOCACHEKEY(opt_iter.type))
+      continue;
+
+    len = coap_opt_length(option);
+    if (length + 4 + len > COAP_CACHE_KEY_MAX_SIZE)
+      return 0;
+
+    key[length++] = opt_iter.type >> 8;
+    key[length++] = opt_iter.type & 0xff;
+    key[length++] = len >> 8;
+    key[length++] = len & 0xff;
+    memcpy(key + length, coap_opt_value(option), len);
+    length += len;
+  }
+
+  return length;
+}
+
+#ifndef WITHOUT_CACHE
+
+#include "uthash.h"
+
+typedef struct coap_cache_entry_t {
+  UT_hash_handle hh;
+  coap_resource_t *resource;    /**< the resource the response belongs to */
+  coap_pdu_t *pdu;              /**< copy of the response without token */
+  coap_tick_t expires;          /**< end of the freshness lifetime */
+  size_t key_length;
+  unsigned char key[];          /**< resource pointer and request options */
+} coap_cache_entry_t;
+
+void
+coap_context_set_cache_size(coap_context_t *context, size_t max_entries) {
+  assert(context);
+  context->cache_max_entries = max_entries;
+}
+
+COAP_STATIC_INLINE size_t
+cache_max_entries(coap_context_t *context) {
+  return context->cache_max_entries
+    ? context->cache_max_entries : COAP_CACHE_DEFAULT_SIZE;
+}
+
+static void
+cache_delete_entry(coap_context_t *context, coap_cache_entry_t *entry) {
+  HASH_DELETE(hh, context->cache, entry);
+  coap_delete_pdu(entry->pdu);
+  coap_free(entry);
+}
+
+/**
+ * Returns @c 1 if @p request may be answered from the cache for
+ * @p resource, @c 0 otherwise.
+ */
+static int
+cache_request_ok(coap_resource_t *resource, coap_pdu_t *request) {
+  coap_opt_iterator_t opt_iter;
+
+  return resource->cacheable
+    && request->hdr->code == COAP_REQUEST_GET
+    && !coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter)
+    && !coap_check_option(request, COAP_OPTION_BLOCK1, &opt_iter)
+    && !coap_check_option(request, COAP_OPTION_BLOCK2, &opt_iter)
+    && !coap_check_option(request, COAP_OPTION_Q_BLOCK1, &opt_iter)
+    && !coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter);
+}
+
+/**
+ * Returns @c 1 if one of the ETag options in @p request matches the
+ * ETag of the cached response @p pdu.
+ */
+static int
+cache_etag_matches(coap_pdu_t *request, coap_pdu_t *pdu) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *etag, *option;
+
+  etag = coap_check_option(pdu, COAP_OPTION_ETAG, &opt_iter);
+  if (!etag)
+    return 0;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_ETAG);
+  coap_option_iterator_init(request, &opt_iter, filter);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_opt_length(option) == coap_opt_length(etag)
+        && memcmp(coap_opt_value(option), coap_opt_value(etag),
+                  coap_opt_length(etag)) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Creates the response to @p request from the cached response of
+ * @p entry. Everything after the token of @p response is replaced.
+ * The Max-Age option is set to the remaining freshness lifetime. When
+ * the request contains a matching ETag, a 2.03 response carrying only
+ * ETag and Max-Age is created.
+ *
+ * @return @c 1 on success, @c 0 if @p response is too small. In the
+ *         latter case, @p response contains only its token.
+ */
+static int
+cache_respond(coap_cache_entry_t *entry, coap_pdu_t *request,
+              coap_pdu_t *response, coap_tick_t now) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  unsigned char buf[4];
+  unsigned int max_age;
+  int max_age_done = 0;
+  int valid = cache_etag_matches(request, entry->pdu);
+  size_t len;
+  unsigned char *data;
+
+  max_age = (unsigned int)((entry->expires - now + COAP_TICKS_PER_SECOND - 1)
+                           / COAP_TICKS_PER_SECOND);
+
+  response->length = sizeof(coap_hdr_t) + response->hdr->token_length;
+  response->max_delta = 0;
+  response->data = NULL;
+  response->hdr->code =
+    valid ? COAP_RESPONSE_CODE(203) : entry->pdu->hdr->code;
+
+  coap_option_iterator_init(entry->pdu, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (!max_age_done && opt_iter.type >= COAP_OPTION_MAXAGE) {
+      if (!coap_add_option(response, COAP_OPTION_MAXAGE,
+                           coap_encode_var_bytes(buf, max_age), buf))
+        goto error;
+      max_age_done = 1;
+    }
+
+    if (opt_iter.type == COAP_OPTION_MAXAGE
+        || (valid && opt_iter.type != COAP_OPTION_ETAG))
+      continue;
+
+    if (!coap_add_option(response, opt_iter.type,
+                         coap_opt_length(option), coap_opt_value(option)))
+      goto error;
+  }
+
+  if (!max_age_done && !coap_add_option(response, COAP_OPTION_MAXAGE,
+                                        coap_encode_var_bytes(buf, max_age),
+                                        buf))
+    goto error;
+
+  if (!valid && coap_get_data(entry->pdu, &len, &data)
+      && !coap_add_data(response, (unsigned int)len, data))
+    goto error;
+
+  return 1;
+
+ error:
+  response->length = sizeof(coap_hdr_t) + response->hdr->token_length;
+  response->max_delta = 0;
+  response->data = NULL;
+  response->hdr->code = 0;
+  return 0;
+}
+
+/**
+ * Returns a copy of @p response without its token or @c NULL on error.
+ */
+static coap_pdu_t *
+cache_copy_response(coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_pdu_t *pdu;
+  size_t len;
+  unsigned char *data;
+
+  pdu = coap_pdu_init(0, response->hdr->code, 0,
+                      response->length - response->hdr->token_length);
+  if (!pdu)
+    return NULL;
+
+  coap_option_iterator_init(response, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (!coap_add_option(pdu, opt_iter.type,
+                         coap_opt_length(option), coap_opt_value(option)))
+      goto error;
+  }
+
+  if (coap_get_data(response, &len, &data)
+      && !coap_add_data(pdu, (unsigned int)len, data))
+    goto error;
+
+  return pdu;
+
+ error:
+  coap_delete_pdu(pdu);
+  return NULL;
+}
+
+/**
+ * Makes room for a new entry in the cache of @p context. Expired entries
+ * are removed first. If the cache is still full, the oldest entries are
+ * evicted.
+ */
+static void
+cache_make_room(coap_context_t *context, coap_tick_t now) {
+  coap_cache_entry_t *entry, *tmp;
+  size_t max_entries = cache_max_entries(context);
+
+  if (HASH_COUNT(context->cache) < max_entries)
+    return;
+
+  HASH_ITER(hh, context->cache, entry, tmp) {
+    if (entry->expires <= now)
+      cache_delete_entry(context, entry);
+  }
+
+  /* uthash iterates in insertion order, hence the head is the oldest */
+  while (context->cache && HASH_COUNT(context->cache) >= max_entries)
+    cache_delete_entry(context, context->cache);
+}
+
+int
+coap_cache_get(coap_context_t *context, coap_resource_t *resource,
+               coap_pdu_t *request, coap_pdu_t *response) {
+  unsigned char key[COAP_CACHE_KEY_MAX_SIZE];
+  size_t key_length;
+  coap_cache_entry_t *entry;
+  coap_tick_t now;
+
+  if (!context->cache || !cache_request_ok(resource, request))
+    return 0;
+
+  if (resource->dirty) {
+    coap_cache_invalidate(context, resource);
+    return 0;
+  }
+
+  key_length = coap_cache_key(resource, request, key);
+  if (!key_length)
+    return 0;
+
+  HASH_FIND(hh, context->cache, key, key_length, entry);
+  if (!entry)
+    return 0;
+
+  coap_ticks(&now);
+  if (entry->expires <= now) {
+    cache_delete_entry(context, entry);
+    return 0;
+  }
+
+  return cache_respond(entry, request, response, now);
+}
+
+void
+coap_cache_put(coap_context_t *context, coap_resource_t *resource,
+               coap_pdu_t *request, coap_pdu_t *response) {
+  unsigned char key[COAP_CACHE_KEY_MAX_SIZE];
+  size_t key_length;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_cache_entry_t *entry;
+  unsigned int max_age = COAP_CACHE_DEFAULT_MAX_AGE;
+  coap_tick_t now;
+
+  if (response->hdr->code != COAP_RESPONSE_CODE(205)
+      || resource->dirty
+      || !cache_request_ok(resource, request)
+      || coap_check_option(response, COAP_OPTION_OBSERVE, &opt_iter)
+      || coap_check_option(response, COAP_OPTION_BLOCK2, &opt_iter)
+      || coap_check_option(response, COAP_OPTION_Q_BLOCK2, &opt_iter))
+    return;
+
+  option = coap_check_option(response, COAP_OPTION_MAXAGE, &opt_iter);
+  if (option)
+    max_age = coap_decode_var_bytes(coap_opt_value(option),
+                                    coap_opt_length(option));
+  if (max_age == 0)
+    return;
+
+  key_length = coap_cache_key(resource, request, key);
+  if (!key_length)
+    return;
+
+  HASH_FIND(hh, context->cache, key, key_length, entry);
+  if (entry)
+    cache_delete_entry(context, entry);
+
+  coap_ticks(&now);
+  cache_make_room(context, now);
+
+  entry = (coap_cache_entry_t *)coap_malloc(sizeof(coap_cache_entry_t)
+                                            + key_length);
+  if (!entry) {
+    debug("coap_cache_put: cannot allocate cache entry\n");
+    return;
+  }
+
+  entry->pdu = cache_copy_response(response);
+  if (!entry->pdu) {
+    debug("coap_cache_put: cannot copy response\n");
+    coap_free(entry);
+    return;
+  }
+
+  entry->resource = resource;
+  entry->expires = now + (coap_tick_t)max_age * COAP_TICKS_PER_SECOND;
+  entry->key_length = key_length;
+  memcpy(entry->key, key, key_length);
+  HASH_ADD_KEYPTR(hh, context->cache, entry->key, entry->key_length, entry);
+
+  /* answer revalidation of the representation that was just created */
+  if (cache_etag_matches(request, entry->pdu))
+    cache_respond(entry, request, response, now);
+}
+
+void
+coap_cache_invalidate(coap_context_t *context, coap_resource_t *resource) {
+  coap_cache_entry_t *entry, *tmp;
+
+  if (!context)
+    return;
+
+  HASH_ITER(hh, context->cache, entry, tmp) {
+    if (entry->resource == resource)
+      cache_delete_entry(context, entry);
+  }
+}
+
+void
+coap_cache_free(coap_context_t *context) {
+  coap_cache_entry_t *entry, *tmp;
+
+  HASH_ITER(hh, context->cache, entry, tmp) {
+    cache_delete_entry(context, entry);
+  }
+  context->cache = NULL;
+}
+
+#endif /* WITHOUT_CACHE */
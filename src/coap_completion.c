@@ -0,0 +1,284 @@
+/* coap_completion.c -- completion of asynchronous transactions from
+ *                      other threads
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "coap.h"
+#include "coap_completion.h"
+#include "debug.h"
+#include "encode.h"
+#include "mem.h"
+
+#ifndef WITHOUT_COMPLETION_QUEUE
+
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#elif defined(HAVE_FCNTL_H)
+#include <fcntl.h>
+#endif
+
+/** A result posted by coap_async_post_completion(). */
+typedef struct coap_completion_t {
+  struct coap_completion_t *next;
+  coap_session_t *session;      /**< session of the transaction */
+  coap_tid_t id;                /**< id of the transaction */
+  unsigned char code;           /**< response code */
+  int content_format;           /**< Content-Format or -1 */
+  size_t length;                /**< length of data */
+  uint8_t data[];               /**< the payload */
+} coap_completion_t;
+
+/**
+ * Completions are pushed onto a list by any number of threads with an
+ * atomic compare-and-swap on head. The loop thread takes the whole list
+ * at once with an atomic exchange, so neither side ever waits for a lock.
+ * The file descriptor is written to only when a completion is pushed
+ * onto an empty list.
+ */
+typedef struct coap_completion_queue_t {
+  coap_completion_t *head;      /**< last posted completion */
+  coap_socket_t sock;           /**< readable when head has been set */
+  coap_fd_t write_fd;           /**< written to signal sock */
+} coap_completion_queue_t;
+
+/** Makes sock of @p queue readable. */
+static void
+completion_queue_signal(coap_completion_queue_t *queue) {
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t count = 1;
+#else /* HAVE_SYS_EVENTFD_H */
+  unsigned char count = 1;
+#endif /* HAVE_SYS_EVENTFD_H */
+
+  /* fails only if the counter is saturated, which signals as well */
+  if (write(queue->write_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    coap_log(LOG_WARNING, "coap_async_post_completion: %s\n",
+             coap_socket_strerror());
+}
+
+/** Consumes all signals of sock of @p queue. */
+static void
+completion_queue_clear(coap_completion_queue_t *queue) {
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t count;
+
+  if (read(queue->sock.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    coap_log(LOG_WARNING, "coap_completion_queue_drain: %s\n",
+             coap_socket_strerror());
+#else /* HAVE_SYS_EVENTFD_H */
+  unsigned char buf[64];
+
+  while (read(queue->sock.fd, buf, sizeof(buf)) == sizeof(buf))
+    ;
+#endif /* HAVE_SYS_EVENTFD_H */
+}
+
+int
+coap_context_enable_completion_queue(coap_context_t *context) {
+  coap_completion_queue_t *queue;
+
+  assert(context);
+
+  if (context->completion_queue)
+    return 1;
+
+  queue = (coap_completion_queue_t *)
+    coap_malloc(sizeof(coap_completion_queue_t));
+  if (!queue) {
+    coap_log(LOG_WARNING,
+             "coap_context_enable_completion_queue: insufficient memory\n");
+    return 0;
+  }
+  memset(queue, 0, sizeof(coap_completion_queue_t));
+
+#ifdef HAVE_SYS_EVENTFD_H
+  queue->sock.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (queue->sock.fd < 0)
+    goto error;
+  queue->write_fd = queue->sock.fd;
+#else /* HAVE_SYS_EVENTFD_H */
+  {
+    int fds[2];
+
+    if (pipe(fds) < 0)
+      goto error;
+    queue->sock.fd = fds[0];
+    queue->write_fd = fds[1];
+#ifdef HAVE_FCNTL_H
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+#endif /* HAVE_FCNTL_H */
+  }
+#endif /* HAVE_SYS_EVENTFD_H */
+
+  queue->sock.flags = COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_WANT_DATA;
+  context->completion_queue = queue;
+  return 1;
+
+ error:
+  coap_log(LOG_WARNING, "coap_context_enable_completion_queue: %s\n",
+           coap_socket_strerror());
+  coap_free(queue);
+  return 0;
+}
+
+int
+coap_async_post_completion(coap_context_t *context, coap_session_t *session,
+                           coap_tid_t id, unsigned char code,
+                           int content_format, const uint8_t *data,
+                           size_t length) {
+  coap_completion_queue_t *queue = context->completion_queue;
+  coap_completion_t *completion, *head;
+
+  if (!queue || sizeof(coap_hdr_t) + 8 + length > COAP_MAX_PDU_SIZE)
+    return 0;
+
+  completion = (coap_completion_t *)
+    coap_malloc(sizeof(coap_completion_t) + length);
+  if (!completion)
+    return 0;
+
+  completion->session = session;
+  completion->id = id;
+  completion->code = code;
+  completion->content_format = content_format;
+  completion->length = length;
+  if (length)
+    memcpy(completion->data, data, length);
+
+  head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  do {
+    completion->next = head;
+  } while (!__atomic_compare_exchange_n(&queue->head, &head, completion, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  /* the loop thread is woken up once until it has taken the list */
+  if (!head)
+    completion_queue_signal(queue);
+  return 1;
+}
+
+/** Answers the transaction of @p completion if it is still pending. */
+static void
+completion_send(coap_context_t *context, coap_completion_t *completion) {
+  coap_async_state_t *s;
+  coap_pdu_t *response;
+  unsigned char buf[4];
+
+  s = coap_find_async(context, completion->session, completion->id);
+  if (!s) {
+    debug("dropped completion of transaction %d\n", completion->id);
+    return;
+  }
+
+  /* room for Content-Format and the payload marker, as checked when the
+   * completion was posted */
+  response = coap_pdu_init(0, completion->code, 0,
+                           sizeof(coap_hdr_t) + 8 + completion->length);
+  if (!response)
+    goto error;
+
+  if (completion->content_format >= 0
+      && !coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                          coap_encode_var_bytes(buf,
+                                                completion->content_format),
+                          buf))
+    goto error;
+
+  if (completion->length
+      && !coap_add_data(response, (unsigned int)completion->length,
+                        completion->data))
+    goto error;
+
+  coap_async_complete(context, s, response);
+  return;
+
+ error:
+  debug("coap_completion_queue_drain: cannot create response for "
+        "transaction %d\n", completion->id);
+  coap_delete_pdu(response);
+}
+
+/**
+ * Takes all completions from @p queue. Returns the list in the order of
+ * posting.
+ */
+static coap_completion_t *
+completion_queue_take(coap_completion_queue_t *queue) {
+  coap_completion_t *completion, *next, *list = NULL;
+
+  completion = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+
+  /* the list is in reverse order of posting */
+  while (completion) {
+    next = completion->next;
+    completion->next = list;
+    list = completion;
+    completion = next;
+  }
+  return list;
+}
+
+unsigned int
+coap_completion_queue_drain(coap_context_t *context) {
+  coap_completion_queue_t *queue = context->completion_queue;
+  coap_completion_t *completion, *next;
+  unsigned int count = 0;
+
+  if (!queue)
+    return 0;
+
+  queue->sock.flags &= ~COAP_SOCKET_HAS_DATA;
+
+  /* Clear the signal before taking the list: a completion posted in the
+   * meantime signals again, so none can be left without a signal. */
+  completion_queue_clear(queue);
+
+  for (completion = completion_queue_take(queue); completion;
+       completion = next) {
+    next = completion->next;
+    completion_send(context, completion);
+    coap_free(completion);
+    count++;
+  }
+
+  return count;
+}
+
+coap_socket_t *
+coap_completion_queue_socket(coap_context_t *context) {
+  return context->completion_queue ? &context->completion_queue->sock : NULL;
+}
+
+void
+coap_free_completion_queue(coap_context_t *context) {
+  coap_completion_queue_t *queue = context->completion_queue;
+  coap_completion_t *completion, *next;
+
+  if (!queue)
+    return;
+
+  for (completion = completion_queue_take(queue); completion;
+       completion = next) {
+    next = completion->next;
+    coap_free(completion);
+  }
+
+  if (queue->write_fd != queue->sock.fd)
+    close(queue->write_fd);
+  close(queue->sock.fd);
+  coap_free(queue);
+  context->completion_queue = NULL;
+}
+
+#endif /* WITHOUT_COMPLETION_QUEUE */
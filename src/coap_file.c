@@ -0,0 +1,410 @@
+/* coap_file.c -- resources that serve the contents of a file
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "coap.h"
+#include "coap_file.h"
+#include "debug.h"
+#include "encode.h"
+#include "mem.h"
+
+#ifndef WITHOUT_FILE_RESOURCE
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_FCNTL_H)
+#define COAP_FILE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#endif
+
+/**
+ * The contents of a file at the time it was loaded. The contents are
+ * shared by the file and all transfers that have been started with them.
+ */
+typedef struct coap_file_contents_t {
+  unsigned int ref;             /**< number of references */
+  uint8_t *data;                /**< the contents or NULL if empty */
+  size_t length;                /**< the length of data */
+  int mapped;                   /**< set if data has been mapped */
+  int modified;                 /**< set when modified in place */
+#ifdef COAP_FILE_MMAP
+  int fd;                       /**< the mapped file, kept open */
+  struct stat st;               /**< status of the mapped file */
+#endif /* COAP_FILE_MMAP */
+  uint8_t etag[COAP_FILE_ETAG_LENGTH]; /**< ETag of the contents */
+} coap_file_contents_t;
+
+typedef struct coap_file_t {
+  char *path;                   /**< the file name, stored behind */
+  int content_format;           /**< Content-Format or -1 */
+  coap_file_contents_t *contents; /**< current contents or NULL */
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;               /**< status of the file when loaded */
+#endif
+} coap_file_t;
+
+static void
+file_contents_release(coap_file_contents_t *contents) {
+  if (--contents->ref > 0)
+    return;
+
+#ifdef COAP_FILE_MMAP
+  if (contents->mapped) {
+    munmap(contents->data, contents->length);
+    close(contents->fd);
+    coap_free(contents);
+    return;
+  }
+#endif /* COAP_FILE_MMAP */
+  if (contents->data)
+    coap_free(contents->data);
+  coap_free(contents);
+}
+
+/** Releases the contents referred to by a large response. */
+static void
+file_contents_release_large(coap_session_t *session, void *app_ptr) {
+  (void)session;
+  file_contents_release((coap_file_contents_t *)app_ptr);
+}
+
+#ifdef HAVE_SYS_STAT_H
+/** Returns @c 1 if @p a and @p b have the same size and modification
+ *  time. */
+COAP_STATIC_INLINE int
+file_stat_unmodified(const struct stat *a, const struct stat *b) {
+  return a->st_size == b->st_size && a->st_mtime == b->st_mtime
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+#endif /* HAVE_STRUCT_STAT_ST_MTIM */
+    ;
+}
+
+/** Returns @c 1 if @p a and @p b describe the same version of a file. */
+COAP_STATIC_INLINE int
+file_stat_equal(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+    && file_stat_unmodified(a, b);
+}
+#endif /* HAVE_SYS_STAT_H */
+
+/**
+ * Returns @c 0 if @p contents are mapped from a file that has been
+ * written to since. Mapped pages follow such changes, and reading beyond
+ * the end of a truncated file raises SIGBUS, so the contents must not be
+ * touched anymore.
+ */
+static int
+file_contents_intact(coap_file_contents_t *contents) {
+#ifdef COAP_FILE_MMAP
+  struct stat st;
+
+  if (!contents->mapped || contents->modified)
+    return !contents->modified;
+
+  if (fstat(contents->fd, &st) == 0 && file_stat_unmodified(&st, &contents->st))
+    return 1;
+
+  coap_log(LOG_WARNING, "file modified in place, "
+           "files must be replaced by renaming\n");
+  contents->modified = 1;
+  return 0;
+#else /* COAP_FILE_MMAP */
+  (void)contents;
+  return 1;
+#endif /* COAP_FILE_MMAP */
+}
+
+/**
+ * Computes the ETag of @p contents, the first COAP_FILE_ETAG_LENGTH bytes
+ * of their SHA-256 digest if OpenSSL is available or their 64-bit FNV-1a
+ * hash otherwise.
+ */
+static void
+file_contents_etag(coap_file_contents_t *contents) {
+#ifdef HAVE_OPENSSL
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+
+  SHA256(contents->data, contents->length, digest);
+  memcpy(contents->etag, digest, sizeof(contents->etag));
+#else /* HAVE_OPENSSL */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t n;
+
+  for (n = 0; n < contents->length; n++) {
+    hash ^= contents->data[n];
+    hash *= 0x100000001b3ULL;
+  }
+  for (n = 0; n < sizeof(contents->etag); n++)
+    contents->etag[n] = (uint8_t)(hash >> (8 * n));
+#endif /* HAVE_OPENSSL */
+}
+
+#ifdef COAP_FILE_MMAP
+/**
+ * Maps the file of @p file into @p contents and updates the status of
+ * @p file.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+file_read(coap_file_t *file, coap_file_contents_t *contents) {
+  int fd;
+  void *data;
+
+  fd = open(file->path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (fstat(fd, &file->st) < 0 || !S_ISREG(file->st.st_mode))
+    goto error;
+
+  contents->length = (size_t)file->st.st_size;
+  if (contents->length) {
+    data = mmap(NULL, contents->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      goto error;
+    contents->data = (uint8_t *)data;
+    contents->mapped = 1;
+    /* keep the file open to detect modifications in place */
+    contents->fd = fd;
+    contents->st = file->st;
+    return 1;
+  }
+
+  close(fd);
+  return 1;
+
+ error:
+  close(fd);
+  return 0;
+}
+#else /* COAP_FILE_MMAP */
+/**
+ * Reads the file of @p file into @p contents and updates the status of
+ * @p file.
+ *
+ * @return @c 1 on success, @c 0 otherwise.
+ */
+static int
+file_read(coap_file_t *file, coap_file_contents_t *contents) {
+  FILE *fp;
+  long length;
+
+#ifdef HAVE_SYS_STAT_H
+  if (stat(file->path, &file->st) < 0)
+    return 0;
+#endif /* HAVE_SYS_STAT_H */
+
+  fp = fopen(file->path, "rb");
+  if (!fp)
+    return 0;
+
+  if (fseek(fp, 0, SEEK_END) != 0 || (length = ftell(fp)) < 0
+      || fseek(fp, 0, SEEK_SET) != 0)
+    goto error;
+
+  contents->length = (size_t)length;
+  if (contents->length) {
+    contents->data = (uint8_t *)coap_malloc(contents->length);
+    if (!contents->data)
+      goto error;
+    if (fread(contents->data, 1, contents->length, fp) != contents->length) {
+      coap_free(contents->data);
+      contents->data = NULL;
+      goto error;
+    }
+  }
+
+  fclose(fp);
+  return 1;
+
+ error:
+  fclose(fp);
+  return 0;
+}
+#endif /* COAP_FILE_MMAP */
+
+/**
+ * Loads the current version of @p file.
+ *
+ * @return The new contents or @c NULL on error.
+ */
+static coap_file_contents_t *
+file_load(coap_file_t *file) {
+  coap_file_contents_t *contents;
+
+  contents =
+    (coap_file_contents_t *)coap_malloc(sizeof(coap_file_contents_t));
+  if (!contents) {
+    coap_log(LOG_WARNING, "coap_resource_check_file: insufficient memory\n");
+    return NULL;
+  }
+  memset(contents, 0, sizeof(coap_file_contents_t));
+
+  if (!file_read(file, contents)) {
+    debug("cannot read file %s\n", file->path);
+    coap_free(contents);
+    return NULL;
+  }
+
+  contents->ref = 1;
+  file_contents_etag(contents);
+  return contents;
+}
+
+int
+coap_resource_check_file(coap_resource_t *resource) {
+  coap_file_t *file = resource->file;
+  coap_file_contents_t *contents;
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;
+#endif /* HAVE_SYS_STAT_H */
+
+  assert(file);
+
+#ifdef HAVE_SYS_STAT_H
+  if (file->contents && file_contents_intact(file->contents)
+      && stat(file->path, &st) == 0 && file_stat_equal(&st, &file->st))
+    return 0;
+#else /* HAVE_SYS_STAT_H */
+  if (file->contents)
+    return 0;
+#endif /* HAVE_SYS_STAT_H */
+
+  contents = file_load(file);
+
+  if (file->contents) {
+    /* transfers in progress keep the previous contents */
+    file_contents_release(file->contents);
+    resource->dirty = 1;
+  }
+  file->contents = contents;
+  return contents != NULL;
+}
+
+/** Returns @c 1 if an ETag option of @p request matches @p contents. */
+static int
+file_etag_matches(coap_pdu_t *request, coap_file_contents_t *contents) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *option;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_ETAG);
+  coap_option_iterator_init(request, &opt_iter, filter);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_opt_length(option) == sizeof(contents->etag)
+        && memcmp(coap_opt_value(option), contents->etag,
+                  sizeof(contents->etag)) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void
+hnd_get_file(coap_context_t *context,
+             coap_resource_t *resource,
+             coap_session_t *session,
+             coap_pdu_t *request,
+             str *token,
+             coap_pdu_t *response) {
+  coap_file_t *file = resource->file;
+  coap_file_contents_t *contents;
+  coap_block_t block;
+  unsigned char buf[4];
+
+  (void)context;
+  (void)token;
+
+  coap_resource_check_file(resource);
+  contents = file->contents;
+  if (!contents) {
+    response->hdr->code = COAP_RESPONSE_CODE(404);
+    return;
+  }
+
+  coap_add_option(response, COAP_OPTION_ETAG,
+                  sizeof(contents->etag), contents->etag);
+
+  /* revalidation of the current contents */
+  if (!coap_get_block(request, COAP_OPTION_BLOCK2, &block)
+      && !coap_get_block(request, COAP_OPTION_Q_BLOCK2, &block)
+      && file_etag_matches(request, contents)) {
+    response->hdr->code = COAP_RESPONSE_CODE(203);
+    return;
+  }
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  if (file->content_format >= 0)
+    coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                    coap_encode_var_bytes(buf, file->content_format), buf);
+
+  /* the large response refers to the contents until it is released */
+  contents->ref++;
+  coap_add_data_large_response(resource, session, request, response,
+                               contents->length, contents->data,
+                               file_contents_release_large, contents);
+}
+
+int
+coap_file_data_intact(coap_release_large_data_t release, void *app_ptr) {
+  return release != file_contents_release_large
+    || file_contents_intact((coap_file_contents_t *)app_ptr);
+}
+
+coap_resource_t *
+coap_resource_init_file(const unsigned char *uri, size_t len,
+                        const char *path, int content_format, int flags) {
+  coap_resource_t *r;
+  coap_file_t *file;
+  size_t path_length;
+
+  assert(path);
+
+  path_length = strlen(path);
+  file = (coap_file_t *)coap_malloc(sizeof(coap_file_t) + path_length + 1);
+  if (!file) {
+    debug("coap_resource_init_file: no memory left\n");
+    return NULL;
+  }
+  memset(file, 0, sizeof(coap_file_t));
+  file->path = (char *)(file + 1);
+  memcpy(file->path, path, path_length + 1);
+  file->content_format = content_format;
+
+  r = coap_resource_init(uri, len, flags);
+  if (!r) {
+    coap_free(file);
+    return NULL;
+  }
+
+  r->file = file;
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get_file);
+  return r;
+}
+
+void
+coap_free_file(struct coap_file_t *file) {
+  if (!file)
+    return;
+
+  if (file->contents)
+    file_contents_release(file->contents);
+  coap_free(file);
+}
+
+#endif /* WITHOUT_FILE_RESOURCE */
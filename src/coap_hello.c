@@ -0,0 +1,238 @@
+/* coap_hello.c -- rate limit of DTLS ClientHello messages
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "coap.h"
+#include "coap_hello.h"
+#include "debug.h"
+#include "mem.h"
+#include "uthash.h"
+
+#ifndef WITHOUT_HELLO_LIMIT
+
+#include <string.h>
+
+/** Size of a prefix: the address family followed by the address bits. */
+#define HELLO_KEY_SIZE 17
+
+/**
+ * The tokens of a prefix. A datagram takes COAP_TICKS_PER_SECOND units of
+ * credit, rate units are added per tick.
+ */
+typedef struct hello_bucket_t {
+  UT_hash_handle hh;
+  coap_tick_t last;             /**< time credit was last updated */
+  coap_tick_t credit;           /**< units of credit left */
+  uint8_t key[HELLO_KEY_SIZE];  /**< the prefix */
+} hello_bucket_t;
+
+struct coap_hello_limit_t {
+  hello_bucket_t *buckets;      /**< buckets, least recently used first */
+  hello_bucket_t global;        /**< the bucket of all prefixes */
+  unsigned int rate;            /**< datagrams per second and prefix */
+  unsigned int burst;           /**< size of a bucket in datagrams */
+  unsigned int max_handshakes;  /**< handshakes in progress at most */
+  coap_hello_stats_t stats;     /**< counters */
+};
+
+/** Copies the first @p bits of @p addr to @p key. */
+static void
+hello_copy_prefix(uint8_t *key, const uint8_t *addr, unsigned int bits) {
+  memcpy(key, addr, bits / 8);
+  if (bits % 8)
+    key[bits / 8] = addr[bits / 8] & (uint8_t)(0xff << (8 - bits % 8));
+}
+
+/**
+ * Sets @p key to the prefix of @p src. Returns 0 if the address family
+ * has no prefixes.
+ */
+static int
+hello_get_prefix(uint8_t key[HELLO_KEY_SIZE], const coap_address_t *src) {
+  const uint8_t *addr;
+
+  memset(key, 0, HELLO_KEY_SIZE);
+  switch (src->addr.sa.sa_family) {
+  case AF_INET:
+    addr = (const uint8_t *)&src->addr.sin.sin_addr;
+    break;
+  case AF_INET6:
+    addr = (const uint8_t *)&src->addr.sin6.sin6_addr;
+    /* clients of a dual-stack socket share the buckets of IPv4 */
+    if (!IN6_IS_ADDR_V4MAPPED(&src->addr.sin6.sin6_addr)) {
+      key[0] = AF_INET6;
+      hello_copy_prefix(key + 1, addr, COAP_HELLO_PREFIX_V6);
+      return 1;
+    }
+    addr += 12;
+    break;
+  default:
+    return 0;
+  }
+  key[0] = AF_INET;
+  hello_copy_prefix(key + 1, addr, COAP_HELLO_PREFIX_V4);
+  return 1;
+}
+
+/**
+ * Returns the bucket of @p key, which is created with the credit of a full
+ * bucket but no more than the global bucket has left if there is none. The
+ * least recently used bucket is taken over when COAP_HELLO_MAX_PREFIXES
+ * buckets exist.
+ */
+static hello_bucket_t *
+hello_get_bucket(struct coap_hello_limit_t *limit,
+                 const uint8_t key[HELLO_KEY_SIZE], coap_tick_t now) {
+  hello_bucket_t *bucket;
+
+  HASH_FIND(hh, limit->buckets, key, HELLO_KEY_SIZE, bucket);
+  if (bucket) {
+    /* the buckets are kept in order of use */
+    HASH_DELETE(hh, limit->buckets, bucket);
+  } else {
+    if (HASH_COUNT(limit->buckets) >= COAP_HELLO_MAX_PREFIXES) {
+      bucket = limit->buckets;
+      HASH_DELETE(hh, limit->buckets, bucket);
+    } else {
+      bucket = (hello_bucket_t *)coap_malloc(sizeof(hello_bucket_t));
+      if (!bucket)
+        return NULL;
+    }
+    memset(bucket, 0, sizeof(hello_bucket_t));
+    memcpy(bucket->key, key, HELLO_KEY_SIZE);
+    bucket->last = now;
+    bucket->credit = (coap_tick_t)limit->burst * COAP_TICKS_PER_SECOND;
+    if (bucket->credit > limit->global.credit)
+      bucket->credit = limit->global.credit;
+  }
+  HASH_ADD(hh, limit->buckets, key, HELLO_KEY_SIZE, bucket);
+  return bucket;
+}
+
+/**
+ * Adds the credit earned since the last update of @p bucket, which holds
+ * @p burst datagrams and is refilled with @p rate datagrams per second.
+ */
+static void
+hello_refill(hello_bucket_t *bucket, unsigned int rate, unsigned int burst,
+             coap_tick_t now) {
+  coap_tick_t max = (coap_tick_t)burst * COAP_TICKS_PER_SECOND;
+
+  if (now <= bucket->last)
+    return;
+  if (now - bucket->last >= (max - bucket->credit) / rate)
+    bucket->credit = max;
+  else
+    bucket->credit += (now - bucket->last) * rate;
+  bucket->last = now;
+}
+
+static void
+hello_clear(struct coap_hello_limit_t *limit) {
+  hello_bucket_t *bucket, *tmp;
+
+  HASH_ITER(hh, limit->buckets, bucket, tmp) {
+    HASH_DELETE(hh, limit->buckets, bucket);
+    coap_free(bucket);
+  }
+}
+
+int
+coap_context_set_hello_limit(coap_context_t *context, unsigned int rate,
+                             unsigned int burst, unsigned int max_handshakes) {
+  struct coap_hello_limit_t *limit = context->hello_limit;
+
+  if (!limit) {
+    limit = (struct coap_hello_limit_t *)
+      coap_malloc(sizeof(struct coap_hello_limit_t));
+    if (!limit) {
+      coap_log(LOG_WARNING,
+               "coap_context_set_hello_limit: insufficient memory\n");
+      return 0;
+    }
+    memset(limit, 0, sizeof(struct coap_hello_limit_t));
+    context->hello_limit = limit;
+  }
+
+  hello_clear(limit);
+  limit->rate = rate;
+  limit->burst = burst < 2 ? 2 : burst;
+  limit->max_handshakes = max_handshakes;
+  limit->global.last = 0;
+  limit->global.credit = (coap_tick_t)limit->burst
+    * COAP_HELLO_GLOBAL_PREFIXES * COAP_TICKS_PER_SECOND;
+  return 1;
+}
+
+void
+coap_context_get_hello_stats(coap_context_t *context,
+                             coap_hello_stats_t *stats) {
+  if (context->hello_limit)
+    *stats = context->hello_limit->stats;
+  else
+    memset(stats, 0, sizeof(coap_hello_stats_t));
+}
+
+int
+coap_hello_admit(coap_context_t *context, const coap_address_t *src,
+                 coap_tick_t now) {
+  struct coap_hello_limit_t *limit = context->hello_limit;
+  uint8_t key[HELLO_KEY_SIZE];
+  hello_bucket_t *bucket;
+
+  if (!limit)
+    return 1;
+
+  limit->stats.received++;
+  if (limit->max_handshakes
+      && context->dtls_handshakes >= limit->max_handshakes) {
+    limit->stats.dropped_busy++;
+    return 0;
+  }
+
+  if (!limit->rate || !hello_get_prefix(key, src))
+    return 1;
+
+  /* a datagram takes credit from its prefix and from the global bucket */
+  hello_refill(&limit->global, limit->rate * COAP_HELLO_GLOBAL_PREFIXES,
+               limit->burst * COAP_HELLO_GLOBAL_PREFIXES, now);
+  bucket = hello_get_bucket(limit, key, now);
+  if (bucket)
+    hello_refill(bucket, limit->rate, limit->burst, now);
+  if (!bucket || bucket->credit < COAP_TICKS_PER_SECOND
+      || limit->global.credit < COAP_TICKS_PER_SECOND) {
+    limit->stats.dropped_rate++;
+    return 0;
+  }
+  bucket->credit -= COAP_TICKS_PER_SECOND;
+  limit->global.credit -= COAP_TICKS_PER_SECOND;
+  return 1;
+}
+
+void
+coap_hello_count(coap_context_t *context, int result) {
+  struct coap_hello_limit_t *limit = context->hello_limit;
+
+  if (!limit)
+    return;
+  if (result == 1)
+    limit->stats.verified++;
+  else if (result == 0)
+    limit->stats.cookies++;
+}
+
+void
+coap_free_hello_limit(coap_context_t *context) {
+  if (!context->hello_limit)
+    return;
+  hello_clear(context->hello_limit);
+  coap_free(context->hello_limit);
+  context->hello_limit = NULL;
+}
+
+#endif /* WITHOUT_HELLO_LIMIT */
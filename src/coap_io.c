@@ -38,19 +38,31 @@
 # include <unistd.h>
 #endif
 #include <errno.h>
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <linux/errqueue.h>
+#endif
 
 #ifdef WITH_CONTIKI
 # include "uip.h"
 #endif
 
 #include "libcoap.h"
+#include "async.h"
+#include "coap_completion.h"
 #include "debug.h"
 #include "mem.h"
 #include "coap_dtls.h"
 #include "coap_io.h"
+#include "coap_keystore.h"
 #include "pdu.h"
 #include "utlist.h"
 
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP) \
+  && defined(HAVE_LINUX_ERRQUEUE_H) && defined(IP_MTU_DISCOVER) \
+  && defined(IP_RECVERR) && defined(IPV6_MTU_DISCOVER) && defined(IPV6_RECVERR)
+#define COAP_PMTU_DISCOVERY
+#endif
+
 #if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
  /* define generic PKTINFO for IPv4 */
 #if defined(IP_PKTINFO)
@@ -126,6 +138,24 @@ void coap_socket_close(coap_socket_t *sock) {
     uip_udp_remove((struct uip_udp_conn *)sock->conn);
 }
 
+int
+coap_socket_set_pmtu_discovery(coap_socket_t *sock,
+  const coap_address_t *addr,
+  int enable) {
+  return 0;
+}
+
+unsigned int
+coap_socket_get_path_mtu(coap_socket_t *sock, const coap_address_t *addr) {
+  return 0;
+}
+
+int
+coap_socket_read_error(coap_socket_t *sock, coap_address_t *dst,
+  unsigned int *mtu) {
+  return 0;
+}
+
 #else
 
 struct coap_endpoint_t *
@@ -279,6 +309,145 @@ void coap_socket_close(coap_socket_t *sock) {
     coap_closesocket(sock->fd);
 }
 
+#ifdef COAP_PMTU_DISCOVERY
+/** Returns the size of IP and UDP headers of datagrams sent to @p sa. */
+static unsigned int
+coap_udp_overhead(const struct sockaddr *sa) {
+  if (sa->sa_family == AF_INET6
+      && !IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)sa)->sin6_addr))
+    return 48;
+  return 28;
+}
+
+int
+coap_socket_set_pmtu_discovery(coap_socket_t *sock,
+  const coap_address_t *addr,
+  int enable) {
+  int pmtudisc = enable ? IP_PMTUDISC_DO : IP_PMTUDISC_WANT;
+  int recverr = enable ? 1 : 0;
+
+  if (addr->addr.sa.sa_family == AF_INET6) {
+    int pmtudisc6 = enable ? IPV6_PMTUDISC_DO : IPV6_PMTUDISC_WANT;
+    if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, OPTVAL_T(&pmtudisc6), sizeof(pmtudisc6)) == COAP_SOCKET_ERROR
+        || setsockopt(sock->fd, IPPROTO_IPV6, IPV6_RECVERR, OPTVAL_T(&recverr), sizeof(recverr)) == COAP_SOCKET_ERROR) {
+      coap_log(LOG_WARNING, "coap_socket_set_pmtu_discovery: setsockopt: %s\n", coap_socket_strerror());
+      return 0;
+    }
+    /* ignore errors, because the likely cause is that IPv4 is disabled at the os level */
+    setsockopt(sock->fd, IPPROTO_IP, IP_MTU_DISCOVER, OPTVAL_T(&pmtudisc), sizeof(pmtudisc));
+    setsockopt(sock->fd, IPPROTO_IP, IP_RECVERR, OPTVAL_T(&recverr), sizeof(recverr));
+  } else if (setsockopt(sock->fd, IPPROTO_IP, IP_MTU_DISCOVER, OPTVAL_T(&pmtudisc), sizeof(pmtudisc)) == COAP_SOCKET_ERROR
+             || setsockopt(sock->fd, IPPROTO_IP, IP_RECVERR, OPTVAL_T(&recverr), sizeof(recverr)) == COAP_SOCKET_ERROR) {
+    coap_log(LOG_WARNING, "coap_socket_set_pmtu_discovery: setsockopt: %s\n", coap_socket_strerror());
+    return 0;
+  }
+
+  if (enable)
+    sock->flags |= COAP_SOCKET_PMTU;
+  else
+    sock->flags &= ~COAP_SOCKET_PMTU;
+  return 1;
+}
+
+unsigned int
+coap_socket_get_path_mtu(coap_socket_t *sock, const coap_address_t *addr) {
+  int mtu = 0;
+  socklen_t optlen = sizeof(mtu);
+  unsigned int overhead = coap_udp_overhead(&addr->addr.sa);
+
+  if (addr->addr.sa.sa_family == AF_INET6) {
+    if (getsockopt(sock->fd, IPPROTO_IPV6, IPV6_MTU, OPTVAL_T(&mtu), &optlen) == COAP_SOCKET_ERROR)
+      return 0;
+  } else if (getsockopt(sock->fd, IPPROTO_IP, IP_MTU, OPTVAL_T(&mtu), &optlen) == COAP_SOCKET_ERROR) {
+    return 0;
+  }
+  return mtu > (int)overhead ? (unsigned int)mtu - overhead : 0;
+}
+
+int
+coap_socket_read_error(coap_socket_t *sock, coap_address_t *dst,
+  unsigned int *mtu) {
+  /* large enough for the extended error and the offender's address */
+  char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+  uint8_t payload[1];		/* the datagram that caused the error is not needed */
+  struct msghdr mhdr;
+  struct iovec iov[1];
+  struct cmsghdr *cmsg;
+
+  *mtu = 0;
+  coap_address_init(dst);
+  if ((sock->flags & COAP_SOCKET_PMTU) == 0)
+    return 0;
+
+  iov[0].iov_base = payload;
+  iov[0].iov_len = sizeof(payload);
+
+  memset(&mhdr, 0, sizeof(struct msghdr));
+  mhdr.msg_name = &dst->addr;
+  mhdr.msg_namelen = sizeof(dst->addr);
+  mhdr.msg_iov = iov;
+  mhdr.msg_iovlen = 1;
+  mhdr.msg_control = buf;
+  mhdr.msg_controllen = sizeof(buf);
+
+  if (recvmsg(sock->fd, &mhdr, MSG_ERRQUEUE) < 0) {
+    if (errno != EAGAIN)
+      coap_log(LOG_WARNING, "coap_socket_read_error: %s\n", coap_socket_strerror());
+    return 0;
+  }
+  dst->size = mhdr.msg_namelen;
+
+  for (cmsg = CMSG_FIRSTHDR(&mhdr); cmsg; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
+    if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR)
+        || (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+      union {
+        uint8_t *c;
+        struct sock_extended_err *e;
+      } u;
+      unsigned int overhead = coap_udp_overhead(&dst->addr.sa);
+
+      u.c = CMSG_DATA(cmsg);
+      if (u.e->ee_errno == EMSGSIZE && u.e->ee_info > overhead)
+        *mtu = u.e->ee_info - overhead;
+      /* the local stack does not report the destination port */
+      if (u.e->ee_origin == SO_EE_ORIGIN_LOCAL)
+        dst->size = 0;
+      break;
+    }
+  }
+  return 1;
+}
+
+#else /* COAP_PMTU_DISCOVERY */
+
+int
+coap_socket_set_pmtu_discovery(coap_socket_t *sock,
+  const coap_address_t *addr,
+  int enable) {
+  (void)sock;
+  (void)addr;
+  (void)enable;
+  return 0;
+}
+
+unsigned int
+coap_socket_get_path_mtu(coap_socket_t *sock, const coap_address_t *addr) {
+  (void)sock;
+  (void)addr;
+  return 0;
+}
+
+int
+coap_socket_read_error(coap_socket_t *sock, coap_address_t *dst,
+  unsigned int *mtu) {
+  (void)sock;
+  (void)dst;
+  *mtu = 0;
+  return 0;
+}
+
+#endif /* COAP_PMTU_DISCOVERY */
+
 #endif  /* WITH_CONTIKI */
 
 #if (!defined(WITH_CONTIKI) && !defined(WITH_LWIP)) != ( defined(HAVE_NETINET_IN_H) || defined(HAVE_WS2TCPIP_H) )
@@ -462,7 +631,15 @@ coap_network_send(coap_socket_t *sock, const coap_session_t *session, const uint
 #ifdef WITH_CONTIKI
 COAP_STATIC_INLINE coap_packet_t *
 coap_malloc_packet(void) {
-  return (coap_packet_t *)coap_malloc_type(COAP_PACKET, 0);
+  coap_packet_t *packet;
+
+  /* the payload is stored behind the packet, see COAP_MAX_PACKET_SIZE */
+  packet = (coap_packet_t *)coap_malloc_type(COAP_PACKET, 0);
+  if (packet) {
+    packet->payload = (unsigned char *)(packet + 1);
+    packet->size = COAP_RXBUFFER_SIZE;
+  }
+  return packet;
 }
 
 void
@@ -498,9 +675,9 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 
   if (sock->flags & COAP_SOCKET_CONNECTED) {
 #ifdef _WIN32
-    len = recv(sock->fd, (char *)packet->payload, COAP_RXBUFFER_SIZE, 0);
+    len = recv(sock->fd, (char *)packet->payload, (int)packet->size, 0);
 #else
-    len = recv(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, 0);
+    len = recv(sock->fd, packet->payload, packet->size, 0);
 #endif
     if (len < 0) {
 #ifdef _WIN32
@@ -512,6 +689,13 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 	coap_log(LOG_WARNING, "coap_network_read: unreachable\n");
 	return -2;
       }
+#ifdef COAP_PMTU_DISCOVERY
+      if ((sock->flags & COAP_SOCKET_PMTU)
+          && (errno == EMSGSIZE || errno == EAGAIN)) {
+	/* an error has been queued for coap_socket_read_error() */
+	return 0;
+      }
+#endif /* COAP_PMTU_DISCOVERY */
       coap_log(LOG_WARNING, "coap_network_read: %s\n", coap_socket_strerror());
       goto error;
     } else if (len > 0) {
@@ -529,7 +713,7 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
     struct iovec iov[1];
 
     iov[0].iov_base = packet->payload;
-    iov[0].iov_len = (iov_len_t)COAP_RXBUFFER_SIZE;
+    iov[0].iov_len = (iov_len_t)packet->size;
 
     memset(&mhdr, 0, sizeof(struct msghdr));
 
@@ -567,11 +751,32 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 	/* server-side ICMP destination unreachable, ignore it. The destination address is in msg_name. */
 	return 0;
       }
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+      if (errno == EAGAIN) {
+#endif
+	/* no more datagrams on the non-blocking socket */
+	return 0;
+      }
+#ifdef COAP_PMTU_DISCOVERY
+      if ((sock->flags & COAP_SOCKET_PMTU) && errno == EMSGSIZE) {
+	/* an error has been queued for coap_socket_read_error() */
+	return 0;
+      }
+#endif /* COAP_PMTU_DISCOVERY */
       coap_log(LOG_WARNING, "coap_network_read: %s\n", coap_socket_strerror());
       goto error;
     } else {
       struct cmsghdr *cmsg;
 
+#if !defined(_WIN32) && defined(MSG_TRUNC)
+      if (mhdr.msg_flags & MSG_TRUNC) {
+	warn("coap_network_read: discarded datagram larger than %zu bytes\n",
+	     packet->size);
+	return 0;
+      }
+#endif /* MSG_TRUNC */
       packet->src.size = mhdr.msg_namelen;
       packet->length = (size_t)len;
 
@@ -654,7 +859,7 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 #endif /* NDEBUG */
 
       (*packet)->length = len;
-      memcpy(&(*packet)->payload, uip_appdata, len);
+      memcpy((*packet)->payload, uip_appdata, len);
     }
 
 #undef UIP_IP_BUF
@@ -675,6 +880,34 @@ error:
 
 #if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
 
+/* Releases the DTLS state of session s if it has been idle for the
+ * dtls_idle_timeout of its context. Returns the time when it will be
+ * released otherwise, or 0. The session itself is kept with whatever
+ * depends on it. A client connects again when it sends, a server session
+ * waits for its client to do so and is freed as any other when it has
+ * timed out. */
+static coap_tick_t
+coap_check_dtls_idle(coap_session_t *s, coap_tick_t now) {
+  coap_tick_t release;
+
+  if (s->proto != COAP_PROTO_DTLS || s->context->dtls_idle_timeout == 0
+      || s->state != COAP_SESSION_STATE_ESTABLISHED || s->sendqueue)
+    return 0;
+
+  release = s->last_rx_tx
+    + (coap_tick_t)s->context->dtls_idle_timeout * COAP_TICKS_PER_SECOND;
+  if (release > now)
+    return release;
+
+  debug("*** %s: DTLS state released when idle\n", coap_session_str(s));
+  coap_dtls_free_session(s);
+  s->tls = NULL;
+  s->state = COAP_SESSION_STATE_NONE;
+  if (s->type == COAP_SESSION_TYPE_SERVER)
+    s->tls_released = 1;
+  return 0;
+}
+
 unsigned int
 coap_write(coap_context_t *ctx,
            coap_socket_t *sockets[],
@@ -686,7 +919,10 @@ coap_write(coap_context_t *ctx,
   coap_endpoint_t *ep;
   coap_session_t *s;
   coap_tick_t session_timeout;
+  coap_tick_t async_timeout;
+  coap_tick_t idle_timeout;
   coap_tick_t timeout = 0;
+  coap_socket_t *completion_sock;
 
   *num_sockets = 0;
 
@@ -701,8 +937,13 @@ coap_write(coap_context_t *ctx,
       if (*num_sockets < max_sockets)
         sockets[(*num_sockets)++] = &ep->sock;
     }
-    LL_FOREACH_SAFE(ctx->endpoint->sessions, s, tmp) {
-      if (s->type == COAP_SESSION_TYPE_SERVER && s->ref == 0 && s->sendqueue == NULL && (s->last_rx_tx + session_timeout <= now || s->state == COAP_SESSION_STATE_NONE)) {
+    LL_FOREACH_SAFE(ep->sessions, s, tmp) {
+      coap_tick_t q_block_timeout;
+
+      idle_timeout = coap_check_dtls_idle(s, now);
+      if (idle_timeout > 0 && (timeout == 0 || idle_timeout - now < timeout))
+        timeout = idle_timeout - now;
+      if (s->type == COAP_SESSION_TYPE_SERVER && s->ref == 0 && s->sendqueue == NULL && (s->last_rx_tx + session_timeout <= now || (s->state == COAP_SESSION_STATE_NONE && !s->tls_released))) {
         coap_session_free(s);
       } else {
         if (s->type == COAP_SESSION_TYPE_SERVER && s->ref == 0 && s->sendqueue == NULL) {
@@ -714,14 +955,52 @@ coap_write(coap_context_t *ctx,
           if (*num_sockets < max_sockets)
             sockets[(*num_sockets)++] = &s->sock;
         }
+
+        /* report missing Q-Block1 blocks, push Q-Block2 sets */
+        q_block_timeout = coap_q_block_check_timeouts(s, now);
+        if (q_block_timeout > 0 && (timeout == 0 || q_block_timeout - now < timeout))
+          timeout = q_block_timeout - now;
       }
     }
   }
   LL_FOREACH(ctx->sessions, s) {
+    coap_tick_t q_block_timeout;
+
+    idle_timeout = coap_check_dtls_idle(s, now);
+    if (idle_timeout > 0 && (timeout == 0 || idle_timeout - now < timeout))
+      timeout = idle_timeout - now;
+
     if (s->sock.flags & (COAP_SOCKET_WANT_DATA | COAP_SOCKET_WANT_WRITE)) {
       if (*num_sockets < max_sockets)
         sockets[(*num_sockets)++] = &s->sock;
     }
+
+    /* request missing blocks of Q-Block transfers */
+    q_block_timeout = coap_q_block_check_timeouts(s, now);
+    if (q_block_timeout > 0 && (timeout == 0 || q_block_timeout - now < timeout))
+      timeout = q_block_timeout - now;
+  }
+
+  completion_sock = coap_completion_queue_socket(ctx);
+  if (completion_sock && *num_sockets < max_sockets)
+    sockets[(*num_sockets)++] = completion_sock;
+
+  if (ctx->dtls_context) {
+    coap_socket_t *worker_sock = coap_dtls_get_worker_socket(ctx->dtls_context);
+    if (worker_sock && *num_sockets < max_sockets)
+      sockets[(*num_sockets)++] = worker_sock;
+  }
+
+  /* release asynchronous states that have not been completed in time */
+  async_timeout = coap_check_async_timeouts(ctx, now);
+  if (async_timeout > 0 && (timeout == 0 || async_timeout - now < timeout))
+    timeout = async_timeout - now;
+
+  /* reload the key file of the keystore when it has changed */
+  if (ctx->keystore) {
+    coap_tick_t keystore_timeout = coap_keystore_check_timeout(ctx->keystore, now);
+    if (keystore_timeout > 0 && (timeout == 0 || keystore_timeout - now < timeout))
+      timeout = keystore_timeout - now;
   }
 
   nextpdu = coap_peek_next(ctx);
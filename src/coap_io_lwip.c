@@ -58,6 +58,9 @@ static void coap_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_
 	/** FIXME derive the context without changing endpoint definition */
 	coap_handle_message(ep->context, packet);
 
+	/* there is no read loop to collect requests for batch handlers */
+	coap_batch_flush(ep->context);
+
 	coap_free_packet(packet);
 }
 
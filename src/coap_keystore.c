@@ -0,0 +1,460 @@
+/* coap_keystore.c -- store of pre-shared keys for DTLS servers
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "coap.h"
+#include "coap_keystore.h"
+#include "debug.h"
+#include "mem.h"
+#include "uthash.h"
+
+#ifndef WITHOUT_KEYSTORE
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+/* The keystore may be used by the DTLS handshake workers. */
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#include <pthread.h>
+#define KEYSTORE_LOCK(Keystore) pthread_mutex_lock(&(Keystore)->lock)
+#define KEYSTORE_UNLOCK(Keystore) pthread_mutex_unlock(&(Keystore)->lock)
+#else /* HAVE_PTHREAD_H && !_WIN32 */
+#define KEYSTORE_LOCK(Keystore)
+#define KEYSTORE_UNLOCK(Keystore)
+#endif /* HAVE_PTHREAD_H && !_WIN32 */
+
+/** Maximum length of a line in a key file. */
+#define KEYSTORE_MAX_LINE 512
+
+/** The key of an identity. */
+typedef struct keystore_entry_t {
+  UT_hash_handle hh;
+  coap_tick_t expires;          /**< end of lifetime of a cached result */
+  int from_file;                /**< set if loaded from the key file */
+  size_t identity_len;          /**< length of the identity */
+  size_t key_len;               /**< length of the key, 0 if unknown */
+  uint8_t data[];               /**< the identity followed by the key */
+} keystore_entry_t;
+
+struct coap_keystore_t {
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+  pthread_mutex_t lock;
+#endif /* HAVE_PTHREAD_H && !_WIN32 */
+  unsigned int ref;             /**< references besides the owner's */
+  keystore_entry_t *keys;       /**< added and loaded keys */
+  keystore_entry_t *cache;      /**< results of lookup, oldest first */
+  coap_keystore_lookup_t lookup; /**< looks up unknown identities */
+  void *lookup_arg;             /**< argument for lookup */
+  unsigned int cache_size;      /**< maximum number of entries in cache */
+  coap_tick_t lifetime;         /**< lifetime of an entry in cache */
+  char *path;                   /**< name of the key file */
+  coap_tick_t last_check;       /**< time the key file was last checked */
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;               /**< status of the file when loaded */
+#endif /* HAVE_SYS_STAT_H */
+};
+
+static keystore_entry_t *
+keystore_new_entry(const uint8_t *identity, size_t identity_len,
+                   const uint8_t *key, size_t key_len) {
+  keystore_entry_t *entry;
+
+  entry = (keystore_entry_t *)
+    coap_malloc(sizeof(keystore_entry_t) + identity_len + key_len);
+  if (!entry)
+    return NULL;
+  memset(entry, 0, sizeof(keystore_entry_t));
+  entry->identity_len = identity_len;
+  entry->key_len = key_len;
+  memcpy(entry->data, identity, identity_len);
+  if (key_len)
+    memcpy(entry->data + identity_len, key, key_len);
+  return entry;
+}
+
+/** Adds @p entry to @p table, replacing an entry with the same identity. */
+static void
+keystore_put(keystore_entry_t **table, keystore_entry_t *entry) {
+  keystore_entry_t *old;
+
+  HASH_FIND(hh, *table, entry->data, entry->identity_len, old);
+  if (old) {
+    HASH_DELETE(hh, *table, old);
+    coap_free(old);
+  }
+  HASH_ADD_KEYPTR(hh, *table, entry->data, entry->identity_len, entry);
+}
+
+static void
+keystore_clear(keystore_entry_t **table) {
+  keystore_entry_t *entry, *tmp;
+
+  HASH_ITER(hh, *table, entry, tmp) {
+    HASH_DELETE(hh, *table, entry);
+    coap_free(entry);
+  }
+}
+
+coap_keystore_t *
+coap_new_keystore(void) {
+  coap_keystore_t *keystore;
+
+  keystore = (coap_keystore_t *)coap_malloc(sizeof(coap_keystore_t));
+  if (!keystore) {
+    coap_log(LOG_WARNING, "coap_new_keystore: insufficient memory\n");
+    return NULL;
+  }
+  memset(keystore, 0, sizeof(coap_keystore_t));
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+  pthread_mutex_init(&keystore->lock, NULL);
+#endif /* HAVE_PTHREAD_H && !_WIN32 */
+  return keystore;
+}
+
+coap_keystore_t *
+coap_keystore_reference(coap_keystore_t *keystore) {
+  KEYSTORE_LOCK(keystore);
+  keystore->ref++;
+  KEYSTORE_UNLOCK(keystore);
+  return keystore;
+}
+
+void
+coap_free_keystore(coap_keystore_t *keystore) {
+  if (!keystore)
+    return;
+
+  KEYSTORE_LOCK(keystore);
+  if (keystore->ref > 0) {
+    keystore->ref--;
+    KEYSTORE_UNLOCK(keystore);
+    return;
+  }
+  KEYSTORE_UNLOCK(keystore);
+
+  keystore_clear(&keystore->keys);
+  keystore_clear(&keystore->cache);
+  if (keystore->path)
+    coap_free(keystore->path);
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+  pthread_mutex_destroy(&keystore->lock);
+#endif /* HAVE_PTHREAD_H && !_WIN32 */
+  coap_free(keystore);
+}
+
+int
+coap_keystore_add(coap_keystore_t *keystore,
+                  const uint8_t *identity, size_t identity_len,
+                  const uint8_t *key, size_t key_len) {
+  keystore_entry_t *entry;
+
+  if (key_len == 0 || key_len > COAP_KEYSTORE_MAX_KEY_LENGTH)
+    return 0;
+
+  entry = keystore_new_entry(identity, identity_len, key, key_len);
+  if (!entry)
+    return 0;
+
+  KEYSTORE_LOCK(keystore);
+  keystore_put(&keystore->keys, entry);
+  KEYSTORE_UNLOCK(keystore);
+  return 1;
+}
+
+int
+coap_keystore_remove(coap_keystore_t *keystore,
+                     const uint8_t *identity, size_t identity_len) {
+  keystore_entry_t *entry;
+
+  KEYSTORE_LOCK(keystore);
+  HASH_FIND(hh, keystore->keys, identity, identity_len, entry);
+  if (entry)
+    HASH_DELETE(hh, keystore->keys, entry);
+  KEYSTORE_UNLOCK(keystore);
+
+  if (!entry)
+    return 0;
+  coap_free(entry);
+  return 1;
+}
+
+/** Returns the value of the hexadecimal digit @p c. */
+static int
+hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  return tolower((unsigned char)c) - 'a' + 10;
+}
+
+/**
+ * Parses a line of a key file into @p entry. Returns @c 1 on success,
+ * @c 0 for an empty line or a comment and @c -1 on error.
+ */
+static int
+keystore_parse_line(char *line, keystore_entry_t **entry) {
+  uint8_t key[COAP_KEYSTORE_MAX_KEY_LENGTH];
+  char *identity, *hex;
+  size_t identity_len, hex_len, n;
+
+  identity = line + strspn(line, " \t");
+  if (*identity == '#' || *identity == '\r' || *identity == '\n'
+      || *identity == '\0')
+    return 0;
+
+  identity_len = strcspn(identity, " \t\r\n");
+  hex = identity + identity_len;
+  hex += strspn(hex, " \t");
+  hex_len = strspn(hex, "0123456789abcdefABCDEF");
+  if (hex_len == 0 || hex_len % 2 || hex_len / 2 > sizeof(key)
+      || hex[hex_len + strspn(hex + hex_len, " \t\r\n")] != '\0')
+    return -1;
+
+  for (n = 0; n < hex_len / 2; n++)
+    key[n] = (uint8_t)(hex_value(hex[2 * n]) << 4 | hex_value(hex[2 * n + 1]));
+
+  *entry = keystore_new_entry((const uint8_t *)identity, identity_len,
+                              key, hex_len / 2);
+  if (!*entry)
+    return -1;
+  (*entry)->from_file = 1;
+  return 1;
+}
+
+/**
+ * Loads the key file of @p keystore, which must be locked. Returns the
+ * number of keys loaded or @c -1 on error.
+ */
+static int
+keystore_load(coap_keystore_t *keystore) {
+  keystore_entry_t *loaded = NULL, *entry, *tmp;
+  char line[KEYSTORE_MAX_LINE];
+  unsigned int lineno = 0;
+  int count = 0, result = 0;
+  FILE *fp;
+
+#ifdef HAVE_SYS_STAT_H
+  if (stat(keystore->path, &keystore->st) < 0)
+    return -1;
+#endif /* HAVE_SYS_STAT_H */
+
+  fp = fopen(keystore->path, "r");
+  if (!fp)
+    return -1;
+
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    if (!strchr(line, '\n') && !feof(fp))
+      result = -1;		/* line too long */
+    else
+      result = keystore_parse_line(line, &entry);
+    if (result < 0)
+      break;
+    if (result > 0)
+      keystore_put(&loaded, entry);
+  }
+  fclose(fp);
+
+  if (result < 0) {
+    coap_log(LOG_WARNING, "%s:%u: invalid key\n", keystore->path, lineno);
+    keystore_clear(&loaded);
+    return -1;
+  }
+
+  /* replace the keys of the previous version */
+  HASH_ITER(hh, keystore->keys, entry, tmp) {
+    if (entry->from_file) {
+      HASH_DELETE(hh, keystore->keys, entry);
+      coap_free(entry);
+    }
+  }
+  HASH_ITER(hh, loaded, entry, tmp) {
+    HASH_DELETE(hh, loaded, entry);
+    keystore_put(&keystore->keys, entry);
+    count++;
+  }
+  return count;
+}
+
+int
+coap_keystore_load_file(coap_keystore_t *keystore, const char *path) {
+  size_t path_len = strlen(path);
+  char *old_path, *new_path;
+  int result;
+
+  new_path = (char *)coap_malloc(path_len + 1);
+  if (!new_path)
+    return -1;
+  memcpy(new_path, path, path_len + 1);
+
+  KEYSTORE_LOCK(keystore);
+  old_path = keystore->path;
+  keystore->path = new_path;
+  result = keystore_load(keystore);
+  if (result < 0) {
+    keystore->path = old_path;
+    old_path = new_path;
+  } else {
+    coap_ticks(&keystore->last_check);
+  }
+  KEYSTORE_UNLOCK(keystore);
+
+  if (old_path)
+    coap_free(old_path);
+  return result;
+}
+
+/** Checks the key file of @p keystore, which must be locked. */
+static int
+keystore_check_file(coap_keystore_t *keystore) {
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;
+
+  if (!keystore->path || stat(keystore->path, &st) < 0
+      || (st.st_size == keystore->st.st_size
+          && st.st_mtime == keystore->st.st_mtime
+          && st.st_ino == keystore->st.st_ino))
+    return 0;
+
+  if (keystore_load(keystore) < 0)
+    return 0;
+  debug("loaded key file %s\n", keystore->path);
+  return 1;
+#else /* HAVE_SYS_STAT_H */
+  (void)keystore;
+  return 0;
+#endif /* HAVE_SYS_STAT_H */
+}
+
+int
+coap_keystore_check_file(coap_keystore_t *keystore) {
+  int result;
+
+  KEYSTORE_LOCK(keystore);
+  result = keystore_check_file(keystore);
+  coap_ticks(&keystore->last_check);
+  KEYSTORE_UNLOCK(keystore);
+  return result;
+}
+
+coap_tick_t
+coap_keystore_check_timeout(coap_keystore_t *keystore, coap_tick_t now) {
+  coap_tick_t next = 0;
+
+  KEYSTORE_LOCK(keystore);
+  if (keystore->path) {
+    if (now - keystore->last_check
+        >= COAP_KEYSTORE_CHECK_INTERVAL * COAP_TICKS_PER_SECOND) {
+      keystore->last_check = now;
+      keystore_check_file(keystore);
+    }
+    next = keystore->last_check
+      + COAP_KEYSTORE_CHECK_INTERVAL * COAP_TICKS_PER_SECOND;
+  }
+  KEYSTORE_UNLOCK(keystore);
+  return next;
+}
+
+void
+coap_keystore_set_lookup(coap_keystore_t *keystore,
+                         coap_keystore_lookup_t lookup, void *arg,
+                         unsigned int cache_size, unsigned int lifetime) {
+  KEYSTORE_LOCK(keystore);
+  keystore->lookup = lookup;
+  keystore->lookup_arg = arg;
+  keystore->cache_size = cache_size;
+  keystore->lifetime = (coap_tick_t)lifetime * COAP_TICKS_PER_SECOND;
+  keystore_clear(&keystore->cache);
+  KEYSTORE_UNLOCK(keystore);
+}
+
+/** Copies the key of @p entry to @p key if it fits. */
+static size_t
+keystore_copy_key(const keystore_entry_t *entry,
+                  uint8_t *key, size_t max_key_len) {
+  if (entry->key_len == 0 || entry->key_len > max_key_len)
+    return 0;
+  memcpy(key, entry->data + entry->identity_len, entry->key_len);
+  return entry->key_len;
+}
+
+size_t
+coap_keystore_lookup(coap_keystore_t *keystore,
+                     const uint8_t *identity, size_t identity_len,
+                     uint8_t *key, size_t max_key_len) {
+  uint8_t buf[COAP_KEYSTORE_MAX_KEY_LENGTH];
+  keystore_entry_t *entry;
+  coap_keystore_lookup_t lookup;
+  void *lookup_arg;
+  size_t key_len;
+  coap_tick_t now;
+
+  coap_ticks(&now);
+
+  KEYSTORE_LOCK(keystore);
+  HASH_FIND(hh, keystore->keys, identity, identity_len, entry);
+  if (!entry) {
+    HASH_FIND(hh, keystore->cache, identity, identity_len, entry);
+    if (entry && entry->expires <= now) {
+      HASH_DELETE(hh, keystore->cache, entry);
+      coap_free(entry);
+      entry = NULL;
+    } else if (entry) {
+      /* the cache is kept in order of use */
+      HASH_DELETE(hh, keystore->cache, entry);
+      HASH_ADD_KEYPTR(hh, keystore->cache, entry->data, entry->identity_len,
+                      entry);
+    }
+  }
+  if (entry || !keystore->lookup) {
+    key_len = entry ? keystore_copy_key(entry, key, max_key_len) : 0;
+    KEYSTORE_UNLOCK(keystore);
+    return key_len;
+  }
+  lookup = keystore->lookup;
+  lookup_arg = keystore->lookup_arg;
+  KEYSTORE_UNLOCK(keystore);
+
+  /* the lookup function may block */
+  key_len = lookup(identity, identity_len, buf, sizeof(buf), lookup_arg);
+  if (key_len > sizeof(buf))
+    key_len = 0;
+
+  KEYSTORE_LOCK(keystore);
+  if (keystore->cache_size > 0 && keystore->lookup == lookup) {
+    entry = keystore_new_entry(identity, identity_len, buf, key_len);
+    if (entry) {
+      entry->expires = now + keystore->lifetime;
+      keystore_put(&keystore->cache, entry);
+      while (HASH_COUNT(keystore->cache) > keystore->cache_size) {
+        entry = keystore->cache;
+        HASH_DELETE(hh, keystore->cache, entry);
+        coap_free(entry);
+      }
+    }
+  }
+  KEYSTORE_UNLOCK(keystore);
+
+  if (key_len > max_key_len)
+    return 0;
+  if (key_len)
+    memcpy(key, buf, key_len);
+  return key_len;
+}
+
+void
+coap_context_set_keystore(coap_context_t *context, coap_keystore_t *keystore) {
+  if (context->keystore && context->keystore != keystore)
+    coap_free_keystore(context->keystore);
+  context->keystore = keystore;
+}
+
+#endif /* WITHOUT_KEYSTORE */
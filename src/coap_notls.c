@@ -13,6 +13,8 @@
 
 #include "coap_dtls.h"
 
+#include <string.h>
+
 #ifdef __GNUC__
 #define UNUSED __attribute__((unused))
 #else /* __GNUC__ */
@@ -102,6 +104,56 @@ coap_dtls_hello(coap_session_t *session UNUSED,
   return 0;
 }
 
+int
+coap_dtls_get_handshake_stats(struct coap_context_t *coap_context UNUSED,
+  coap_dtls_handshake_stats_t *stats
+) {
+  memset(stats, 0, sizeof(coap_dtls_handshake_stats_t));
+  return 0;
+}
+
+int
+coap_dtls_set_handshake_workers(struct coap_context_t *coap_context UNUSED,
+  unsigned int count UNUSED
+) {
+  return 0;
+}
+
+coap_socket_t *coap_dtls_get_worker_socket(void *dtls_context UNUSED) {
+  return NULL;
+}
+
+void coap_dtls_handle_workers(void *dtls_context UNUSED) {
+}
+
+int
+coap_dtls_set_ciphers(struct coap_context_t *coap_context UNUSED,
+  const char *ciphers UNUSED,
+  int server_preference UNUSED
+) {
+  return 0;
+}
+
+int
+coap_dtls_set_low_memory(struct coap_context_t *coap_context UNUSED,
+  int enable UNUSED,
+  unsigned int idle_timeout UNUSED
+) {
+  return 0;
+}
+
+size_t coap_dtls_estimate_session_memory(coap_session_t *session UNUSED) {
+  return 0;
+}
+
+const char *coap_dtls_get_cipher(coap_session_t *session UNUSED) {
+  return NULL;
+}
+
+const char *coap_dtls_get_library(void) {
+  return "none";
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *session) {
   return 0;
 }
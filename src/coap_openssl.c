@@ -12,21 +12,80 @@
 #ifdef HAVE_OPENSSL
 
 #include "coap_dtls.h"
+#include "coap_keystore.h"
 #include "mem.h"
 #include "debug.h"
 #include "prng.h"
+#include "utlist.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
 #include <openssl/hmac.h>
+#include <openssl/evp.h>
+
+/* Handshakes are run by worker threads where POSIX threads are available. */
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#define COAP_DTLS_WORKERS
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif /* HAVE_PTHREAD_H && !_WIN32 */
+
+/* The cipher suites offered unless set with coap_dtls_set_ciphers(). */
+#define COAP_OPENSSL_CIPHERS "TLSv1.2:TLSv1.0"
+
+struct coap_dtls_pool_t;
+struct coap_ssl_st;
+
+/* Length of the digest that identifies the credentials of a client. */
+#define COAP_DTLS_PEER_ID_LENGTH 32
+
+/* A session kept by a client to resume it with the same server, from the
+ * same local interface and with the same PSK identity and key. */
+typedef struct coap_dtls_peer_session_t {
+  struct coap_dtls_peer_session_t *next;
+  coap_address_t remote_addr;
+  uint8_t peer_id[COAP_DTLS_PEER_ID_LENGTH];
+  SSL_SESSION *session;
+} coap_dtls_peer_session_t;
+
+/* The state of a session for the BIO of its SSL object. It is kept in
+ * the session, or in the job of its handshake while that is run by the
+ * workers, and outlives the SSL object. */
+typedef struct coap_ssl_st {
+  coap_session_t *session;
+  const void *pdu;
+  unsigned pdu_len;
+  unsigned peekmode;
+  coap_tick_t timeout;
+  struct coap_dtls_job_t *job;	/* set while the handshake is run by workers */
+  struct coap_dtls_context_t *dtls; /* set while in the timers of dtls */
+  size_t timer_index;		/* in the timers of dtls */
+  struct coap_dtls_context_t *reserved; /* that has an entry reserved for data */
+  int buffers_released;		/* set while the SSL holds no record buffers */
+  coap_pdu_t *rx_pdu;		/* receives the next plaintext record */
+  uint8_t peer_id[COAP_DTLS_PEER_ID_LENGTH]; /* credentials of a client */
+} coap_ssl_data;
 
 /* This structure encapsulates the OpenSSL context object. */
 typedef struct coap_dtls_context_t {
   SSL_CTX *ctx;
   SSL *ssl;	/* OpenSSL object for listening to connection requests */
+  coap_ssl_data listen_data;	/* of ssl until a session takes it over */
   HMAC_CTX *cookie_hmac;
   BIO_METHOD *meth;
   BIO_ADDR *bio_addr;
+  coap_dtls_peer_session_t *peer_sessions; /* most recent first */
+  unsigned int peer_session_count;
+  coap_dtls_handshake_stats_t stats;
+  struct coap_dtls_pool_t *pool; /* handshake workers, if enabled */
+  struct coap_ssl_st **timers;	/* running retransmission timers, a binary
+				 * heap with the earliest first */
+  size_t timer_count;		/* entries used in timers */
+  size_t timer_size;		/* entries allocated for timers */
+  size_t timer_reserved;	/* entries reserved for sessions */
+  int low_memory;		/* set by coap_dtls_set_low_memory() */
 } coap_dtls_context_t;
 
 int coap_dtls_is_supported(void) {
@@ -48,22 +107,182 @@ int coap_dtls_get_log_level(void) {
   return dtls_log_level;
 }
 
-typedef struct coap_ssl_st {
+/* A datagram passed to or from a handshake worker. */
+typedef struct coap_dtls_record_t {
+  struct coap_dtls_record_t *next;
+  size_t length;
+  uint8_t data[];
+} coap_dtls_record_t;
+
+#define COAP_DTLS_JOB_IDLE    0	/* owned by the loop thread */
+#define COAP_DTLS_JOB_QUEUED  1	/* waiting for a worker */
+#define COAP_DTLS_JOB_RUNNING 2	/* owned by a worker */
+#define COAP_DTLS_JOB_DONE    3	/* waiting for the loop thread */
+
+#define COAP_DTLS_LOOKUP_NONE     0 /* no key asked for */
+#define COAP_DTLS_LOOKUP_QUEUED   1 /* in the lookups of the pool */
+#define COAP_DTLS_LOOKUP_ANSWERED 2 /* psk set by the loop thread */
+
+/* The handshake of a server session while it is run by the workers. The
+ * loop thread gives one record at a time to a worker, which owns the SSL
+ * object until it has processed the record. Whatever the worker would
+ * send or report is kept until the loop thread takes the job back. */
+typedef struct coap_dtls_job_t {
+  struct coap_dtls_job_t *next;	/* in the pending, lookups or done list of
+				 * the pool */
+  struct coap_dtls_pool_t *pool;
+  SSL *ssl;
   coap_session_t *session;
-  const void *pdu;
-  unsigned pdu_len;
-  unsigned peekmode;
-  coap_tick_t timeout;
-} coap_ssl_data;
+  int state;			/* COAP_DTLS_JOB_*, changed with the pool locked */
+  int busy;			/* set while not idle, read by the loop thread only */
+  int abandoned;		/* set when the session is released while running */
+  int in_worker;		/* set while a worker processes the record */
+  coap_dtls_record_t *record;	/* the record to process or NULL to start */
+  coap_dtls_record_t *backlog;	/* records received while busy */
+  coap_dtls_record_t *out;	/* datagrams to send */
+  coap_dtls_record_t *plaintext; /* application data decrypted, if any */
+  int result;			/* 1 when finished, -1 on error, 0 otherwise */
+  int event;			/* DTLS event or -1 */
+  int default_psk;		/* set if the context has the default PSK
+				 * callback, which the worker does itself */
+  struct coap_keystore_t *keystore; /* referenced from the context */
+  int lookup;			/* COAP_DTLS_LOOKUP_*, changed with the pool
+				 * locked */
+  uint8_t identity[PSK_MAX_IDENTITY_LEN]; /* to look up by the loop thread */
+  size_t identity_len;
+  uint8_t psk[PSK_MAX_PSK_LEN];	/* the key of the context or looked up by
+				 * the loop thread */
+  size_t psk_len;
+  uint8_t cookie[32];		/* computed for the session by the loop thread */
+  unsigned int cookie_len;
+  coap_ssl_data data;		/* of the session while its job runs */
+} coap_dtls_job_t;
+
+static void
+coap_dtls_timer_set(coap_dtls_context_t *dtls, size_t i, coap_ssl_data *data) {
+  dtls->timers[i] = data;
+  data->timer_index = i;
+}
+
+/* Moves the timer at index i up or down the heap to its place. */
+static void
+coap_dtls_timer_sift(coap_dtls_context_t *dtls, size_t i) {
+  coap_ssl_data *data = dtls->timers[i];
+  size_t child;
+
+  while (i > 0 && dtls->timers[(i - 1) / 2]->timeout > data->timeout) {
+    coap_dtls_timer_set(dtls, i, dtls->timers[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  while ((child = 2 * i + 1) < dtls->timer_count) {
+    if (child + 1 < dtls->timer_count
+        && dtls->timers[child + 1]->timeout < dtls->timers[child]->timeout)
+      child++;
+    if (dtls->timers[child]->timeout >= data->timeout)
+      break;
+    coap_dtls_timer_set(dtls, i, dtls->timers[child]);
+    i = child;
+  }
+  coap_dtls_timer_set(dtls, i, data);
+}
+
+static void
+coap_dtls_timer_cancel(coap_ssl_data *data) {
+  coap_dtls_context_t *dtls = data->dtls;
+
+  if (dtls) {
+    coap_ssl_data *last = dtls->timers[--dtls->timer_count];
+    if (last != data) {
+      coap_dtls_timer_set(dtls, data->timer_index, last);
+      coap_dtls_timer_sift(dtls, data->timer_index);
+    }
+    data->dtls = NULL;
+  }
+}
+
+/* Reserves an entry in the timers of dtls for the session of data, so
+ * that its retransmission timer can always be started. Returns 0 if the
+ * timers cannot grow. */
+static int
+coap_dtls_timer_reserve(coap_dtls_context_t *dtls, coap_ssl_data *data) {
+  if (data->reserved)
+    return 1;
+  if (dtls->timer_reserved == dtls->timer_size) {
+    size_t size = dtls->timer_size ? 2 * dtls->timer_size : 16;
+    struct coap_ssl_st **timers = (struct coap_ssl_st **)
+      coap_malloc(size * sizeof(struct coap_ssl_st *));
+    if (!timers) {
+      coap_log(LOG_WARNING, "coap_dtls_timer_reserve: insufficient memory\n");
+      return 0;
+    }
+    if (dtls->timer_count)
+      memcpy(timers, dtls->timers,
+             dtls->timer_count * sizeof(struct coap_ssl_st *));
+    coap_free(dtls->timers);
+    dtls->timers = timers;
+    dtls->timer_size = size;
+  }
+  dtls->timer_reserved++;
+  data->reserved = dtls;
+  return 1;
+}
+
+static void
+coap_dtls_timer_release(coap_ssl_data *data) {
+  coap_dtls_timer_cancel(data);
+  if (data->reserved) {
+    data->reserved->timer_reserved--;
+    data->reserved = NULL;
+  }
+}
+
+/* Keeps the session of data in the timers of its context while its
+ * retransmission timer is running, in the entry reserved for it. */
+static void
+coap_dtls_timer_update(coap_ssl_data *data) {
+  coap_dtls_context_t *dtls = data->reserved;
+
+  if (!data->timeout || !dtls || !data->session
+      || data->session->type == COAP_SESSION_TYPE_HELLO) {
+    coap_dtls_timer_cancel(data);
+    return;
+  }
 
+  if (!data->dtls) {
+    assert(dtls->timer_count < dtls->timer_size);
+    data->dtls = dtls;
+    coap_dtls_timer_set(dtls, dtls->timer_count++, data);
+  }
+  coap_dtls_timer_sift(dtls, data->timer_index);
+}
+
+/* The state of a session must fit into the space it has for it. */
+typedef char coap_ssl_data_fits[sizeof(coap_ssl_data)
+                                <= COAP_DTLS_SESSION_DATA_SIZE ? 1 : -1];
+
+static coap_ssl_data *
+coap_dtls_session_data(coap_session_t *session) {
+  return (coap_ssl_data *)session->tls_data.data;
+}
+
+/* Moves the state of the BIO of ssl to data, with its timer. */
+static void
+coap_dtls_move_data(SSL *ssl, coap_ssl_data *data) {
+  coap_ssl_data *from = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+  int running = from->dtls != NULL;
+
+  coap_dtls_timer_cancel(from);
+  *data = *from;
+  memset(from, 0, sizeof(coap_ssl_data));
+  BIO_set_data(SSL_get_rbio(ssl), data);
+  if (running)
+    coap_dtls_timer_update(data);
+}
+
+/* The state of the BIO is set by whoever creates the SSL object. */
 static int coap_dgram_create(BIO *a) {
-  coap_ssl_data *data = NULL;
-  data = malloc(sizeof(coap_ssl_data));
-  if (data == NULL)
-    return 0;
   BIO_set_init(a, 1);
-  BIO_set_data(a, data);
-  memset(data, 0x00, sizeof(coap_ssl_data));
+  BIO_set_data(a, NULL);
   return 1;
 }
 
@@ -72,8 +291,12 @@ static int coap_dgram_destroy(BIO *a) {
   if (a == NULL)
     return 0;
   data = (coap_ssl_data *)BIO_get_data(a);
-  if (data != NULL)
-    free(data);
+  if (data != NULL) {
+    coap_dtls_timer_release(data);
+    coap_delete_pdu(data->rx_pdu);
+    data->rx_pdu = NULL;
+    BIO_set_data(a, NULL);
+  }
   return 1;
 }
 
@@ -108,7 +331,18 @@ static int coap_dgram_write(BIO *a, const char *in, int inl) {
   int ret = 0;
   coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(a);
 
-  if (data->session) {
+  if (data->job && data->job->in_worker) {
+    /* sent by the loop thread when it takes the job back */
+    coap_dtls_record_t *record = (coap_dtls_record_t *)
+      coap_malloc(sizeof(coap_dtls_record_t) + (size_t)inl);
+    BIO_clear_retry_flags(a);
+    if (!record)
+      return -1;
+    record->length = (size_t)inl;
+    memcpy(record->data, in, (size_t)inl);
+    LL_APPEND(data->job->out, record);
+    ret = inl;
+  } else if (data->session) {
     ret = (int)coap_session_send(data->session, (unsigned char*)in, (size_t)inl);
     BIO_clear_retry_flags(a);
     if (ret <= 0)
@@ -159,7 +393,13 @@ static long coap_dgram_ctrl(BIO *a, int cmd, long num, void *ptr) {
     ret = 1;
     break;
   case BIO_CTRL_DGRAM_SET_NEXT_TIMEOUT:
-    data->timeout = coap_ticks_from_rt_us((uint64_t)((struct timeval*)ptr)->tv_sec * 1000000 + ((struct timeval*)ptr)->tv_usec);
+    if (((struct timeval*)ptr)->tv_sec == 0 && ((struct timeval*)ptr)->tv_usec == 0)
+      data->timeout = 0;		/* stopped */
+    else
+      data->timeout = coap_ticks_from_rt_us((uint64_t)((struct timeval*)ptr)->tv_sec * 1000000 + ((struct timeval*)ptr)->tv_usec);
+    /* the timers of a busy handshake are updated when it is taken back */
+    if (!data->job || !data->job->in_worker)
+      coap_dtls_timer_update(data);
     ret = 1;
     break;
   case BIO_CTRL_RESET:
@@ -197,7 +437,15 @@ static int coap_dtls_verify_cert(int ok, X509_STORE_CTX *ctx) {
 static int coap_dtls_generate_cookie(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len) {
   coap_dtls_context_t *dtls = (coap_dtls_context_t *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
   coap_ssl_data *data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
-  int r = HMAC_Init_ex(dtls->cookie_hmac, NULL, 0, NULL, NULL);
+  int r;
+
+  if (data->job && data->job->in_worker) {
+    /* a worker must not look into the session nor use cookie_hmac */
+    memcpy(cookie, data->job->cookie, data->job->cookie_len);
+    *cookie_len = data->job->cookie_len;
+    return data->job->cookie_len > 0;
+  }
+  r = HMAC_Init_ex(dtls->cookie_hmac, NULL, 0, NULL, NULL);
   r &= HMAC_Update(dtls->cookie_hmac, (const uint8_t*)&data->session->local_addr.addr, (size_t)data->session->local_addr.size);
   r &= HMAC_Update(dtls->cookie_hmac, (const uint8_t*)&data->session->remote_addr.addr, (size_t)data->session->remote_addr.size);
   r &= HMAC_Final(dtls->cookie_hmac, cookie, cookie_len);
@@ -213,6 +461,68 @@ static int coap_dtls_verify_cookie(SSL *ssl, const unsigned char *cookie, unsign
     return 0;
 }
 
+/* Computes the digest of the local interface of session and of the PSK
+ * identity and key of a client, which must match for a session to be
+ * resumed. */
+static void
+coap_dtls_peer_id(const coap_session_t *session,
+                  const uint8_t *identity, size_t identity_len,
+                  const uint8_t *key, size_t key_len,
+                  uint8_t peer_id[COAP_DTLS_PEER_ID_LENGTH]) {
+  EVP_MD_CTX *md = EVP_MD_CTX_new();
+  const coap_address_t *local = &session->local_addr;
+  uint8_t len[sizeof(size_t)];
+  unsigned int n;
+  int r = md != NULL;
+
+  r = r && EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+  /* the interface, not the port which changes with each session */
+  switch (local->addr.sa.sa_family) {
+  case AF_INET:
+    r = r && EVP_DigestUpdate(md, &local->addr.sin.sin_addr,
+                              sizeof(local->addr.sin.sin_addr));
+    break;
+  case AF_INET6:
+    r = r && EVP_DigestUpdate(md, &local->addr.sin6.sin6_addr,
+                              sizeof(local->addr.sin6.sin6_addr));
+    r = r && EVP_DigestUpdate(md, &local->addr.sin6.sin6_scope_id,
+                              sizeof(local->addr.sin6.sin6_scope_id));
+    break;
+  default:
+    break;
+  }
+  r = r && EVP_DigestUpdate(md, &session->ifindex, sizeof(session->ifindex));
+  memcpy(len, &identity_len, sizeof(len));
+  r = r && EVP_DigestUpdate(md, len, sizeof(len));
+  r = r && EVP_DigestUpdate(md, identity, identity_len);
+  r = r && EVP_DigestUpdate(md, key, key_len);
+  r = r && EVP_DigestFinal_ex(md, peer_id, &n);
+  if (!r) {
+    /* no session of this client is resumed */
+    RAND_bytes(peer_id, COAP_DTLS_PEER_ID_LENGTH);
+  }
+  EVP_MD_CTX_free(md);
+}
+
+/* Computes the digest of the credentials that the client session will
+ * present to find a session to resume. The server's hint is not known
+ * before the handshake. */
+static void
+coap_dtls_client_peer_id(coap_session_t *session,
+                         uint8_t peer_id[COAP_DTLS_PEER_ID_LENGTH]) {
+  uint8_t identity[PSK_MAX_IDENTITY_LEN];
+  uint8_t key[PSK_MAX_PSK_LEN];
+  size_t identity_len = 0, key_len = 0;
+
+  if (session->context->get_client_psk)
+    key_len = session->context->get_client_psk(session, NULL, 0, identity,
+                                               &identity_len,
+                                               sizeof(identity), key,
+                                               sizeof(key));
+  coap_dtls_peer_id(session, identity, identity_len, key, key_len, peer_id);
+  OPENSSL_cleanse(key, sizeof(key));
+}
+
 static unsigned coap_dtls_psk_client_callback(SSL *ssl, const char *hint, char *identity, unsigned int max_identity_len, unsigned char *buf, unsigned max_len) {
   size_t hint_len = 0, identity_len = 0, psk_len;
   coap_ssl_data *data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
@@ -230,9 +540,18 @@ static unsigned coap_dtls_psk_client_callback(SSL *ssl, const char *hint, char *
   psk_len = data->session->context->get_client_psk(data->session, (const uint8_t*)hint, hint_len, (uint8_t*)identity, &identity_len, max_identity_len - 1, (uint8_t*)buf, max_len);
   if (identity_len < max_identity_len)
     identity[identity_len] = 0;
+  /* the session is saved for the credentials actually used */
+  coap_dtls_peer_id(data->session, (const uint8_t *)identity, identity_len,
+                    buf, psk_len, data->peer_id);
   return (unsigned)psk_len;
 }
 
+#ifdef COAP_DTLS_WORKERS
+static size_t coap_dtls_job_psk(coap_dtls_job_t *job,
+                                const uint8_t *identity, size_t identity_len,
+                                uint8_t *psk, size_t max_psk_len);
+#endif /* COAP_DTLS_WORKERS */
+
 static unsigned coap_dtls_psk_server_callback(SSL *ssl, const char *identity, unsigned char *buf, unsigned max_len) {
   size_t identity_len = 0;
   coap_ssl_data *data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
@@ -244,17 +563,98 @@ static unsigned coap_dtls_psk_server_callback(SSL *ssl, const char *identity, un
 
   coap_log(LOG_DEBUG, "got psk_identity: '%.*s'\n", (int)identity_len, identity);
 
+#ifdef COAP_DTLS_WORKERS
+  if (data->job && data->job->in_worker)
+    return (unsigned)coap_dtls_job_psk(data->job, (const uint8_t *)identity,
+                                       identity_len, (uint8_t *)buf, max_len);
+#endif /* COAP_DTLS_WORKERS */
+
   if (data->session == NULL || data->session->context == NULL || data->session->context->get_server_psk == NULL)
     return 0;
 
   return (unsigned)data->session->context->get_server_psk(data->session, (const uint8_t*)identity, identity_len, (uint8_t*)buf, max_len);
 }
 
+static coap_dtls_peer_session_t *
+coap_dtls_find_peer_session(coap_dtls_context_t *dtls,
+                            const coap_address_t *remote_addr,
+                            const uint8_t peer_id[COAP_DTLS_PEER_ID_LENGTH]) {
+  coap_dtls_peer_session_t *peer;
+
+  LL_FOREACH(dtls->peer_sessions, peer) {
+    if (coap_address_equals(&peer->remote_addr, remote_addr)
+        && memcmp(peer->peer_id, peer_id, COAP_DTLS_PEER_ID_LENGTH) == 0)
+      return peer;
+  }
+  return NULL;
+}
+
+static void
+coap_dtls_free_peer_session(coap_dtls_context_t *dtls,
+                            coap_dtls_peer_session_t *peer) {
+  LL_DELETE(dtls->peer_sessions, peer);
+  dtls->peer_session_count--;
+  SSL_SESSION_free(peer->session);
+  coap_free(peer);
+}
+
+/* Keeps the session of a completed client handshake to resume it when the
+ * next connection to the same server is made with the same credentials.
+ * Only the most recently used COAP_DTLS_CLIENT_SESSIONS are remembered. */
+static void
+coap_dtls_save_peer_session(coap_dtls_context_t *dtls, coap_session_t *session,
+                            SSL *ssl) {
+  coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+  coap_dtls_peer_session_t *peer, *last;
+
+  peer = coap_dtls_find_peer_session(dtls, &session->remote_addr,
+                                     data->peer_id);
+  if (peer) {
+    coap_dtls_free_peer_session(dtls, peer);
+  } else if (dtls->peer_session_count >= COAP_DTLS_CLIENT_SESSIONS) {
+    LL_FOREACH(dtls->peer_sessions, last) {
+      if (!last->next)
+        break;
+    }
+    coap_dtls_free_peer_session(dtls, last);
+  }
+
+  peer = (coap_dtls_peer_session_t *)
+    coap_malloc(sizeof(coap_dtls_peer_session_t));
+  if (!peer)
+    return;
+  memset(peer, 0, sizeof(coap_dtls_peer_session_t));
+  coap_address_copy(&peer->remote_addr, &session->remote_addr);
+  memcpy(peer->peer_id, data->peer_id, COAP_DTLS_PEER_ID_LENGTH);
+  peer->session = SSL_get1_session(ssl);
+  LL_PREPEND(dtls->peer_sessions, peer);
+  dtls->peer_session_count++;
+}
+
+/* A session that has ended with an error is not resumed. */
+static void
+coap_dtls_forget_peer_session(coap_session_t *session) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)session->context->dtls_context;
+  coap_dtls_peer_session_t *peer;
+  coap_ssl_data *data;
+
+  if (session->type != COAP_SESSION_TYPE_CLIENT || !session->tls)
+    return;
+  data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio((SSL *)session->tls));
+  peer = coap_dtls_find_peer_session(dtls, &session->remote_addr,
+                                     data->peer_id);
+  if (peer)
+    coap_dtls_free_peer_session(dtls, peer);
+}
+
 static int dtls_event = 0;
 
 static void coap_dtls_info_callback(const SSL *ssl, int where, int ret) {
   const char *pstr;
   int w = where &~SSL_ST_MASK;
+  coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+  int *event = data && data->job && data->job->in_worker ? &data->job->event : &dtls_event;
 
   if (w & SSL_ST_CONNECT)
     pstr = "SSL_connect";
@@ -271,7 +671,7 @@ static void coap_dtls_info_callback(const SSL *ssl, int where, int ret) {
     if (dtls_log_level >= LOG_INFO)
       coap_log(LOG_INFO, "SSL3 alert %s:%s:%s\n", pstr, SSL_alert_type_string_long(ret), SSL_alert_desc_string_long(ret));
     if ((where & SSL_CB_WRITE) && (ret >> 8) == SSL3_AL_FATAL)
-      dtls_event = COAP_EVENT_DTLS_ERROR;
+      *event = COAP_EVENT_DTLS_ERROR;
   } else if (where & SSL_CB_EXIT) {
     if (ret == 0) {
       if (dtls_log_level >= LOG_WARNING) {
@@ -294,7 +694,574 @@ static void coap_dtls_info_callback(const SSL *ssl, int where, int ret) {
   }
 
   if (where == SSL_CB_HANDSHAKE_START && SSL_get_state(ssl) == TLS_ST_OK)
-    dtls_event = COAP_EVENT_DTLS_RENEGOTIATE;
+    *event = COAP_EVENT_DTLS_RENEGOTIATE;
+}
+
+/* Reports the completed handshake of session. */
+/* In the low-memory mode, an established session holds the buffers for
+ * its records only while OpenSSL works on it, which OpenSSL does not do by
+ * itself for DTLS. */
+static void
+coap_dtls_take_buffers(coap_session_t *session, SSL *ssl) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)session->context->dtls_context;
+
+  if (dtls->low_memory && SSL_alloc_buffers(ssl))
+    ((coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl)))->buffers_released = 0;
+}
+
+/* Releases the buffers of ssl if nothing is pending in them. */
+static void
+coap_dtls_drop_buffers(coap_session_t *session, SSL *ssl) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)session->context->dtls_context;
+
+  if (dtls->low_memory && SSL_is_init_finished(ssl) && SSL_free_buffers(ssl))
+    ((coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl)))->buffers_released = 1;
+}
+
+/* Returns the PDU of data that takes a record of size bytes. The plaintext
+ * is never larger than the datagram that carried it. The PDU is reused for
+ * the records of the session, unless a larger one is needed. */
+static coap_pdu_t *
+coap_dtls_rx_pdu(coap_ssl_data *data, size_t size) {
+  if (size < sizeof(coap_hdr_t))
+    size = sizeof(coap_hdr_t);
+  if (data->rx_pdu && data->rx_pdu->max_size < size) {
+    coap_delete_pdu(data->rx_pdu);
+    data->rx_pdu = NULL;
+  }
+  if (!data->rx_pdu)
+    data->rx_pdu = coap_pdu_init(0, 0, 0, size);
+  else
+    data->rx_pdu->max_delta = 0;	/* the rest is set by coap_pdu_parse() */
+  return data->rx_pdu;
+}
+
+static void
+coap_dtls_established(coap_session_t *session, SSL *ssl) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)session->context->dtls_context;
+
+  coap_dtls_drop_buffers(session, ssl);
+  if (SSL_session_reused(ssl))
+    dtls->stats.resumed++;
+  else
+    dtls->stats.full++;
+  if (session->type == COAP_SESSION_TYPE_CLIENT)
+    coap_dtls_save_peer_session(dtls, session, ssl);
+  coap_handle_event(session->context, COAP_EVENT_DTLS_CONNECTED, session);
+  coap_session_connected(session);
+}
+
+#ifdef COAP_DTLS_WORKERS
+
+static coap_dtls_record_t *
+coap_dtls_new_record(const uint8_t *data, size_t length) {
+  coap_dtls_record_t *record = (coap_dtls_record_t *)
+    coap_malloc(sizeof(coap_dtls_record_t) + length);
+
+  if (record) {
+    record->next = NULL;
+    record->length = length;
+    memcpy(record->data, data, length);
+  }
+  return record;
+}
+
+static void
+coap_dtls_free_records(coap_dtls_record_t *list) {
+  coap_dtls_record_t *record, *tmp;
+
+  LL_FOREACH_SAFE(list, record, tmp) {
+    coap_free(record);
+  }
+}
+
+typedef struct coap_dtls_pool_t {
+  pthread_mutex_t lock;
+  pthread_cond_t pending_cond;	/* signalled when a job is queued */
+  pthread_cond_t lookup_cond;	/* signalled when lookups are answered */
+  coap_dtls_job_t *pending;	/* jobs for the workers, oldest first */
+  coap_dtls_job_t *lookups;	/* jobs waiting for a key from the loop
+				 * thread, oldest first */
+  coap_dtls_job_t *done;	/* jobs for the loop thread, oldest first */
+  int stop;
+  unsigned int count;		/* number of threads */
+  pthread_t *threads;
+  coap_socket_t sock;		/* readable when jobs are done */
+  int write_fd;			/* written to signal sock */
+} coap_dtls_pool_t;
+
+/* Wakes up the loop thread unless it has already been woken up for the
+ * lists that it has not yet taken. Called with the pool locked. */
+static void
+coap_dtls_pool_wake(coap_dtls_pool_t *pool) {
+  if (!pool->done && !pool->lookups) {
+    unsigned char c = 1;
+    if (write(pool->write_fd, &c, 1) < 0 && errno != EAGAIN)
+      coap_log(LOG_WARNING, "coap_dtls_pool_wake: %s\n", coap_socket_strerror());
+  }
+}
+
+/* Looks up the key for identity in the worker that runs the handshake of
+ * job. The default callback of the context is done by the worker, with
+ * the keystore and the key that the context had when the handshake was
+ * started. Any other callback is called by the loop thread, which the
+ * worker waits for. */
+static size_t
+coap_dtls_job_psk(coap_dtls_job_t *job,
+                  const uint8_t *identity, size_t identity_len,
+                  uint8_t *psk, size_t max_psk_len) {
+  coap_dtls_pool_t *pool = job->pool;
+  size_t psk_len = 0;
+
+  if (job->default_psk) {
+    if (job->keystore) {
+      psk_len = coap_keystore_lookup(job->keystore, identity, identity_len,
+                                     psk, max_psk_len);
+      if (psk_len > 0)
+        return psk_len;
+    }
+    if (job->psk_len > 0 && job->psk_len <= max_psk_len) {
+      memcpy(psk, job->psk, job->psk_len);
+      return job->psk_len;
+    }
+    return 0;
+  }
+
+  if (identity_len > sizeof(job->identity))
+    return 0;
+  memcpy(job->identity, identity, identity_len);
+  job->identity_len = identity_len;
+  job->psk_len = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  coap_dtls_pool_wake(pool);
+  job->lookup = COAP_DTLS_LOOKUP_QUEUED;
+  LL_APPEND(pool->lookups, job);
+  while (job->lookup == COAP_DTLS_LOOKUP_QUEUED && !pool->stop)
+    pthread_cond_wait(&pool->lookup_cond, &pool->lock);
+  if (job->lookup == COAP_DTLS_LOOKUP_QUEUED) {
+    LL_DELETE(pool->lookups, job);
+  } else if (job->psk_len <= max_psk_len) {
+    memcpy(psk, job->psk, job->psk_len);
+    psk_len = job->psk_len;
+  }
+  job->lookup = COAP_DTLS_LOOKUP_NONE;
+  pthread_mutex_unlock(&pool->lock);
+  OPENSSL_cleanse(job->psk, sizeof(job->psk));
+  job->psk_len = 0;
+  return psk_len;
+}
+
+/* Processes the record of job in a worker. */
+static void
+coap_dtls_job_run(coap_dtls_job_t *job) {
+  SSL *ssl = job->ssl;
+  coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+  coap_dtls_record_t *plaintext = NULL;
+  int r;
+
+  job->in_worker = 1;
+  job->event = -1;
+  if (job->record) {
+    /* the plaintext is never larger than the record that carried it */
+    plaintext = (coap_dtls_record_t *)
+      coap_malloc(sizeof(coap_dtls_record_t) + job->record->length);
+    if (!plaintext) {
+      job->result = 0;		/* the record is dropped */
+      job->in_worker = 0;
+      return;
+    }
+    data->pdu = job->record->data;
+    data->pdu_len = (unsigned)job->record->length;
+    r = SSL_read(ssl, plaintext->data, (int)job->record->length);
+  } else {
+    r = SSL_accept(ssl);
+  }
+
+  if (r > 0) {
+    job->result = SSL_is_init_finished(ssl) ? 1 : 0;
+    if (job->record) {
+      plaintext->next = NULL;
+      plaintext->length = (size_t)r;
+      job->plaintext = plaintext;
+      plaintext = NULL;
+    }
+  } else {
+    int err = SSL_get_error(ssl, r);
+    if (r < 0 && (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)) {
+      job->result = SSL_is_init_finished(ssl) ? 1 : 0;
+    } else {
+      if (err == SSL_ERROR_ZERO_RETURN)
+	job->event = COAP_EVENT_DTLS_CLOSED;
+      else if (job->event < 0)
+	job->event = COAP_EVENT_DTLS_ERROR;
+      job->result = -1;
+    }
+  }
+  if (job->event == COAP_EVENT_DTLS_ERROR)
+    job->result = -1;
+
+  ERR_clear_error();
+  if (plaintext)
+    coap_free(plaintext);
+  job->in_worker = 0;
+}
+
+static void *
+coap_dtls_worker(void *arg) {
+  coap_dtls_pool_t *pool = (coap_dtls_pool_t *)arg;
+  coap_dtls_job_t *job;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->pending && !pool->stop)
+      pthread_cond_wait(&pool->pending_cond, &pool->lock);
+    if (pool->stop)
+      break;
+
+    job = pool->pending;
+    LL_DELETE(pool->pending, job);
+    job->state = COAP_DTLS_JOB_RUNNING;
+    pthread_mutex_unlock(&pool->lock);
+
+    coap_dtls_job_run(job);
+
+    pthread_mutex_lock(&pool->lock);
+    job->state = COAP_DTLS_JOB_DONE;
+    /* the loop thread is woken up once until it has taken the lists */
+    coap_dtls_pool_wake(pool);
+    LL_APPEND(pool->done, job);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void
+coap_dtls_job_submit(coap_dtls_pool_t *pool, coap_dtls_job_t *job) {
+  /* the worker owns the timeout until the job is taken back */
+  coap_dtls_timer_cancel((coap_ssl_data *)BIO_get_data(SSL_get_rbio(job->ssl)));
+  job->busy = 1;
+  pthread_mutex_lock(&pool->lock);
+  job->state = COAP_DTLS_JOB_QUEUED;
+  LL_APPEND(pool->pending, job);
+  pthread_cond_signal(&pool->pending_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Takes job back from the workers. A job that is running is abandoned
+ * instead, to be freed with its SSL object by coap_dtls_handle_workers()
+ * when the worker is done. Returns 0 if the job has been abandoned. */
+static int
+coap_dtls_job_cancel(coap_dtls_pool_t *pool, coap_dtls_job_t *job) {
+  int running;
+
+  pthread_mutex_lock(&pool->lock);
+  running = job->state == COAP_DTLS_JOB_RUNNING;
+  if (running) {
+    job->abandoned = 1;
+    job->session = NULL;
+  } else {
+    if (job->state == COAP_DTLS_JOB_QUEUED)
+      LL_DELETE(pool->pending, job);
+    else if (job->state == COAP_DTLS_JOB_DONE)
+      LL_DELETE(pool->done, job);
+    job->state = COAP_DTLS_JOB_IDLE;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  job->busy = 0;
+  return !running;
+}
+
+static void
+coap_dtls_free_job(coap_dtls_job_t *job) {
+  coap_dtls_free_records(job->record);
+  coap_dtls_free_records(job->backlog);
+  coap_dtls_free_records(job->out);
+  coap_dtls_free_records(job->plaintext);
+  OPENSSL_cleanse(job->psk, sizeof(job->psk));
+  coap_free_keystore(job->keystore);
+  coap_free(job);
+}
+
+/* Frees an abandoned job together with the SSL object of its session. */
+static void
+coap_dtls_free_abandoned_job(coap_dtls_job_t *job) {
+  coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(job->ssl));
+
+  data->job = NULL;
+  data->session = NULL;
+  SSL_free(job->ssl);		/* the state of its BIO is in job */
+  coap_dtls_free_job(job);
+}
+
+/* Moves the state of the BIO back into the session of job, which the loop
+ * thread owns, and frees job. */
+static void
+coap_dtls_job_finish(coap_dtls_job_t *job) {
+  coap_ssl_data *data = coap_dtls_session_data(job->session);
+
+  coap_dtls_move_data(job->ssl, data);
+  data->job = NULL;
+  coap_dtls_free_job(job);
+}
+
+/* Hands the handshake of session over to the workers. */
+static int
+coap_dtls_job_start(coap_dtls_pool_t *pool, coap_session_t *session, SSL *ssl) {
+  coap_context_t *ctx = session->context;
+  coap_dtls_job_t *job;
+
+  job = (coap_dtls_job_t *)coap_malloc(sizeof(coap_dtls_job_t));
+  if (!job)
+    return 0;
+  memset(job, 0, sizeof(coap_dtls_job_t));
+  job->pool = pool;
+  job->ssl = ssl;
+  job->session = session;
+  if (ctx->get_server_psk == coap_get_context_server_psk) {
+    /* the worker does the lookup itself with what the context has now */
+    job->default_psk = 1;
+    if (ctx->keystore)
+      job->keystore = coap_keystore_reference(ctx->keystore);
+    if (ctx->psk_key && ctx->psk_key_len <= sizeof(job->psk)) {
+      memcpy(job->psk, ctx->psk_key, ctx->psk_key_len);
+      job->psk_len = ctx->psk_key_len;
+    }
+  }
+  if (!coap_dtls_generate_cookie(ssl, job->cookie, &job->cookie_len))
+    job->cookie_len = 0;
+  /* the state of the BIO lives in the job, which may outlive session */
+  coap_dtls_move_data(ssl, &job->data);
+  job->data.job = job;
+  coap_dtls_job_submit(pool, job);
+  return 1;
+}
+
+/* Continues with the session of job when a worker has processed a
+ * record. */
+static void
+coap_dtls_job_done(coap_dtls_pool_t *pool, coap_dtls_job_t *job) {
+  coap_session_t *session = job->session;
+  SSL *ssl = job->ssl;
+  coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+  coap_dtls_record_t *record, *tmp, *plaintext, *backlog = NULL;
+  int result = job->result, event = job->event;
+
+  job->busy = 0;
+  coap_dtls_timer_update(data);
+  LL_FOREACH_SAFE(job->out, record, tmp) {
+    LL_DELETE(job->out, record);
+    coap_session_send(session, record->data, record->length);
+    coap_free(record);
+  }
+  coap_dtls_free_records(job->record);
+  job->record = NULL;
+  plaintext = job->plaintext;
+  job->plaintext = NULL;
+
+  if (result != 0) {
+    /* records are processed by the loop thread again */
+    backlog = job->backlog;
+    job->backlog = NULL;
+    coap_dtls_job_finish(job);
+  } else if (job->backlog) {
+    job->record = job->backlog;
+    LL_DELETE(job->backlog, job->record);
+    SSL_set_mtu(ssl, session->mtu);
+    coap_dtls_job_submit(pool, job);
+  }
+
+  if (result == 1)
+    coap_dtls_established(session, ssl);
+  if (event >= 0) {
+    if (event == COAP_EVENT_DTLS_ERROR)
+      coap_dtls_forget_peer_session(session);
+    coap_handle_event(session->context, event, session);
+  }
+  if (result < 0) {
+    coap_session_disconnected(session);
+  } else {
+    if (plaintext)
+      coap_handle_message(session->context, session, plaintext->data,
+                          plaintext->length);
+    LL_FOREACH(backlog, record) {
+      if (!session->tls)
+	break;
+      coap_dtls_receive(session, record->data, record->length);
+    }
+  }
+  coap_dtls_free_records(plaintext);
+  coap_dtls_free_records(backlog);
+}
+
+static void
+coap_dtls_free_pool(coap_dtls_pool_t *pool) {
+  coap_dtls_job_t *job, *tmp;
+  unsigned int n;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->pending_cond);
+  pthread_cond_broadcast(&pool->lookup_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (n = 0; n < pool->count; n++)
+    pthread_join(pool->threads[n], NULL);
+
+  /* jobs are taken back when their sessions are released, except for
+   * those that were running then */
+  assert(!pool->pending);
+  LL_FOREACH_SAFE(pool->done, job, tmp) {
+    assert(job->abandoned);
+    LL_DELETE(pool->done, job);
+    coap_dtls_free_abandoned_job(job);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->pending_cond);
+  pthread_cond_destroy(&pool->lookup_cond);
+  if (pool->sock.fd != COAP_INVALID_SOCKET)
+    close(pool->sock.fd);
+  if (pool->write_fd >= 0)
+    close(pool->write_fd);
+  coap_free(pool->threads);
+  coap_free(pool);
+}
+
+int coap_dtls_set_handshake_workers(struct coap_context_t *coap_context,
+                                    unsigned int count) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)coap_context->dtls_context;
+  coap_dtls_pool_t *pool;
+  int fds[2];
+
+  if (!dtls || count == 0)
+    return 0;
+  if (dtls->pool)
+    return 1;
+
+  pool = (coap_dtls_pool_t *)coap_malloc(sizeof(coap_dtls_pool_t));
+  if (!pool)
+    return 0;
+  memset(pool, 0, sizeof(coap_dtls_pool_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->pending_cond, NULL);
+  pthread_cond_init(&pool->lookup_cond, NULL);
+  pool->sock.fd = COAP_INVALID_SOCKET;
+  pool->write_fd = -1;
+
+  pool->threads = (pthread_t *)coap_malloc(count * sizeof(pthread_t));
+  if (!pool->threads || pipe(fds) < 0)
+    goto error;
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  pool->sock.fd = fds[0];
+  pool->sock.flags = COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_WANT_DATA;
+  pool->write_fd = fds[1];
+
+  for (pool->count = 0; pool->count < count; pool->count++) {
+    if (pthread_create(&pool->threads[pool->count], NULL, coap_dtls_worker,
+                       pool) != 0)
+      goto error;
+  }
+
+  dtls->pool = pool;
+  return 1;
+
+ error:
+  coap_log(LOG_WARNING, "coap_dtls_set_handshake_workers: cannot start workers\n");
+  coap_dtls_free_pool(pool);
+  return 0;
+}
+
+coap_socket_t *coap_dtls_get_worker_socket(void *dtls_context) {
+  coap_dtls_context_t *dtls = (coap_dtls_context_t *)dtls_context;
+
+  return dtls->pool ? &dtls->pool->sock : NULL;
+}
+
+void coap_dtls_handle_workers(void *dtls_context) {
+  coap_dtls_context_t *dtls = (coap_dtls_context_t *)dtls_context;
+  coap_dtls_pool_t *pool = dtls->pool;
+  coap_dtls_job_t *job;
+  unsigned char buf[64];
+
+  if (!pool)
+    return;
+
+  pool->sock.flags &= ~COAP_SOCKET_HAS_DATA;
+  while (read(pool->sock.fd, buf, sizeof(buf)) == sizeof(buf))
+    ;
+
+  /* One at a time, as the event handler may release other sessions whose
+   * jobs are done as well. */
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    job = pool->lookups;
+    if (job) {
+      LL_DELETE(pool->lookups, job);
+    } else {
+      job = pool->done;
+      if (job) {
+        LL_DELETE(pool->done, job);
+        job->state = COAP_DTLS_JOB_IDLE;
+      }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!job)
+      break;
+    if (job->lookup == COAP_DTLS_LOOKUP_QUEUED) {
+      /* the worker waits for the key, the session is gone if abandoned */
+      coap_session_t *session = job->session;
+      size_t psk_len = 0;
+
+      if (session && session->context->get_server_psk)
+        psk_len = session->context->get_server_psk(session, job->identity,
+                                                   job->identity_len,
+                                                   job->psk,
+                                                   sizeof(job->psk));
+      pthread_mutex_lock(&pool->lock);
+      job->psk_len = psk_len;
+      job->lookup = COAP_DTLS_LOOKUP_ANSWERED;
+      pthread_cond_broadcast(&pool->lookup_cond);
+      pthread_mutex_unlock(&pool->lock);
+    } else if (job->abandoned)
+      coap_dtls_free_abandoned_job(job);
+    else
+      coap_dtls_job_done(pool, job);
+  }
+}
+
+#else /* COAP_DTLS_WORKERS */
+
+int coap_dtls_set_handshake_workers(struct coap_context_t *coap_context,
+                                    unsigned int count) {
+  (void)coap_context;
+  (void)count;
+  return 0;
+}
+
+coap_socket_t *coap_dtls_get_worker_socket(void *dtls_context) {
+  (void)dtls_context;
+  return NULL;
+}
+
+void coap_dtls_handle_workers(void *dtls_context) {
+  (void)dtls_context;
+}
+
+#endif /* COAP_DTLS_WORKERS */
+
+/* Returns the job of session while a worker owns its SSL object. */
+static coap_dtls_job_t *
+coap_dtls_busy_job(coap_session_t *session) {
+  coap_ssl_data *data;
+
+  if (!session->tls)
+    return NULL;
+  data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio((SSL *)session->tls));
+  return data->job && data->job->busy ? data->job : NULL;
 }
 
 void *coap_dtls_new_context(struct coap_context_t *coap_context) {
@@ -311,7 +1278,7 @@ void *coap_dtls_new_context(struct coap_context_t *coap_context) {
     SSL_CTX_set_min_proto_version(context->ctx, DTLS1_2_VERSION);
     SSL_CTX_set_app_data(context->ctx, context);
     SSL_CTX_set_read_ahead(context->ctx, 1);
-    SSL_CTX_set_cipher_list(context->ctx, "TLSv1.2:TLSv1.0");
+    SSL_CTX_set_cipher_list(context->ctx, COAP_OPENSSL_CIPHERS);
     if (!RAND_bytes(cookie_secret, (int)sizeof(cookie_secret))) {
       if (dtls_log_level >= LOG_WARNING)
 	coap_log(LOG_WARNING, "Insufficient entropy for random cookie generation");
@@ -328,6 +1295,12 @@ void *coap_dtls_new_context(struct coap_context_t *coap_context) {
     SSL_CTX_set_psk_server_callback(context->ctx, coap_dtls_psk_server_callback);
     SSL_CTX_use_psk_identity_hint(context->ctx, "");
     SSL_CTX_set_options(context->ctx, SSL_OP_NO_QUERY_MTU);
+    /* Clients are given a session ticket and may as well resume with the
+     * id of a session kept in the server cache. */
+    SSL_CTX_set_session_cache_mode(context->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(context->ctx, (const uint8_t *)"libcoap", 7);
+    SSL_CTX_sess_set_cache_size(context->ctx, COAP_DTLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(context->ctx, COAP_DTLS_SESSION_LIFETIME);
     context->meth = BIO_meth_new(BIO_TYPE_DGRAM, "coapdgram");
     if (!context->meth)
       goto error;
@@ -346,6 +1319,7 @@ void *coap_dtls_new_context(struct coap_context_t *coap_context) {
     bio = BIO_new(context->meth);
     if (!bio)
       goto error;
+    BIO_set_data(bio, &context->listen_data);
     SSL_set_bio(context->ssl, bio, bio);
     SSL_set_app_data(context->ssl, NULL);
     SSL_set_options(context->ssl, SSL_OP_COOKIE_EXCHANGE);
@@ -361,6 +1335,15 @@ error:
 
 void coap_dtls_free_context(void *handle) {
   coap_dtls_context_t *context = (coap_dtls_context_t *)handle;
+  coap_dtls_peer_session_t *peer, *tmp;
+
+  LL_FOREACH_SAFE(context->peer_sessions, peer, tmp) {
+    coap_dtls_free_peer_session(context, peer);
+  }
+#ifdef COAP_DTLS_WORKERS
+  if (context->pool)
+    coap_dtls_free_pool(context->pool);
+#endif /* COAP_DTLS_WORKERS */
   if (context->ssl)
     SSL_free(context->ssl);
   if (context->ctx)
@@ -371,16 +1354,18 @@ void coap_dtls_free_context(void *handle) {
     BIO_meth_free(context->meth);
   if (context->bio_addr)
     BIO_ADDR_free(context->bio_addr);
+  coap_free(context->timers);
   coap_free(context);
 }
 
 void * coap_dtls_new_server_session(coap_session_t *session) {
   BIO *nbio = NULL;
   SSL *nssl = NULL, *ssl = NULL;
-  coap_ssl_data *data;
+  coap_ssl_data *data = coap_dtls_session_data(session);
   coap_dtls_context_t *dtls = (coap_dtls_context_t *)session->context->dtls_context;
   int r;
 
+  /* the SSL that listens for the next hello */
   nssl = SSL_new(dtls->ctx);
   if (!nssl)
     goto error;
@@ -391,13 +1376,19 @@ void * coap_dtls_new_server_session(coap_session_t *session) {
   SSL_set_app_data(nssl, NULL);
   SSL_set_options(nssl, SSL_OP_COOKIE_EXCHANGE);
   SSL_set_mtu(nssl, session->mtu);
+
+  /* the session takes over the SSL that has listened for its hello */
   ssl = dtls->ssl;
+  coap_dtls_move_data(ssl, data);
+  BIO_set_data(nbio, &dtls->listen_data);
   dtls->ssl = nssl;
   nssl = NULL;
   SSL_set_app_data(ssl, session);
-
-  data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
   data->session = session;
+  if (!coap_dtls_timer_reserve(dtls, data)) {
+    SSL_free(ssl);
+    return NULL;
+  }
 
   if (session->context->get_server_hint) {
     char hint[128] = "";
@@ -408,6 +1399,15 @@ void * coap_dtls_new_server_session(coap_session_t *session) {
     }
   }
 
+#ifdef COAP_DTLS_WORKERS
+  if (dtls->pool) {
+    if (coap_dtls_job_start(dtls->pool, session, ssl))
+      return ssl;
+    SSL_free(ssl);
+    return NULL;
+  }
+#endif /* COAP_DTLS_WORKERS */
+
   r = SSL_accept(ssl);
   if (r == -1) {
     int err = SSL_get_error(ssl, r);
@@ -432,6 +1432,7 @@ void *coap_dtls_new_client_session(coap_session_t *session) {
   BIO *bio = NULL;
   SSL *ssl = NULL;
   coap_ssl_data *data;
+  coap_dtls_peer_session_t *peer;
   int r;
   coap_dtls_context_t *dtls = (coap_dtls_context_t *)session->context->dtls_context;
 
@@ -441,13 +1442,23 @@ void *coap_dtls_new_client_session(coap_session_t *session) {
   bio = BIO_new(dtls->meth);
   if (!bio)
     goto error;
-  data = (coap_ssl_data *)BIO_get_data(bio);
+  data = coap_dtls_session_data(session);
+  memset(data, 0, sizeof(coap_ssl_data));
   data->session = session;
+  BIO_set_data(bio, data);
   SSL_set_bio(ssl, bio, bio);
+  if (!coap_dtls_timer_reserve(dtls, data))
+    goto error;
   SSL_set_app_data(ssl, session);
   SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
   SSL_set_mtu(ssl, session->mtu);
 
+  coap_dtls_client_peer_id(session, data->peer_id);
+  peer = coap_dtls_find_peer_session(dtls, &session->remote_addr,
+                                     data->peer_id);
+  if (peer)
+    SSL_set_session(ssl, peer->session);
+
   r = SSL_connect(ssl);
   if (r == -1) {
     int ret = SSL_get_error(ssl, r);
@@ -468,15 +1479,31 @@ error:
 
 void coap_dtls_session_update_mtu(coap_session_t *session) {
   SSL *ssl = (SSL *)session->tls;
-  if (ssl)
+  /* a busy handshake gets the new MTU with the next record */
+  if (ssl && !coap_dtls_busy_job(session))
     SSL_set_mtu(ssl, session->mtu);
 }
 
 void coap_dtls_free_session(coap_session_t *session) {
   SSL *ssl = (SSL *)session->tls;
   if (ssl) {
-    if (!(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN))
+#ifdef COAP_DTLS_WORKERS
+    coap_ssl_data *data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+    if (data->job) {
+      coap_dtls_context_t *dtls =
+	(coap_dtls_context_t *)session->context->dtls_context;
+      if (!coap_dtls_job_cancel(dtls->pool, data->job)) {
+	/* the SSL object is freed with the job */
+	session->tls = NULL;
+	return;
+      }
+      coap_dtls_job_finish(data->job);
+    }
+#endif /* COAP_DTLS_WORKERS */
+    if (!(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN)) {
+      coap_dtls_take_buffers(session, ssl);
       SSL_shutdown(ssl);
+    }
     SSL_free(ssl);
   }
 }
@@ -488,8 +1515,13 @@ int coap_dtls_send(coap_session_t *session,
 
   assert(ssl != NULL);
 
+  if (coap_dtls_busy_job(session))
+    return 0;
+
   dtls_event = -1;
+  coap_dtls_take_buffers(session, ssl);
   r = SSL_write(ssl, data, (int)data_len);
+  coap_dtls_drop_buffers(session, ssl);
 
   if (r <= 0) {
     int err = SSL_get_error(ssl, r);
@@ -506,6 +1538,8 @@ int coap_dtls_send(coap_session_t *session,
   }
 
   if (dtls_event >= 0) {
+    if (dtls_event == COAP_EVENT_DTLS_ERROR)
+      coap_dtls_forget_peer_session(session);
     coap_handle_event(session->context, dtls_event, session);
     if (dtls_event == COAP_EVENT_DTLS_ERROR || dtls_event == COAP_EVENT_DTLS_CLOSED) {
       coap_session_disconnected(session);
@@ -517,12 +1551,36 @@ int coap_dtls_send(coap_session_t *session,
 }
 
 int coap_dtls_is_context_timeout(void) {
-  return 0;
+  return 1;
 }
 
 coap_tick_t coap_dtls_get_context_timeout(void *dtls_context) {
-  (void)dtls_context;
-  return 0;
+  coap_dtls_context_t *dtls = (coap_dtls_context_t *)dtls_context;
+  coap_ssl_data *data;
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  while (dtls->timer_count && dtls->timers[0]->timeout <= now) {
+    coap_session_t *session;
+    struct timeval tv;
+
+    data = dtls->timers[0];
+    session = data->session;
+    coap_dtls_timer_cancel(data);
+    debug("** %s: DTLS retransmit timeout\n", coap_session_str(session));
+    if (coap_dtls_busy_job(session))
+      continue;			/* re-armed when taken back */
+    coap_dtls_handle_timeout(session);
+
+    /* OpenSSL has not retransmitted if its own clock is behind */
+    if (session->tls && !data->dtls
+        && DTLSv1_get_timeout((SSL *)session->tls, &tv)) {
+      data->timeout = now + (coap_tick_t)tv.tv_sec * COAP_TICKS_PER_SECOND
+        + (coap_tick_t)tv.tv_usec * COAP_TICKS_PER_SECOND / 1000000;
+      coap_dtls_timer_update(data);
+    }
+  }
+  return dtls->timer_count ? dtls->timers[0]->timeout : 0;
 }
 
 coap_tick_t coap_dtls_get_timeout(coap_session_t *session) {
@@ -530,15 +1588,23 @@ coap_tick_t coap_dtls_get_timeout(coap_session_t *session) {
   coap_ssl_data *ssl_data;
 
   assert(ssl != NULL);
+  if (coap_dtls_busy_job(session))
+    return 0;
   ssl_data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
   return ssl_data->timeout;
 }
 
 void coap_dtls_handle_timeout(coap_session_t *session) {
   SSL *ssl = (SSL *)session->tls;
+  int r;
 
   assert(ssl != NULL);
-  if (DTLSv1_handle_timeout(ssl) < 0) {
+  if (coap_dtls_busy_job(session))
+    return;
+  coap_dtls_take_buffers(session, ssl);
+  r = DTLSv1_handle_timeout(ssl);
+  coap_dtls_drop_buffers(session, ssl);
+  if (r < 0) {
     /* Too may retries */
     coap_session_disconnected(session);
   }
@@ -579,22 +1645,65 @@ int coap_dtls_receive(coap_session_t *session,
   assert(ssl != NULL);
 
   int in_init = SSL_in_init(ssl);
-  uint8_t pdu[COAP_RXBUFFER_SIZE];
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)session->context->dtls_context;
+  coap_pdu_t *pdu;
+
   ssl_data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
+#ifdef COAP_DTLS_WORKERS
+  if (ssl_data->job) {
+    /* the handshake is run by the workers */
+    coap_dtls_job_t *job = ssl_data->job;
+    coap_dtls_record_t *record = coap_dtls_new_record(data, data_len);
+
+    if (!record)
+      return -1;
+    if (job->busy) {
+      LL_APPEND(job->backlog, record);
+    } else {
+      job->record = record;
+      SSL_set_mtu(ssl, session->mtu);
+      coap_dtls_job_submit(dtls->pool, job);
+    }
+    return 0;
+  }
+#endif /* COAP_DTLS_WORKERS */
+  /* The record is decrypted right into the PDU that is passed on. */
+  pdu = coap_dtls_rx_pdu(ssl_data, data_len);
+  if (!pdu)
+    return -1;
   ssl_data->pdu = data;
   ssl_data->pdu_len = (unsigned)data_len;
 
   dtls_event = -1;
-  r = SSL_read(ssl, pdu, (int)sizeof(pdu));
+  coap_dtls_take_buffers(session, ssl);
+  r = SSL_read(ssl, pdu->hdr, (int)pdu->max_size);
+  coap_dtls_drop_buffers(session, ssl);
   if (r > 0) {
-    return coap_handle_message(session->context, session, pdu, (size_t)r);
+    /* held while the message is handled, which may release the session
+     * or its SSL object */
+    ssl_data->rx_pdu = NULL;
+    coap_session_reference(session);
+    r = coap_handle_message_pdu(session->context, session, &pdu, (size_t)r);
+    if (pdu) {
+      if (session->tls && !dtls->low_memory && !ssl_data->rx_pdu
+          && BIO_get_data(SSL_get_rbio((SSL *)session->tls)) == ssl_data)
+        ssl_data->rx_pdu = pdu;
+      else
+        coap_delete_pdu(pdu);
+    }
+    coap_session_release(session);
   } else {
     int err = SSL_get_error(ssl, r);
+
+    /* kept for the next record unless memory is to be saved */
+    if (dtls->low_memory) {
+      coap_delete_pdu(ssl_data->rx_pdu);
+      ssl_data->rx_pdu = NULL;
+    }
     if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-      if (in_init && SSL_is_init_finished(ssl)) {
-	coap_handle_event(session->context, COAP_EVENT_DTLS_CONNECTED, session);
-	coap_session_connected(session);
-      }
+      if (in_init && SSL_is_init_finished(ssl))
+	coap_dtls_established(session, ssl);
       r = 0;
     } else {
       if (err == SSL_ERROR_ZERO_RETURN)	/* Got a close notify alert from the remote side */
@@ -604,6 +1713,8 @@ int coap_dtls_receive(coap_session_t *session,
       r = -1;
     }
     if (dtls_event >= 0) {
+      if (dtls_event == COAP_EVENT_DTLS_ERROR)
+	coap_dtls_forget_peer_session(session);
       coap_handle_event(session->context, dtls_event, session);
       if (dtls_event == COAP_EVENT_DTLS_ERROR || dtls_event == COAP_EVENT_DTLS_CLOSED) {
 	coap_session_disconnected(session);
@@ -615,10 +1726,114 @@ int coap_dtls_receive(coap_session_t *session,
   return r;
 }
 
+int coap_dtls_get_handshake_stats(struct coap_context_t *coap_context,
+                                  coap_dtls_handshake_stats_t *stats) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)coap_context->dtls_context;
+
+  if (!dtls) {
+    memset(stats, 0, sizeof(coap_dtls_handshake_stats_t));
+    return 0;
+  }
+  *stats = dtls->stats;
+  return 1;
+}
+
+int coap_dtls_set_low_memory(struct coap_context_t *coap_context,
+                             int enable, unsigned int idle_timeout) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)coap_context->dtls_context;
+
+  if (!dtls)
+    return 0;
+
+  dtls->low_memory = enable;
+  coap_context->dtls_idle_timeout = enable ? idle_timeout : 0;
+  return 1;
+}
+
+/* The least that the buffers OpenSSL allocates to read and write records
+ * take, which an established session holds unless they are released. Each
+ * holds a record with the largest plaintext and more for its overhead. */
+#define COAP_DTLS_RECORD_BUFFERS \
+  (2 * (DTLS1_RT_HEADER_LENGTH + SSL3_RT_MAX_PLAIN_LENGTH))
+
+/* Counts only what the session is known to hold: the record buffers, the
+ * PDU kept for the next record and the master secret of its SSL session.
+ * The SSL object and its cipher state are opaque and not counted. */
+size_t coap_dtls_estimate_session_memory(coap_session_t *session) {
+  SSL *ssl = (SSL *)session->tls;
+  SSL_SESSION *ssl_session;
+  coap_ssl_data *data;
+  size_t bytes = 0;
+
+  if (!ssl)
+    return 0;
+  data = (coap_ssl_data *)BIO_get_data(SSL_get_rbio(ssl));
+  if (!data->buffers_released)
+    bytes += COAP_DTLS_RECORD_BUFFERS;
+  if (data->rx_pdu)
+    bytes += sizeof(coap_pdu_t) + data->rx_pdu->max_size;
+  ssl_session = coap_dtls_busy_job(session) ? NULL : SSL_get_session(ssl);
+  if (ssl_session)
+    bytes += SSL_SESSION_get_master_key(ssl_session, NULL, 0);
+  return bytes;
+}
+
+int coap_dtls_set_ciphers(struct coap_context_t *coap_context,
+                          const char *ciphers, int server_preference) {
+  coap_dtls_context_t *dtls =
+    (coap_dtls_context_t *)coap_context->dtls_context;
+  SSL *probe;
+  int r;
+
+  if (!dtls)
+    return 0;
+  if (!ciphers)
+    ciphers = COAP_OPENSSL_CIPHERS;
+
+  /* a list without any known suite would still replace that of ctx */
+  probe = SSL_new(dtls->ctx);
+  if (!probe)
+    return 0;
+  r = SSL_set_cipher_list(probe, ciphers);
+  SSL_free(probe);
+  if (!r) {
+    coap_log(LOG_WARNING, "coap_dtls_set_ciphers: no cipher suite supported in %s\n", ciphers);
+    return 0;
+  }
+
+  SSL_CTX_set_cipher_list(dtls->ctx, ciphers);
+  if (server_preference)
+    SSL_CTX_set_options(dtls->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  else
+    SSL_CTX_clear_options(dtls->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+  /* the next server session takes over the SSL that listens for hellos */
+  SSL_set_cipher_list(dtls->ssl, ciphers);
+  if (server_preference)
+    SSL_set_options(dtls->ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  else
+    SSL_clear_options(dtls->ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  return 1;
+}
+
+const char *coap_dtls_get_cipher(coap_session_t *session) {
+  SSL *ssl = (SSL *)session->tls;
+
+  if (!ssl || coap_dtls_busy_job(session) || !SSL_is_init_finished(ssl))
+    return NULL;
+  return SSL_CIPHER_get_name(SSL_get_current_cipher(ssl));
+}
+
+const char *coap_dtls_get_library(void) {
+  return OpenSSL_version(OPENSSL_VERSION);
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *session) {
   unsigned int overhead = 37;
   const SSL_CIPHER *s_ciph = NULL;
-  if (session->tls != NULL)
+  if (session->tls != NULL && !coap_dtls_busy_job(session))
     s_ciph = SSL_get_current_cipher(session->tls);
   if ( s_ciph ) {
     unsigned int ivlen, maclen, blocksize = 1, pad = 0;
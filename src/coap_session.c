@@ -14,6 +14,7 @@
 #include "coap_io.h"
 #include "coap_dtls.h"
 #include "coap_session.h"
+#include "block.h"
 #include "net.h"
 #include "debug.h"
 #include "mem.h"
@@ -61,6 +62,8 @@ coap_make_session(coap_proto_t proto, coap_session_type_t type, const coap_addre
     session->mtu = endpoint->default_mtu;
   else
     session->mtu = COAP_DEFAULT_PDU_SIZE;
+  session->max_mtu = session->mtu;
+  session->rx_buffer_size = COAP_RXBUFFER_SIZE;
   if (proto == COAP_PROTO_DTLS) {
     session->tls_overhead = 29;
     if (session->tls_overhead >= session->mtu) {
@@ -71,6 +74,19 @@ coap_make_session(coap_proto_t proto, coap_session_type_t type, const coap_addre
   return session;
 }
 
+/**
+ * Updates the number of DTLS server handshakes in progress when
+ * @p session leaves the handshake state.
+ */
+static void
+coap_session_end_handshake(coap_session_t *session) {
+  if (session->type == COAP_SESSION_TYPE_SERVER
+      && session->state == COAP_SESSION_STATE_HANDSHAKE
+      && session->proto == COAP_PROTO_DTLS
+      && session->context && session->context->dtls_handshakes > 0)
+    session->context->dtls_handshakes--;
+}
+
 void coap_session_free(coap_session_t *session) {
   coap_queue_t *q, *tmp;
 
@@ -79,10 +95,13 @@ void coap_session_free(coap_session_t *session) {
   assert(session->ref == 0);
   if (session->ref)
     return;
+  coap_session_end_handshake(session);
   if (session->proto == COAP_PROTO_DTLS)
     coap_dtls_free_session(session);
   if (session->sock.flags != COAP_SOCKET_EMPTY)
     coap_socket_close(&session->sock);
+  if (session->rx_buffer)
+    coap_free_type(COAP_PDU_BUF, session->rx_buffer);
   if (session->endpoint) {
     if (session->endpoint->sessions)
       LL_DELETE(session->endpoint->sessions, session);
@@ -98,6 +117,11 @@ void coap_session_free(coap_session_t *session) {
   LL_FOREACH_SAFE(session->sendqueue, q, tmp)
     coap_delete_node(q);
 
+  coap_free_large_responses(session);
+  coap_free_large_requests(session);
+  coap_free_block_fetches(session);
+  coap_free_q_block_sends(session);
+
   debug("*** %s: session closed\n", coap_session_str(session));
 
   coap_free_type(COAP_SESSION, session);
@@ -108,13 +132,96 @@ unsigned int coap_session_max_pdu_size(coap_session_t *session) {
 }
 
 void coap_session_set_mtu(coap_session_t *session, unsigned mtu) {
+  if (mtu > COAP_MAX_PDU_SIZE)
+    mtu = COAP_MAX_PDU_SIZE;
   session->mtu = (uint16_t)mtu;
+  session->max_mtu = session->mtu;
   if (session->tls_overhead >= session->mtu) {
     session->tls_overhead = session->mtu;
     coap_log(LOG_ERR, "DTLS overhead exceeds MTU\n");
   }
 }
 
+/**
+* Replaces the receive buffer in @p buffer of @p buffer_size bytes by one
+* of @p size bytes, which is allocated on the next read.
+*
+* @return 1 on success, 0 if @p size is invalid.
+*/
+static int
+coap_set_rx_buffer_size(uint8_t **buffer, size_t *buffer_size, size_t size) {
+#ifdef WITH_CONTIKI
+  /* packets have a fixed size of COAP_RXBUFFER_SIZE */
+  (void)buffer;
+  (void)buffer_size;
+  (void)size;
+  return 0;
+#else /* WITH_CONTIKI */
+  if (size == 0)
+    size = COAP_RXBUFFER_SIZE;
+  if (size < sizeof(coap_hdr_t) || size > COAP_MAX_PDU_SIZE)
+    return 0;
+
+  if (*buffer && size != *buffer_size) {
+    coap_free_type(COAP_PDU_BUF, *buffer);
+    *buffer = NULL;
+  }
+  *buffer_size = size;
+  return 1;
+#endif /* WITH_CONTIKI */
+}
+
+int coap_session_set_rx_buffer_size(coap_session_t *session, size_t size) {
+  if (session->sock.flags == COAP_SOCKET_EMPTY)
+    return 0;
+  return coap_set_rx_buffer_size(&session->rx_buffer,
+                                 &session->rx_buffer_size, size);
+}
+
+void coap_session_set_path_mtu(coap_session_t *session, unsigned mtu) {
+  if (mtu > session->max_mtu)
+    mtu = session->max_mtu;
+  if (mtu <= session->tls_overhead) {
+    debug("*** %s: ignoring path mtu %u\n", coap_session_str(session), mtu);
+    return;
+  }
+  if (mtu == session->mtu)
+    return;
+
+  debug("*** %s: mtu %u\n", coap_session_str(session), mtu);
+  session->mtu = (uint16_t)mtu;
+  if (session->proto == COAP_PROTO_DTLS && session->tls)
+    coap_dtls_session_update_mtu(session);
+}
+
+int coap_session_set_pmtu_discovery(coap_session_t *session, int enable) {
+  if ((session->sock.flags & COAP_SOCKET_CONNECTED) == 0)
+    return 0;
+  if (!coap_socket_set_pmtu_discovery(&session->sock, &session->remote_addr,
+                                      enable))
+    return 0;
+
+  if (enable) {
+    unsigned mtu = coap_socket_get_path_mtu(&session->sock,
+                                            &session->remote_addr);
+    if (mtu)
+      coap_session_set_path_mtu(session, mtu);
+  } else {
+    coap_session_set_path_mtu(session, session->max_mtu);
+  }
+  return 1;
+}
+
+void coap_session_read_errors(coap_session_t *session) {
+  coap_address_t dst;
+  unsigned mtu;
+
+  while (coap_socket_read_error(&session->sock, &dst, &mtu)) {
+    if (mtu)
+      coap_session_set_path_mtu(session, mtu);
+  }
+}
+
 ssize_t coap_session_send(coap_session_t *session, const uint8_t *data, size_t datalen) {
   ssize_t bytes_written;
 
@@ -130,6 +237,13 @@ ssize_t coap_session_send(coap_session_t *session, const uint8_t *data, size_t d
     debug("*  %s: sent %zd bytes\n", coap_session_str(session), datalen);
   } else {
     debug("*  %s: failed to send %zd bytes\n", coap_session_str(session), datalen);
+    /* a datagram that was too big lowers the path mtu */
+    if (sock->flags & COAP_SOCKET_PMTU) {
+      if (sock == &session->sock)
+        coap_session_read_errors(session);
+      else
+        coap_endpoint_read_errors(session->endpoint, session);
+    }
   }
   return bytes_written;
 }
@@ -166,6 +280,7 @@ coap_session_delay_pdu(coap_session_t *session, coap_pdu_t *pdu,
 void coap_session_connected(coap_session_t *session) {
   debug("*** %s: session connected\n", coap_session_str(session));
 
+  coap_session_end_handshake(session);
   session->state = COAP_SESSION_STATE_ESTABLISHED;
 
   if ( session->proto==COAP_PROTO_DTLS) {
@@ -199,6 +314,7 @@ void coap_session_connected(coap_session_t *session) {
 
 void coap_session_disconnected(coap_session_t *session) {
   debug("*** %s: session disconnected\n", coap_session_str(session));
+  coap_session_end_handshake(session);
   if (session->proto == COAP_PROTO_DTLS && session->tls) {
     coap_dtls_free_session(session);
     session->tls = NULL;
@@ -220,6 +336,7 @@ void coap_session_disconnected(coap_session_t *session) {
 
 void coap_session_reset(coap_session_t *session) {
   debug("*** %s: session reset\n", coap_session_str(session));
+  coap_session_end_handshake(session);
 #ifndef WITHOUT_OBSERVE
   coap_delete_observers(session->context, session);
 #endif
@@ -253,7 +370,11 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
       coap_address_equals(&session->remote_addr, &packet->src))
     {
       session->last_rx_tx = now;
-      return session;
+      /* a session whose DTLS state has been released when idle gets a
+       * new one after a hello, see coap_endpoint_new_dtls_session() */
+      if (!session->tls_released)
+        return session;
+      break;
     }
     if (session->ref == 0 && session->sendqueue == NULL && session->type == COAP_SESSION_TYPE_SERVER) {
       ++num_idle;
@@ -262,7 +383,7 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
     }
   }
 
-  if (endpoint->context->max_idle_sessions > 0 && num_idle >= endpoint->context->max_idle_sessions)
+  if (!session && endpoint->context->max_idle_sessions > 0 && num_idle >= endpoint->context->max_idle_sessions)
     coap_session_free(oldest);
 
   if (endpoint->proto == COAP_PROTO_DTLS) {
@@ -289,10 +410,35 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
 coap_session_t *
 coap_endpoint_new_dtls_session(coap_endpoint_t *endpoint,
   const coap_packet_t *packet, coap_tick_t now) {
-  coap_session_t *session = coap_make_session(COAP_PROTO_DTLS, COAP_SESSION_TYPE_SERVER, &packet->dst, &packet->src, packet->ifindex, endpoint->context, endpoint);
+  coap_session_t *session;
+
+  /* a session kept with its observers and transfers when its DTLS state
+   * was released resumes with a new one */
+  LL_FOREACH(endpoint->sessions, session) {
+    if (session->tls_released && session->ifindex == packet->ifindex &&
+      coap_address_equals(&session->local_addr, &packet->dst) &&
+      coap_address_equals(&session->remote_addr, &packet->src))
+    {
+      session->last_rx_tx = now;
+      endpoint->context->dtls_handshakes++;
+      session->state = COAP_SESSION_STATE_HANDSHAKE;
+      session->tls = coap_dtls_new_server_session(session);
+      if (!session->tls) {
+        coap_session_end_handshake(session);
+        session->state = COAP_SESSION_STATE_NONE;
+        return NULL;
+      }
+      session->tls_released = 0;
+      debug("*** %s: session resumed\n", coap_session_str(session));
+      return session;
+    }
+  }
+
+  session = coap_make_session(COAP_PROTO_DTLS, COAP_SESSION_TYPE_SERVER, &packet->dst, &packet->src, packet->ifindex, endpoint->context, endpoint);
   if (session) {
     session->last_rx_tx = now;
     session->state = COAP_SESSION_STATE_HANDSHAKE;
+    endpoint->context->dtls_handshakes++;
     session->tls = coap_dtls_new_server_session(session);
     if (session->tls) {
       session->state = COAP_SESSION_STATE_HANDSHAKE;
@@ -465,6 +611,7 @@ coap_new_endpoint(coap_context_t *context, const coap_address_t *listen_addr, co
   }
 
   ep->default_mtu = COAP_DEFAULT_PDU_SIZE;
+  ep->rx_buffer_size = COAP_RXBUFFER_SIZE;
 
   LL_PREPEND(context->endpoint, ep);
   return ep;
@@ -475,25 +622,66 @@ error:
 }
 
 void coap_endpoint_set_default_mtu(coap_endpoint_t *ep, unsigned mtu) {
+  if (mtu > COAP_MAX_PDU_SIZE)
+    mtu = COAP_MAX_PDU_SIZE;
   ep->default_mtu = (uint16_t)mtu;
 }
 
+int coap_endpoint_set_rx_buffer_size(coap_endpoint_t *ep, size_t size) {
+  return coap_set_rx_buffer_size(&ep->rx_buffer, &ep->rx_buffer_size, size);
+}
+
+int coap_endpoint_set_pmtu_discovery(coap_endpoint_t *ep, int enable) {
+  coap_session_t *session;
+
+  if (!coap_socket_set_pmtu_discovery(&ep->sock, &ep->bind_addr, enable))
+    return 0;
+
+  if (!enable) {
+    LL_FOREACH(ep->sessions, session)
+      coap_session_set_path_mtu(session, session->max_mtu);
+  }
+  return 1;
+}
+
+void coap_endpoint_read_errors(coap_endpoint_t *ep, coap_session_t *sender) {
+  coap_address_t dst;
+  coap_session_t *session;
+  unsigned mtu;
+
+  while (coap_socket_read_error(&ep->sock, &dst, &mtu)) {
+    if (!mtu)
+      continue;
+    if (dst.size == 0) {
+      session = sender;
+    } else {
+      LL_FOREACH(ep->sessions, session) {
+        if (coap_address_equals(&session->remote_addr, &dst))
+          break;
+      }
+    }
+    if (session)
+      coap_session_set_path_mtu(session, mtu);
+  }
+}
+
 void
 coap_free_endpoint(coap_endpoint_t *ep) {
   if (ep) {
-    coap_session_t *session;
+    coap_session_t *session, *tmp;
 
     if (ep->sock.flags != COAP_SOCKET_EMPTY)
       coap_socket_close(&ep->sock);
 
-    LL_FOREACH(ep->sessions, session) {
+    LL_FOREACH_SAFE(ep->sessions, session, tmp) {
       assert(session->ref == 0);
-      if (session->ref == 0) {
-	if (session->sock.flags != COAP_SOCKET_EMPTY)
-	  coap_socket_close(&session->sock);
-      }
+      if (session->ref == 0)
+        coap_session_free(session);
     }
 
+    if (ep->rx_buffer)
+      coap_free_type(COAP_PDU_BUF, ep->rx_buffer);
+
     coap_mfree_endpoint(ep);
   }
 }
@@ -70,8 +70,9 @@ coap_clock_init(void) {
 /* creates a Qx.frac from fval */
 #define Q(frac,fval) ((coap_tick_t)(((1 << (frac)) * (fval))))
 
-/* number of frac bits for sub-seconds */
-#define FRAC 10
+/* number of frac bits for sub-seconds, large enough for the factor
+ * COAP_TICKS_PER_SECOND/1000000000.0 not to be truncated to zero */
+#define FRAC 30
 
 /* rounds val up and right shifts by frac positions */
 #define SHR_FP(val,frac) (((val) + (1 << ((frac) - 1))) >> (frac))
@@ -89,7 +90,7 @@ coap_ticks(coap_tick_t *t) {
    * Both cases should not be possible here.
    */
 
-  tmp = SHR_FP(tv.tv_nsec * Q(FRAC, (COAP_TICKS_PER_SECOND/1000000000.0)), FRAC);
+  tmp = SHR_FP((coap_tick_t)tv.tv_nsec * Q(FRAC, (COAP_TICKS_PER_SECOND/1000000000.0)), FRAC);
 #else /* _POSIX_TIMERS */
   /* Fall back to gettimeofday() */
 
@@ -101,7 +102,7 @@ coap_ticks(coap_tick_t *t) {
    * Both cases should not be possible here.
    */
 
-  tmp = SHR_FP(tv.tv_usec * Q(FRAC, (COAP_TICKS_PER_SECOND/1000000.0)), FRAC);
+  tmp = SHR_FP((coap_tick_t)tv.tv_usec * Q(FRAC, (COAP_TICKS_PER_SECOND/1000000.0)), FRAC);
 #endif /* not _POSIX_TIMERS */
 
   /* Finally, convert temporary FP representation to multiple of
@@ -16,6 +16,8 @@
 #include "mem.h"
 #include "coap_dtls.h"
 
+#include <string.h>
+
 #include <tinydtls.h>
 #include <dtls.h>
 
@@ -429,6 +431,77 @@ coap_dtls_hello(coap_session_t *session,
   return res;
 }
 
+/* handshakes are run by the loop thread */
+int coap_dtls_set_handshake_workers(struct coap_context_t *coap_context,
+                                    unsigned int count) {
+  (void)coap_context;
+  (void)count;
+  return 0;
+}
+
+coap_socket_t *coap_dtls_get_worker_socket(void *dtls_context) {
+  (void)dtls_context;
+  return NULL;
+}
+
+void coap_dtls_handle_workers(void *dtls_context) {
+  (void)dtls_context;
+}
+
+/* tinydtls does not resume sessions */
+int coap_dtls_get_handshake_stats(struct coap_context_t *coap_context,
+                                  coap_dtls_handshake_stats_t *stats) {
+  (void)coap_context;
+  memset(stats, 0, sizeof(coap_dtls_handshake_stats_t));
+  return 0;
+}
+
+/* tinydtls keeps its peers small and allocates buffers for handshakes
+ * only, so releasing idle sessions is all there is to do. */
+int coap_dtls_set_low_memory(struct coap_context_t *coap_context,
+                             int enable, unsigned int idle_timeout) {
+  if (!coap_context->dtls_context)
+    return 0;
+  coap_context->dtls_idle_timeout = enable ? idle_timeout : 0;
+  return 1;
+}
+
+size_t coap_dtls_estimate_session_memory(coap_session_t *session) {
+  (void)session;
+  return 0;
+}
+
+/* tinydtls implements TLS_PSK_WITH_AES_128_CCM_8 only. */
+#define COAP_TINYDTLS_PSK_CIPHER "PSK-AES128-CCM8"
+
+int coap_dtls_set_ciphers(struct coap_context_t *coap_context,
+                          const char *ciphers, int server_preference) {
+  size_t len = strlen(COAP_TINYDTLS_PSK_CIPHER);
+  const char *p;
+
+  (void)coap_context;
+  (void)server_preference;
+  if (!ciphers)
+    return 1;
+  for (p = strstr(ciphers, COAP_TINYDTLS_PSK_CIPHER); p;
+       p = strstr(p + len, COAP_TINYDTLS_PSK_CIPHER)) {
+    if ((p == ciphers || p[-1] == ':') && (p[len] == ':' || p[len] == '\0'))
+      return 1;
+  }
+  coap_log(LOG_WARNING, "coap_dtls_set_ciphers: no cipher suite supported in %s\n", ciphers);
+  return 0;
+}
+
+const char *coap_dtls_get_cipher(coap_session_t *session) {
+  if (!session->tls || session->state != COAP_SESSION_STATE_ESTABLISHED)
+    return NULL;
+  return COAP_TINYDTLS_PSK_CIPHER;
+}
+
+const char *coap_dtls_get_library(void) {
+  return "tinydtls";
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *session) {
   (void)session;
   return 13 + 8 + 8;
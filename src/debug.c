@@ -309,6 +309,8 @@ msg_option_string(uint16_t option_type) {
     { COAP_OPTION_LOCATION_QUERY, "Location-Query" },
     { COAP_OPTION_BLOCK2, "Block2" },
     { COAP_OPTION_BLOCK1, "Block1" },
+    { COAP_OPTION_Q_BLOCK1, "Q-Block1" },
+    { COAP_OPTION_Q_BLOCK2, "Q-Block2" },
     { COAP_OPTION_PROXY_URI, "Proxy-Uri" },
     { COAP_OPTION_PROXY_SCHEME, "Proxy-Scheme" },
     { COAP_OPTION_SIZE1, "Size1" },
@@ -345,7 +347,9 @@ print_content_format(unsigned int format_type,
     { COAP_MEDIATYPE_APPLICATION_OCTET_STREAM, "application/octet-stream" },
     { COAP_MEDIATYPE_APPLICATION_EXI, "application/exi" },
     { COAP_MEDIATYPE_APPLICATION_JSON, "application/json" },
-    { COAP_MEDIATYPE_APPLICATION_CBOR, "application/cbor" }
+    { COAP_MEDIATYPE_APPLICATION_CBOR, "application/cbor" },
+    { COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ,
+      "application/missing-blocks+cbor-seq" }
   };
 
   size_t i;
@@ -416,6 +420,8 @@ coap_show_pdu(const coap_pdu_t *pdu) {
 
     case COAP_OPTION_BLOCK1:
     case COAP_OPTION_BLOCK2:
+    case COAP_OPTION_Q_BLOCK1:
+    case COAP_OPTION_Q_BLOCK2:
       /* split block option into number/more/size where more is the
        * letter M if set, the _ otherwise */
       buf_len = snprintf((char *)buf, sizeof(buf), "%u/%c/%u",
@@ -518,12 +524,17 @@ int coap_debug_set_packet_loss(const char *loss_level) {
   const char *p = loss_level;
   char *end = NULL;
   int n = (int)strtol(p, &end, 10), i = 0;
-  if (end == p || n <= 0)
+  if (end == p || n < 0)
     return 0;
   if (*end == '%') {
+    /* "0%" switches packet loss off again */
+    if (n == 0)
+      num_packet_loss_intervals = 0;
     if (n > 100)
       n = 100;
     packet_loss_level = n * 65536 / 100;
+  } else if (n == 0) {
+    return 0;
   } else {
     while (i < 10) {
       packet_loss_intervals[i].start = n;
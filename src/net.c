@@ -48,6 +48,10 @@
 #include "mem.h"
 #include "str.h"
 #include "async.h"
+#include "coap_completion.h"
+#include "coap_keystore.h"
+#include "coap_hello.h"
+#include "coap_cache.h"
 #include "resource.h"
 #include "option.h"
 #include "encode.h"
@@ -366,15 +370,19 @@ coap_get_session_client_psk(
   return 0;
 }
 
-static size_t
+size_t
 coap_get_context_server_psk(
   const coap_session_t *session,
   const uint8_t *identity, size_t identity_len,
   uint8_t *psk, size_t max_psk_len
 ) {
-  (void)identity;
-  (void)identity_len;
   const coap_context_t *ctx = session->context;
+  if (ctx && ctx->keystore) {
+    size_t key_len = coap_keystore_lookup(ctx->keystore, identity,
+                                          identity_len, psk, max_psk_len);
+    if (key_len > 0)
+      return key_len;
+  }
   if (ctx && ctx->psk_key && ctx->psk_key_len > 0 && ctx->psk_key_len <= max_psk_len) {
     memcpy(psk, ctx->psk_key, ctx->psk_key_len);
     return ctx->psk_key_len;
@@ -539,21 +547,29 @@ coap_free_context(coap_context_t *context) {
   coap_retransmittimer_restart(context);
 #endif
 
+  coap_free_completion_queue(context);
+  coap_free_all_async(context);
+  coap_batch_free(context);
+  coap_cache_free(context);
   coap_delete_all_resources(context);
 
-  if (context->dtls_context)
-    coap_dtls_free_context(context->dtls_context);
-
+  /* endpoints first, their sessions may still refer to the DTLS context */
   LL_FOREACH_SAFE(context->endpoint, ep, tmp) {
     coap_free_endpoint(ep);
   }
 
+  if (context->dtls_context)
+    coap_dtls_free_context(context->dtls_context);
+
   if (context->psk_hint)
     coap_free(context->psk_hint);
 
   if (context->psk_key)
     coap_free(context->psk_key);
 
+  coap_free_keystore(context->keystore);
+  coap_free_hello_limit(context);
+
 #ifndef WITH_CONTIKI
   coap_free_type(COAP_CONTEXT, context);
 #endif/* not WITH_CONTIKI */
@@ -595,6 +611,10 @@ coap_option_check_critical(coap_context_t *ctx,
       case COAP_OPTION_PROXY_SCHEME:
       case COAP_OPTION_BLOCK2:
       case COAP_OPTION_BLOCK1:
+#ifndef WITHOUT_Q_BLOCK
+      case COAP_OPTION_Q_BLOCK1:
+      case COAP_OPTION_Q_BLOCK2:
+#endif /* WITHOUT_Q_BLOCK */
 	break;
       default:
 	if (coap_option_filter_get(ctx->known_options, opt_iter.type) <= 0) {
@@ -655,7 +675,9 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
   }
 
   if (session->state == COAP_SESSION_STATE_NONE) {
-    if (session->proto == COAP_PROTO_DTLS && !session->tls) {
+    /* a server session waits for its client to connect again */
+    if (session->proto == COAP_PROTO_DTLS && !session->tls
+        && session->type == COAP_SESSION_TYPE_CLIENT) {
       session->tls = coap_dtls_new_client_session(session);
       if (session->tls) {
 	session->state = COAP_SESSION_STATE_HANDSHAKE;
@@ -901,6 +923,7 @@ coap_retransmit(coap_context_t *context, coap_queue_t *node) {
 }
 
 void coap_dispatch(coap_context_t *context, coap_queue_t *rcvd);
+static int batch_wants_more(coap_context_t *context, coap_tick_t now);
 
 #ifdef WITH_LWIP
 /* WITH_LWIP, this is handled by coap_recv in a different way */
@@ -943,6 +966,19 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
 
   assert(session->sock.flags & COAP_SOCKET_CONNECTED);
 
+#ifndef WITH_CONTIKI
+  if (!session->rx_buffer)
+    session->rx_buffer = (uint8_t *)coap_malloc_type(COAP_PDU_BUF,
+                                                     session->rx_buffer_size);
+  if (session->rx_buffer) {
+    packet->payload = session->rx_buffer;
+    packet->size = session->rx_buffer_size;
+  } else {
+    warn("*  %s: no receive buffer\n", coap_session_str(session));
+    packet = NULL;
+  }
+#endif /* WITH_CONTIKI */
+
   if (packet) {
     coap_address_copy(&packet->src, &session->remote_addr);
     coap_address_copy(&packet->dst, &session->local_addr);
@@ -961,6 +997,9 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
     result = coap_handle_message_for_proto(ctx, session, packet);
   }
 
+  if (session->sock.flags & COAP_SOCKET_PMTU)
+    coap_session_read_errors(session);
+
 #ifdef WITH_CONTIKI
   if ( packet )
     coap_free_packet(packet);
@@ -969,10 +1008,14 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
   return result;
 }
 
-static int
+/**
+ * Reads a datagram from @p endpoint and handles it. Returns the number of
+ * bytes read, @c 0 if no datagram was available or @c -1 on error.
+ */
+static ssize_t
 coap_read_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t now) {
   ssize_t bytes_read = -1;
-  int result = -1;		/* the value to be returned */
+  int result;
 #ifdef WITH_CONTIKI
   coap_packet_t *packet = coap_malloc_packet();
 #else /* WITH_CONTIKI */
@@ -982,6 +1025,19 @@ coap_read_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t n
 
   assert(endpoint->sock.flags&COAP_SOCKET_BOUND);
 
+#ifndef WITH_CONTIKI
+  if (!endpoint->rx_buffer)
+    endpoint->rx_buffer = (uint8_t *)coap_malloc_type(COAP_PDU_BUF,
+                                                      endpoint->rx_buffer_size);
+  if (endpoint->rx_buffer) {
+    packet->payload = endpoint->rx_buffer;
+    packet->size = endpoint->rx_buffer_size;
+  } else {
+    warn("*  %s: no receive buffer\n", coap_endpoint_str(endpoint));
+    packet = NULL;
+  }
+#endif /* WITH_CONTIKI */
+
   if (packet) {
     coap_address_init(&packet->src);
     coap_address_copy(&packet->dst, &endpoint->bind_addr);
@@ -992,30 +1048,52 @@ coap_read_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t n
     warn("*  %s: read failed\n", coap_endpoint_str(endpoint));
   } else if (bytes_read > 0) {
     coap_session_t *session = coap_endpoint_get_session(endpoint, packet, now);
+    /* hello messages are dropped before any cookie is computed */
+    if (session == &endpoint->hello
+        && !coap_hello_admit(ctx, &packet->src, now))
+      session = NULL;
     if (session) {
       debug("*  %s: received %zd bytes\n", coap_session_str(session), bytes_read);
       result = coap_handle_message_for_proto(ctx, session, packet);
+      if (session == &endpoint->hello)
+        coap_hello_count(ctx, result);
       if (endpoint->proto == COAP_PROTO_DTLS && session->type == COAP_SESSION_TYPE_HELLO && result == 1)
 	coap_endpoint_new_dtls_session(endpoint, packet, now);
     }
   }
 
+  if (endpoint->sock.flags & COAP_SOCKET_PMTU)
+    coap_endpoint_read_errors(endpoint, NULL);
+
 #ifdef WITH_CONTIKI
   if (packet)
     coap_free_packet(packet);
 #endif
 
-  return result;
+  return bytes_read;
 }
 
 void
 coap_read(coap_context_t *ctx, coap_tick_t now) {
   coap_endpoint_t *ep, *tmp;
   coap_session_t *s, *tmp_s;
+  coap_socket_t *completion_sock;
 
   LL_FOREACH_SAFE(ctx->endpoint, ep, tmp) {
-    if ((ep->sock.flags & COAP_SOCKET_HAS_DATA) != 0)
-      coap_read_endpoint(ctx, ep, now);
+    if ((ep->sock.flags & COAP_SOCKET_HAS_DATA) != 0) {
+      if (coap_read_endpoint(ctx, ep, now) <= 0)
+        continue;
+
+      /* read more requests for batch handlers while datagrams are
+       * available */
+      coap_ticks(&now);
+      while (batch_wants_more(ctx, now)) {
+        ep->sock.flags |= COAP_SOCKET_HAS_DATA;
+        if (coap_read_endpoint(ctx, ep, now) <= 0)
+          break;
+        coap_ticks(&now);
+      }
+    }
   }
 
   LL_FOREACH_SAFE(ctx->sessions, s, tmp_s) {
@@ -1023,12 +1101,32 @@ coap_read(coap_context_t *ctx, coap_tick_t now) {
       coap_read_session(ctx, s, now);
   }
 
+  /* handshakes that have been continued by the DTLS workers */
+  if (ctx->dtls_context) {
+    coap_socket_t *worker_sock = coap_dtls_get_worker_socket(ctx->dtls_context);
+    if (worker_sock && (worker_sock->flags & COAP_SOCKET_HAS_DATA) != 0)
+      coap_dtls_handle_workers(ctx->dtls_context);
+  }
+
+  coap_batch_flush(ctx);
+
+  /* results of asynchronous transactions from other threads */
+  completion_sock = coap_completion_queue_socket(ctx);
+  if (completion_sock && (completion_sock->flags & COAP_SOCKET_HAS_DATA) != 0)
+    coap_completion_queue_drain(ctx);
 }
 #endif /* not WITH_LWIP */
 
-int
-coap_handle_message(coap_context_t *ctx, coap_session_t *session,
-  uint8_t *msg, size_t msg_len) {
+static void coap_dispatch_node(coap_context_t *context, coap_queue_t *rcvd);
+
+/**
+ * Parses and interprets the message @p msg. If @p pdu is not NULL, @p msg
+ * is the storage of *@p pdu, which is set to NULL if the context keeps
+ * it. Otherwise a PDU is created and @p msg is copied to it.
+ */
+static int
+coap_handle_message_in(coap_context_t *ctx, coap_session_t *session,
+  uint8_t *msg, size_t msg_len, coap_pdu_t **pdu) {
   coap_queue_t *node;
 
   /* the negated result code */
@@ -1054,11 +1152,15 @@ coap_handle_message(coap_context_t *ctx, coap_session_t *session,
   /* from this point, the result code indicates that */
   result = RESULT_ERR;
 
+  if (pdu) {
+    node->pdu = *pdu;
+  } else {
 #ifdef WITH_LWIP
-  node->pdu = coap_pdu_from_pbuf(coap_packet_extract_pbuf(packet));
+    node->pdu = coap_pdu_from_pbuf(coap_packet_extract_pbuf(packet));
 #else
-  node->pdu = coap_pdu_init(0, 0, 0, msg_len);
+    node->pdu = coap_pdu_init(0, 0, 0, msg_len);
 #endif
+  }
   if (!node->pdu) {
     goto error;
   }
@@ -1091,11 +1193,21 @@ coap_handle_message(coap_context_t *ctx, coap_session_t *session,
   }
 #endif
 
-  coap_dispatch(ctx, node);
+  coap_dispatch_node(ctx, node);
+  if (pdu) {
+    /* handed back unless a handler has kept it, as for a batch */
+    if (node->pdu)
+      node->pdu = NULL;
+    else
+      *pdu = NULL;
+  }
+  coap_delete_node(node);
   return -RESULT_OK;
 
 error:
   /* FIXME: send back RST? */
+  if (pdu)
+    node->pdu = NULL;
   coap_delete_node(node);
   return -result;
 
@@ -1103,6 +1215,19 @@ error_early:
   return -result;
 }
 
+int
+coap_handle_message(coap_context_t *ctx, coap_session_t *session,
+  uint8_t *msg, size_t msg_len) {
+  return coap_handle_message_in(ctx, session, msg, msg_len, NULL);
+}
+
+int
+coap_handle_message_pdu(coap_context_t *ctx, coap_session_t *session,
+  coap_pdu_t **pdu, size_t length) {
+  return coap_handle_message_in(ctx, session, (uint8_t *)(*pdu)->hdr, length,
+                                pdu);
+}
+
 int
 coap_remove_from_queue(coap_queue_t **queue, coap_session_t *session, coap_tid_t id, coap_queue_t **node) {
   coap_queue_t *p, *q;
@@ -1128,7 +1253,7 @@ coap_remove_from_queue(coap_queue_t **queue, coap_session_t *session, coap_tid_t
   do {
     p = q;
     q = q->next;
-  } while (q && session != q->session && id != q->id);
+  } while (q && (session != q->session || id != q->id));
 
   if (q) {			/* found transaction */
     p->next = q->next;
@@ -1222,7 +1347,7 @@ coap_cancel_all_messages(coap_context_t *context, coap_session_t *session,
 
 coap_queue_t *
 coap_find_transaction(coap_queue_t *queue, coap_session_t *session, coap_tid_t id) {
-  while (queue && queue->session != session && queue->id != id)
+  while (queue && (queue->session != session || queue->id != id))
     queue = queue->next;
 
   return queue;
@@ -1579,6 +1704,207 @@ no_response(coap_pdu_t *request, coap_pdu_t *response) {
 #define WANT_WKC(Pdu,Key)					\
   (((Pdu)->hdr->code == COAP_REQUEST_GET) && is_wkc(Key))
 
+static size_t
+batch_max_requests(coap_context_t *context) {
+  return context->batch_max_requests
+    ? context->batch_max_requests : COAP_BATCH_DEFAULT_SIZE;
+}
+
+/** Releases the request at index @p n of the batch of @p context. */
+static void
+batch_release(coap_context_t *context, size_t n) {
+  coap_batch_request_t *b = &context->batch[n];
+
+  coap_delete_pdu(b->request);
+  coap_delete_pdu(b->response);
+  coap_session_release(b->session);
+  memset(b, 0, sizeof(coap_batch_request_t));
+}
+
+/**
+ * Collects the request of @p node for the batch handler of @p resource.
+ * Returns @c 1 if the request has been taken from @p node, @c 0 if it
+ * must be handled as usual.
+ */
+static int
+batch_add(coap_context_t *context, coap_resource_t *resource,
+          coap_queue_t *node) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_batch_request_t *b;
+  size_t max_requests = batch_max_requests(context);
+
+  if (node->pdu->hdr->type != COAP_MESSAGE_NON
+      || coap_mcast_interface(&node->local_if))
+    return 0;
+
+  /* requests that need per-request state in the library */
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_OBSERVE);
+  coap_option_setb(filter, COAP_OPTION_BLOCK1);
+  coap_option_setb(filter, COAP_OPTION_BLOCK2);
+  coap_option_setb(filter, COAP_OPTION_Q_BLOCK1);
+  coap_option_setb(filter, COAP_OPTION_Q_BLOCK2);
+  coap_option_iterator_init(node->pdu, &opt_iter, filter);
+  if (coap_option_next(&opt_iter))
+    return 0;
+
+  if (context->batch_size < max_requests) {
+    /* the second half is scratch space for coap_batch_flush() */
+    b = (coap_batch_request_t *)
+      coap_malloc(2 * max_requests * sizeof(coap_batch_request_t));
+    if (!b)
+      return 0;
+    if (context->batch_count)
+      memcpy(b, context->batch,
+             context->batch_count * sizeof(coap_batch_request_t));
+    if (context->batch)
+      coap_free(context->batch);
+    context->batch = b;
+    context->batch_size = max_requests;
+  }
+
+  if (context->batch_count == 0)
+    coap_ticks(&context->batch_start);
+
+  b = &context->batch[context->batch_count++];
+  b->session = coap_session_reference(node->session);
+  b->resource = resource;
+  b->request = node->pdu;
+  b->response = NULL;
+  node->pdu = NULL;
+
+  if (context->batch_count >= max_requests)
+    coap_batch_flush(context);
+  return 1;
+}
+
+/**
+ * Returns @c 1 if coap_read() should read more datagrams to add to the
+ * pending batch of @p context.
+ */
+static int
+batch_wants_more(coap_context_t *context, coap_tick_t now) {
+  unsigned int max_delay = context->batch_max_delay
+    ? context->batch_max_delay : COAP_BATCH_DEFAULT_DELAY;
+
+  return context->batch_count > 0
+    && now - context->batch_start < max_delay * COAP_TICKS_PER_SECOND / 1000;
+}
+
+/** Sends the response of @p b if it has been set by the batch handler. */
+static void
+batch_send_response(coap_batch_request_t *b) {
+  coap_pdu_t *response = b->response;
+
+  b->response = NULL;
+  if (response->hdr->code == 0
+      || no_response(b->request, response) == RESPONSE_DROP) {
+    coap_delete_pdu(response);
+    return;
+  }
+
+  if (coap_send(b->session, response) == COAP_INVALID_TID)
+    debug("cannot send response for message %d\n", b->request->hdr->id);
+}
+
+void
+coap_batch_flush(coap_context_t *context) {
+  coap_batch_request_t *group = context->batch + context->batch_size;
+  coap_resource_t *resource;
+  size_t count = context->batch_count;
+  size_t n, i, k;
+
+  for (n = 0; n < count; n++) {
+    resource = context->batch[n].resource;
+    if (!resource)
+      continue;
+
+    /* pass all requests for resource to its handler at once */
+    k = 0;
+    for (i = n; i < count; i++) {
+      if (context->batch[i].resource != resource)
+        continue;
+      group[k] = context->batch[i];
+      group[k].response =
+        coap_pdu_init(COAP_MESSAGE_NON, 0, group[k].request->hdr->id,
+                      coap_session_max_pdu_size(group[k].session));
+      if (group[k].response
+          && !coap_add_token(group[k].response,
+                             group[k].request->hdr->token_length,
+                             group[k].request->hdr->token)) {
+        coap_delete_pdu(group[k].response);
+        group[k].response = NULL;
+      }
+      if (group[k].response) {
+        k++;
+      } else {
+        warn("cannot generate response\r\n");
+        coap_delete_pdu(context->batch[i].request);
+        coap_session_release(context->batch[i].session);
+      }
+      memset(&context->batch[i], 0, sizeof(coap_batch_request_t));
+    }
+    if (!k)
+      continue;
+
+    debug("call batch handler for resource 0x%02x%02x%02x%02x with %zu "
+          "requests\n", resource->key[0], resource->key[1],
+          resource->key[2], resource->key[3], k);
+    resource->batch_handler(context, resource, group, k);
+
+    for (i = 0; i < k; i++)
+      batch_send_response(&group[i]);
+    for (i = 0; i < k; i++) {
+      coap_delete_pdu(group[i].request);
+      coap_session_release(group[i].session);
+    }
+  }
+
+  context->batch_count = 0;
+}
+
+void
+coap_context_set_batch_limits(coap_context_t *context,
+                              unsigned int max_requests,
+                              unsigned int max_delay) {
+  assert(context);
+
+  coap_batch_flush(context);
+  if (context->batch && context->batch_size < max_requests) {
+    coap_free(context->batch);
+    context->batch = NULL;
+    context->batch_size = 0;
+  }
+  context->batch_max_requests = max_requests;
+  context->batch_max_delay = max_delay;
+}
+
+void
+coap_batch_detach_resource(coap_context_t *context,
+                           coap_resource_t *resource) {
+  size_t n;
+
+  for (n = 0; n < context->batch_count; n++) {
+    if (context->batch[n].resource == resource)
+      batch_release(context, n);
+  }
+}
+
+void
+coap_batch_free(coap_context_t *context) {
+  size_t n;
+
+  for (n = 0; n < context->batch_count; n++) {
+    if (context->batch[n].resource)
+      batch_release(context, n);
+  }
+  if (context->batch)
+    coap_free(context->batch);
+  context->batch = NULL;
+  context->batch_count = context->batch_size = 0;
+}
+
 static void
 handle_request(coap_context_t *context, coap_queue_t *node) {
   coap_method_handler_t h = NULL;
@@ -1633,10 +1959,12 @@ handle_request(coap_context_t *context, coap_queue_t *node) {
     return;
   }
 
+  if (coap_resource_get_batch_handler(resource)
+      && batch_add(context, resource, node))
+    return;
+
   /* the resource was found, check if there is a registered handler */
-  if ((size_t)node->pdu->hdr->code - 1 <
-    sizeof(resource->handler) / sizeof(coap_method_handler_t))
-    h = resource->handler[node->pdu->hdr->code - 1];
+  h = coap_resource_get_handler(resource, node->pdu->hdr->code);
 
   if (h) {
     debug("call custom handler for resource 0x%02x%02x%02x%02x\n",
@@ -1678,7 +2006,31 @@ handle_request(coap_context_t *context, coap_queue_t *node) {
 	}
       }
 
-      h(context, resource, node->session, node->pdu, &token, response);
+      if (coap_large_response_get(resource, node->session, node->pdu,
+				  response)) {
+	debug("next block for resource 0x%02x%02x%02x%02x\n",
+	  key[0], key[1], key[2], key[3]);
+      } else if (coap_large_request_receive(resource, node->session,
+					    node->pdu, response)) {
+	debug("block received for resource 0x%02x%02x%02x%02x\n",
+	  key[0], key[1], key[2], key[3]);
+      } else if (coap_cache_get(context, resource, node->pdu, response)) {
+	debug("response for resource 0x%02x%02x%02x%02x taken from cache\n",
+	  key[0], key[1], key[2], key[3]);
+#ifndef WITHOUT_ASYNC
+      } else if (coap_async_coalesce(context, resource, node->session,
+				     node->pdu)) {
+	/* answered with the pending request, send empty ACK if needed */
+#endif /* WITHOUT_ASYNC */
+      } else {
+	h(context, resource, node->session, node->pdu, &token, response);
+#ifndef WITHOUT_ASYNC
+	coap_async_enable_coalescing(context, resource, node->session,
+				     node->pdu);
+#endif /* WITHOUT_ASYNC */
+	coap_cache_put(context, resource, node->pdu, response);
+	coap_large_request_finish(node->session, node->pdu, response);
+      }
 
       respond = no_response(node->pdu, response);
       if (respond != RESPONSE_DROP) {
@@ -1751,6 +2103,12 @@ handle_response(coap_context_t *context,
     rcvd->pdu->hdr->token,
     rcvd->pdu->hdr->token_length);
 
+  /* Responses to requests of library-driven block transfers stay in the
+   * library. */
+  if (coap_block_fetch_response(rcvd->session, rcvd->pdu)
+      || coap_q_block_send_response(rcvd->session, rcvd->pdu))
+    return;
+
   /* Call application-specific response handler when available. */
   if (context->response_handler) {
     context->response_handler(context, rcvd->session, sent ? sent->pdu : NULL,
@@ -1760,6 +2118,13 @@ handle_response(coap_context_t *context,
 
 void
 coap_dispatch(coap_context_t *context, coap_queue_t *rcvd) {
+  coap_dispatch_node(context, rcvd);
+  coap_delete_node(rcvd);
+}
+
+/* Dispatches rcvd, which is left to the caller. */
+static void
+coap_dispatch_node(coap_context_t *context, coap_queue_t *rcvd) {
   coap_queue_t *sent = NULL;
   coap_pdu_t *response;
   coap_opt_filter_t opt_filter;
@@ -1856,7 +2221,6 @@ coap_dispatch(coap_context_t *context, coap_queue_t *rcvd) {
 
   cleanup:
     coap_delete_node(sent);
-    coap_delete_node(rcvd);
   }
 }
 
@@ -94,9 +94,9 @@ coap_pdu_init(unsigned char type, unsigned char code,
   if (size < sizeof(coap_hdr_t) || size > COAP_RXBUFFER_SIZE)
     return NULL;
 #else
-  assert(size <= 16384);
+  assert(size <= COAP_MAX_PDU_SIZE);
   /* Size must be large enough to fit the header. */
-  if (size < sizeof(coap_hdr_t) || size > 16384)
+  if (size < sizeof(coap_hdr_t) || size > COAP_MAX_PDU_SIZE)
     return NULL;
 #endif
 
@@ -211,6 +211,71 @@ coap_add_option(coap_pdu_t *pdu, unsigned short type, unsigned int len, const un
   return optsize;
 }
 
+size_t
+coap_insert_option(coap_pdu_t *pdu, unsigned short type,
+                   unsigned int len, const unsigned char *data) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_pdu_t *tmp;
+  size_t optsize = 0, payload_len;
+  unsigned char *payload;
+  unsigned short max_delta;
+
+  assert(pdu);
+
+  if (type >= pdu->max_delta && !pdu->data)
+    return coap_add_option(pdu, type, len, data);
+
+  /* keep a copy of options and data to rebuild the PDU from */
+  tmp = coap_pdu_init(0, 0, 0, pdu->length);
+  if (!tmp)
+    return 0;
+  memcpy(tmp->hdr, pdu->hdr, pdu->length);
+  tmp->length = pdu->length;
+  if (pdu->data)
+    tmp->data = (unsigned char *)tmp->hdr
+      + (pdu->data - (unsigned char *)pdu->hdr);
+  max_delta = pdu->max_delta;
+
+  pdu->length = sizeof(coap_hdr_t) + pdu->hdr->token_length;
+  pdu->max_delta = 0;
+  pdu->data = NULL;
+
+  coap_option_iterator_init(tmp, &opt_iter, COAP_OPT_ALL);
+  do {
+    option = coap_option_next(&opt_iter);
+
+    if (!optsize && (!option || opt_iter.type > type)) {
+      optsize = coap_add_option(pdu, type, len, data);
+      if (!optsize)
+        goto error;
+    }
+
+    if (option && !coap_add_option(pdu, opt_iter.type,
+                                   coap_opt_length(option),
+                                   coap_opt_value(option)))
+      goto error;
+  } while (option);
+
+  if (coap_get_data(tmp, &payload_len, &payload)
+      && !coap_add_data(pdu, (unsigned int)payload_len, payload))
+    goto error;
+
+  coap_delete_pdu(tmp);
+  return optsize;
+
+ error:
+  warn("coap_insert_option: cannot insert option\n");
+  memcpy(pdu->hdr, tmp->hdr, tmp->length);
+  pdu->length = tmp->length;
+  pdu->max_delta = max_delta;
+  if (tmp->data)
+    pdu->data = (unsigned char *)pdu->hdr
+      + (tmp->data - (unsigned char *)tmp->hdr);
+  coap_delete_pdu(tmp);
+  return 0;
+}
+
 /** @FIXME de-duplicate code with coap_add_option */
 unsigned char*
 coap_add_option_later(coap_pdu_t *pdu, unsigned short type, unsigned int len) {
@@ -401,13 +466,16 @@ coap_pdu_parse(unsigned char *data, size_t length, coap_pdu_t *pdu) {
   }
 
 #ifndef WITH_LWIP
-  /* Copy message id in network byte order, so we can easily write the
-   * response back to the network. */
-  memcpy(&pdu->hdr->id, data + 2, 2);
-
-  /* Append data (including the Token) to pdu structure, if any. */
-  if (length > sizeof(coap_hdr_t)) {
-    memcpy(pdu->hdr + 1, data + sizeof(coap_hdr_t), length - sizeof(coap_hdr_t));
+  /* nothing to copy if the message has been received into the PDU */
+  if (data != (unsigned char *)pdu->hdr) {
+    /* Copy message id in network byte order, so we can easily write the
+     * response back to the network. */
+    memcpy(&pdu->hdr->id, data + 2, 2);
+
+    /* Append data (including the Token) to pdu structure, if any. */
+    if (length > sizeof(coap_hdr_t)) {
+      memcpy(pdu->hdr + 1, data + sizeof(coap_hdr_t), length - sizeof(coap_hdr_t));
+    }
   }
   pdu->length = (unsigned short)length;
  
@@ -8,6 +8,8 @@
 
 #include "coap_config.h"
 #include "coap.h"
+#include "coap_cache.h"
+#include "coap_file.h"
 #include "debug.h"
 #include "mem.h"
 #include "net.h"
@@ -15,6 +17,10 @@
 #include "subscribe.h"
 #include "utlist.h"
 
+#ifndef WITHOUT_ATTR_INDEX
+#include "uthash.h"
+#endif /* WITHOUT_ATTR_INDEX */
+
 #if defined(WITH_LWIP)
 /* mem.h is only needed for the string free calls for
  * COAP_ATTR_FLAGS_RELEASE_NAME / COAP_ATTR_FLAGS_RELEASE_VALUE /
@@ -100,6 +106,21 @@ coap_free_subscription(coap_subscription_t *subscription) {
     }									\
   }
  
+/**
+ * Prints the link attribute Attr (which must have the fields name and
+ * value) to Buf, preceded by a semicolon.
+ */
+#define PRINT_ATTR_WITH_OFFSET(Buf,Bufend,Offset,Attr,Result) {		\
+    PRINT_COND_WITH_OFFSET((Buf), (Bufend), (Offset), ';', (Result));	\
+    COPY_COND_WITH_OFFSET((Buf), (Bufend), (Offset),			\
+                          (Attr)->name.s, (Attr)->name.length, (Result)); \
+    if ((Attr)->value.s) {						\
+      PRINT_COND_WITH_OFFSET((Buf), (Bufend), (Offset), '=', (Result)); \
+      COPY_COND_WITH_OFFSET((Buf), (Bufend), (Offset),			\
+                            (Attr)->value.s, (Attr)->value.length, (Result)); \
+    }									\
+  }
+
 static int
 match(const str *text, const str *pattern, int match_prefix, int match_substring) {
   assert(text); assert(pattern);
@@ -135,6 +156,490 @@ match(const str *text, const str *pattern, int match_prefix, int match_substring
     memcmp(text->s, pattern->s, pattern->length) == 0;
 }
 
+#ifndef WITHOUT_QUERY_FILTER
+/* Attributes whose values are space-separated lists of tokens. */
+static const str substring_attributes[] = {
+  {2, (unsigned char *)"rt"},
+  {2, (unsigned char *)"if"},
+  {3, (unsigned char *)"rel"},
+  {0, NULL}};
+
+static int
+is_substring_attribute(const unsigned char *name, size_t nlen) {
+  const str *a;
+
+  for (a = substring_attributes; a->s; a++) {
+    if (nlen == a->length && memcmp(name, a->s, nlen) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Sets @p value to the attribute value @p raw with surrounding double
+ * quotes removed.
+ */
+static void
+unquote_value(const str *raw, str *value) {
+  if (raw->s && raw->length >= 2 && raw->s[0] == '"') {
+    value->length = raw->length - 2;
+    value->s = raw->s + 1;
+  } else {
+    *value = *raw;
+  }
+}
+#endif /* WITHOUT_QUERY_FILTER */
+
+#ifndef WITHOUT_ATTR_INDEX
+/*
+ * The attribute index maps each attribute name to a sorted array of
+ * value tokens. Each token holds the list of attributes (and thus
+ * resources) carrying it. Values of rt, if and rel are split into
+ * space-separated tokens just like match() does, values of all other
+ * attributes are indexed as a whole. Exact lookups use a binary
+ * search, prefix lookups scan the contiguous range of tokens that
+ * start with the given prefix.
+ */
+
+typedef struct coap_attr_token_t coap_attr_token_t;
+
+/**
+ * An attribute that carries a particular value token. Postings for
+ * attributes of a resource class have no resource, postings for
+ * attributes of static resources have no attr.
+ */
+typedef struct coap_attr_posting_t {
+  struct coap_attr_posting_t *prev;
+  struct coap_attr_posting_t *next;
+  struct coap_attr_posting_t *sibling; /**< next posting of the same attr */
+  coap_attr_token_t *token;            /**< the token this posting is filed under */
+  coap_attr_t *attr;
+  coap_resource_t *resource;
+} coap_attr_posting_t;
+
+/** All postings for a value token of a specific attribute name. */
+struct coap_attr_token_t {
+  coap_attr_posting_t *postings;
+  struct coap_attr_index_t *index; /**< the attribute name entry */
+  str token;                       /**< points to the bytes after this struct */
+};
+
+/** Index entry for an attribute name. */
+typedef struct coap_attr_index_t {
+  UT_hash_handle hh;
+  coap_attr_token_t **tokens;      /**< sorted by token value */
+  size_t count;                    /**< number of used elements in tokens */
+  size_t size;                     /**< number of allocated elements */
+  str name;                        /**< points to the bytes after this struct */
+} coap_attr_index_t;
+
+static int
+compare_token(const str *token, const unsigned char *s, size_t len) {
+  int res = memcmp(token->s, s, min(token->length, len));
+  if (res == 0 && token->length != len)
+    res = token->length < len ? -1 : 1;
+  return res;
+}
+
+/**
+ * Returns the position of the first token in @p idx that is not less
+ * than @p s.
+ */
+static size_t
+token_lower_bound(const coap_attr_index_t *idx,
+                  const unsigned char *s, size_t len) {
+  size_t lo = 0, hi = idx->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compare_token(&idx->tokens[mid]->token, s, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static coap_attr_index_t *
+attr_index_find(coap_context_t *context,
+                const unsigned char *name, size_t nlen) {
+  coap_attr_index_t *idx;
+  HASH_FIND(hh, context->attr_index, name, nlen, idx);
+  return idx;
+}
+
+/**
+ * Returns the token entry for @p name and @p s from the attribute
+ * index of @p context. Missing entries are created. This function
+ * returns @c NULL on error.
+ */
+static coap_attr_token_t *
+attr_index_get_token(coap_context_t *context,
+                     const unsigned char *name, size_t nlen,
+                     const unsigned char *s, size_t len) {
+  coap_attr_index_t *idx;
+  coap_attr_token_t *token;
+  size_t pos;
+
+  idx = attr_index_find(context, name, nlen);
+  if (!idx) {
+    idx = (coap_attr_index_t *)coap_malloc(sizeof(coap_attr_index_t) + nlen);
+    if (!idx)
+      return NULL;
+    memset(idx, 0, sizeof(coap_attr_index_t));
+    idx->name.s = (unsigned char *)(idx + 1);
+    idx->name.length = nlen;
+    memcpy(idx->name.s, name, nlen);
+    HASH_ADD_KEYPTR(hh, context->attr_index, idx->name.s, nlen, idx);
+  }
+
+  pos = token_lower_bound(idx, s, len);
+  if (pos < idx->count && compare_token(&idx->tokens[pos]->token, s, len) == 0)
+    return idx->tokens[pos];
+
+  if (idx->count == idx->size) {
+    size_t size = idx->size ? 2 * idx->size : 4;
+    coap_attr_token_t **tokens;
+
+    tokens = (coap_attr_token_t **)coap_malloc(size * sizeof(coap_attr_token_t *));
+    if (!tokens)
+      goto error;
+    if (idx->tokens) {
+      memcpy(tokens, idx->tokens, idx->count * sizeof(coap_attr_token_t *));
+      coap_free(idx->tokens);
+    }
+    idx->tokens = tokens;
+    idx->size = size;
+  }
+
+  token = (coap_attr_token_t *)coap_malloc(sizeof(coap_attr_token_t) + len);
+  if (!token)
+    goto error;
+
+  token->postings = NULL;
+  token->index = idx;
+  token->token.s = (unsigned char *)(token + 1);
+  token->token.length = len;
+  if (len)
+    memcpy(token->token.s, s, len);
+
+  memmove(idx->tokens + pos + 1, idx->tokens + pos,
+          (idx->count - pos) * sizeof(coap_attr_token_t *));
+  idx->tokens[pos] = token;
+  idx->count++;
+
+  return token;
+
+ error:
+  if (idx->count == 0) {
+    HASH_DELETE(hh, context->attr_index, idx);
+    coap_free(idx->tokens);
+    coap_free(idx);
+  }
+  return NULL;
+}
+
+static void
+attr_index_release_token(coap_context_t *context, coap_attr_token_t *token) {
+  coap_attr_index_t *idx = token->index;
+  size_t pos;
+
+  pos = token_lower_bound(idx, token->token.s, token->token.length);
+  assert(pos < idx->count && idx->tokens[pos] == token);
+
+  memmove(idx->tokens + pos, idx->tokens + pos + 1,
+          (idx->count - pos - 1) * sizeof(coap_attr_token_t *));
+  idx->count--;
+  coap_free(token);
+
+  if (idx->count == 0) {
+    HASH_DELETE(hh, context->attr_index, idx);
+    coap_free(idx->tokens);
+    coap_free(idx);
+  }
+}
+
+/**
+ * Removes the postings in @p chain (linked by their sibling field)
+ * from the attribute index of @p context.
+ */
+static void
+attr_index_remove_postings(coap_context_t *context,
+                           coap_attr_posting_t **chain) {
+  coap_attr_posting_t *posting;
+
+  while ((posting = *chain) != NULL) {
+    coap_attr_token_t *token = posting->token;
+
+    *chain = posting->sibling;
+    DL_DELETE(token->postings, posting);
+    if (!token->postings)
+      attr_index_release_token(context, token);
+    coap_free(posting);
+  }
+}
+
+COAP_STATIC_INLINE void
+attr_index_remove(coap_context_t *context, coap_attr_t *attr) {
+  attr_index_remove_postings(context, &attr->postings);
+}
+
+/**
+ * Adds all value tokens of the attribute @p name with value @p raw to
+ * the attribute index of @p context. The postings refer to @p attr and
+ * @p resource and are linked into @p chain. This function returns @c 1
+ * on success or @c 0 on error. On error, the index of @p context is
+ * marked incomplete so that query filters no longer rely on it.
+ */
+static int
+attr_index_add_value(coap_context_t *context,
+                     const str *name, const str *raw,
+                     coap_attr_t *attr, coap_resource_t *resource,
+                     coap_attr_posting_t **chain) {
+  str value;
+  int split;
+  unsigned char *next_token;
+  size_t remaining_length;
+
+  unquote_value(raw, &value);
+  split = is_substring_attribute(name->s, name->length);
+  next_token = value.s;
+  remaining_length = value.length;
+
+  /* This loop splits the value exactly like match() does. */
+  do {
+    unsigned char *s = next_token;
+    size_t len = remaining_length;
+    coap_attr_token_t *token;
+    coap_attr_posting_t *posting;
+
+    if (split) {
+      if (!remaining_length)
+        break;
+      next_token = (unsigned char *)memchr(s, ' ', remaining_length);
+      if (next_token) {
+        len = next_token - s;
+        remaining_length -= len + 1;
+        next_token++;
+      } else {
+        remaining_length = 0;
+      }
+    } else {
+      remaining_length = 0;
+    }
+
+    token = attr_index_get_token(context, name->s, name->length, s, len);
+    if (!token)
+      goto error;
+
+    /* a value may contain the same token more than once */
+    if (token->postings && token->postings->attr == attr &&
+        token->postings->resource == resource)
+      continue;
+
+    posting = (coap_attr_posting_t *)coap_malloc(sizeof(coap_attr_posting_t));
+    if (!posting) {
+      if (!token->postings)
+        attr_index_release_token(context, token);
+      goto error;
+    }
+
+    posting->token = token;
+    posting->attr = attr;
+    posting->resource = resource;
+    posting->sibling = *chain;
+    *chain = posting;
+    DL_PREPEND(token->postings, posting);
+  } while (remaining_length);
+
+  return 1;
+
+ error:
+  if (!context->attr_index_incomplete)
+    warn("attr_index_add: no memory left, "
+         "query filters use a linear search from now on\n");
+  context->attr_index_incomplete = 1;
+  attr_index_remove_postings(context, chain);
+  return 0;
+}
+
+COAP_STATIC_INLINE int
+attr_index_add(coap_context_t *context, coap_attr_t *attr) {
+  return attr_index_add_value(context, &attr->name, &attr->value,
+                              attr, attr->resource, &attr->postings);
+}
+
+static void
+attr_index_free(coap_context_t *context) {
+  coap_attr_index_t *idx, *tmp;
+
+  /* All entries are released with their attributes. Anything left
+   * here was added by an attribute that has been unlinked by other
+   * means. */
+  HASH_ITER(hh, context->attr_index, idx, tmp) {
+    while (idx->count) {
+      coap_attr_token_t *token = idx->tokens[--idx->count];
+      coap_attr_posting_t *posting, *ptmp;
+      DL_FOREACH_SAFE(token->postings, posting, ptmp) {
+        if (posting->attr)
+          posting->attr->postings = NULL;
+        coap_free(posting);
+      }
+      coap_free(token);
+    }
+    HASH_DELETE(hh, context->attr_index, idx);
+    coap_free(idx->tokens);
+    coap_free(idx);
+  }
+}
+
+/**
+ * Orders resources like RESOURCES_ITER() does: the hash table keeps
+ * the order of insertion, the list is built by prepending.
+ */
+static int
+compare_resource_seq(const void *a, const void *b) {
+  const coap_resource_t *ra = *(const coap_resource_t * const *)a;
+  const coap_resource_t *rb = *(const coap_resource_t * const *)b;
+#ifdef COAP_RESOURCES_NOHASH
+  return ra->seq > rb->seq ? -1 : (ra->seq < rb->seq ? 1 : 0);
+#else
+  return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq ? 1 : 0);
+#endif
+}
+
+/**
+ * Checks if the attribute coap_find_attr() returns for @p name on @p r
+ * matches @p pattern. The index lists every attribute, but a query
+ * filter only looks at the first one of a given name.
+ */
+static int
+attr_index_verify(coap_resource_t *r, const str *name, const str *pattern,
+                  int match_prefix) {
+  const coap_attr_t *attr;
+  str value;
+
+  attr = coap_find_attr(r, name->s, name->length);
+  if (!attr)
+    return 0;
+  unquote_value(&attr->value, &value);
+  return match(&value, pattern, match_prefix,
+               is_substring_attribute(name->s, name->length));
+}
+
+/**
+ * Looks up all resources that have an attribute @p name with a value
+ * token matching @p pattern. The result is an array of distinct
+ * resources in the order of context->resources that must be released
+ * with coap_free(). The number of
+ * resources is stored in @p count. As with a linear search, only the
+ * first attribute @p name of a resource is matched.
+ *
+ * @return The array of resources, or @c NULL if none were found
+ *         (@p count is @c 0) or on error (@p count is @c 1).
+ */
+static coap_resource_t **
+attr_index_lookup(coap_context_t *context,
+                  const str *name, const str *pattern, int match_prefix,
+                  size_t *count) {
+  coap_attr_index_t *idx;
+  coap_resource_t **result;
+  size_t pos, end, n = 0, i, j;
+
+  *count = 0;
+  idx = attr_index_find(context, name->s, name->length);
+  if (!idx)
+    return NULL;
+
+  pos = end = token_lower_bound(idx, pattern->s, pattern->length);
+  while (end < idx->count) {
+    const str *token = &idx->tokens[end]->token;
+    coap_attr_posting_t *posting;
+
+    if (match_prefix) {
+      if (token->length < pattern->length ||
+          memcmp(token->s, pattern->s, pattern->length) != 0)
+        break;
+    } else if (compare_token(token, pattern->s, pattern->length) != 0) {
+      break;
+    }
+
+    DL_FOREACH(idx->tokens[end]->postings, posting)
+      n += posting->resource ? 1 : posting->attr->rclass->count;
+    end++;
+  }
+
+  if (n == 0)
+    return NULL;
+
+  result = (coap_resource_t **)coap_malloc(n * sizeof(coap_resource_t *));
+  if (!result) {
+    *count = 1;
+    return NULL;
+  }
+
+  for (i = 0; pos < end; pos++) {
+    coap_attr_posting_t *posting;
+    DL_FOREACH(idx->tokens[pos]->postings, posting) {
+      if (posting->resource) {
+        result[i++] = posting->resource;
+      } else {
+        coap_resource_t *r;
+        DL_FOREACH2(posting->attr->rclass->resources, r, class_next)
+          result[i++] = r;
+      }
+    }
+  }
+
+  /* A resource may carry several matching tokens. */
+  qsort(result, n, sizeof(coap_resource_t *), compare_resource_seq);
+  for (i = 0, j = 0; j < n; j++) {
+    if ((j == 0 || result[j] != result[j - 1]) &&
+        attr_index_verify(result[j], name, pattern, match_prefix))
+      result[i++] = result[j];
+  }
+
+  *count = i;
+  if (i == 0) {
+    coap_free(result);
+    return NULL;
+  }
+  return result;
+}
+#endif /* WITHOUT_ATTR_INDEX */
+
+/**
+ * Appends the link description of @p r to the output of
+ * coap_print_wellknown(), preceded by a comma unless @p r is the
+ * first resource. Returns @c 0 on error, @c 1 otherwise.
+ */
+static int
+print_wellknown_link(coap_resource_t *r, unsigned char **p,
+                     const unsigned char *bufend, size_t *offset,
+                     size_t *written, int *subsequent_resource) {
+  coap_print_status_t result;
+  size_t left;
+
+  if (!*subsequent_resource) {	/* this is the first resource  */
+    *subsequent_resource = 1;
+  } else {
+    PRINT_COND_WITH_OFFSET(*p, bufend, *offset, ',', *written);
+  }
+
+  left = bufend - *p; /* calculate available space */
+  result = coap_print_link(r, *p, &left, offset);
+
+  if (result & COAP_PRINT_STATUS_ERROR) {
+    return 0;
+  }
+
+  /* coap_print_link() returns the number of characters that
+   * where actually written to p. Now advance to its end. */
+  *p += COAP_PRINT_OUTPUT_LENGTH(result);
+  *written += left;
+  return 1;
+}
+
 /** 
  * Prints the names of all known resources to @p buf. This function
  * sets @p buflen to the number of bytes actually written and returns
@@ -169,7 +674,7 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
   size_t output_length = 0;
   unsigned char *p = buf;
   const unsigned char *bufend = buf + *buflen;
-  size_t left, written = 0;
+  size_t written = 0;
   coap_print_status_t result;
   const size_t old_offset = offset;
   int subsequent_resource = 0;
@@ -179,11 +684,6 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
 #define MATCH_URI       0x01
 #define MATCH_PREFIX    0x02
 #define MATCH_SUBSTRING 0x04
-  static const str _rt_attributes[] = {
-    {2, (unsigned char *)"rt"},
-    {2, (unsigned char *)"if"},
-    {3, (unsigned char *)"rel"},
-    {0, NULL}};
 #endif /* WITHOUT_QUERY_FILTER */
 
 #ifndef WITHOUT_QUERY_FILTER
@@ -195,18 +695,12 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
       resource_param.length++;
     
     if (resource_param.length < COAP_OPT_LENGTH(query_filter)) {
-      const str *rt_attributes;
       if (resource_param.length == 4 && 
 	  memcmp(resource_param.s, "href", 4) == 0)
 	flags |= MATCH_URI;
 
-      for (rt_attributes = _rt_attributes; rt_attributes->s; rt_attributes++) {
-        if (resource_param.length == rt_attributes->length && 
-            memcmp(resource_param.s, rt_attributes->s, rt_attributes->length) == 0) {
-          flags |= MATCH_SUBSTRING;
-          break;
-        }
-      }
+      if (is_substring_attribute(resource_param.s, resource_param.length))
+        flags |= MATCH_SUBSTRING;
 
       /* rest is query-pattern */
       query_pattern.s = 
@@ -228,6 +722,41 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
       }      
     }
   }
+
+  if (resource_param.length &&
+      (flags & (MATCH_URI | MATCH_PREFIX)) == MATCH_URI) {
+    /* exact match on href: look up the resource by its key */
+    coap_key_t key;
+    coap_resource_t *r;
+
+    coap_hash_path(query_pattern.s, query_pattern.length, key);
+    r = coap_get_resource_from_key(context, key);
+    if (r && match(&r->uri, &query_pattern, 0, 0))
+      print_wellknown_link(r, &p, bufend, &offset, &written,
+                           &subsequent_resource);
+    goto finish;
+  }
+
+#ifndef WITHOUT_ATTR_INDEX
+  if (resource_param.length && !(flags & MATCH_URI)
+      && !context->attr_index_incomplete) {
+    coap_resource_t **resources;
+    size_t count, n;
+
+    resources = attr_index_lookup(context, &resource_param, &query_pattern,
+                                  (flags & MATCH_PREFIX) != 0, &count);
+    if (resources || count == 0) {
+      for (n = 0; n < count; n++) {
+        if (!print_wellknown_link(resources[n], &p, bufend, &offset, &written,
+                                  &subsequent_resource))
+          break;
+      }
+      coap_free(resources);
+      goto finish;
+    }
+    /* out of memory, fall back to linear search */
+  }
+#endif /* WITHOUT_ATTR_INDEX */
 #endif /* WITHOUT_QUERY_FILTER */
 
   RESOURCES_ITER(context->resources, r) {
@@ -239,16 +768,12 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
 	if (!match(&r->uri, &query_pattern, (flags & MATCH_PREFIX) != 0, (flags & MATCH_SUBSTRING) != 0))
 	  continue;
       } else {			/* match attribute */
-	coap_attr_t *attr;
+	const coap_attr_t *attr;
         str unquoted_val;
 	attr = coap_find_attr(r, resource_param.s, resource_param.length);
         if (!attr) continue;
-        if (attr->value.s[0] == '"') {          /* if attribute has a quoted value, remove double quotes */
-          unquoted_val.length = attr->value.length - 2;
-          unquoted_val.s = attr->value.s + 1;
-        } else {
-          unquoted_val = attr->value;
-        }
+        /* if attribute has a quoted value, remove double quotes */
+        unquote_value(&attr->value, &unquoted_val);
 	if (!(match(&unquoted_val, &query_pattern, 
                     (flags & MATCH_PREFIX) != 0,
                     (flags & MATCH_SUBSTRING) != 0)))
@@ -257,25 +782,14 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
     }
 #endif /* WITHOUT_QUERY_FILTER */
 
-    if (!subsequent_resource) {	/* this is the first resource  */
-      subsequent_resource = 1;
-    } else {
-      PRINT_COND_WITH_OFFSET(p, bufend, offset, ',', written);
-    }
-
-    left = bufend - p; /* calculate available space */
-    result = coap_print_link(r, p, &left, &offset);
-
-    if (result & COAP_PRINT_STATUS_ERROR) {
+    if (!print_wellknown_link(r, &p, bufend, &offset, &written,
+                              &subsequent_resource))
       break;
-    }
-
-    /* coap_print_link() returns the number of characters that
-     * where actually written to p. Now advance to its end. */
-    p += COAP_PRINT_OUTPUT_LENGTH(result);
-    written += left;
   }
 
+#ifndef WITHOUT_QUERY_FILTER
+ finish:
+#endif /* WITHOUT_QUERY_FILTER */
   *buflen = written;
   output_length = p - buf;
 
@@ -318,15 +832,93 @@ coap_resource_init(const unsigned char *uri, size_t len, int flags) {
   return r;
 }
 
-coap_attr_t *
-coap_add_attr(coap_resource_t *resource, 
-	      const unsigned char *name, size_t nlen,
-	      const unsigned char *val, size_t vlen,
-              int flags) {
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+coap_resource_t *
+coap_resource_init_compact(coap_resource_class_t *rclass,
+                           const unsigned char *uri, size_t len) {
+  coap_resource_t *r;
+
+  assert(rclass);
+
+  /* Only the fields up to the handler table are allocated, the URI is
+   * stored right behind them. */
+  r = (coap_resource_t *)coap_malloc_type(COAP_RESOURCE,
+                                          COAP_RESOURCE_COMPACT_SIZE + len);
+  if (r) {
+    memset(r, 0, COAP_RESOURCE_COMPACT_SIZE);
+    r->rclass = rclass;
+    r->observable = rclass->observable;
+
+    if (len) {
+      r->uri.s = (unsigned char *)r + COAP_RESOURCE_COMPACT_SIZE;
+      memcpy(r->uri.s, uri, len);
+    }
+    r->uri.length = len;
+
+    coap_hash_path(r->uri.s, r->uri.length, r->key);
+
+    /* the URI must not be released separately */
+    r->flags = rclass->flags & ~COAP_RESOURCE_FLAGS_RELEASE_URI;
+  } else {
+    debug("coap_resource_init_compact: no memory left\n");
+  }
+
+  return r;
+}
+
+coap_resource_class_t *
+coap_resource_class_init(int flags) {
+  coap_resource_class_t *rclass;
+
+  rclass = (coap_resource_class_t *)coap_malloc(sizeof(coap_resource_class_t));
+  if (rclass) {
+    memset(rclass, 0, sizeof(coap_resource_class_t));
+    rclass->flags = flags;
+  } else {
+    debug("coap_resource_class_init: no memory left\n");
+  }
+
+  return rclass;
+}
+
+void
+coap_add_resource_class(coap_context_t *context,
+                        coap_resource_class_t *rclass) {
+#ifndef WITHOUT_ATTR_INDEX
   coap_attr_t *attr;
 
-  if (!resource || !name)
-    return NULL;
+  LL_FOREACH(rclass->link_attr, attr)
+    attr_index_add(context, attr);
+#endif /* WITHOUT_ATTR_INDEX */
+
+  assert(!rclass->context);
+  rclass->context = context;
+  LL_PREPEND(context->resource_classes, rclass);
+}
+
+static void
+coap_free_resource_class(coap_resource_class_t *rclass) {
+  coap_attr_t *attr, *tmp;
+
+  /* all resources of this class must have been deleted before */
+  assert(rclass->count == 0);
+
+  LL_FOREACH_SAFE(rclass->link_attr, attr, tmp) coap_delete_attr(attr);
+
+  coap_free(rclass);
+}
+#endif /* !WITH_CONTIKI && !WITH_LWIP */
+
+/**
+ * Creates a new attribute and prepends it to @p list. See
+ * coap_add_attr() for the parameters.
+ */
+static coap_attr_t *
+coap_new_attr(coap_attr_t **list,
+              const unsigned char *name, size_t nlen,
+              const unsigned char *val, size_t vlen,
+              int flags) {
+  coap_attr_t *attr;
 
 #ifdef WITH_LWIP
   attr = (coap_attr_t *)memp_malloc(MEMP_COAP_RESOURCEATTR);
@@ -336,6 +928,7 @@ coap_add_attr(coap_resource_t *resource,
 #endif
 
   if (attr) {
+    memset(attr, 0, sizeof(coap_attr_t));
     attr->name.length = nlen;
     attr->value.length = val ? vlen : 0;
 
@@ -345,16 +938,71 @@ coap_add_attr(coap_resource_t *resource,
     attr->flags = flags;
 
     /* add attribute to resource list */
-    LL_PREPEND(resource->link_attr, attr);
+    LL_PREPEND(*list, attr);
   } else {
     debug("coap_add_attr: no memory left\n");
   }
-  
+
   return attr;
 }
 
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
 coap_attr_t *
-coap_find_attr(coap_resource_t *resource, 
+coap_resource_class_add_attr(coap_resource_class_t *rclass,
+                             const unsigned char *name, size_t nlen,
+                             const unsigned char *val, size_t vlen,
+                             int flags) {
+  coap_attr_t *attr;
+
+  if (!rclass || !name)
+    return NULL;
+
+  attr = coap_new_attr(&rclass->link_attr, name, nlen, val, vlen, flags);
+  if (attr) {
+    attr->rclass = rclass;
+#ifndef WITHOUT_ATTR_INDEX
+    if (rclass->context)
+      attr_index_add(rclass->context, attr);
+#endif /* WITHOUT_ATTR_INDEX */
+  }
+
+  return attr;
+}
+#endif /* !WITH_CONTIKI && !WITH_LWIP */
+
+coap_attr_t *
+coap_add_attr(coap_resource_t *resource, 
+	      const unsigned char *name, size_t nlen,
+	      const unsigned char *val, size_t vlen,
+              int flags) {
+  coap_attr_t *attr;
+
+  if (!resource || !name)
+    return NULL;
+
+  attr = coap_new_attr(&resource->link_attr, name, nlen, val, vlen, flags);
+  if (attr) {
+    attr->resource = resource;
+#ifndef WITHOUT_ATTR_INDEX
+    if (resource->context)
+      attr_index_add(resource->context, attr);
+#endif /* WITHOUT_ATTR_INDEX */
+  }
+
+  return attr;
+}
+
+/**
+ * Returns the description of the static resource @p resource or @c NULL.
+ * Compact resources have no storage for the description.
+ */
+COAP_STATIC_INLINE const coap_static_resource_t *
+resource_desc(const coap_resource_t *resource) {
+  return resource->rclass ? NULL : resource->desc;
+}
+
+const coap_attr_t *
+coap_find_attr(const coap_resource_t *resource,
 	       const unsigned char *name, size_t nlen) {
   coap_attr_t *attr;
 
@@ -367,6 +1015,23 @@ coap_find_attr(coap_resource_t *resource,
       return attr;
   }
 
+  if (resource->rclass) {
+    LL_FOREACH(resource->rclass->link_attr, attr) {
+      if (attr->name.length == nlen &&
+          memcmp(attr->name.s, name, nlen) == 0)
+        return attr;
+    }
+  }
+
+  if (resource_desc(resource) && resource->desc->link_attr) {
+    const coap_static_attr_t *sattr;
+    for (sattr = resource->desc->link_attr; sattr->name.s; sattr++) {
+      if (sattr->name.length == nlen &&
+          memcmp(sattr->name.s, name, nlen) == 0)
+        return sattr;
+    }
+  }
+
   return NULL;
 }
 
@@ -374,6 +1039,21 @@ void
 coap_delete_attr(coap_attr_t *attr) {
   if (!attr)
     return;
+
+  if (attr->resource) {
+#ifndef WITHOUT_ATTR_INDEX
+    if (attr->resource->context)
+      attr_index_remove(attr->resource->context, attr);
+#endif /* WITHOUT_ATTR_INDEX */
+    LL_DELETE(attr->resource->link_attr, attr);
+  } else if (attr->rclass) {
+#ifndef WITHOUT_ATTR_INDEX
+    if (attr->rclass->context)
+      attr_index_remove(attr->rclass->context, attr);
+#endif /* WITHOUT_ATTR_INDEX */
+    LL_DELETE(attr->rclass->link_attr, attr);
+  }
+
   if (attr->flags & COAP_ATTR_FLAGS_RELEASE_NAME)
     coap_free(attr->name.s);
   if (attr->flags & COAP_ATTR_FLAGS_RELEASE_VALUE)
@@ -405,9 +1085,65 @@ coap_hash_request_uri(const coap_pdu_t *request, coap_key_t key) {
 
 void
 coap_add_resource(coap_context_t *context, coap_resource_t *resource) {
+#ifndef WITHOUT_ATTR_INDEX
+  coap_attr_t *attr;
+
+  LL_FOREACH(resource->link_attr, attr)
+    attr_index_add(context, attr);
+#endif /* WITHOUT_ATTR_INDEX */
+
+  if (resource->rclass) {
+    /* resources of a class are found through the class's attributes */
+    assert(resource->rclass->context == context);
+    DL_PREPEND2(resource->rclass->resources, resource, class_prev, class_next);
+    resource->rclass->count++;
+  }
+
+  resource->context = context;
+  resource->seq = ++context->resource_seq;
   RESOURCES_ADD(context->resources, resource);
 }
 
+void
+coap_add_static_resources(coap_context_t *context,
+                          const coap_static_resource_t *table,
+                          size_t count,
+                          coap_resource_t *storage) {
+  size_t n;
+
+  assert(table || !count);
+  assert(storage || !count);
+
+  for (n = 0; n < count; n++) {
+    coap_resource_t *r = &storage[n];
+
+    memset(r, 0, sizeof(coap_resource_t));
+    r->desc = &table[n];
+    r->observable = table[n].observable;
+    r->uri = table[n].uri;
+    r->flags = table[n].flags & ~COAP_RESOURCE_FLAGS_RELEASE_URI;
+
+    coap_hash_path(r->uri.s, r->uri.length, r->key);
+
+#ifndef WITHOUT_ATTR_INDEX
+    if (table[n].link_attr) {
+      const coap_static_attr_t *sattr;
+      for (sattr = table[n].link_attr; sattr->name.s; sattr++) {
+        /* static resources are never removed from the index
+         * individually, so the postings need not be tracked */
+        coap_attr_posting_t *postings = NULL;
+        attr_index_add_value(context, &sattr->name, &sattr->value,
+                             NULL, r, &postings);
+      }
+    }
+#endif /* WITHOUT_ATTR_INDEX */
+
+    r->context = context;
+    r->seq = ++context->resource_seq;
+    RESOURCES_ADD(context->resources, r);
+  }
+}
+
 static void
 coap_free_resource(coap_resource_t *resource) {
   coap_attr_t *attr, *tmp;
@@ -418,6 +1154,22 @@ coap_free_resource(coap_resource_t *resource) {
   /* delete registered attributes */
   LL_FOREACH_SAFE(resource->link_attr, attr, tmp) coap_delete_attr(attr);
 
+  coap_cache_invalidate(resource->context, resource);
+  if (resource->context)
+    coap_batch_detach_resource(resource->context, resource);
+#ifndef WITHOUT_ASYNC
+  if (resource->context)
+    coap_async_detach_resource(resource->context, resource);
+#endif /* WITHOUT_ASYNC */
+
+  if (resource->rclass && resource->context) {
+    DL_DELETE2(resource->rclass->resources, resource, class_prev, class_next);
+    resource->rclass->count--;
+  }
+
+  if (!resource->rclass)
+    coap_free_file(resource->file);
+
   if (resource->flags & COAP_RESOURCE_FLAGS_RELEASE_URI)
     coap_free(resource->uri.s);
 
@@ -427,6 +1179,10 @@ coap_free_resource(coap_resource_t *resource) {
     COAP_FREE_TYPE( subscription, obs );
   }
 
+  /* the storage of static resources is owned by the application */
+  if (resource_desc(resource))
+    return;
+
 #ifdef WITH_LWIP
   memp_free(MEMP_COAP_RESOURCE, resource);
 #endif
@@ -447,6 +1203,11 @@ coap_delete_resource(coap_context_t *context, coap_key_t key) {
   if (!resource) 
     return 0;
 
+  if (resource_desc(resource)) {
+    debug("coap_delete_resource: cannot delete static resource\n");
+    return 0;
+  }
+
   /* remove resource from list */
   RESOURCES_DELETE(context->resources, resource);
 
@@ -474,6 +1235,20 @@ coap_delete_all_resources(coap_context_t *context) {
   }
 
   context->resources = NULL;
+
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+  {
+    coap_resource_class_t *rclass, *ctmp;
+    LL_FOREACH_SAFE(context->resource_classes, rclass, ctmp) {
+      coap_free_resource_class(rclass);
+    }
+    context->resource_classes = NULL;
+  }
+#endif /* !WITH_CONTIKI && !WITH_LWIP */
+
+#ifndef WITHOUT_ATTR_INDEX
+  attr_index_free(context);
+#endif /* WITHOUT_ATTR_INDEX */
 }
 
 coap_resource_t *
@@ -505,19 +1280,21 @@ coap_print_link(const coap_resource_t *resource,
   PRINT_COND_WITH_OFFSET(p, bufend, *offset, '>', *len);
 
   LL_FOREACH(resource->link_attr, attr) {
+    PRINT_ATTR_WITH_OFFSET(p, bufend, *offset, attr, *len);
+  }
 
-    PRINT_COND_WITH_OFFSET(p, bufend, *offset, ';', *len);
-
-    COPY_COND_WITH_OFFSET(p, bufend, *offset,
-			  attr->name.s, attr->name.length, *len);
-
-    if (attr->value.s) {
-      PRINT_COND_WITH_OFFSET(p, bufend, *offset, '=', *len);
-
-      COPY_COND_WITH_OFFSET(p, bufend, *offset,
-			    attr->value.s, attr->value.length, *len);
+  /* attributes shared with other resources */
+  if (resource->rclass) {
+    LL_FOREACH(resource->rclass->link_attr, attr) {
+      PRINT_ATTR_WITH_OFFSET(p, bufend, *offset, attr, *len);
     }
+  }
 
+  if (resource_desc(resource) && resource->desc->link_attr) {
+    const coap_static_attr_t *sattr;
+    for (sattr = resource->desc->link_attr; sattr->name.s; sattr++) {
+      PRINT_ATTR_WITH_OFFSET(p, bufend, *offset, sattr, *len);
+    }
   }
   if (resource->observable) {
     COPY_COND_WITH_OFFSET(p, bufend, *offset, ";obs", 4, *len);
@@ -644,11 +1421,14 @@ coap_notify_observers(coap_context_t *context, coap_resource_t *r) {
   str token;
   coap_pdu_t *response;
 
+  if (r->dirty)
+    coap_cache_invalidate(context, r);
+
   if (r->observable && (r->dirty || r->partiallydirty)) {
     r->partiallydirty = 0;
 
     /* retrieve GET handler, prepare response */
-    h = r->handler[COAP_REQUEST_GET - 1];
+    h = coap_resource_get_handler(r, COAP_REQUEST_GET);
     assert(h);		/* we do not allow subscriptions if no
 			 * GET handler is defined */
 
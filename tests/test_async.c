@@ -0,0 +1,305 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_async.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WITHOUT_ASYNC
+
+#define TEST_PORT 5702
+#define TEST_STATES 1000	/* states registered per session */
+
+static coap_context_t *ctx;	/* Holds the asynchronous states */
+static coap_session_t *session[2]; /* Sessions of the states */
+
+static int expired;		/* Number of calls to expire_handler() */
+static int released;		/* Number of application data released */
+
+static void
+expire_handler(coap_context_t *context, coap_async_state_t *state) {
+  CU_ASSERT(context == ctx);
+  expired++;
+  if (state->appdata) {
+    released++;
+    state->appdata = NULL;
+  }
+}
+
+static coap_async_state_t *
+register_request(coap_session_t *s, unsigned short id, void *data) {
+  coap_async_state_t *state;
+  coap_pdu_t *request;
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, htons(id),
+                          COAP_DEFAULT_PDU_SIZE);
+  if (!request)
+    return NULL;
+  state = coap_register_async(ctx, s, request, COAP_ASYNC_SEPARATE, data);
+  coap_delete_pdu(request);
+  return state;
+}
+
+/* States are found by session and transaction id. */
+static void
+t_async1(void) {
+  coap_async_state_t *state, *removed;
+  unsigned short id;
+  int n;
+
+  for (n = 0; n < 2; n++) {
+    for (id = 1; id <= TEST_STATES; id++) {
+      state = register_request(session[n], id, NULL);
+      CU_ASSERT_FATAL(state != NULL);
+    }
+  }
+  CU_ASSERT(HASH_COUNT(ctx->async_state) == 2 * TEST_STATES);
+
+  /* a transaction is registered only once */
+  CU_ASSERT_PTR_NULL(register_request(session[0], 1, NULL));
+
+  for (n = 0; n < 2; n++) {
+    for (id = 1; id <= TEST_STATES; id++) {
+      state = coap_find_async(ctx, session[n], id);
+      CU_ASSERT_FATAL(state != NULL);
+      CU_ASSERT(state->session == session[n]);
+      CU_ASSERT(state->id == id);
+    }
+  }
+  CU_ASSERT_PTR_NULL(coap_find_async(ctx, session[0], TEST_STATES + 1));
+
+  for (n = 0; n < 2; n++) {
+    for (id = 1; id <= TEST_STATES; id++) {
+      CU_ASSERT(coap_remove_async(ctx, session[n], id, &removed));
+      CU_ASSERT_FATAL(removed != NULL);
+      CU_ASSERT(removed->id == id);
+      coap_free_async(removed);
+    }
+  }
+  CU_ASSERT_PTR_NULL(ctx->async_state);
+  CU_ASSERT(!coap_remove_async(ctx, session[0], 1, &removed));
+}
+
+/* States expire unless they are touched. */
+static void
+t_async2(void) {
+  coap_async_state_t *state[3];
+  coap_tick_t now;
+
+  expired = released = 0;
+  coap_context_set_async_timeout(ctx, 2);
+
+  state[0] = register_request(session[0], 1, &expired);
+  state[1] = register_request(session[0], 2, NULL);
+  state[2] = register_request(session[1], 1, &released);
+  CU_ASSERT_FATAL(state[0] && state[1] && state[2]);
+
+  now = state[0]->created;
+  state[1]->created = state[0]->created + COAP_TICKS_PER_SECOND;
+  state[2]->created = state[0]->created + 3 * COAP_TICKS_PER_SECOND;
+
+  CU_ASSERT(coap_check_async_timeouts(ctx, now)
+            == now + 2 * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(expired == 0);
+
+  now += 2 * COAP_TICKS_PER_SECOND;
+  CU_ASSERT(coap_check_async_timeouts(ctx, now)
+            == now + COAP_TICKS_PER_SECOND);
+  CU_ASSERT(expired == 1);
+  CU_ASSERT(released == 1);
+  CU_ASSERT_PTR_NULL(coap_find_async(ctx, session[0], 1));
+
+  now += COAP_TICKS_PER_SECOND;
+  CU_ASSERT(coap_check_async_timeouts(ctx, now)
+            == now + 2 * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(expired == 2);
+  CU_ASSERT_PTR_NULL(coap_find_async(ctx, session[0], 2));
+  CU_ASSERT(coap_find_async(ctx, session[1], 1) == state[2]);
+
+  /* touching a state moves its expiry */
+  state[2]->created = now + COAP_TICKS_PER_SECOND;
+  now += 2 * COAP_TICKS_PER_SECOND;
+  CU_ASSERT(coap_check_async_timeouts(ctx, now)
+            == now + COAP_TICKS_PER_SECOND);
+  CU_ASSERT(expired == 2);
+
+  now += COAP_TICKS_PER_SECOND;
+  CU_ASSERT(coap_check_async_timeouts(ctx, now) == 0);
+  CU_ASSERT(expired == 3);
+  CU_ASSERT(released == 2);
+  CU_ASSERT_PTR_NULL(ctx->async_state);
+}
+
+/* Without a timeout, states do not expire. */
+static void
+t_async3(void) {
+  coap_tick_t now;
+
+  expired = 0;
+  coap_context_set_async_timeout(ctx, 0);
+  CU_ASSERT_FATAL(register_request(session[0], 1, NULL) != NULL);
+
+  coap_ticks(&now);
+  CU_ASSERT(coap_check_async_timeouts(ctx, now + 3600 * COAP_TICKS_PER_SECOND)
+            == 0);
+  CU_ASSERT(expired == 0);
+  CU_ASSERT(coap_find_async(ctx, session[0], 1) != NULL);
+}
+
+/* The handler is called for the states left when the context is
+ * released. */
+static void
+t_async4(void) {
+  expired = 0;
+  CU_ASSERT_FATAL(register_request(session[1], 2, NULL) != NULL);
+
+  coap_free_all_async(ctx);
+  CU_ASSERT(expired == 2);
+  CU_ASSERT_PTR_NULL(ctx->async_state);
+}
+
+/* Returns a GET request with the given id and Uri-Query for coalescing. */
+static coap_pdu_t *
+coalesce_request(unsigned short id, const char *query) {
+  coap_pdu_t *request;
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, htons(id),
+                          COAP_DEFAULT_PDU_SIZE);
+  if (request)
+    coap_add_option(request, COAP_OPTION_URI_QUERY, strlen(query),
+                    (const unsigned char *)query);
+  return request;
+}
+
+/* Identical GET requests are coalesced with a pending transaction. */
+static void
+t_async5(void) {
+  coap_resource_t *resource;
+  coap_async_state_t *state, *removed;
+  coap_pdu_t *request[TEST_STATES];
+  unsigned short id;
+  char query[8];
+
+  resource = coap_resource_init(NULL, 0, COAP_RESOURCE_FLAGS_COALESCE);
+  CU_ASSERT_FATAL(resource != NULL);
+  coap_add_resource(ctx, resource);
+
+  /* one pending transaction per query */
+  for (id = 1; id <= TEST_STATES; id++) {
+    snprintf(query, sizeof(query), "q=%u", id);
+    request[id - 1] = coalesce_request(id, query);
+    CU_ASSERT_FATAL(request[id - 1] != NULL);
+    CU_ASSERT(!coap_async_coalesce(ctx, resource, session[0], request[id - 1]));
+    state = coap_register_async(ctx, session[0], request[id - 1], 0, NULL);
+    CU_ASSERT_FATAL(state != NULL);
+    coap_async_enable_coalescing(ctx, resource, session[0], request[id - 1]);
+  }
+  CU_ASSERT(HASH_CNT(chh, ctx->async_coalesce) == TEST_STATES);
+
+  /* the same query from another session is parked, retransmissions
+   * are recognized */
+  CU_ASSERT(coap_async_coalesce(ctx, resource, session[1], request[9]));
+  CU_ASSERT(coap_async_coalesce(ctx, resource, session[1], request[9]));
+  CU_ASSERT(coap_async_coalesce(ctx, resource, session[0], request[9]));
+  state = coap_find_async(ctx, session[0], 10);
+  CU_ASSERT_FATAL(state != NULL);
+  CU_ASSERT_FATAL(state->coalesced != NULL);
+  CU_ASSERT(state->coalesced->session == session[1]);
+  CU_ASSERT_PTR_NULL(state->coalesced->next);
+
+  /* removed transactions take no more requests */
+  CU_ASSERT(coap_remove_async(ctx, session[0], 10, &removed));
+  coap_free_async(removed);
+  CU_ASSERT(!coap_async_coalesce(ctx, resource, session[1], request[9]));
+
+  /* nor do those of a deleted resource */
+  coap_async_detach_resource(ctx, resource);
+  CU_ASSERT_PTR_NULL(ctx->async_coalesce);
+  CU_ASSERT(!coap_async_coalesce(ctx, resource, session[1], request[0]));
+
+  for (id = 1; id <= TEST_STATES; id++)
+    coap_delete_pdu(request[id - 1]);
+  coap_free_all_async(ctx);
+  coap_delete_resource(ctx, resource->key);
+}
+
+static int
+t_async_tests_create(void) {
+  coap_address_t addr;
+  int n;
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+  coap_register_async_expire_handler(ctx, expire_handler);
+
+  for (n = 0; n < 2; n++) {
+    coap_address_init(&addr);
+    addr.size = sizeof(struct sockaddr_in);
+    addr.addr.sin.sin_family = AF_INET;
+    addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.addr.sin.sin_port = htons(TEST_PORT + n);
+
+    session[n] = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+    if (!session[n])
+      return 1;
+  }
+  return 0;
+}
+
+static int
+t_async_tests_remove(void) {
+  coap_session_release(session[0]);
+  coap_session_release(session[1]);
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_async_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("asynchronous state", t_async_tests_create,
+                       t_async_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add asynchronous state test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define ASYNC_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add asynchronous state test (%s)\n",   \
+	    CU_get_error_msg());				      \
+  }
+
+  ASYNC_TEST(suite, t_async1);
+  ASYNC_TEST(suite, t_async2);
+  ASYNC_TEST(suite, t_async3);
+  ASYNC_TEST(suite, t_async4);
+  ASYNC_TEST(suite, t_async5);
+
+  return suite;
+}
+
+#else /* WITHOUT_ASYNC */
+
+CU_pSuite
+t_init_async_tests(void) {
+  return NULL;
+}
+
+#endif /* WITHOUT_ASYNC */
@@ -0,0 +1,236 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_batch.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_PORT 5705
+#define TEST_REQUESTS 200
+#define TEST_BATCH_SIZE 16
+#define TEST_DEADLINE 2		/* seconds */
+
+static coap_context_t *server_ctx; /* Collects the requests */
+static coap_context_t *client_ctx; /* Sends the requests */
+static coap_session_t *session;	/* Client session to server_ctx */
+
+static int post_calls;		/* Number of calls to hnd_post() */
+static int batch_calls;		/* Number of calls to hnd_batch() */
+static size_t batched;		/* Number of requests passed to hnd_batch() */
+static size_t max_batch;	/* Largest count passed to hnd_batch() */
+static int in_order;		/* Cleared if requests have been reordered */
+static unsigned int next_seq;	/* Expected sequence number */
+static int responses;		/* Number of 2.04 responses received */
+
+static void
+hnd_post(coap_context_t *ctx, coap_resource_t *resource,
+         coap_session_t *s, coap_pdu_t *request, str *token,
+         coap_pdu_t *response) {
+  (void)ctx;
+  (void)resource;
+  (void)s;
+  (void)request;
+  (void)token;
+
+  post_calls++;
+  response->hdr->code = COAP_RESPONSE_CODE(204);
+}
+
+static void
+hnd_batch(coap_context_t *ctx, coap_resource_t *resource,
+          coap_batch_request_t *requests, size_t count) {
+  size_t n, length;
+  unsigned char *data;
+
+  (void)ctx;
+
+  batch_calls++;
+  batched += count;
+  if (count > max_batch)
+    max_batch = count;
+
+  for (n = 0; n < count; n++) {
+    CU_ASSERT(requests[n].resource == resource);
+    CU_ASSERT(requests[n].session != NULL);
+    if (!coap_get_data(requests[n].request, &length, &data)
+        || length != 2 || (unsigned int)(data[0] << 8 | data[1]) != next_seq)
+      in_order = 0;
+    next_seq++;
+    /* every other request is answered */
+    if (n % 2 == 0)
+      requests[n].response->hdr->code = COAP_RESPONSE_CODE(204);
+  }
+}
+
+static void
+response_handler(coap_context_t *ctx, coap_session_t *s,
+                 coap_pdu_t *sent, coap_pdu_t *pdu, const coap_tid_t id) {
+  (void)ctx;
+  (void)s;
+  (void)sent;
+  (void)id;
+
+  if (pdu->hdr->code == COAP_RESPONSE_CODE(204))
+    responses++;
+}
+
+static void
+reset(void) {
+  post_calls = batch_calls = responses = 0;
+  batched = max_batch = 0;
+  in_order = 1;
+  next_seq = 0;
+}
+
+static void
+send_post(unsigned char type, unsigned int seq) {
+  coap_pdu_t *request;
+  unsigned char buf[2] = { (unsigned char)(seq >> 8), (unsigned char)seq };
+  unsigned char token = (unsigned char)seq;
+
+  request = coap_new_pdu(session);
+  CU_ASSERT_FATAL(request != NULL);
+  request->hdr->type = type;
+  request->hdr->code = COAP_REQUEST_POST;
+  request->hdr->id = coap_new_message_id(client_ctx);
+  coap_add_token(request, 1, &token);
+  coap_add_option(request, COAP_OPTION_URI_PATH, 6,
+                  (const unsigned char *)"ingest");
+  coap_add_data(request, sizeof(buf), buf);
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+}
+
+/* Runs both contexts for a while or until *count has reached expected. */
+static void
+run_until(int *count, int expected) {
+  coap_tick_t start, now;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(client_ctx, 2);
+    coap_ticks(&now);
+  } while (*count < expected
+           && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+}
+
+/* NON requests are passed to the batch handler in order of arrival. */
+static void
+t_batch1(void) {
+  unsigned int n;
+
+  reset();
+  for (n = 0; n < TEST_REQUESTS; n++)
+    send_post(COAP_MESSAGE_NON, n);
+  run_until(&responses, TEST_REQUESTS / 2);
+
+  CU_ASSERT(post_calls == 0);
+  CU_ASSERT(batched == TEST_REQUESTS);
+  CU_ASSERT(in_order);
+  CU_ASSERT(batch_calls < TEST_REQUESTS);
+  CU_ASSERT(max_batch > 1);
+  CU_ASSERT(max_batch <= COAP_BATCH_DEFAULT_SIZE);
+  CU_ASSERT(responses == TEST_REQUESTS / 2);
+}
+
+/* Batches do not exceed the configured size. */
+static void
+t_batch2(void) {
+  unsigned int n;
+
+  reset();
+  coap_context_set_batch_limits(server_ctx, TEST_BATCH_SIZE, 0);
+  for (n = 0; n < TEST_REQUESTS; n++)
+    send_post(COAP_MESSAGE_NON, n);
+  run_until(&responses, TEST_REQUESTS / 2);
+
+  CU_ASSERT(batched == TEST_REQUESTS);
+  CU_ASSERT(in_order);
+  CU_ASSERT(max_batch <= TEST_BATCH_SIZE);
+  CU_ASSERT(batch_calls >= TEST_REQUESTS / TEST_BATCH_SIZE);
+}
+
+/* Confirmable requests are passed to the method handler. */
+static void
+t_batch3(void) {
+  reset();
+  send_post(COAP_MESSAGE_CON, 0);
+  run_until(&responses, 1);
+
+  CU_ASSERT(post_calls == 1);
+  CU_ASSERT(batch_calls == 0);
+  CU_ASSERT(responses == 1);
+}
+
+static int
+t_batch_tests_create(void) {
+  coap_address_t addr;
+  coap_resource_t *r;
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(TEST_PORT);
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !client_ctx
+      || !coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP))
+    return 1;
+
+  r = coap_resource_init((unsigned char *)"ingest", 6, 0);
+  coap_register_handler(r, COAP_REQUEST_POST, hnd_post);
+  coap_register_batch_handler(r, hnd_batch);
+  coap_add_resource(server_ctx, r);
+
+  coap_register_response_handler(client_ctx, response_handler);
+  session = coap_new_client_session(client_ctx, NULL, &addr, COAP_PROTO_UDP);
+  return session == NULL;
+}
+
+static int
+t_batch_tests_remove(void) {
+  coap_session_release(session);
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_batch_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("batch handler", t_batch_tests_create,
+                       t_batch_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add batch handler test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define BATCH_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add batch handler test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  BATCH_TEST(suite, t_batch1);
+  BATCH_TEST(suite, t_batch2);
+  BATCH_TEST(suite, t_batch3);
+
+  return suite;
+}
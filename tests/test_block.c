@@ -0,0 +1,744 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_block.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_BODY_SIZE 3000
+
+static coap_context_t *ctx;	/* Holds the coap context for all tests */
+static coap_session_t *session;	/* Session the requests are received on */
+static coap_resource_t *resource; /* The requested resource */
+static coap_resource_t *upload;	/* Resource that reassembles Block1 */
+static unsigned char body[TEST_BODY_SIZE];
+static int released;		/* Number of calls to release_body() */
+static unsigned char sunk[TEST_BODY_SIZE]; /* Data passed to sink() */
+static size_t sunk_length;
+static int sink_released;	/* Number of calls to release_sink() */
+static unsigned char fetched[TEST_BODY_SIZE]; /* Body passed to fetch_handler() */
+static size_t fetched_length;
+static int fetch_calls;		/* Number of calls to fetch_handler() */
+static unsigned char fetch_code; /* Code of the last call to fetch_handler() */
+static int fetch_done;		/* Set when fetch_handler() has seen the end */
+
+static void
+release_body(coap_session_t *s, void *app_ptr) {
+  CU_ASSERT(s == session);
+  CU_ASSERT(app_ptr == body);
+  released++;
+}
+
+/* Creates a GET request with the given token and an optional Block2
+ * option (if szx >= 0) or ETag. */
+static coap_pdu_t *
+make_request(const char *token, unsigned int num, int szx,
+             const unsigned char *etag, size_t etag_length) {
+  coap_pdu_t *request;
+  unsigned char buf[4];
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0x1234,
+                          COAP_DEFAULT_PDU_SIZE);
+  coap_add_token(request, strlen(token), (const unsigned char *)token);
+  if (etag)
+    coap_add_option(request, COAP_OPTION_ETAG, (unsigned int)etag_length,
+                    etag);
+  if (szx >= 0)
+    coap_add_option(request, COAP_OPTION_BLOCK2,
+                    coap_encode_var_bytes(buf, (num << 4) | szx), buf);
+  return request;
+}
+
+static coap_pdu_t *
+make_response(coap_pdu_t *request, size_t size) {
+  coap_pdu_t *response;
+
+  response = coap_pdu_init(COAP_MESSAGE_ACK, 0, request->hdr->id, size);
+  coap_add_token(response, request->hdr->token_length, request->hdr->token);
+  return response;
+}
+
+/* Fills response like a GET handler using the large response API. */
+static int
+handle_get(coap_pdu_t *request, coap_pdu_t *response,
+           coap_release_large_data_t release) {
+  unsigned char buf[4];
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                  coap_encode_var_bytes(buf, COAP_MEDIATYPE_TEXT_PLAIN), buf);
+  return coap_add_data_large_response(resource, session, request, response,
+                                      sizeof(body), body, release, body);
+}
+
+/* Checks that response carries block num of size 1 << (szx + 4). */
+static void
+check_block(coap_pdu_t *response, unsigned int num, unsigned int szx) {
+  coap_block_t block;
+  size_t len, expected;
+  unsigned char *data;
+  size_t offset = (size_t)num << (szx + 4);
+
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(coap_get_block(response, COAP_OPTION_BLOCK2, &block));
+  CU_ASSERT(block.num == num);
+  CU_ASSERT(block.szx == szx);
+  CU_ASSERT(block.m == (offset + (1 << (szx + 4)) < sizeof(body)));
+
+  expected = sizeof(body) - offset;
+  if (expected > ((size_t)1 << (szx + 4)))
+    expected = (size_t)1 << (szx + 4);
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  CU_ASSERT(len == expected);
+  CU_ASSERT(memcmp(data, body + offset, expected) == 0);
+}
+
+static void
+t_large_response1(void) {
+  coap_pdu_t *request, *response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  unsigned int num;
+
+  request = make_request("t1", 0, -1, NULL, 0);
+  response = make_response(request, coap_session_max_pdu_size(session));
+  CU_ASSERT(handle_get(request, response, NULL) == 1);
+  check_block(response, 0, 6);
+  CU_ASSERT(coap_check_option(response, COAP_OPTION_ETAG, &opt_iter) != NULL);
+  CU_ASSERT(coap_check_option(response, COAP_OPTION_CONTENT_FORMAT, &opt_iter)
+            != NULL);
+  option = coap_check_option(response, COAP_OPTION_SIZE2, &opt_iter);
+  CU_ASSERT(option != NULL);
+  if (option)
+    CU_ASSERT(coap_decode_var_bytes(coap_opt_value(option),
+                                    coap_opt_length(option)) == sizeof(body));
+  CU_ASSERT(session->large_responses != NULL);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* subsequent blocks come from the library */
+  for (num = 1; num < 3; num++) {
+    request = make_request("t1", num, 6, NULL, 0);
+    response = make_response(request, coap_session_max_pdu_size(session));
+    CU_ASSERT(coap_large_response_get(resource, session, request, response));
+    check_block(response, num, 6);
+    CU_ASSERT(coap_check_option(response, COAP_OPTION_SIZE2, &opt_iter)
+              == NULL);
+    coap_delete_pdu(response);
+    coap_delete_pdu(request);
+  }
+
+  /* released after the final block */
+  CU_ASSERT(session->large_responses == NULL);
+}
+
+static void
+t_large_response2(void) {
+  coap_pdu_t *request, *response;
+  coap_block_t block;
+  size_t len;
+  unsigned char *data;
+
+  /* everything fits into a single message */
+  released = 0;
+  request = make_request("t2", 0, -1, NULL, 0);
+  response = make_response(request, sizeof(body) + 64);
+  CU_ASSERT(handle_get(request, response, release_body) == 1);
+  CU_ASSERT(released == 1);
+  CU_ASSERT(!coap_get_block(response, COAP_OPTION_BLOCK2, &block));
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  CU_ASSERT(len == sizeof(body));
+  CU_ASSERT(session->large_responses == NULL);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+}
+
+static void
+t_large_response3(void) {
+  coap_pdu_t *request, *response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  unsigned char etag[8];
+  size_t etag_length;
+
+  /* the client asks for small blocks */
+  released = 0;
+  request = make_request("t3", 0, 2, NULL, 0);
+  response = make_response(request, coap_session_max_pdu_size(session));
+  CU_ASSERT(handle_get(request, response, release_body) == 1);
+  check_block(response, 0, 2);
+  option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+  CU_ASSERT_FATAL(option != NULL);
+  etag_length = coap_opt_length(option);
+  memcpy(etag, coap_opt_value(option), etag_length);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* a different token with the same ETag continues the transfer */
+  request = make_request("other", 5, 2, etag, etag_length);
+  response = make_response(request, coap_session_max_pdu_size(session));
+  CU_ASSERT(coap_large_response_get(resource, session, request, response));
+  check_block(response, 5, 2);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* unknown token and no ETag is left to the handler */
+  request = make_request("other", 6, 2, NULL, 0);
+  response = make_response(request, coap_session_max_pdu_size(session));
+  CU_ASSERT(!coap_large_response_get(resource, session, request, response));
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* blocks beyond the end are rejected */
+  request = make_request("t3", 100, 2, NULL, 0);
+  response = make_response(request, coap_session_max_pdu_size(session));
+  CU_ASSERT(coap_large_response_get(resource, session, request, response));
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(402));
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* closing the session releases the representation */
+  CU_ASSERT(released == 0);
+  coap_free_large_responses(session);
+  CU_ASSERT(released == 1);
+  CU_ASSERT(session->large_responses == NULL);
+}
+
+static void
+t_large_response4(void) {
+  coap_pdu_t *request, *response;
+
+  /* the block size is reduced to fit into the response */
+  request = make_request("t4", 0, 6, NULL, 0);
+  response = make_response(request, 300);
+  CU_ASSERT(handle_get(request, response, NULL) == 1);
+  check_block(response, 0, 4);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* later requests use the reduced size */
+  request = make_request("t4", 3, 4, NULL, 0);
+  response = make_response(request, 300);
+  CU_ASSERT(coap_large_response_get(resource, session, request, response));
+  check_block(response, 3, 4);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_free_large_responses(session);
+}
+
+/* Creates a PUT request that carries block num of size 1 << (szx + 4)
+ * from body, limited to length bytes in total. */
+static coap_pdu_t *
+make_put(const char *token, unsigned int num, unsigned int szx, size_t length,
+         size_t size1) {
+  coap_pdu_t *request;
+  unsigned char buf[4];
+  size_t offset = (size_t)num << (szx + 4);
+  size_t block_size = (size_t)1 << (szx + 4);
+  int m = offset + block_size < length;
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_PUT, 0x2345,
+                          COAP_DEFAULT_PDU_SIZE);
+  coap_add_token(request, strlen(token), (const unsigned char *)token);
+  coap_add_option(request, COAP_OPTION_BLOCK1,
+                  coap_encode_var_bytes(buf, (num << 4) | (m << 3) | szx),
+                  buf);
+  if (size1)
+    coap_add_option(request, COAP_OPTION_SIZE1,
+                    coap_encode_var_bytes(buf, (unsigned int)size1), buf);
+  coap_add_data(request, (unsigned int)(m ? block_size : length - offset),
+                body + offset);
+  return request;
+}
+
+/* Passes a block of request to coap_large_request_receive() and
+ * returns the response code, or 0 if the handler must be called. */
+static unsigned char
+receive(coap_pdu_t *request) {
+  coap_pdu_t *response;
+  unsigned char code = 0;
+
+  response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+  if (coap_large_request_receive(upload, session, request, response))
+    code = response->hdr->code;
+  coap_delete_pdu(response);
+  return code;
+}
+
+static int
+sink(coap_session_t *s, coap_resource_t *r, coap_pdu_t *request,
+     size_t offset, const uint8_t *data, size_t length, void **app_ptr) {
+  CU_ASSERT(s == session);
+  CU_ASSERT(r == upload);
+  CU_ASSERT(request != NULL);
+  CU_ASSERT(*app_ptr == (offset ? sunk : NULL));
+  CU_ASSERT(offset == sunk_length);
+  memcpy(sunk + offset, data, length);
+  sunk_length += length;
+  *app_ptr = sunk;
+  return 1;
+}
+
+static void
+release_sink(coap_session_t *s, void *app_ptr) {
+  CU_ASSERT(s == session);
+  CU_ASSERT(app_ptr == sunk);
+  sink_released++;
+}
+
+static void
+t_large_request1(void) {
+  coap_pdu_t *request, *response;
+  coap_block_t block;
+  size_t length;
+  const uint8_t *data;
+  void *app_ptr;
+  unsigned int num;
+
+  /* blocks but the last are acknowledged with 2.31 */
+  for (num = 0; num < 2; num++) {
+    request = make_put("r1", num, 2, 150, 0);
+    response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+    CU_ASSERT(coap_large_request_receive(upload, session, request, response));
+    CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(231));
+    CU_ASSERT(coap_get_block(response, COAP_OPTION_BLOCK1, &block));
+    CU_ASSERT(block.num == num);
+    CU_ASSERT(block.m == 1);
+    CU_ASSERT(block.szx == 2);
+    coap_delete_pdu(response);
+    coap_delete_pdu(request);
+  }
+
+  /* a retransmitted block is acknowledged again */
+  request = make_put("r1", 1, 2, 150, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(231));
+  coap_delete_pdu(request);
+
+  /* the final block goes to the handler with the complete body */
+  request = make_put("r1", 2, 2, 150, 0);
+  response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+  CU_ASSERT(!coap_large_request_receive(upload, session, request, response));
+  CU_ASSERT(coap_get_data_large_request(session, request, &length, &data,
+                                        &app_ptr));
+  CU_ASSERT(length == 150);
+  CU_ASSERT(data != NULL && memcmp(data, body, 150) == 0);
+  CU_ASSERT(app_ptr == NULL);
+
+  /* Block1 is inserted in front of the handler's payload */
+  response->hdr->code = COAP_RESPONSE_CODE(204);
+  coap_add_data(response, 2, (const unsigned char *)"ok");
+  coap_large_request_finish(session, request, response);
+  CU_ASSERT(coap_get_block(response, COAP_OPTION_BLOCK1, &block));
+  CU_ASSERT(block.num == 2);
+  CU_ASSERT(block.m == 0);
+  CU_ASSERT(coap_get_data(response, &length, (unsigned char **)&data));
+  CU_ASSERT(length == 2 && memcmp(data, "ok", 2) == 0);
+  CU_ASSERT(session->large_requests == NULL);
+  CU_ASSERT(ctx->large_requests == 0);
+  coap_delete_pdu(response);
+
+  /* without a transfer, the payload of the request is returned */
+  CU_ASSERT(coap_get_data_large_request(session, request, &length, &data,
+                                        &app_ptr));
+  CU_ASSERT(length == 150 - 128);
+  coap_delete_pdu(request);
+}
+
+static void
+t_large_request2(void) {
+  coap_pdu_t *request, *response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+
+  /* a block other than the first needs a transfer */
+  request = make_put("r2", 1, 2, 150, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(408));
+  coap_delete_pdu(request);
+
+  /* missing blocks abort the transfer */
+  request = make_put("r2", 0, 2, 150, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(231));
+  coap_delete_pdu(request);
+  request = make_put("r2", 2, 2, 150, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(408));
+  coap_delete_pdu(request);
+  CU_ASSERT(session->large_requests == NULL);
+
+  /* bodies beyond the limit are rejected with Size1 */
+  coap_context_set_large_request_limits(ctx, 100, 1);
+  request = make_put("r2", 0, 2, 150, 150);
+  response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+  CU_ASSERT(coap_large_request_receive(upload, session, request, response));
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(413));
+  option = coap_check_option(response, COAP_OPTION_SIZE1, &opt_iter);
+  CU_ASSERT(option != NULL);
+  if (option)
+    CU_ASSERT(coap_decode_var_bytes(coap_opt_value(option),
+                                    coap_opt_length(option)) == 100);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* also when Size1 is missing */
+  request = make_put("r2", 0, 2, 150, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(231));
+  coap_delete_pdu(request);
+  request = make_put("r2", 1, 2, 150, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(413));
+  coap_delete_pdu(request);
+
+  /* only one transfer at a time */
+  request = make_put("r2", 0, 2, 100, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(231));
+  coap_delete_pdu(request);
+  request = make_put("other", 0, 2, 100, 0);
+  CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(503));
+  coap_delete_pdu(request);
+
+  /* resources without the flag are left to the handler */
+  request = make_put("r2", 1, 2, 100, 0);
+  CU_ASSERT(!coap_large_request_receive(resource, session, request, NULL));
+  coap_delete_pdu(request);
+
+  coap_free_large_requests(session);
+  CU_ASSERT(ctx->large_requests == 0);
+  coap_context_set_large_request_limits(ctx, 0, 0);
+}
+
+static void
+t_large_request3(void) {
+  coap_pdu_t *request, *response;
+  size_t length;
+  const uint8_t *data;
+  void *app_ptr;
+  unsigned int num;
+
+  /* blocks are streamed to the sink */
+  coap_context_set_large_request_sink(ctx, sink, release_sink);
+  sunk_length = 0;
+  sink_released = 0;
+  for (num = 0; num < 4; num++) {
+    request = make_put("r3", num, 4, sizeof(body), 0);
+    CU_ASSERT(receive(request) == COAP_RESPONSE_CODE(231));
+    coap_delete_pdu(request);
+  }
+  CU_ASSERT(sunk_length == 4 * 256);
+  CU_ASSERT(memcmp(sunk, body, sunk_length) == 0);
+
+  /* closing the session releases the sink's state */
+  coap_free_large_requests(session);
+  CU_ASSERT(sink_released == 1);
+
+  sunk_length = 0;
+  for (num = 0; num < 2; num++) {
+    request = make_put("r3", num, 4, 300, 0);
+    response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+    CU_ASSERT(coap_large_request_receive(upload, session, request, response)
+              == !num);
+    coap_delete_pdu(response);
+    coap_delete_pdu(request);
+  }
+  request = make_put("r3", 1, 4, 300, 0);
+  CU_ASSERT(coap_get_data_large_request(session, request, &length, &data,
+                                        &app_ptr));
+  CU_ASSERT(length == 300);
+  CU_ASSERT(data == NULL);
+  CU_ASSERT(app_ptr == sunk);
+  CU_ASSERT(memcmp(sunk, body, 300) == 0);
+
+  response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+  response->hdr->code = COAP_RESPONSE_CODE(204);
+  coap_large_request_finish(session, request, response);
+  CU_ASSERT(sink_released == 2);
+  CU_ASSERT(session->large_requests == NULL);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_context_set_large_request_sink(ctx, NULL, NULL);
+}
+
+static void
+fetch_handler(coap_session_t *s, unsigned char code, size_t offset,
+              const uint8_t *data, size_t length, int last, void *app_ptr) {
+  CU_ASSERT(s == session);
+  CU_ASSERT(app_ptr == fetched);
+  CU_ASSERT(!fetch_done);
+  if (offset == 0)
+    fetched_length = 0;         /* (re)started */
+  CU_ASSERT(offset == fetched_length);
+  if (data) {
+    memcpy(fetched + offset, data, length);
+    fetched_length += length;
+  }
+  fetch_code = code;
+  fetch_done = last;
+  fetch_calls++;
+}
+
+/* Starts a fetch of the "large" resource. */
+static coap_block_fetch_t *
+start_fetch(unsigned int szx, unsigned int window) {
+  coap_pdu_t *request;
+  coap_block_fetch_t *fetch;
+
+  fetched_length = 0;
+  fetch_calls = 0;
+  fetch_code = 0;
+  fetch_done = 0;
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0,
+                          COAP_DEFAULT_PDU_SIZE);
+  coap_add_option(request, COAP_OPTION_URI_PATH, 5,
+                  (const unsigned char *)"large");
+  fetch = coap_block_fetch(session, request, szx, window, fetch_handler,
+                           fetched);
+  coap_delete_pdu(request);
+  return fetch;
+}
+
+/* Returns the number of block requests in the send queue. */
+static unsigned int
+count_block_requests(void) {
+  coap_queue_t *node;
+  unsigned int count = 0;
+
+  for (node = ctx->sendqueue; node; node = node->next)
+    count++;
+  return count;
+}
+
+/* Returns the pending request for block num or NULL. */
+static coap_pdu_t *
+find_block_request(unsigned int num) {
+  coap_queue_t *node;
+  coap_block_t block;
+
+  for (node = ctx->sendqueue; node; node = node->next) {
+    if (coap_get_block(node->pdu, COAP_OPTION_BLOCK2, &block)
+        && block.num == num)
+      return node->pdu;
+  }
+  return NULL;
+}
+
+/* Answers the pending request for block num like a server that has
+ * size bytes of body with the given ETag, or with code if not 2.05. */
+static void
+answer_block(unsigned int num, unsigned int szx, size_t size,
+             unsigned char etag, unsigned char code) {
+  coap_pdu_t *request, *response;
+  unsigned char buf[4];
+  size_t offset = (size_t)num << (szx + 4);
+  size_t block_size = (size_t)1 << (szx + 4);
+  int m = offset + block_size < size;
+
+  request = find_block_request(num);
+  CU_ASSERT_FATAL(request != NULL);
+
+  response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+  response->hdr->code = code;
+  if (code == COAP_RESPONSE_CODE(205)) {
+    coap_add_option(response, COAP_OPTION_ETAG, 1, &etag);
+    coap_add_option(response, COAP_OPTION_BLOCK2,
+                    coap_encode_var_bytes(buf, (num << 4) | (m << 3) | szx),
+                    buf);
+    if (num == 0)
+      coap_add_option(response, COAP_OPTION_SIZE2,
+                      coap_encode_var_bytes(buf, (unsigned int)size), buf);
+    coap_add_data(response, (unsigned int)(m ? block_size : size - offset),
+                  body + offset);
+  }
+
+  /* as done by handle_response() */
+  coap_cancel_all_messages(ctx, session, response->hdr->token,
+                           response->hdr->token_length);
+  CU_ASSERT(coap_block_fetch_response(session, response));
+  coap_delete_pdu(response);
+}
+
+static void
+t_block_fetch1(void) {
+  coap_block_fetch_t *fetch;
+  unsigned int num;
+
+  fetch = start_fetch(4, 4);
+  CU_ASSERT_FATAL(fetch != NULL);
+
+  /* the first block is requested alone */
+  CU_ASSERT(count_block_requests() == 1);
+  answer_block(0, 4, 2000, 1, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetch_calls == 1);
+  CU_ASSERT(fetched_length == 256);
+  CU_ASSERT(count_block_requests() == 4);
+
+  /* blocks that arrive out of order are passed on in order */
+  answer_block(3, 4, 2000, 1, COAP_RESPONSE_CODE(205));
+  answer_block(2, 4, 2000, 1, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetch_calls == 1);
+  CU_ASSERT(count_block_requests() == 4);
+  answer_block(1, 4, 2000, 1, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetch_calls == 4);
+  CU_ASSERT(fetched_length == 4 * 256);
+
+  /* requests do not go beyond the size announced in Size2 */
+  for (num = 4; num < 8; num++) {
+    CU_ASSERT(!fetch_done);
+    answer_block(num, 4, 2000, 1, COAP_RESPONSE_CODE(205));
+  }
+  CU_ASSERT(fetch_done);
+  CU_ASSERT(fetch_code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetched_length == 2000);
+  CU_ASSERT(memcmp(fetched, body, 2000) == 0);
+  CU_ASSERT(ctx->sendqueue == NULL);
+  CU_ASSERT(session->block_fetches == NULL);
+}
+
+static void
+t_block_fetch2(void) {
+  coap_block_fetch_t *fetch;
+  unsigned int num;
+
+  /* a changed ETag restarts the transfer */
+  fetch = start_fetch(4, 2);
+  CU_ASSERT_FATAL(fetch != NULL);
+  answer_block(0, 4, 1000, 1, COAP_RESPONSE_CODE(205));
+  answer_block(1, 4, 1000, 2, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetched_length == 256);
+  CU_ASSERT(count_block_requests() == 1);
+  CU_ASSERT(find_block_request(0) != NULL);
+  for (num = 0; num < 4; num++)
+    answer_block(num, 4, 1000, 2, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetch_done);
+  CU_ASSERT(fetched_length == 1000);
+  CU_ASSERT(memcmp(fetched, body, 1000) == 0);
+
+  /* errors are passed to the handler */
+  fetch = start_fetch(4, 2);
+  CU_ASSERT_FATAL(fetch != NULL);
+  answer_block(0, 4, 1000, 1, COAP_RESPONSE_CODE(404));
+  CU_ASSERT(fetch_done);
+  CU_ASSERT(fetch_calls == 1);
+  CU_ASSERT(fetch_code == COAP_RESPONSE_CODE(404));
+  CU_ASSERT(session->block_fetches == NULL);
+
+  /* cancelling a transfer stops its requests */
+  fetch = start_fetch(4, 2);
+  CU_ASSERT_FATAL(fetch != NULL);
+  answer_block(0, 4, 1000, 1, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(count_block_requests() == 2);
+  coap_block_fetch_cancel(fetch);
+  CU_ASSERT(ctx->sendqueue == NULL);
+  CU_ASSERT(session->block_fetches == NULL);
+}
+
+static void
+t_block_fetch3(void) {
+  coap_pdu_t *request, *response;
+  coap_block_fetch_t *fetch;
+
+  /* without Size2, requests beyond the end are answered with 4.02 */
+  fetch = start_fetch(4, 3);
+  CU_ASSERT_FATAL(fetch != NULL);
+  request = find_block_request(0);
+  CU_ASSERT_FATAL(request != NULL);
+  response = make_response(request, COAP_DEFAULT_PDU_SIZE);
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_option(response, COAP_OPTION_ETAG, 1,
+                  (const unsigned char *)"\x00");
+  coap_add_option(response, COAP_OPTION_BLOCK2, 1,
+                  (const unsigned char *)"\x0c"); /* 0/M/256 */
+  coap_add_data(response, 256, body);
+  coap_cancel_all_messages(ctx, session, response->hdr->token,
+                           response->hdr->token_length);
+  CU_ASSERT(coap_block_fetch_response(session, response));
+  coap_delete_pdu(response);
+  CU_ASSERT(count_block_requests() == 3);
+
+  answer_block(3, 4, 600, 0, COAP_RESPONSE_CODE(402));
+  answer_block(1, 4, 600, 0, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(!fetch_done);
+  answer_block(2, 4, 600, 0, COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetch_done);
+  CU_ASSERT(fetch_code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetched_length == 600);
+  CU_ASSERT(memcmp(fetched, body, 600) == 0);
+  CU_ASSERT(session->block_fetches == NULL);
+}
+
+static int
+t_block_tests_create(void) {
+  coap_address_t addr;
+  size_t n;
+
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 7);
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in6);
+  addr.addr.sin6.sin6_family = AF_INET6;
+  addr.addr.sin6.sin6_addr = in6addr_loopback;
+  addr.addr.sin6.sin6_port = htons(COAP_DEFAULT_PORT);
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+
+  session = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+  resource = coap_resource_init((unsigned char *)"large", 5, 0);
+  coap_add_resource(ctx, resource);
+  upload = coap_resource_init((unsigned char *)"upload", 6,
+                              COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1);
+  coap_add_resource(ctx, upload);
+  return session == NULL;
+}
+
+static int
+t_block_tests_remove(void) {
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_block_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("block transfer", t_block_tests_create,
+                       t_block_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add block transfer test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define BLOCK_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add block transfer test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  BLOCK_TEST(suite, t_large_response1);
+  BLOCK_TEST(suite, t_large_response2);
+  BLOCK_TEST(suite, t_large_response3);
+  BLOCK_TEST(suite, t_large_response4);
+  BLOCK_TEST(suite, t_large_request1);
+  BLOCK_TEST(suite, t_large_request2);
+  BLOCK_TEST(suite, t_large_request3);
+  BLOCK_TEST(suite, t_block_fetch1);
+  BLOCK_TEST(suite, t_block_fetch2);
+  BLOCK_TEST(suite, t_block_fetch3);
+
+  return suite;
+}
@@ -0,0 +1,324 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_cache.h"
+
+#include <coap.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_PDU_SIZE 120
+
+static coap_context_t *ctx;	/* Holds the coap context for all tests */
+static coap_resource_t *resource; /* A cacheable resource */
+
+static const unsigned char token[] = { 0x12, 0x34 };
+static const unsigned char etag[] = { 0xe1, 0xe2, 0xe3 };
+static const unsigned char payload[] = "cached representation";
+
+/* Creates a GET request with optional Accept and ETag options. */
+static coap_pdu_t *
+make_request(int accept, const unsigned char *tag, size_t taglen) {
+  coap_pdu_t *request;
+  unsigned char buf[4];
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0x1234,
+                          TEST_PDU_SIZE);
+  coap_add_token(request, sizeof(token), token);
+  if (tag)
+    coap_add_option(request, COAP_OPTION_ETAG, (unsigned int)taglen, tag);
+  coap_add_option(request, COAP_OPTION_URI_PATH, 4,
+                  (const unsigned char *)"test");
+  if (accept >= 0)
+    coap_add_option(request, COAP_OPTION_ACCEPT,
+                    coap_encode_var_bytes(buf, accept), buf);
+  return request;
+}
+
+/* Creates an empty response to @p request as done by handle_request(). */
+static coap_pdu_t *
+make_response(coap_pdu_t *request) {
+  coap_pdu_t *response;
+
+  response = coap_pdu_init(COAP_MESSAGE_ACK, 0, request->hdr->id,
+                           TEST_PDU_SIZE);
+  coap_add_token(response, request->hdr->token_length, request->hdr->token);
+  return response;
+}
+
+/* Fills @p response like a GET handler would. */
+static void
+fill_response(coap_pdu_t *response, unsigned int max_age) {
+  unsigned char buf[4];
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_option(response, COAP_OPTION_ETAG, sizeof(etag), etag);
+  coap_add_option(response, COAP_OPTION_CONTENT_FORMAT,
+                  coap_encode_var_bytes(buf, COAP_MEDIATYPE_TEXT_PLAIN), buf);
+  coap_add_option(response, COAP_OPTION_MAXAGE,
+                  coap_encode_var_bytes(buf, max_age), buf);
+  coap_add_data(response, sizeof(payload) - 1, payload);
+}
+
+/* Runs the cache path of handle_request() and returns 1 on a hit. */
+static int
+serve(coap_pdu_t *request, coap_pdu_t *response, unsigned int max_age) {
+  if (coap_cache_get(ctx, resource, request, response))
+    return 1;
+  fill_response(response, max_age);
+  coap_cache_put(ctx, resource, request, response);
+  return 0;
+}
+
+static unsigned int
+option_value(coap_pdu_t *pdu, unsigned short type) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option = coap_check_option(pdu, type, &opt_iter);
+
+  return option
+    ? coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option))
+    : 0;
+}
+
+static void
+t_cache1(void) {
+  coap_pdu_t *request, *response;
+  size_t len;
+  unsigned char *data;
+
+  request = make_request(0, NULL, 0);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 30) == 0);
+  coap_delete_pdu(response);
+
+  /* second request is served from cache */
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 30) == 1);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(response->hdr->id == request->hdr->id);
+  CU_ASSERT(response->hdr->token_length == sizeof(token));
+  CU_ASSERT(memcmp(response->hdr->token, token, sizeof(token)) == 0);
+  CU_ASSERT(option_value(response, COAP_OPTION_CONTENT_FORMAT)
+            == COAP_MEDIATYPE_TEXT_PLAIN);
+  CU_ASSERT(option_value(response, COAP_OPTION_MAXAGE) > 0);
+  CU_ASSERT(option_value(response, COAP_OPTION_MAXAGE) <= 30);
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  CU_ASSERT(len == sizeof(payload) - 1);
+  CU_ASSERT(memcmp(data, payload, len) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* Accept is part of the cache key */
+  request = make_request(COAP_MEDIATYPE_APPLICATION_JSON, NULL, 0);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 30) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_cache_free(ctx);
+}
+
+static void
+t_cache2(void) {
+  coap_pdu_t *request, *response;
+  size_t len;
+  unsigned char *data;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+
+  /* populate the cache */
+  request = make_request(-1, NULL, 0);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* matching ETag yields 2.03 without payload */
+  request = make_request(-1, etag, sizeof(etag));
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 1);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(203));
+  option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+  CU_ASSERT(option != NULL);
+  if (option) {
+    CU_ASSERT(coap_opt_length(option) == sizeof(etag));
+    CU_ASSERT(memcmp(coap_opt_value(option), etag, sizeof(etag)) == 0);
+  }
+  CU_ASSERT(coap_check_option(response, COAP_OPTION_CONTENT_FORMAT,
+                              &opt_iter) == NULL);
+  CU_ASSERT(option_value(response, COAP_OPTION_MAXAGE) > 0);
+  CU_ASSERT(coap_get_data(response, &len, &data) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* a stale ETag gets the full representation */
+  request = make_request(-1, (const unsigned char *)"old", 3);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 1);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_cache_free(ctx);
+
+  /* revalidation also works when the handler has just been called */
+  request = make_request(-1, etag, sizeof(etag));
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(203));
+  CU_ASSERT(coap_get_data(response, &len, &data) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_cache_free(ctx);
+}
+
+static void
+t_cache3(void) {
+  coap_pdu_t *request, *response;
+
+  request = make_request(-1, NULL, 0);
+
+  /* Max-Age 0 is not stored */
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 0) == 0);
+  coap_delete_pdu(response);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  coap_delete_pdu(response);
+
+  /* a dirty resource invalidates its entries */
+  resource->dirty = 1;
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  coap_delete_pdu(response);
+  resource->dirty = 0;
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  coap_delete_pdu(response);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 1);
+  coap_delete_pdu(response);
+
+  /* as does coap_check_notify() on a dirty resource */
+  resource->dirty = 1;
+  coap_check_notify(ctx);
+  CU_ASSERT(resource->dirty == 0);
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  coap_delete_pdu(response);
+
+  /* non-cacheable resources are never served from cache */
+  resource->cacheable = 0;
+  response = make_response(request);
+  CU_ASSERT(serve(request, response, 60) == 0);
+  coap_delete_pdu(response);
+  resource->cacheable = 1;
+
+  coap_delete_pdu(request);
+
+  /* requests for observation bypass the cache */
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0x1235,
+                          TEST_PDU_SIZE);
+  coap_add_token(request, sizeof(token), token);
+  coap_add_option(request, COAP_OPTION_OBSERVE, 0, NULL);
+  response = make_response(request);
+  CU_ASSERT(coap_cache_get(ctx, resource, request, response) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_cache_free(ctx);
+}
+
+static void
+t_cache4(void) {
+  coap_pdu_t *request, *response;
+  int accept;
+
+  coap_context_set_cache_size(ctx, 2);
+
+  for (accept = 0; accept < 3; accept++) {
+    request = make_request(accept, NULL, 0);
+    response = make_response(request);
+    CU_ASSERT(serve(request, response, 60) == 0);
+    coap_delete_pdu(response);
+    coap_delete_pdu(request);
+  }
+
+  /* the oldest entry has been evicted */
+  request = make_request(0, NULL, 0);
+  response = make_response(request);
+  CU_ASSERT(coap_cache_get(ctx, resource, request, response) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  for (accept = 1; accept < 3; accept++) {
+    request = make_request(accept, NULL, 0);
+    response = make_response(request);
+    CU_ASSERT(coap_cache_get(ctx, resource, request, response) == 1);
+    coap_delete_pdu(response);
+    coap_delete_pdu(request);
+  }
+
+  /* deleting the resource drops its entries */
+  coap_delete_resource(ctx, resource->key);
+  CU_ASSERT(ctx->cache == NULL);
+
+  coap_context_set_cache_size(ctx, 0);
+  resource = coap_resource_init((unsigned char *)"test", 4, 0);
+  resource->cacheable = 1;
+  coap_add_resource(ctx, resource);
+}
+
+static int
+t_cache_tests_create(void) {
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+
+  resource = coap_resource_init((unsigned char *)"test", 4, 0);
+  resource->cacheable = 1;
+  coap_add_resource(ctx, resource);
+  return 0;
+}
+
+static int
+t_cache_tests_remove(void) {
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_cache_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("response cache", t_cache_tests_create,
+                       t_cache_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add response cache test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define CACHE_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add response cache test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  CACHE_TEST(suite, t_cache1);
+  CACHE_TEST(suite, t_cache2);
+  CACHE_TEST(suite, t_cache3);
+  CACHE_TEST(suite, t_cache4);
+
+  return suite;
+}
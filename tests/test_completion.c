@@ -0,0 +1,262 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_completion.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#if !defined(WITHOUT_COMPLETION_QUEUE) && defined(HAVE_PTHREAD_H)
+
+#include <pthread.h>
+
+#define TEST_PORT 5704
+#define TEST_REQUESTS 8		/* requests completed by worker threads */
+#define TEST_POSTS 1000		/* completions posted per thread in t_completion3 */
+#define TEST_DEADLINE 2		/* seconds */
+
+static coap_context_t *server_ctx; /* Completes the requests */
+static coap_context_t *client_ctx; /* Sends the requests */
+static coap_session_t *session;	/* Client session to server_ctx */
+
+/* Transactions registered by hnd_get(), indexed by the token. */
+static struct {
+  coap_session_t *session;
+  coap_tid_t id;
+} pending[TEST_REQUESTS];
+static int registered;		/* Number of calls to hnd_get() */
+
+static int responses;		/* Number of responses received */
+static int response_ok[TEST_REQUESTS]; /* Set for each expected response */
+
+static void
+hnd_get(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *s, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  coap_async_state_t *state;
+
+  (void)resource;
+  (void)response;
+
+  if (token->length != 1 || token->s[0] >= TEST_REQUESTS)
+    return;
+
+  state = coap_register_async(ctx, s, request, COAP_ASYNC_SEPARATE, NULL);
+  if (state) {
+    pending[token->s[0]].session = state->session;
+    pending[token->s[0]].id = state->id;
+    registered++;
+  }
+}
+
+static void
+response_handler(coap_context_t *ctx, coap_session_t *s,
+                 coap_pdu_t *sent, coap_pdu_t *pdu, const coap_tid_t id) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t length;
+  unsigned char *data;
+  unsigned char n;
+
+  (void)ctx;
+  (void)s;
+  (void)sent;
+  (void)id;
+
+  if (pdu->hdr->token_length != 1 || pdu->hdr->token[0] >= TEST_REQUESTS)
+    return;
+
+  n = pdu->hdr->token[0];
+  responses++;
+  option = coap_check_option(pdu, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+  if (pdu->hdr->code == COAP_RESPONSE_CODE(205)
+      && option && coap_decode_var_bytes(coap_opt_value(option),
+                                         coap_opt_length(option)) == 0
+      && coap_get_data(pdu, &length, &data)
+      && length == 1 && data[0] == 'a' + n)
+    response_ok[n] = 1;
+}
+
+/* Runs both contexts for a while or until *count has reached expected. */
+static void
+run_until(int *count, int expected) {
+  coap_tick_t start, now;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(client_ctx, 2);
+    coap_ticks(&now);
+  } while (*count < expected
+           && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+}
+
+static void *
+complete_request(void *arg) {
+  unsigned char n = *(unsigned char *)arg;
+  uint8_t payload = (uint8_t)('a' + n);
+
+  coap_async_post_completion(server_ctx, pending[n].session, pending[n].id,
+                             COAP_RESPONSE_CODE(205), 0, &payload, 1);
+  return NULL;
+}
+
+static void *
+post_unknown(void *arg) {
+  int n;
+
+  (void)arg;
+  for (n = 0; n < TEST_POSTS; n++)
+    coap_async_post_completion(server_ctx, NULL, (coap_tid_t)n,
+                               COAP_RESPONSE_CODE(205), -1, NULL, 0);
+  return NULL;
+}
+
+/* A completion cannot be posted before the queue is enabled. */
+static void
+t_completion1(void) {
+  CU_ASSERT(coap_completion_queue_socket(server_ctx) == NULL);
+  CU_ASSERT(!coap_async_post_completion(server_ctx, NULL, 0,
+                                        COAP_RESPONSE_CODE(205), -1,
+                                        NULL, 0));
+
+  CU_ASSERT(coap_context_enable_completion_queue(server_ctx));
+  CU_ASSERT(coap_context_enable_completion_queue(server_ctx));
+  CU_ASSERT(coap_completion_queue_socket(server_ctx) != NULL);
+  CU_ASSERT(coap_completion_queue_drain(server_ctx) == 0);
+}
+
+/* Requests are answered with the results posted by worker threads. */
+static void
+t_completion2(void) {
+  pthread_t threads[TEST_REQUESTS];
+  unsigned char index[TEST_REQUESTS];
+  unsigned char n;
+  coap_pdu_t *request;
+
+  for (n = 0; n < TEST_REQUESTS; n++) {
+    request = coap_new_pdu(session);
+    CU_ASSERT_FATAL(request != NULL);
+    request->hdr->type = COAP_MESSAGE_NON;
+    request->hdr->code = COAP_REQUEST_GET;
+    request->hdr->id = coap_new_message_id(client_ctx);
+    coap_add_token(request, 1, &n);
+    coap_add_option(request, COAP_OPTION_URI_PATH, 4,
+                    (const unsigned char *)"slow");
+    CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+  }
+  run_until(&registered, TEST_REQUESTS);
+  CU_ASSERT_FATAL(registered == TEST_REQUESTS);
+  CU_ASSERT(responses == 0);
+
+  for (n = 0; n < TEST_REQUESTS; n++) {
+    index[n] = n;
+    CU_ASSERT(pthread_create(&threads[n], NULL, complete_request,
+                             &index[n]) == 0);
+  }
+  for (n = 0; n < TEST_REQUESTS; n++)
+    pthread_join(threads[n], NULL);
+
+  run_until(&responses, TEST_REQUESTS);
+  CU_ASSERT(responses == TEST_REQUESTS);
+  for (n = 0; n < TEST_REQUESTS; n++)
+    CU_ASSERT(response_ok[n]);
+  CU_ASSERT_PTR_NULL(server_ctx->async_state);
+}
+
+/* Completions from concurrent threads are all taken by the loop thread,
+ * those for unknown transactions are dropped. */
+static void
+t_completion3(void) {
+  pthread_t threads[4];
+  unsigned int n, count = 0;
+
+  for (n = 0; n < 4; n++)
+    CU_ASSERT(pthread_create(&threads[n], NULL, post_unknown, NULL) == 0);
+  for (n = 0; n < 4; n++)
+    pthread_join(threads[n], NULL);
+
+  count = coap_completion_queue_drain(server_ctx);
+  CU_ASSERT(count == 4 * TEST_POSTS);
+  CU_ASSERT(coap_completion_queue_drain(server_ctx) == 0);
+}
+
+static int
+t_completion_tests_create(void) {
+  coap_address_t addr;
+  coap_resource_t *r;
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(TEST_PORT);
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !client_ctx
+      || !coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP))
+    return 1;
+
+  r = coap_resource_init((unsigned char *)"slow", 4, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server_ctx, r);
+
+  coap_register_response_handler(client_ctx, response_handler);
+  session = coap_new_client_session(client_ctx, NULL, &addr, COAP_PROTO_UDP);
+  return session == NULL;
+}
+
+static int
+t_completion_tests_remove(void) {
+  coap_session_release(session);
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_completion_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("completion queue", t_completion_tests_create,
+                       t_completion_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add completion queue test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define COMPLETION_TEST(s,t)					      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add completion queue test (%s)\n",     \
+	    CU_get_error_msg());				      \
+  }
+
+  COMPLETION_TEST(suite, t_completion1);
+  COMPLETION_TEST(suite, t_completion2);
+  COMPLETION_TEST(suite, t_completion3);
+
+  return suite;
+}
+
+#else /* WITHOUT_COMPLETION_QUEUE || !HAVE_PTHREAD_H */
+
+CU_pSuite
+t_init_completion_tests(void) {
+  return NULL;
+}
+
+#endif /* WITHOUT_COMPLETION_QUEUE || !HAVE_PTHREAD_H */
@@ -0,0 +1,767 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_dtls.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_PORT 5706
+#define TEST_DEADLINE 5		/* seconds */
+
+static coap_context_t *server_ctx; /* Accepts the DTLS sessions */
+static coap_context_t *client_ctx; /* Connects to server_ctx */
+static coap_endpoint_t *endpoint; /* Endpoint of server_ctx */
+static coap_address_t server_addr;
+static const uint8_t key[] = "secretPSK";
+
+static int connected;		/* Number of ends that have connected */
+
+static int
+event_handler(coap_context_t *ctx, coap_event_t event, void *data) {
+  (void)data;
+
+  (void)ctx;
+
+  if (event == COAP_EVENT_DTLS_CONNECTED)
+    connected++;
+  return 0;
+}
+
+/* Creates a client session in @p ctx with the PSK @p identity and runs
+ * both contexts until the handshake has completed at both ends. */
+static coap_session_t *
+connect_identity(coap_context_t *ctx, const char *identity) {
+  coap_session_t *session;
+  coap_tick_t start, now;
+
+  connected = 0;
+  session = coap_new_client_session_psk(ctx, NULL, &server_addr,
+                                        COAP_PROTO_DTLS, identity,
+                                        key, sizeof(key) - 1);
+  if (!session)
+    return NULL;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(ctx, 2);
+    coap_ticks(&now);
+  } while (connected < 2 && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+  return session;
+}
+
+static coap_session_t *
+connect_session(coap_context_t *ctx) {
+  return connect_identity(ctx, "client");
+}
+
+/* The first connection needs a full handshake. */
+static void
+t_dtls1(void) {
+  coap_session_t *session;
+  coap_dtls_handshake_stats_t client_stats, server_stats;
+
+  session = connect_session(client_ctx);
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+  coap_session_release(session);
+
+  CU_ASSERT(coap_dtls_get_handshake_stats(client_ctx, &client_stats));
+  CU_ASSERT(coap_dtls_get_handshake_stats(server_ctx, &server_stats));
+  CU_ASSERT(client_stats.full == 1);
+  CU_ASSERT(client_stats.resumed == 0);
+  CU_ASSERT(server_stats.full == 1);
+  CU_ASSERT(server_stats.resumed == 0);
+}
+
+/* A new session to the same server resumes the previous one. */
+static void
+t_dtls2(void) {
+  coap_session_t *session;
+  coap_dtls_handshake_stats_t client_stats, server_stats;
+
+  session = connect_session(client_ctx);
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+  coap_session_release(session);
+
+  coap_dtls_get_handshake_stats(client_ctx, &client_stats);
+  coap_dtls_get_handshake_stats(server_ctx, &server_stats);
+  CU_ASSERT(client_stats.full == 1);
+  CU_ASSERT(client_stats.resumed == 1);
+  CU_ASSERT(server_stats.full == 1);
+  CU_ASSERT(server_stats.resumed == 1);
+}
+
+/* A client that has no session with the server needs a full handshake. */
+static void
+t_dtls3(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_dtls_handshake_stats_t stats;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+
+  session = connect_session(ctx);
+  CU_ASSERT(session != NULL);
+  CU_ASSERT(connected == 2);
+  coap_session_release(session);
+
+  coap_dtls_get_handshake_stats(ctx, &stats);
+  CU_ASSERT(stats.full == 1);
+  CU_ASSERT(stats.resumed == 0);
+  coap_dtls_get_handshake_stats(server_ctx, &stats);
+  CU_ASSERT(stats.full == 2);
+  CU_ASSERT(stats.resumed == 1);
+  coap_free_context(ctx);
+}
+
+/* Handshakes run by workers complete as those run by the event loop. */
+static void
+t_dtls4(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_dtls_handshake_stats_t before, after;
+  int n;
+
+  CU_ASSERT_FATAL(coap_dtls_set_handshake_workers(server_ctx, 2));
+  CU_ASSERT(coap_dtls_set_handshake_workers(server_ctx, 4));
+  coap_dtls_get_handshake_stats(server_ctx, &before);
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+
+  /* a full handshake, then one that resumes the session */
+  for (n = 0; n < 2; n++) {
+    session = connect_session(ctx);
+    CU_ASSERT(session != NULL);
+    CU_ASSERT(connected == 2);
+    coap_session_release(session);
+  }
+
+  coap_dtls_get_handshake_stats(server_ctx, &after);
+  CU_ASSERT(after.full == before.full + 1);
+  CU_ASSERT(after.resumed == before.resumed + 1);
+  coap_free_context(ctx);
+}
+
+/* A ClientHello that is not answered is sent again when the timer of the
+ * context expires, after which the timer is running again. */
+static void
+t_dtls5(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_tick_t start, first, next, now;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  session = coap_new_client_session_psk(ctx, NULL, &server_addr,
+                                        COAP_PROTO_DTLS, "client",
+                                        key, sizeof(key) - 1);
+  CU_ASSERT_FATAL(session != NULL);
+
+  CU_ASSERT(coap_dtls_is_context_timeout());
+  first = coap_dtls_get_context_timeout(ctx->dtls_context);
+  CU_ASSERT_FATAL(first > 0);
+
+  /* server_ctx does not run, so the ClientHello is not answered */
+  coap_ticks(&start);
+  do {
+    coap_run_once(ctx, 100);
+    coap_ticks(&now);
+  } while (now <= first && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+
+  next = coap_dtls_get_context_timeout(ctx->dtls_context);
+  CU_ASSERT(next > first);
+  CU_ASSERT(session->state == COAP_SESSION_STATE_HANDSHAKE);
+
+  coap_session_release(session);
+  coap_free_context(ctx);
+}
+
+/* Connects a new client that offers @p ciphers and returns the name of
+ * the suite negotiated, or NULL on error. */
+static const char *
+negotiate(const char *ciphers, unsigned int *overhead) {
+  static char name[64];
+  coap_context_t *ctx;
+  coap_session_t *session;
+  const char *cipher = NULL;
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return NULL;
+  coap_set_event_handler(ctx, event_handler);
+
+  if (coap_dtls_set_ciphers(ctx, ciphers, 0)) {
+    session = connect_session(ctx);
+    if (session) {
+      cipher = coap_dtls_get_cipher(session);
+      if (cipher) {
+        snprintf(name, sizeof(name), "%s", cipher);
+        cipher = name;
+      }
+      *overhead = coap_dtls_get_overhead(session);
+      coap_session_release(session);
+    }
+  }
+  coap_free_context(ctx);
+  return cipher;
+}
+
+/* The suite negotiated follows the preference of the client unless the
+ * server has its own. AES-CCM-8 has the smallest tag of both. */
+static void
+t_dtls6(void) {
+  const char *cipher;
+  unsigned int ccm8, gcm;
+
+  CU_ASSERT(!coap_dtls_set_ciphers(server_ctx, "NO-SUCH-CIPHER", 0));
+
+  cipher = negotiate(COAP_DTLS_CIPHERS_PSK_CCM8, &ccm8);
+  CU_ASSERT_FATAL(cipher != NULL);
+  CU_ASSERT(strcmp(cipher, "PSK-AES128-CCM8") == 0);
+
+  cipher = negotiate(COAP_DTLS_CIPHERS_PSK_GCM, &gcm);
+  CU_ASSERT_FATAL(cipher != NULL);
+  CU_ASSERT(strcmp(cipher, "PSK-AES128-GCM-SHA256") == 0);
+  CU_ASSERT(ccm8 + 8 == gcm);
+
+  CU_ASSERT(coap_dtls_set_ciphers(server_ctx, COAP_DTLS_CIPHERS_PSK_GCM, 1));
+  cipher = negotiate(COAP_DTLS_CIPHERS_PSK_CCM8, &ccm8);
+  CU_ASSERT_FATAL(cipher != NULL);
+  CU_ASSERT(strcmp(cipher, "PSK-AES128-GCM-SHA256") == 0);
+
+  CU_ASSERT(coap_dtls_set_ciphers(server_ctx, NULL, 0));
+}
+
+/* Returns the bytes held for a session of a new client that connects
+ * with or without the low-memory mode. */
+static size_t
+session_memory(int low_memory) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  size_t bytes = 0;
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 0;
+  coap_set_event_handler(ctx, event_handler);
+
+  if (coap_dtls_set_low_memory(ctx, low_memory, 0)) {
+    session = connect_session(ctx);
+    if (session) {
+      if (connected == 2)
+        bytes = coap_dtls_estimate_session_memory(session);
+      coap_session_release(session);
+    }
+  }
+  coap_free_context(ctx);
+  return bytes;
+}
+
+/* Established sessions hold no buffers in the low-memory mode. */
+static void
+t_dtls7(void) {
+  size_t full, low;
+
+  full = session_memory(0);
+  low = session_memory(1);
+  CU_ASSERT(low > 0);
+  CU_ASSERT(low < full);
+}
+
+/* The DTLS state of an idle client session is released and the session
+ * is resumed when the client sends again. The server releases its session
+ * on the close_notify alert. */
+static void
+t_dtls8(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_pdu_t *request;
+  coap_dtls_handshake_stats_t before, after;
+  coap_tick_t start, now;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+  CU_ASSERT(coap_dtls_set_low_memory(ctx, 1, 1));
+
+  session = connect_session(ctx);
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+  CU_ASSERT(endpoint->sessions != NULL);
+  coap_dtls_get_handshake_stats(ctx, &before);
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 10);
+    coap_run_once(ctx, 10);
+    coap_ticks(&now);
+  } while ((session->tls || endpoint->sessions)
+           && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(session->state == COAP_SESSION_STATE_NONE);
+  CU_ASSERT_PTR_NULL(session->tls);
+  CU_ASSERT_PTR_NULL(endpoint->sessions);
+
+  /* sending connects again */
+  connected = 0;
+  request = coap_new_pdu(session);
+  CU_ASSERT_FATAL(request != NULL);
+  request->hdr->type = COAP_MESSAGE_NON;
+  request->hdr->code = COAP_REQUEST_GET;
+  request->hdr->id = coap_new_message_id(ctx);
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(ctx, 2);
+    coap_ticks(&now);
+  } while (connected < 2 && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(session->state == COAP_SESSION_STATE_ESTABLISHED);
+  coap_dtls_get_handshake_stats(ctx, &after);
+  CU_ASSERT(after.resumed == before.resumed + 1);
+
+  /* the server takes the close_notify alert */
+  coap_session_release(session);
+  coap_free_context(ctx);
+  coap_run_once(server_ctx, 10);
+}
+
+/* The hello limit lets a client through that completes its handshake,
+ * but drops ClientHello messages from its prefix beyond the burst. */
+static void
+t_dtls9(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_hello_stats_t before, after;
+  int n;
+
+  CU_ASSERT(coap_context_set_hello_limit(server_ctx, 1, 2, 1));
+  coap_context_get_hello_stats(server_ctx, &before);
+
+  session = connect_session(client_ctx);
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+  CU_ASSERT(server_ctx->dtls_handshakes == 0);
+  coap_session_release(session);
+
+  coap_context_get_hello_stats(server_ctx, &after);
+  CU_ASSERT(after.verified == before.verified + 1);
+  CU_ASSERT(after.cookies == before.cookies + 1);
+  CU_ASSERT(after.dropped_rate == before.dropped_rate);
+
+  /* the bucket of the loopback prefix is empty now */
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+  connected = 0;
+  session = coap_new_client_session_psk(ctx, NULL, &server_addr,
+                                        COAP_PROTO_DTLS, "client",
+                                        key, sizeof(key) - 1);
+  CU_ASSERT_FATAL(session != NULL);
+  for (n = 0; n < 5; n++) {
+    coap_run_once(ctx, 10);
+    coap_run_once(server_ctx, 10);
+  }
+  CU_ASSERT(connected == 0);
+  CU_ASSERT(session->state == COAP_SESSION_STATE_HANDSHAKE);
+  coap_context_get_hello_stats(server_ctx, &before);
+  CU_ASSERT(before.dropped_rate == after.dropped_rate + 1);
+  CU_ASSERT(before.cookies == after.cookies);
+
+  coap_session_release(session);
+  coap_free_context(ctx);
+  coap_run_once(server_ctx, 10);
+  CU_ASSERT(coap_context_set_hello_limit(server_ctx, 0, 0, 0));
+}
+
+static char server_identity[16]; /* last identity seen by the server */
+
+static size_t
+get_server_psk(const coap_session_t *session, const uint8_t *identity,
+               size_t identity_len, uint8_t *psk, size_t max_psk_len) {
+  (void)session;
+
+  if (identity_len >= sizeof(server_identity)
+      || sizeof(key) - 1 > max_psk_len)
+    return 0;
+  memcpy(server_identity, identity, identity_len);
+  server_identity[identity_len] = '\0';
+  memcpy(psk, key, sizeof(key) - 1);
+  return sizeof(key) - 1;
+}
+
+/* A client resumes the session of a server only with the identity that
+ * has established it. */
+static void
+t_dtls10(void) {
+  static const char *identity[] = { "alice", "bob" };
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_dtls_handshake_stats_t stats;
+  int n, round;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+  server_ctx->get_server_psk = get_server_psk;
+
+  for (round = 0; round < 2; round++) {
+    for (n = 0; n < 2; n++) {
+      server_identity[0] = '\0';
+      session = connect_identity(ctx, identity[n]);
+      CU_ASSERT_FATAL(session != NULL);
+      CU_ASSERT(connected == 2);
+      coap_session_release(session);
+
+      coap_dtls_get_handshake_stats(ctx, &stats);
+      if (round == 0) {
+        /* a full handshake with the identity of the session */
+        CU_ASSERT(strcmp(server_identity, identity[n]) == 0);
+        CU_ASSERT(stats.full == (unsigned long)n + 1);
+        CU_ASSERT(stats.resumed == 0);
+      } else {
+        CU_ASSERT(server_identity[0] == '\0');
+        CU_ASSERT(stats.full == 2);
+        CU_ASSERT(stats.resumed == (unsigned long)n + 1);
+      }
+    }
+  }
+
+  coap_free_context(ctx);
+  coap_run_once(server_ctx, 10);
+}
+
+/* A server session may be released while a worker runs its handshake,
+ * which is then freed by the loop thread when the worker is done. The
+ * session is released after increasing delays to find its job queued,
+ * running or done. */
+static void
+t_dtls11(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_tick_t start, now;
+  int n;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+
+  for (n = 0; n < 40; n++) {
+    session = coap_new_client_session_psk(ctx, NULL, &server_addr,
+                                          COAP_PROTO_DTLS, "client",
+                                          key, sizeof(key) - 1);
+    CU_ASSERT_FATAL(session != NULL);
+
+    /* the job is submitted once the cookie has been verified */
+    coap_ticks(&start);
+    do {
+      coap_run_once(ctx, 10);
+      coap_run_once(server_ctx, 10);
+      coap_ticks(&now);
+    } while (!endpoint->sessions
+             && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+    CU_ASSERT_FATAL(endpoint->sessions != NULL);
+    usleep(10 * n);
+    coap_session_free(endpoint->sessions);
+    CU_ASSERT_PTR_NULL(endpoint->sessions);
+
+    coap_session_release(session);
+    coap_run_once(server_ctx, 10);
+  }
+  coap_free_context(ctx);
+}
+
+/* An idle server session releases its DTLS state but is kept with what
+ * depends on it, such as observers or asynchronous states. When the
+ * client connects again, the handshake resumes on the same session. */
+static void
+t_dtls12(void) {
+  coap_context_t *ctx;
+  coap_session_t *session, *server;
+  coap_pdu_t *request;
+  coap_dtls_handshake_stats_t before, after;
+  coap_tick_t start, now;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+  CU_ASSERT(coap_dtls_set_low_memory(server_ctx, 1, 1));
+
+  session = connect_session(ctx);
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+  server = endpoint->sessions;
+  CU_ASSERT_FATAL(server != NULL);
+  coap_session_reference(server);
+  coap_dtls_get_handshake_stats(server_ctx, &before);
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 10);
+    coap_run_once(ctx, 10);
+    coap_ticks(&now);
+  } while ((server->tls || session->tls)
+           && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+  CU_ASSERT_PTR_NULL(server->tls);
+  CU_ASSERT(server->state == COAP_SESSION_STATE_NONE);
+  CU_ASSERT(endpoint->sessions == server);
+  CU_ASSERT_PTR_NULL(session->tls);
+
+  /* the client connects again when it sends */
+  connected = 0;
+  request = coap_new_pdu(session);
+  CU_ASSERT_FATAL(request != NULL);
+  request->hdr->type = COAP_MESSAGE_NON;
+  request->hdr->code = COAP_REQUEST_GET;
+  request->hdr->id = coap_new_message_id(ctx);
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(ctx, 2);
+    coap_ticks(&now);
+  } while (connected < 2 && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(connected == 2);
+  CU_ASSERT(server->state == COAP_SESSION_STATE_ESTABLISHED);
+  CU_ASSERT(server->tls != NULL);
+  CU_ASSERT(endpoint->sessions == server);
+  CU_ASSERT_PTR_NULL(server->next);
+  coap_dtls_get_handshake_stats(server_ctx, &after);
+  CU_ASSERT(after.full == before.full);
+  CU_ASSERT(after.resumed == before.resumed + 1);
+
+  CU_ASSERT(coap_dtls_set_low_memory(server_ctx, 0, 0));
+  coap_session_release(server);
+  coap_session_release(session);
+  coap_free_context(ctx);
+  coap_run_once(server_ctx, 10);
+}
+
+#if defined(HAVE_PTHREAD_H) && !defined(WITHOUT_KEYSTORE)
+static int keystore_lookups;	/* calls of keystore_lookup() */
+static int keystore_in_loop;	/* calls by the loop thread */
+static pthread_t loop_thread;
+
+static size_t
+keystore_lookup(const uint8_t *identity, size_t identity_len,
+                uint8_t *psk, size_t max_psk_len, void *arg) {
+  (void)identity;
+  (void)identity_len;
+  (void)arg;
+
+  keystore_lookups++;
+  if (pthread_equal(pthread_self(), loop_thread))
+    keystore_in_loop++;
+  if (sizeof(key) - 1 > max_psk_len)
+    return 0;
+  memcpy(psk, key, sizeof(key) - 1);
+  return sizeof(key) - 1;
+}
+
+/* The keystore of a context is looked up by the handshake workers rather
+ * than by the loop thread. */
+static void
+t_dtls13(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_keystore_t *keystore;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+  keystore = coap_new_keystore();
+  CU_ASSERT_FATAL(keystore != NULL);
+  coap_keystore_set_lookup(keystore, keystore_lookup, NULL, 0, 0);
+  coap_context_set_keystore(server_ctx, keystore);
+  server_ctx->get_server_psk = coap_get_context_server_psk;
+  CU_ASSERT_FATAL(coap_dtls_set_handshake_workers(server_ctx, 2));
+  loop_thread = pthread_self();
+  keystore_lookups = keystore_in_loop = 0;
+
+  session = connect_identity(ctx, "carol");
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+  CU_ASSERT(keystore_lookups == 1);
+  CU_ASSERT(keystore_in_loop == 0);
+  coap_session_release(session);
+
+  coap_free_context(ctx);
+  coap_run_once(server_ctx, 10);
+  coap_context_set_keystore(server_ctx, NULL);
+}
+#endif /* HAVE_PTHREAD_H && !WITHOUT_KEYSTORE */
+
+#define TEST_BATCH 8		/* requests sent at once in t_dtls14 */
+
+static unsigned int batch_seq;	/* next sequence number expected */
+static int batch_in_order;	/* cleared if a request has been altered */
+
+static void
+hnd_batch(coap_context_t *ctx, coap_resource_t *resource,
+          coap_batch_request_t *requests, size_t count) {
+  size_t n, length;
+  unsigned char *data;
+
+  (void)ctx;
+  (void)resource;
+
+  for (n = 0; n < count; n++) {
+    if (!coap_get_data(requests[n].request, &length, &data)
+        || length != 1 || data[0] != batch_seq)
+      batch_in_order = 0;
+    batch_seq++;
+  }
+}
+
+/* Records are decrypted into a PDU that the session reuses, but not into
+ * one that a batch handler has yet to get. */
+static void
+t_dtls14(void) {
+  coap_context_t *ctx;
+  coap_session_t *session;
+  coap_resource_t *r;
+  coap_pdu_t *request;
+  coap_tick_t start, now;
+  unsigned char n;
+
+  r = coap_resource_init((unsigned char *)"ingest", 6, 0);
+  CU_ASSERT_FATAL(r != NULL);
+  coap_register_batch_handler(r, hnd_batch);
+  coap_add_resource(server_ctx, r);
+  batch_seq = 0;
+  batch_in_order = 1;
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  coap_set_event_handler(ctx, event_handler);
+  session = connect_session(ctx);
+  CU_ASSERT_FATAL(session != NULL);
+  CU_ASSERT(connected == 2);
+
+  for (n = 0; n < TEST_BATCH; n++) {
+    request = coap_new_pdu(session);
+    CU_ASSERT_FATAL(request != NULL);
+    request->hdr->type = COAP_MESSAGE_NON;
+    request->hdr->code = COAP_REQUEST_POST;
+    request->hdr->id = coap_new_message_id(ctx);
+    coap_add_option(request, COAP_OPTION_URI_PATH, 6,
+                    (const unsigned char *)"ingest");
+    coap_add_data(request, 1, &n);
+    CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+  }
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(ctx, 2);
+    coap_ticks(&now);
+  } while (batch_seq < TEST_BATCH
+           && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+  CU_ASSERT(batch_seq == TEST_BATCH);
+  CU_ASSERT(batch_in_order);
+
+  coap_session_release(session);
+  coap_free_context(ctx);
+  coap_run_once(server_ctx, 10);
+  coap_delete_resource(server_ctx, r->key);
+}
+
+static int
+t_dtls_tests_create(void) {
+  coap_address_init(&server_addr);
+  server_addr.size = sizeof(struct sockaddr_in);
+  server_addr.addr.sin.sin_family = AF_INET;
+  server_addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server_addr.addr.sin.sin_port = htons(TEST_PORT);
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !client_ctx)
+    return 1;
+  coap_context_set_psk(server_ctx, "", key, sizeof(key) - 1);
+  endpoint = coap_new_endpoint(server_ctx, &server_addr, COAP_PROTO_DTLS);
+  if (!endpoint)
+    return 1;
+
+  coap_set_event_handler(server_ctx, event_handler);
+  coap_set_event_handler(client_ctx, event_handler);
+  return 0;
+}
+
+static int
+t_dtls_tests_remove(void) {
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_dtls_tests(void) {
+  CU_pSuite suite;
+  coap_context_t *ctx;
+  coap_dtls_handshake_stats_t stats;
+  int resumes;
+
+  /* only DTLS libraries that resume sessions are tested */
+  ctx = coap_new_context(NULL);
+  resumes = ctx && coap_dtls_get_handshake_stats(ctx, &stats);
+  coap_free_context(ctx);
+  if (!resumes)
+    return NULL;
+
+  suite = CU_add_suite("DTLS sessions", t_dtls_tests_create,
+                       t_dtls_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add DTLS session test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define DTLS_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add DTLS session test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  DTLS_TEST(suite, t_dtls1);
+  DTLS_TEST(suite, t_dtls2);
+  DTLS_TEST(suite, t_dtls3);
+  DTLS_TEST(suite, t_dtls4);
+  DTLS_TEST(suite, t_dtls5);
+  DTLS_TEST(suite, t_dtls6);
+  DTLS_TEST(suite, t_dtls7);
+  DTLS_TEST(suite, t_dtls8);
+  DTLS_TEST(suite, t_dtls9);
+  DTLS_TEST(suite, t_dtls10);
+  DTLS_TEST(suite, t_dtls11);
+  DTLS_TEST(suite, t_dtls12);
+#if defined(HAVE_PTHREAD_H) && !defined(WITHOUT_KEYSTORE)
+  DTLS_TEST(suite, t_dtls13);
+#endif /* HAVE_PTHREAD_H && !WITHOUT_KEYSTORE */
+  DTLS_TEST(suite, t_dtls14);
+
+  return suite;
+}
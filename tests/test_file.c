@@ -0,0 +1,338 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_file.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WITHOUT_FILE_RESOURCE
+
+#define TEST_FILE "test_file.tmp"
+#define TEST_FILE_NEW "test_file.tmp.new"
+#define TEST_BODY_SIZE 3000
+
+static coap_context_t *ctx;	/* Holds the coap context for all tests */
+static coap_session_t *session;	/* Session the requests are received on */
+static coap_resource_t *resource; /* Serves TEST_FILE */
+static unsigned char body[TEST_BODY_SIZE];
+
+/* Replaces TEST_FILE with the first length bytes of body. */
+static int
+write_file(size_t length) {
+  FILE *fp = fopen(TEST_FILE_NEW, "wb");
+
+  if (!fp)
+    return 0;
+  if (fwrite(body, 1, length, fp) != length) {
+    fclose(fp);
+    return 0;
+  }
+  fclose(fp);
+  remove(TEST_FILE);
+  return rename(TEST_FILE_NEW, TEST_FILE) == 0;
+}
+
+/* Creates a GET request with an optional Block2 option (if szx >= 0)
+ * or ETag. */
+static coap_pdu_t *
+make_request(unsigned int num, int szx, const unsigned char *etag,
+             size_t etag_length) {
+  coap_pdu_t *request;
+  unsigned char buf[4];
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0x1234,
+                          COAP_DEFAULT_PDU_SIZE);
+  coap_add_token(request, 2, (const unsigned char *)"f1");
+  if (etag)
+    coap_add_option(request, COAP_OPTION_ETAG, (unsigned int)etag_length,
+                    etag);
+  if (szx >= 0)
+    coap_add_option(request, COAP_OPTION_BLOCK2,
+                    coap_encode_var_bytes(buf, (num << 4) | szx), buf);
+  return request;
+}
+
+/* Runs request through the library and the handler of resource like
+ * handle_request() does and returns the response. */
+static coap_pdu_t *
+serve(coap_pdu_t *request) {
+  coap_pdu_t *response;
+  str token = { 2, (unsigned char *)"f1" };
+
+  response = coap_pdu_init(COAP_MESSAGE_ACK, 0, request->hdr->id,
+                           coap_session_max_pdu_size(session));
+  coap_add_token(response, request->hdr->token_length, request->hdr->token);
+  if (!coap_large_response_get(resource, session, request, response))
+    resource->handler[COAP_REQUEST_GET - 1](ctx, resource, session, request,
+                                            &token, response);
+  return response;
+}
+
+/* Fetches the whole file with blocks of szx and compares it with the
+ * first length bytes of body. Stores the ETag in etag. */
+static void
+fetch(int szx, size_t length, unsigned char *etag) {
+  coap_pdu_t *request, *response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_block_t block;
+  size_t offset = 0, len;
+  unsigned char *data;
+  unsigned int num = 0;
+
+  do {
+    request = make_request(num, szx, NULL, 0);
+    response = serve(request);
+    CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+    option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+    CU_ASSERT(option && coap_opt_length(option) == COAP_FILE_ETAG_LENGTH);
+    if (option && num == 0)
+      memcpy(etag, coap_opt_value(option), COAP_FILE_ETAG_LENGTH);
+    CU_ASSERT(coap_get_block(response, COAP_OPTION_BLOCK2, &block));
+    if (coap_get_data(response, &len, &data)) {
+      CU_ASSERT(offset + len <= length);
+      if (offset + len <= length)
+        CU_ASSERT(memcmp(data, body + offset, len) == 0);
+      offset += len;
+    }
+    coap_delete_pdu(response);
+    coap_delete_pdu(request);
+    num++;
+  } while (block.m && num < 1000);
+
+  CU_ASSERT(offset == length);
+}
+
+static void
+t_file1(void) {
+  coap_pdu_t *request, *response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  unsigned char etag[COAP_FILE_ETAG_LENGTH];
+
+  CU_ASSERT(write_file(sizeof(body)));
+  fetch(4, sizeof(body), etag);
+
+  /* the Content-Format is added */
+  request = make_request(0, 6, NULL, 0);
+  response = serve(request);
+  option = coap_check_option(response, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+  CU_ASSERT(option != NULL);
+  if (option)
+    CU_ASSERT(coap_decode_var_bytes(coap_opt_value(option),
+                                    coap_opt_length(option))
+              == COAP_MEDIATYPE_APPLICATION_OCTET_STREAM);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* a matching ETag is answered with 2.03 */
+  request = make_request(0, -1, etag, sizeof(etag));
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(203));
+  CU_ASSERT(response->data == NULL);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+}
+
+static void
+t_file2(void) {
+  coap_pdu_t *request, *response;
+  unsigned char etag1[COAP_FILE_ETAG_LENGTH], etag2[COAP_FILE_ETAG_LENGTH];
+  size_t n, len;
+  unsigned char *data;
+
+  CU_ASSERT(write_file(sizeof(body)));
+  fetch(5, sizeof(body), etag1);
+
+  /* start a transfer, then replace the file */
+  request = make_request(0, 4, NULL, 0);
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 11);
+  CU_ASSERT(write_file(sizeof(body) - 100));
+  resource->dirty = 0;
+
+  /* the transfer in progress continues with the old contents */
+  request = make_request(1, 4, NULL, 0);
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  CU_ASSERT(len == 256);
+  for (n = 0; n < len; n++) {
+    if (data[n] != (unsigned char)((256 + n) * 7))
+      break;
+  }
+  CU_ASSERT(n == len);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* a new transfer gets the new contents */
+  coap_free_large_responses(session);
+  fetch(4, sizeof(body) - 100, etag2);
+  CU_ASSERT(memcmp(etag1, etag2, sizeof(etag1)) != 0);
+  CU_ASSERT(resource->dirty);
+  resource->dirty = 0;
+}
+
+static void
+t_file3(void) {
+  coap_pdu_t *request, *response;
+  coap_block_t block;
+  size_t len;
+  unsigned char *data;
+
+  coap_free_large_responses(session);
+  remove(TEST_FILE);
+
+  request = make_request(0, -1, NULL, 0);
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(404));
+  coap_delete_pdu(response);
+
+  /* the file is served again when it is back */
+  CU_ASSERT(write_file(10));
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(!coap_get_block(response, COAP_OPTION_BLOCK2, &block));
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  CU_ASSERT(len == 10);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+}
+
+/* A file written over during a transfer is detected before the next
+ * block is served, which then comes from the new contents. */
+static void
+t_file4(void) {
+  coap_pdu_t *request, *response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  unsigned char etag[COAP_FILE_ETAG_LENGTH];
+  size_t n, len;
+  unsigned char *data;
+  FILE *fp;
+
+  coap_free_large_responses(session);
+  CU_ASSERT(write_file(sizeof(body) - 100));
+
+  request = make_request(0, 4, NULL, 0);
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+  CU_ASSERT(option != NULL);
+  if (option)
+    memcpy(etag, coap_opt_value(option), sizeof(etag));
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  /* append in place, which changes the size */
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 5);
+  fp = fopen(TEST_FILE, "r+b");
+  CU_ASSERT(fp != NULL);
+  if (!fp)
+    return;
+  CU_ASSERT(fwrite(body, 1, sizeof(body), fp) == sizeof(body));
+  fclose(fp);
+
+  request = make_request(1, 4, NULL, 0);
+  response = serve(request);
+  CU_ASSERT(response->hdr->code == COAP_RESPONSE_CODE(205));
+  option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+  CU_ASSERT(option && coap_opt_length(option) == sizeof(etag)
+            && memcmp(coap_opt_value(option), etag, sizeof(etag)) != 0);
+  CU_ASSERT(coap_get_data(response, &len, &data));
+  CU_ASSERT(len == 256 && memcmp(data, body + 256, len) == 0);
+  coap_delete_pdu(response);
+  coap_delete_pdu(request);
+
+  coap_free_large_responses(session);
+  resource->dirty = 0;
+}
+
+static int
+t_file_tests_create(void) {
+  coap_address_t addr;
+  size_t n;
+
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 7);
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in6);
+  addr.addr.sin6.sin6_family = AF_INET6;
+  addr.addr.sin6.sin6_addr = in6addr_loopback;
+  addr.addr.sin6.sin6_port = htons(COAP_DEFAULT_PORT);
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+
+  session = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+  resource = coap_resource_init_file((unsigned char *)"file", 4, TEST_FILE,
+                                     COAP_MEDIATYPE_APPLICATION_OCTET_STREAM,
+                                     0);
+  if (!resource)
+    return 1;
+  coap_add_resource(ctx, resource);
+  return session == NULL;
+}
+
+static int
+t_file_tests_remove(void) {
+  coap_free_context(ctx);
+  remove(TEST_FILE);
+  return 0;
+}
+
+CU_pSuite
+t_init_file_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("file resource", t_file_tests_create,
+                       t_file_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add file resource test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define FILE_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add file resource test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  FILE_TEST(suite, t_file1);
+  FILE_TEST(suite, t_file2);
+  FILE_TEST(suite, t_file3);
+  FILE_TEST(suite, t_file4);
+
+  return suite;
+}
+
+#else /* WITHOUT_FILE_RESOURCE */
+
+CU_pSuite
+t_init_file_tests(void) {
+  return NULL;
+}
+
+#endif /* WITHOUT_FILE_RESOURCE */
@@ -0,0 +1,209 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_hello.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+static coap_context_t *ctx;	/* Holds the limit for all tests */
+
+static coap_address_t *
+ipv4(uint32_t addr) {
+  static coap_address_t address;
+
+  coap_address_init(&address);
+  address.size = sizeof(struct sockaddr_in);
+  address.addr.sin.sin_family = AF_INET;
+  address.addr.sin.sin_addr.s_addr = htonl(addr);
+  return &address;
+}
+
+static coap_address_t *
+ipv6(const uint8_t addr[16]) {
+  static coap_address_t address;
+
+  coap_address_init(&address);
+  address.size = sizeof(struct sockaddr_in6);
+  address.addr.sin6.sin6_family = AF_INET6;
+  memcpy(&address.addr.sin6.sin6_addr, addr, 16);
+  return &address;
+}
+
+/* Without a limit, all datagrams are accepted and none is counted. */
+static void
+t_hello1(void) {
+  coap_hello_stats_t stats;
+  int n;
+
+  for (n = 0; n < 100; n++)
+    CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+  coap_context_get_hello_stats(ctx, &stats);
+  CU_ASSERT(stats.received == 0);
+  CU_ASSERT(stats.dropped_rate == 0);
+}
+
+/* Senders with the same IPv4 prefix share a bucket, which is refilled
+ * with rate datagrams per second. */
+static void
+t_hello2(void) {
+  coap_hello_stats_t stats;
+  coap_tick_t now = 1000 * COAP_TICKS_PER_SECOND;
+
+  CU_ASSERT(coap_context_set_hello_limit(ctx, 2, 4, 0));
+
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000002), now));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a0000fe), now));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000003), now));
+  /* another prefix */
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000101), now));
+
+  /* one datagram after half a second */
+  now += COAP_TICKS_PER_SECOND / 2;
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000001), now));
+
+  /* no more than burst after a long time */
+  now += 3600 * COAP_TICKS_PER_SECOND;
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), now));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000001), now));
+
+  coap_context_get_hello_stats(ctx, &stats);
+  CU_ASSERT(stats.received == 13);
+  CU_ASSERT(stats.dropped_rate == 3);
+  CU_ASSERT(stats.dropped_busy == 0);
+}
+
+/* IPv6 senders share a bucket per /64, IPv4-mapped addresses that of
+ * IPv4. */
+static void
+t_hello3(void) {
+  uint8_t addr[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 1 };
+  uint8_t mapped[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff,
+                         10, 0, 2, 1 };
+
+  CU_ASSERT(coap_context_set_hello_limit(ctx, 1, 2, 0));
+
+  addr[15] = 1;
+  CU_ASSERT(coap_hello_admit(ctx, ipv6(addr), 0));
+  addr[8] = 0xff;
+  CU_ASSERT(coap_hello_admit(ctx, ipv6(addr), 0));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv6(addr), 0));
+  addr[7] = 2;
+  CU_ASSERT(coap_hello_admit(ctx, ipv6(addr), 0));
+
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000201), 0));
+  CU_ASSERT(coap_hello_admit(ctx, ipv6(mapped), 0));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000202), 0));
+}
+
+/* All datagrams are dropped while max_handshakes are in progress. */
+static void
+t_hello4(void) {
+  coap_hello_stats_t before, after;
+
+  CU_ASSERT(coap_context_set_hello_limit(ctx, 0, 0, 2));
+  coap_context_get_hello_stats(ctx, &before);
+
+  ctx->dtls_handshakes = 1;
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+  ctx->dtls_handshakes = 2;
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0b000001), 0));
+  ctx->dtls_handshakes = 0;
+
+  coap_context_get_hello_stats(ctx, &after);
+  CU_ASSERT(after.received == before.received + 3);
+  CU_ASSERT(after.dropped_busy == before.dropped_busy + 2);
+  CU_ASSERT(after.dropped_rate == before.dropped_rate);
+}
+
+/* A flood of prefixes is limited by the global bucket, from which new
+ * and evicted buckets get their credit. */
+static void
+t_hello5(void) {
+  coap_hello_stats_t before, after;
+  unsigned long admitted = 0;
+  uint32_t n;
+
+  CU_ASSERT(coap_context_set_hello_limit(ctx, 1, 2, 0));
+  coap_context_get_hello_stats(ctx, &before);
+
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+  CU_ASSERT(coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+
+  for (n = 1; n <= 2 * COAP_HELLO_MAX_PREFIXES; n++)
+    admitted += coap_hello_admit(ctx, ipv4(0x0b000000 + (n << 8)), 0);
+  CU_ASSERT(admitted == 2 * COAP_HELLO_GLOBAL_PREFIXES - 2);
+  /* the bucket of 10.0.0.0/24 has been evicted, which gives no credit */
+  CU_ASSERT(!coap_hello_admit(ctx, ipv4(0x0a000001), 0));
+
+  coap_context_get_hello_stats(ctx, &after);
+  CU_ASSERT(after.received - before.received == 2 * COAP_HELLO_MAX_PREFIXES + 4);
+  CU_ASSERT(after.dropped_rate - before.dropped_rate
+            == 2 * COAP_HELLO_MAX_PREFIXES + 4 - admitted - 2);
+
+  /* a second later, the global bucket has been refilled in part */
+  admitted = 0;
+  for (n = 1; n <= COAP_HELLO_MAX_PREFIXES; n++)
+    admitted += coap_hello_admit(ctx, ipv4(0x0c000000 + (n << 8)),
+                                 COAP_TICKS_PER_SECOND);
+  CU_ASSERT(admitted == COAP_HELLO_GLOBAL_PREFIXES);
+}
+
+static int
+t_hello_tests_create(void) {
+  ctx = coap_new_context(NULL);
+  return ctx == NULL;
+}
+
+static int
+t_hello_tests_remove(void) {
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_hello_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("DTLS hello limit", t_hello_tests_create,
+                       t_hello_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add DTLS hello limit test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define HELLO_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add DTLS hello limit test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  HELLO_TEST(suite, t_hello1);
+  HELLO_TEST(suite, t_hello2);
+  HELLO_TEST(suite, t_hello3);
+  HELLO_TEST(suite, t_hello4);
+  HELLO_TEST(suite, t_hello5);
+
+  return suite;
+}
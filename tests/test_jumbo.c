@@ -0,0 +1,263 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_jumbo.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_BODY_SIZE 20000
+#define TEST_MTU 32768
+#define TEST_PORT 5701
+#define TEST_DEADLINE 2		/* seconds */
+
+static coap_context_t *server_ctx; /* Serves the resource */
+static coap_context_t *client_ctx; /* Sends the requests */
+static coap_endpoint_t *endpoint; /* Endpoint of server_ctx */
+static coap_session_t *session;	/* Client session to server_ctx */
+static unsigned char body[TEST_BODY_SIZE];
+
+static int put_calls;		/* Number of calls to hnd_put() */
+static size_t put_length;	/* Payload length seen by hnd_put() */
+static coap_pdu_t *received;	/* Copy of the last response */
+
+static void
+hnd_get(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *s, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  (void)ctx;
+  (void)token;
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_data_large_response(resource, s, request, response,
+                               sizeof(body), body, NULL, NULL);
+}
+
+static void
+hnd_put(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *s, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  size_t length;
+  unsigned char *data;
+
+  (void)ctx;
+  (void)resource;
+  (void)s;
+  (void)token;
+
+  put_calls++;
+  if (coap_get_data(request, &length, &data)
+      && length <= sizeof(body) && memcmp(data, body, length) == 0)
+    put_length = length;
+  response->hdr->code = COAP_RESPONSE_CODE(204);
+}
+
+static void
+response_handler(coap_context_t *ctx, coap_session_t *s,
+                 coap_pdu_t *sent, coap_pdu_t *pdu, const coap_tid_t id) {
+  size_t length;
+  unsigned char *data;
+
+  (void)ctx;
+  (void)s;
+  (void)sent;
+  (void)id;
+
+  if (received)
+    coap_delete_pdu(received);
+  received = coap_pdu_init(0, 0, 0, pdu->length);
+  if (received && coap_get_data(pdu, &length, &data)) {
+    received->hdr->code = pdu->hdr->code;
+    coap_add_data(received, (unsigned int)length, data);
+  }
+}
+
+/* Runs both contexts for a while or until a response has arrived. */
+static void
+run(void) {
+  coap_tick_t start, now;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(client_ctx, 2);
+    coap_ticks(&now);
+  } while (!received && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+}
+
+static coap_pdu_t *
+make_request(unsigned char code, const char *path) {
+  coap_pdu_t *request;
+
+  request = coap_new_pdu(session);
+  if (!request)
+    return NULL;
+  request->hdr->type = COAP_MESSAGE_NON;
+  request->hdr->code = code;
+  request->hdr->id = coap_new_message_id(client_ctx);
+  coap_add_option(request, COAP_OPTION_URI_PATH, (unsigned int)strlen(path),
+                  (const unsigned char *)path);
+  return request;
+}
+
+static void
+reset(void) {
+  put_calls = 0;
+  put_length = 0;
+  if (received)
+    coap_delete_pdu(received);
+  received = NULL;
+}
+
+/* Datagrams larger than the default receive buffer are discarded. */
+static void
+t_jumbo1(void) {
+  coap_pdu_t *request;
+
+  reset();
+  coap_session_set_mtu(session, TEST_MTU);
+  request = make_request(COAP_REQUEST_PUT, "put");
+  CU_ASSERT_FATAL(request != NULL);
+  CU_ASSERT(coap_add_data(request, 3000, body));
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+  run();
+
+  CU_ASSERT(put_calls == 0);
+  CU_ASSERT_PTR_NULL(received);
+}
+
+/* With larger buffers, a request is received in a single datagram. */
+static void
+t_jumbo2(void) {
+  coap_pdu_t *request;
+
+  reset();
+  CU_ASSERT(coap_endpoint_set_rx_buffer_size(endpoint, TEST_MTU));
+  request = make_request(COAP_REQUEST_PUT, "put");
+  CU_ASSERT_FATAL(request != NULL);
+  CU_ASSERT(coap_add_data(request, sizeof(body), body));
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+  run();
+
+  CU_ASSERT(put_calls == 1);
+  CU_ASSERT(put_length == sizeof(body));
+  CU_ASSERT_PTR_NOT_NULL(received);
+}
+
+/* A representation that fits into the session MTU is sent without
+ * Block2, provided the client can receive it. */
+static void
+t_jumbo3(void) {
+  coap_pdu_t *request;
+  size_t length;
+  unsigned char *data;
+
+  reset();
+  CU_ASSERT(coap_session_set_rx_buffer_size(session, TEST_MTU));
+  request = make_request(COAP_REQUEST_GET, "get");
+  CU_ASSERT_FATAL(request != NULL);
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+  run();
+
+  CU_ASSERT_FATAL(received != NULL);
+  CU_ASSERT(received->hdr->code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(coap_get_data(received, &length, &data));
+  CU_ASSERT(length == sizeof(body));
+  CU_ASSERT(memcmp(data, body, sizeof(body)) == 0);
+}
+
+static void
+t_jumbo4(void) {
+  CU_ASSERT(coap_endpoint_set_rx_buffer_size(endpoint, COAP_MAX_PDU_SIZE));
+  CU_ASSERT(!coap_endpoint_set_rx_buffer_size(endpoint,
+                                              COAP_MAX_PDU_SIZE + 1));
+  CU_ASSERT(coap_endpoint_set_rx_buffer_size(endpoint, 0));
+  CU_ASSERT(endpoint->rx_buffer_size == COAP_RXBUFFER_SIZE);
+
+  coap_session_set_mtu(session, COAP_MAX_PDU_SIZE + 1);
+  CU_ASSERT(session->mtu == COAP_MAX_PDU_SIZE);
+}
+
+static int
+t_jumbo_tests_create(void) {
+  coap_address_t addr;
+  coap_resource_t *r;
+  size_t n;
+
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 11 + (n >> 8));
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(TEST_PORT);
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !client_ctx)
+    return 1;
+  endpoint = coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP);
+  if (!endpoint)
+    return 1;
+  /* the server sessions inherit the MTU when they are created */
+  coap_endpoint_set_default_mtu(endpoint, TEST_MTU);
+
+  r = coap_resource_init((unsigned char *)"get", 3, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server_ctx, r);
+  r = coap_resource_init((unsigned char *)"put", 3, 0);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_put);
+  coap_add_resource(server_ctx, r);
+
+  coap_register_response_handler(client_ctx, response_handler);
+  session = coap_new_client_session(client_ctx, NULL, &addr, COAP_PROTO_UDP);
+  return session == NULL;
+}
+
+static int
+t_jumbo_tests_remove(void) {
+  reset();
+  coap_session_release(session);
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_jumbo_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("large datagrams", t_jumbo_tests_create,
+                       t_jumbo_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add large datagram test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define JUMBO_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add large datagram test (%s)\n",      \
+	    CU_get_error_msg());				      \
+  }
+
+  JUMBO_TEST(suite, t_jumbo1);
+  JUMBO_TEST(suite, t_jumbo2);
+  JUMBO_TEST(suite, t_jumbo3);
+  JUMBO_TEST(suite, t_jumbo4);
+
+  return suite;
+}
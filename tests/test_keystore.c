@@ -0,0 +1,218 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_keystore.h"
+
+#include <coap.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_FILE "test_keystore.tmp"
+#define TEST_FILE_NEW "test_keystore.tmp.new"
+
+static coap_keystore_t *keystore; /* The keystore for all tests */
+
+static unsigned int lookups;	/* Number of calls to lookup() */
+
+/* Knows the identities "db" followed by a digit. */
+static size_t
+lookup(const uint8_t *identity, size_t identity_len,
+       uint8_t *key, size_t max_key_len, void *arg) {
+  (void)arg;
+
+  lookups++;
+  if (identity_len != 3 || memcmp(identity, "db", 2) != 0 || max_key_len < 4)
+    return 0;
+  memcpy(key, "key", 3);
+  key[3] = identity[2];
+  return 4;
+}
+
+/* Replaces TEST_FILE with text. */
+static int
+write_file(const char *text) {
+  FILE *fp = fopen(TEST_FILE_NEW, "w");
+
+  if (!fp)
+    return 0;
+  fputs(text, fp);
+  fclose(fp);
+  remove(TEST_FILE);
+  return rename(TEST_FILE_NEW, TEST_FILE) == 0;
+}
+
+static size_t
+get(const char *identity, uint8_t *key, size_t max_key_len) {
+  return coap_keystore_lookup(keystore, (const uint8_t *)identity,
+                              strlen(identity), key, max_key_len);
+}
+
+static void
+t_keystore1(void) {
+  uint8_t key[COAP_KEYSTORE_MAX_KEY_LENGTH + 1];
+
+  memset(key, 'k', sizeof(key));
+  CU_ASSERT(coap_keystore_add(keystore, (const uint8_t *)"alice", 5,
+                              (const uint8_t *)"secret", 6));
+  CU_ASSERT(!coap_keystore_add(keystore, (const uint8_t *)"bob", 3,
+                               key, sizeof(key)));
+
+  CU_ASSERT(get("alice", key, sizeof(key)) == 6);
+  CU_ASSERT(memcmp(key, "secret", 6) == 0);
+  CU_ASSERT(get("alice", key, 5) == 0);
+  CU_ASSERT(get("alic", key, sizeof(key)) == 0);
+  CU_ASSERT(get("bob", key, sizeof(key)) == 0);
+
+  /* replaced */
+  CU_ASSERT(coap_keystore_add(keystore, (const uint8_t *)"alice", 5,
+                              (const uint8_t *)"other", 5));
+  CU_ASSERT(get("alice", key, sizeof(key)) == 5);
+  CU_ASSERT(memcmp(key, "other", 5) == 0);
+
+  CU_ASSERT(coap_keystore_remove(keystore, (const uint8_t *)"alice", 5));
+  CU_ASSERT(!coap_keystore_remove(keystore, (const uint8_t *)"alice", 5));
+  CU_ASSERT(get("alice", key, sizeof(key)) == 0);
+}
+
+/* Keys are loaded from a file and replaced when it changes. */
+static void
+t_keystore2(void) {
+  uint8_t key[COAP_KEYSTORE_MAX_KEY_LENGTH];
+
+  CU_ASSERT(coap_keystore_add(keystore, (const uint8_t *)"carol", 5,
+                              (const uint8_t *)"added", 5));
+  CU_ASSERT_FATAL(write_file("# identity key\n"
+                             "dave 0123456789abcdef\n"
+                             "\n"
+                             "  erin\tDEADBEEF  \n"));
+  CU_ASSERT(coap_keystore_load_file(keystore, TEST_FILE) == 2);
+  CU_ASSERT(get("dave", key, sizeof(key)) == 8);
+  CU_ASSERT(memcmp(key, "\x01\x23\x45\x67\x89\xab\xcd\xef", 8) == 0);
+  CU_ASSERT(get("erin", key, sizeof(key)) == 4);
+  CU_ASSERT(memcmp(key, "\xde\xad\xbe\xef", 4) == 0);
+
+  CU_ASSERT(coap_keystore_check_file(keystore) == 0);
+
+  /* a malformed file is not loaded */
+  CU_ASSERT_FATAL(write_file("dave 012\n"));
+  CU_ASSERT(coap_keystore_check_file(keystore) == 0);
+  CU_ASSERT(get("dave", key, sizeof(key)) == 8);
+
+  CU_ASSERT_FATAL(write_file("frank 00ff\n"));
+  CU_ASSERT(coap_keystore_check_file(keystore) == 1);
+  CU_ASSERT(get("dave", key, sizeof(key)) == 0);
+  CU_ASSERT(get("erin", key, sizeof(key)) == 0);
+  CU_ASSERT(get("frank", key, sizeof(key)) == 2);
+  CU_ASSERT(get("carol", key, sizeof(key)) == 5);
+
+  CU_ASSERT(coap_keystore_load_file(keystore, TEST_FILE ".missing") == -1);
+  CU_ASSERT(get("frank", key, sizeof(key)) == 2);
+}
+
+/* Results of the lookup function are cached. */
+static void
+t_keystore3(void) {
+  uint8_t key[COAP_KEYSTORE_MAX_KEY_LENGTH];
+
+  coap_keystore_set_lookup(keystore, lookup, NULL, 2, 60);
+  lookups = 0;
+
+  CU_ASSERT(get("db1", key, sizeof(key)) == 4);
+  CU_ASSERT(memcmp(key, "key1", 4) == 0);
+  CU_ASSERT(get("db1", key, sizeof(key)) == 4);
+  CU_ASSERT(lookups == 1);
+
+  /* unknown identities are cached as well */
+  CU_ASSERT(get("nobody", key, sizeof(key)) == 0);
+  CU_ASSERT(get("nobody", key, sizeof(key)) == 0);
+  CU_ASSERT(lookups == 2);
+
+  /* stored keys are not looked up */
+  CU_ASSERT(get("frank", key, sizeof(key)) == 2);
+  CU_ASSERT(lookups == 2);
+
+  /* db1 has been used after nobody, which is removed first */
+  CU_ASSERT(get("db1", key, sizeof(key)) == 4);
+  CU_ASSERT(get("db2", key, sizeof(key)) == 4);
+  CU_ASSERT(lookups == 3);
+  CU_ASSERT(get("db1", key, sizeof(key)) == 4);
+  CU_ASSERT(lookups == 3);
+  CU_ASSERT(get("nobody", key, sizeof(key)) == 0);
+  CU_ASSERT(lookups == 4);
+
+  coap_keystore_set_lookup(keystore, NULL, NULL, 0, 0);
+  CU_ASSERT(get("db1", key, sizeof(key)) == 0);
+}
+
+/* The PSK callback of a context resolves identities with the keystore. */
+static void
+t_keystore4(void) {
+  coap_context_t *ctx;
+  coap_session_t session;
+  uint8_t key[COAP_KEYSTORE_MAX_KEY_LENGTH];
+
+  ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(ctx != NULL);
+  memset(&session, 0, sizeof(session));
+  session.context = ctx;
+
+  coap_context_set_psk(ctx, "", (const uint8_t *)"default", 7);
+  coap_context_set_keystore(ctx, keystore);
+  CU_ASSERT(ctx->get_server_psk(&session, (const uint8_t *)"frank", 5,
+                                key, sizeof(key)) == 2);
+  CU_ASSERT(memcmp(key, "\x00\xff", 2) == 0);
+  CU_ASSERT(ctx->get_server_psk(&session, (const uint8_t *)"nobody", 6,
+                                key, sizeof(key)) == 7);
+
+  /* the context releases the keystore */
+  coap_free_context(ctx);
+  keystore = coap_new_keystore();
+  CU_ASSERT(keystore != NULL);
+}
+
+static int
+t_keystore_tests_create(void) {
+  keystore = coap_new_keystore();
+  return keystore == NULL;
+}
+
+static int
+t_keystore_tests_remove(void) {
+  coap_free_keystore(keystore);
+  remove(TEST_FILE);
+  return 0;
+}
+
+CU_pSuite
+t_init_keystore_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("PSK keystore", t_keystore_tests_create,
+                       t_keystore_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add PSK keystore test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define KEYSTORE_TEST(s,t)					      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add PSK keystore test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  KEYSTORE_TEST(suite, t_keystore1);
+  KEYSTORE_TEST(suite, t_keystore2);
+  KEYSTORE_TEST(suite, t_keystore3);
+  KEYSTORE_TEST(suite, t_keystore4);
+
+  return suite;
+}
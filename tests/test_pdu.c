@@ -247,6 +247,27 @@ t_parse_pdu14(void) {
   CU_ASSERT(result == 0);
 }
 
+static void
+t_parse_pdu15(void) {
+  /* parsed in place, as received by a DTLS library */
+  uint8_t teststr[] = {  0x52, 0x01, 0x12, 0x34, 't', 'k',
+                      0xb4, 't', 'e', 's', 't', 0xff, 'd', 'a', 't', 'a'
+  };
+  int result;
+
+  memcpy(pdu->hdr, teststr, sizeof(teststr));
+  result = coap_pdu_parse((unsigned char *)pdu->hdr, sizeof(teststr), pdu);
+  CU_ASSERT(result > 0);
+
+  CU_ASSERT(pdu->length == sizeof(teststr));
+  CU_ASSERT(pdu->hdr->version == 1);
+  CU_ASSERT(pdu->hdr->type == COAP_MESSAGE_NON);
+  CU_ASSERT(pdu->hdr->token_length == 2);
+  CU_ASSERT(pdu->hdr->code == COAP_REQUEST_GET);
+  CU_ASSERT(memcmp(pdu->hdr, teststr, sizeof(teststr)) == 0);
+  CU_ASSERT(pdu->data == (unsigned char *)pdu->hdr + 12);
+}
+
 /************************************************************************
  ** PDU encoder
  ************************************************************************/
@@ -665,6 +686,7 @@ t_init_pdu_tests(void) {
   PDU_TEST(suite[0], t_parse_pdu12);
   PDU_TEST(suite[0], t_parse_pdu13);
   PDU_TEST(suite[0], t_parse_pdu14);
+  PDU_TEST(suite[0], t_parse_pdu15);
 
   suite[1] = CU_add_suite("pdu encoder", t_pdu_tests_create, t_pdu_tests_remove);
   if (suite[1]) {
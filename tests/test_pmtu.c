@@ -0,0 +1,200 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_pmtu.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_BODY_SIZE 3000
+#define TEST_PORT 5700
+#define TEST_DEADLINE 10	/* seconds */
+
+static coap_context_t *server_ctx; /* Serves the resource */
+static coap_context_t *client_ctx; /* Runs the transfer */
+static coap_endpoint_t *endpoint; /* Endpoint of server_ctx */
+static coap_session_t *session;	/* Client session to server_ctx */
+static unsigned char body[TEST_BODY_SIZE];
+
+static size_t fetched_length;
+static size_t max_chunk;	/* Largest chunk passed to fetch_handler() */
+static int fetch_done;		/* Set when fetch_handler() has seen the end */
+
+static void
+hnd_get(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *s, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  (void)ctx;
+  (void)token;
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_data_large_response(resource, s, request, response,
+                               sizeof(body), body, NULL, NULL);
+}
+
+static void
+fetch_handler(coap_session_t *s, unsigned char code, size_t offset,
+              const uint8_t *data, size_t length, int last, void *app_ptr) {
+  (void)s;
+  (void)code;
+  (void)app_ptr;
+
+  CU_ASSERT(offset == fetched_length);
+  CU_ASSERT(data == NULL || memcmp(data, body + offset, length) == 0);
+  fetched_length = offset + length;
+  if (length > max_chunk)
+    max_chunk = length;
+  if (last)
+    fetch_done = 1;
+}
+
+/* The session MTU follows the path MTU up to the configured value. */
+static void
+t_pmtu1(void) {
+  unsigned int max_mtu = session->max_mtu;
+
+  CU_ASSERT(session->mtu == COAP_DEFAULT_PDU_SIZE);
+  CU_ASSERT(coap_session_max_block_szx(session) == COAP_MAX_BLOCK_SZX);
+
+  coap_session_set_path_mtu(session, 548);
+  CU_ASSERT(session->mtu == 548);
+  CU_ASSERT(coap_session_max_block_szx(session) == 4);
+
+  coap_session_set_path_mtu(session, 65507);
+  CU_ASSERT(session->mtu == max_mtu);
+  CU_ASSERT(coap_session_max_block_szx(session) == COAP_MAX_BLOCK_SZX);
+
+  coap_session_set_path_mtu(session, 0);
+  CU_ASSERT(session->mtu == max_mtu);
+}
+
+/* Discovery on loopback keeps the configured MTU as upper bound. */
+static void
+t_pmtu2(void) {
+  if (!coap_session_set_pmtu_discovery(session, 1)) {
+    /* not supported on this platform */
+    CU_ASSERT(coap_endpoint_set_pmtu_discovery(endpoint, 1) == 0);
+    return;
+  }
+  CU_ASSERT(session->mtu == COAP_DEFAULT_PDU_SIZE);
+
+  coap_session_set_mtu(session, 1400);
+  CU_ASSERT(coap_session_set_pmtu_discovery(session, 1));
+  CU_ASSERT(session->mtu == 1400);
+
+  coap_session_set_path_mtu(session, 548);
+  CU_ASSERT(coap_session_set_pmtu_discovery(session, 0));
+  CU_ASSERT(session->mtu == 1400);
+
+  CU_ASSERT(coap_endpoint_set_pmtu_discovery(endpoint, 1));
+  coap_session_set_mtu(session, COAP_DEFAULT_PDU_SIZE);
+}
+
+/* A client request asks for blocks that fit into the session MTU. */
+static void
+t_pmtu3(void) {
+  coap_pdu_t *request;
+  coap_tick_t start, now;
+
+  fetched_length = 0;
+  max_chunk = 0;
+  fetch_done = 0;
+
+  coap_session_set_path_mtu(session, 300);
+  CU_ASSERT(coap_session_max_block_szx(session) == 3);
+
+  request = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0,
+                          COAP_DEFAULT_PDU_SIZE);
+  coap_add_option(request, COAP_OPTION_URI_PATH, 5,
+                  (const unsigned char *)"large");
+  CU_ASSERT_PTR_NOT_NULL(coap_block_fetch(session, request,
+                                          COAP_MAX_BLOCK_SZX, 1,
+                                          fetch_handler, NULL));
+  coap_delete_pdu(request);
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(client_ctx, 2);
+    coap_ticks(&now);
+  } while (!fetch_done && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+
+  CU_ASSERT(fetch_done);
+  CU_ASSERT(fetched_length == sizeof(body));
+  CU_ASSERT(max_chunk == 128);
+}
+
+static int
+t_pmtu_tests_create(void) {
+  coap_address_t addr;
+  coap_resource_t *r;
+  size_t n;
+
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 7 + (n >> 8));
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(TEST_PORT);
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !client_ctx)
+    return 1;
+  endpoint = coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP);
+  if (!endpoint)
+    return 1;
+
+  r = coap_resource_init((unsigned char *)"large", 5, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server_ctx, r);
+
+  session = coap_new_client_session(client_ctx, NULL, &addr, COAP_PROTO_UDP);
+  return session == NULL;
+}
+
+static int
+t_pmtu_tests_remove(void) {
+  coap_session_release(session);
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_pmtu_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("path MTU", t_pmtu_tests_create, t_pmtu_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add path MTU test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define PMTU_TEST(s,t)						      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add path MTU test (%s)\n",	      \
+	    CU_get_error_msg());				      \
+  }
+
+  PMTU_TEST(suite, t_pmtu1);
+  PMTU_TEST(suite, t_pmtu2);
+  PMTU_TEST(suite, t_pmtu3);
+
+  return suite;
+}
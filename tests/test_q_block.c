@@ -0,0 +1,405 @@
+/* libcoap unit tests
+ *
+ * Copyright (C) 2017 Olaf Bergmann <bergmann@tzi.org>
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_q_block.h"
+
+#include <coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WITHOUT_Q_BLOCK
+
+#define TEST_BODY_SIZE 20000
+#define TEST_PORT 5699
+#define TEST_SZX 4		/* 256 byte blocks, i.e. 79 blocks in 8 sets */
+#define TEST_NON_TIMEOUT 20	/* milliseconds */
+#define TEST_DEADLINE 60	/* seconds */
+
+/* Packets dropped by the lossy tests, counted from the start of the
+ * transfer. Fixed numbers keep the tests reproducible. */
+#define TEST_LOSS "3,8,14-15,27,40,52-53,66,79,85-86"
+
+static coap_context_t *server_ctx; /* Serves the resources */
+static coap_context_t *client_ctx; /* Runs the transfers */
+static coap_session_t *session;	/* Client session to server_ctx */
+static unsigned char body[TEST_BODY_SIZE];
+static int get_calls;		/* Number of calls to hnd_get() */
+
+static unsigned char fetched[TEST_BODY_SIZE]; /* Body passed to fetch_handler() */
+static size_t fetched_length;
+static unsigned char fetch_code; /* Code of the last call to fetch_handler() */
+static int fetch_done;		/* Set when fetch_handler() has seen the end */
+
+static unsigned char uploaded[TEST_BODY_SIZE]; /* Body received by hnd_put() */
+static size_t uploaded_length;
+static int put_calls;		/* Number of calls to hnd_put() */
+static unsigned char send_code;	/* Code passed to send_handler() */
+static int send_done;		/* Set when send_handler() has been called */
+
+/* Responses seen by raw_handler() for requests sent by the tests */
+static unsigned char raw_seen[(TEST_BODY_SIZE >> (TEST_SZX + 4)) + 1];
+static unsigned int raw_blocks;	/* Distinct Q-Block2 blocks received */
+static int raw_408;		/* 4.08 responses received */
+static int raw_231;		/* 2.31 responses received */
+
+static void
+hnd_get(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *s, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  (void)ctx;
+  (void)token;
+
+  get_calls++;
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_data_large_response(resource, s, request, response,
+                               sizeof(body), body, NULL, NULL);
+}
+
+static void
+hnd_put(coap_context_t *ctx, coap_resource_t *resource,
+        coap_session_t *s, coap_pdu_t *request, str *token,
+        coap_pdu_t *response) {
+  size_t length;
+  const uint8_t *data;
+  void *app_ptr;
+
+  (void)ctx;
+  (void)resource;
+  (void)token;
+
+  put_calls++;
+  if (coap_get_data_large_request(s, request, &length, &data, &app_ptr)
+      && data && length <= sizeof(uploaded)) {
+    memcpy(uploaded, data, length);
+    uploaded_length = length;
+  }
+  response->hdr->code = COAP_RESPONSE_CODE(204);
+}
+
+static void
+fetch_handler(coap_session_t *s, unsigned char code, size_t offset,
+              const uint8_t *data, size_t length, int last, void *app_ptr) {
+  (void)s;
+  (void)app_ptr;
+
+  fetch_code = code;
+  CU_ASSERT(offset == fetched_length);
+  if (data && offset + length <= sizeof(fetched)) {
+    memcpy(fetched + offset, data, length);
+    fetched_length = offset + length;
+  }
+  if (last)
+    fetch_done = 1;
+}
+
+static void
+send_handler(coap_session_t *s, unsigned char code, coap_pdu_t *response,
+             void *app_ptr) {
+  coap_block_t block;
+
+  (void)s;
+  (void)app_ptr;
+
+  send_code = code;
+  send_done = 1;
+  if (response && code == COAP_RESPONSE_CODE(204)) {
+    CU_ASSERT(coap_get_block(response, COAP_OPTION_Q_BLOCK1, &block));
+    CU_ASSERT(block.m == 0);
+  }
+}
+
+static void
+raw_handler(coap_context_t *ctx, coap_session_t *s, coap_pdu_t *sent,
+            coap_pdu_t *received, const coap_tid_t id) {
+  coap_block_t block;
+
+  (void)ctx;
+  (void)s;
+  (void)sent;
+  (void)id;
+
+  if (received->hdr->code == COAP_RESPONSE_CODE(408))
+    raw_408++;
+  else if (received->hdr->code == COAP_RESPONSE_CODE(231))
+    raw_231++;
+  else if (coap_get_block(received, COAP_OPTION_Q_BLOCK2, &block)
+           && block.num < sizeof(raw_seen) && !raw_seen[block.num]) {
+    raw_seen[block.num] = 1;
+    raw_blocks++;
+  }
+}
+
+/* Runs both contexts for ms milliseconds. */
+static void
+run_for(unsigned int ms) {
+  coap_tick_t start, now;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(client_ctx, 2);
+    coap_ticks(&now);
+  } while (now - start < (coap_tick_t)ms * COAP_TICKS_PER_SECOND / 1000);
+}
+
+/* Sends a request with the token "raw" that bypasses the transfer
+ * engines of the client, optionally with block num of payload. */
+static void
+send_raw(unsigned char code, const char *path, unsigned short type,
+         unsigned int num, int more) {
+  coap_pdu_t *request;
+  unsigned char buf[4];
+
+  request = coap_pdu_init(COAP_MESSAGE_NON, code,
+                          coap_new_message_id(client_ctx),
+                          COAP_DEFAULT_PDU_SIZE);
+  coap_add_token(request, 3, (const unsigned char *)"raw");
+  coap_add_option(request, COAP_OPTION_URI_PATH, (unsigned int)strlen(path),
+                  (const unsigned char *)path);
+  coap_add_option(request, type,
+                  coap_encode_var_bytes(buf, (num << 4) | (more << 3)
+                                        | TEST_SZX), buf);
+  if (type == COAP_OPTION_Q_BLOCK1)
+    coap_add_block(request, sizeof(body), body, num, TEST_SZX);
+  CU_ASSERT(coap_send(session, request) != COAP_INVALID_TID);
+}
+
+/* Runs both contexts until *done is set or the deadline has passed. */
+static void
+run_until(int *done) {
+  coap_tick_t start, now;
+
+  coap_ticks(&start);
+  do {
+    coap_run_once(server_ctx, 2);
+    coap_run_once(client_ctx, 2);
+    coap_ticks(&now);
+  } while (!*done && now - start < TEST_DEADLINE * COAP_TICKS_PER_SECOND);
+}
+
+static coap_pdu_t *
+make_request(unsigned char code, const char *path) {
+  coap_pdu_t *request;
+
+  request = coap_pdu_init(COAP_MESSAGE_NON, code, 0, COAP_DEFAULT_PDU_SIZE);
+  coap_add_option(request, COAP_OPTION_URI_PATH, (unsigned int)strlen(path),
+                  (const unsigned char *)path);
+  return request;
+}
+
+static void
+fetch(const char *loss) {
+  coap_pdu_t *request;
+
+  memset(fetched, 0, sizeof(fetched));
+  fetched_length = 0;
+  fetch_code = 0;
+  fetch_done = 0;
+
+  request = make_request(COAP_REQUEST_GET, "large");
+  coap_debug_set_packet_loss(loss);
+  CU_ASSERT_PTR_NOT_NULL(coap_q_block_fetch(session, request, TEST_SZX,
+                                            fetch_handler, NULL));
+  coap_delete_pdu(request);
+  run_until(&fetch_done);
+  coap_debug_set_packet_loss("0%");
+
+  CU_ASSERT(fetch_done);
+  CU_ASSERT(fetch_code == COAP_RESPONSE_CODE(205));
+  CU_ASSERT(fetched_length == sizeof(body));
+  CU_ASSERT(memcmp(fetched, body, sizeof(body)) == 0);
+}
+
+static void
+upload(const char *loss) {
+  coap_pdu_t *request;
+
+  memset(uploaded, 0, sizeof(uploaded));
+  uploaded_length = 0;
+  put_calls = 0;
+  send_code = 0;
+  send_done = 0;
+
+  request = make_request(COAP_REQUEST_PUT, "upload");
+  coap_debug_set_packet_loss(loss);
+  CU_ASSERT_PTR_NOT_NULL(coap_q_block_send(session, request, TEST_SZX,
+                                           sizeof(body), body, NULL,
+                                           send_handler, NULL));
+  coap_delete_pdu(request);
+  run_until(&send_done);
+  coap_debug_set_packet_loss("0%");
+
+  CU_ASSERT(send_done);
+  CU_ASSERT(put_calls >= 1);
+  CU_ASSERT(uploaded_length == sizeof(body));
+  CU_ASSERT(memcmp(uploaded, body, sizeof(body)) == 0);
+}
+
+static void
+t_q_block2_1(void) {
+  get_calls = 0;
+  fetch("0%");
+  CU_ASSERT(send_code == 0);
+
+  /* the handler creates the representation once, later sets are
+   * served from the representation kept by the library */
+  CU_ASSERT(get_calls == 1);
+}
+
+static void
+t_q_block2_2(void) {
+  fetch(TEST_LOSS);
+}
+
+static void
+t_q_block1_1(void) {
+  upload("0%");
+  CU_ASSERT(send_code == COAP_RESPONSE_CODE(204));
+  CU_ASSERT(put_calls == 1);
+}
+
+static void
+t_q_block1_2(void) {
+  upload(TEST_LOSS);
+  CU_ASSERT(send_code == COAP_RESPONSE_CODE(204));
+}
+
+/* The server pushes the next set when the client does not ask for it,
+ * but only for a limited number of sets without requests. */
+static void
+t_q_block2_3(void) {
+  memset(raw_seen, 0, sizeof(raw_seen));
+  raw_blocks = 0;
+  coap_register_response_handler(client_ctx, raw_handler);
+
+  send_raw(COAP_REQUEST_GET, "large", COAP_OPTION_Q_BLOCK2, 0, 1);
+  run_for(20 * TEST_NON_TIMEOUT);
+  CU_ASSERT(raw_blocks == (1 + COAP_NON_MAX_RETRANSMIT)
+            * COAP_Q_BLOCK_MAX_PAYLOADS);
+
+  /* a request for the next set starts pushing again */
+  send_raw(COAP_REQUEST_GET, "large", COAP_OPTION_Q_BLOCK2, raw_blocks, 1);
+  run_for(20 * TEST_NON_TIMEOUT);
+  CU_ASSERT(raw_blocks == sizeof(raw_seen));
+
+  coap_register_response_handler(client_ctx, NULL);
+}
+
+/* The server reports missing blocks again after NON_RECEIVE_TIMEOUT, but
+ * only COAP_NON_MAX_RETRANSMIT times without progress. */
+static void
+t_q_block1_3(void) {
+  unsigned int num;
+
+  raw_408 = raw_231 = 0;
+  coap_register_response_handler(client_ctx, raw_handler);
+
+  for (num = 0; num < COAP_Q_BLOCK_MAX_PAYLOADS; num++) {
+    if (num != 2)
+      send_raw(COAP_REQUEST_PUT, "upload", COAP_OPTION_Q_BLOCK1, num, 1);
+  }
+  run_until(&raw_408);
+  CU_ASSERT(raw_408 == 1);
+
+  run_for(20 * TEST_NON_TIMEOUT);
+  CU_ASSERT(raw_408 == 1 + COAP_NON_MAX_RETRANSMIT);
+
+  send_raw(COAP_REQUEST_PUT, "upload", COAP_OPTION_Q_BLOCK1, 2, 1);
+  run_until(&raw_231);
+  CU_ASSERT(raw_231 == 1);
+  CU_ASSERT(raw_408 == 1 + COAP_NON_MAX_RETRANSMIT);
+
+  coap_register_response_handler(client_ctx, NULL);
+}
+
+static int
+t_q_block_tests_create(void) {
+  coap_address_t addr;
+  coap_resource_t *r;
+  size_t n;
+
+  for (n = 0; n < sizeof(body); n++)
+    body[n] = (unsigned char)(n * 13 + (n >> 8));
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(TEST_PORT);
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  if (!server_ctx || !client_ctx
+      || !coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP))
+    return 1;
+
+  r = coap_resource_init((unsigned char *)"large", 5, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get);
+  coap_add_resource(server_ctx, r);
+  r = coap_resource_init((unsigned char *)"upload", 6,
+                         COAP_RESOURCE_FLAGS_REASSEMBLE_BLOCK1);
+  coap_register_handler(r, COAP_REQUEST_PUT, hnd_put);
+  coap_add_resource(server_ctx, r);
+
+  coap_context_set_non_timeout(server_ctx, TEST_NON_TIMEOUT);
+  coap_context_set_non_timeout(client_ctx, TEST_NON_TIMEOUT);
+  session = coap_new_client_session(client_ctx, NULL, &addr, COAP_PROTO_UDP);
+  return session == NULL;
+}
+
+static int
+t_q_block_tests_remove(void) {
+  coap_debug_set_packet_loss("0%");
+  coap_session_release(session);
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_q_block_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("Q-Block transfer", t_q_block_tests_create,
+                       t_q_block_tests_remove);
+  if (!suite) {			/* signal error */
+    fprintf(stderr, "W: cannot add Q-Block transfer test suite (%s)\n",
+	    CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define Q_BLOCK_TEST(s,t)					      \
+  if (!CU_ADD_TEST(s,t)) {					      \
+    fprintf(stderr, "W: cannot add Q-Block transfer test (%s)\n",     \
+	    CU_get_error_msg());				      \
+  }
+
+  Q_BLOCK_TEST(suite, t_q_block2_1);
+  Q_BLOCK_TEST(suite, t_q_block2_2);
+  Q_BLOCK_TEST(suite, t_q_block1_1);
+  Q_BLOCK_TEST(suite, t_q_block1_2);
+  Q_BLOCK_TEST(suite, t_q_block2_3);
+  Q_BLOCK_TEST(suite, t_q_block1_3);
+
+  return suite;
+}
+
+#else /* WITHOUT_Q_BLOCK */
+
+CU_pSuite
+t_init_q_block_tests(void) {
+  return NULL;
+}
+
+#endif /* WITHOUT_Q_BLOCK */
@@ -267,6 +267,40 @@ t_sendqueue10(void) {
   CU_ASSERT(tmp_node->t == timestamp[2]);
 }
 
+/* transactions of the same session must be told apart by their id */
+static void
+t_sendqueue11(void) {
+  coap_queue_t *queue = NULL, *tmp_node = NULL;
+  coap_queue_t *n[3];
+  size_t i;
+
+  for (i = 0; i < sizeof(n)/sizeof(coap_queue_t *); i++) {
+    n[i] = coap_new_node();
+    CU_ASSERT_PTR_NOT_NULL(n[i]);
+    if (!n[i]) {
+      coap_delete_all(queue);
+      return;
+    }
+    n[i]->id = i + 1;
+    n[i]->t = (i + 1) * 10;
+    n[i]->session = coap_session_reference(session);
+    coap_insert_node(&queue, n[i]);
+  }
+
+  CU_ASSERT_PTR_EQUAL(coap_find_transaction(queue, session, 2), n[1]);
+  CU_ASSERT_PTR_EQUAL(coap_find_transaction(queue, session, 3), n[2]);
+  CU_ASSERT_PTR_NULL(coap_find_transaction(queue, session, 4));
+
+  CU_ASSERT(coap_remove_from_queue(&queue, session, 3, &tmp_node) == 1);
+  CU_ASSERT_PTR_EQUAL(tmp_node, n[2]);
+  CU_ASSERT_PTR_EQUAL(queue, n[0]);
+  CU_ASSERT_PTR_EQUAL(queue->next, n[1]);
+  CU_ASSERT_PTR_NULL(queue->next->next);
+
+  coap_delete_node(tmp_node);
+  coap_delete_all(queue);
+}
+
 /* This function creates a set of nodes for testing. These nodes
  * will exist for all tests and are modified by coap_insert_node()
  * and coap_remove_from_queue().
@@ -352,6 +386,7 @@ t_init_sendqueue_tests(void) {
   SENDQUEUE_TEST(suite, t_sendqueue8);
   SENDQUEUE_TEST(suite, t_sendqueue9);
   SENDQUEUE_TEST(suite, t_sendqueue10);
+  SENDQUEUE_TEST(suite, t_sendqueue11);
 
   return suite;
 }
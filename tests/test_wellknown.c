@@ -19,6 +19,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __GNUC__
+#define UNUSED_PARAM __attribute__ ((unused))
+#else /* not a GCC */
+#define UNUSED_PARAM
+#endif /* GCC */
+
 #define TEST_PDU_SIZE 120
 #define TEST_URI_LEN    4
 
@@ -248,6 +254,213 @@ t_wellknown6(void) {
   } while (block.m == 1);
 }
 
+/* Returns the .well-known/core representation for the given query
+ * filter (NUL-terminated in buf). */
+static size_t
+wellknown_filtered(const char *query, unsigned char *buf, size_t buflen) {
+  coap_print_status_t result;
+  unsigned char opt[40];
+  size_t len = buflen - 1;
+
+  if (!coap_opt_encode((coap_opt_t *)opt, sizeof(opt), COAP_OPTION_URI_QUERY,
+                       (const unsigned char *)query, strlen(query)))
+    return 0;
+
+  result = coap_print_wellknown(ctx, buf, &len, 0, (coap_opt_t *)opt);
+  CU_ASSERT((result & COAP_PRINT_STATUS_MASK) == 0);
+
+  buf[COAP_PRINT_OUTPUT_LENGTH(result)] = '\0';
+  return COAP_PRINT_OUTPUT_LENGTH(result);
+}
+
+/* Query filters on attributes registered before and after the
+ * resource has been added to the context. */
+static void
+t_wellknown7(void) {
+  coap_resource_t *r1, *r2;
+  coap_attr_t *attr;
+  unsigned char buf[120];
+
+  r1 = coap_resource_init((unsigned char *)"s/temp", 6, 0);
+  coap_add_attr(r1, (unsigned char *)"rt", 2,
+                (unsigned char *)"\"temperature-c core.s\"", 22, 0);
+  coap_add_resource(ctx, r1);
+
+  r2 = coap_resource_init((unsigned char *)"s/light", 7, 0);
+  coap_add_resource(ctx, r2);
+  attr = coap_add_attr(r2, (unsigned char *)"rt", 2,
+                       (unsigned char *)"\"light-lux core.s\"", 18, 0);
+  coap_add_attr(r2, (unsigned char *)"ct", 2, (unsigned char *)"41", 2, 0);
+
+  wellknown_filtered("rt=temperature-c", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf, "</s/temp>;rt=\"temperature-c core.s\"") == 0);
+
+  /* filtered links are listed in the order of the unfiltered listing */
+  wellknown_filtered("rt=core.s", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf, "</s/temp>;rt=\"temperature-c core.s\","
+                   "</s/light>;ct=41;rt=\"light-lux core.s\"") == 0);
+
+  wellknown_filtered("rt=l*", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf,
+                   "</s/light>;ct=41;rt=\"light-lux core.s\"") == 0);
+
+  /* tokens are split for rt, if, and rel only */
+  CU_ASSERT(wellknown_filtered("rt=temperature", buf, sizeof(buf)) == 0);
+  CU_ASSERT(wellknown_filtered("ct=4", buf, sizeof(buf)) == 0);
+  wellknown_filtered("ct=4*", buf, sizeof(buf));
+  CU_ASSERT(strncmp((char *)buf, "</s/light>", 10) == 0);
+
+  wellknown_filtered("if=one", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf, "</abcd>;if=\"one\";obs") == 0);
+
+  wellknown_filtered("href=/s/light", buf, sizeof(buf));
+  CU_ASSERT(strncmp((char *)buf, "</s/light>", 10) == 0);
+
+  coap_delete_attr(attr);
+  wellknown_filtered("rt=core.s", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf, "</s/temp>;rt=\"temperature-c core.s\"") == 0);
+  CU_ASSERT(wellknown_filtered("rt=light-lux", buf, sizeof(buf)) == 0);
+
+  coap_delete_resource(ctx, r1->key);
+  CU_ASSERT(wellknown_filtered("rt=core*", buf, sizeof(buf)) == 0);
+}
+
+/* Compact resources share handlers and attributes of their class. */
+static void
+t_wellknown8(void) {
+  coap_resource_class_t *rclass;
+  coap_resource_t *r;
+  coap_key_t key;
+  unsigned char buf[120];
+  char uri[8];
+  int i;
+
+  rclass = coap_resource_class_init(0);
+  CU_ASSERT_PTR_NOT_NULL(rclass);
+  if (!rclass)
+    return;
+
+  coap_resource_class_add_attr(rclass, (unsigned char *)"ct", 2,
+                               (unsigned char *)"0", 1, 0);
+  coap_add_resource_class(ctx, rclass);
+  coap_resource_class_add_attr(rclass, (unsigned char *)"rt", 2,
+                               (unsigned char *)"\"dev\"", 5, 0);
+
+  for (i = 0; i < 3; i++) {
+    /* the URI is copied, uri may be reused */
+    snprintf(uri, sizeof(uri), "d/%d", i);
+    r = coap_resource_init_compact(rclass, (unsigned char *)uri, strlen(uri));
+    CU_ASSERT_PTR_NOT_NULL(r);
+    if (r)
+      coap_add_resource(ctx, r);
+  }
+
+  coap_hash_path((unsigned char *)"d/1", 3, key);
+  r = coap_get_resource_from_key(ctx, key);
+  CU_ASSERT_PTR_NOT_NULL(r);
+  if (!r)
+    return;
+
+  coap_add_attr(r, (unsigned char *)"title", 5, (unsigned char *)"x", 1, 0);
+  CU_ASSERT_PTR_NOT_NULL(coap_find_attr(r, (unsigned char *)"ct", 2));
+
+  wellknown_filtered("title=x", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf, "</d/1>;title=x;rt=\"dev\";ct=0") == 0);
+
+  CU_ASSERT(wellknown_filtered("rt=dev", buf, sizeof(buf)) > 0);
+  CU_ASSERT(strstr((char *)buf, "</d/0>") != NULL);
+  CU_ASSERT(strstr((char *)buf, "</d/1>") > strstr((char *)buf, "</d/0>"));
+  CU_ASSERT(strstr((char *)buf, "</d/2>") > strstr((char *)buf, "</d/1>"));
+
+  coap_delete_resource(ctx, key);
+  wellknown_filtered("rt=dev", buf, sizeof(buf));
+  CU_ASSERT(strstr((char *)buf, "</d/1>") == NULL);
+  CU_ASSERT(strstr((char *)buf, "</d/2>") != NULL);
+}
+
+static void
+t_static_get(coap_context_t *context UNUSED_PARAM,
+             struct coap_resource_t *resource UNUSED_PARAM,
+             coap_session_t *sess UNUSED_PARAM,
+             coap_pdu_t *request UNUSED_PARAM,
+             str *token UNUSED_PARAM,
+             coap_pdu_t *response UNUSED_PARAM) {
+}
+
+static const coap_static_attr_t t_static_attrs[] = {
+  COAP_STATIC_ATTR("rt", "\"fw.version\""),
+  COAP_STATIC_ATTR("ct", "0"),
+  COAP_STATIC_ATTR_END
+};
+
+static const coap_static_resource_t t_static_resources[] = {
+  { COAP_STR_LITERAL("fw/version"), 0, 0,
+    { t_static_get }, t_static_attrs },
+  { COAP_STR_LITERAL("fw/reset"), 0, 0,
+    { NULL, t_static_get }, NULL }
+};
+
+/* Resources from a static table use the handlers and attributes of
+ * their description. */
+static void
+t_wellknown9(void) {
+  static coap_resource_t storage[2];
+  coap_key_t key;
+  coap_resource_t *r;
+  const coap_attr_t *attr;
+  unsigned char buf[120];
+
+  coap_add_static_resources(ctx, t_static_resources, 2, storage);
+
+  coap_hash_path((unsigned char *)"fw/reset", 8, key);
+  r = coap_get_resource_from_key(ctx, key);
+  CU_ASSERT(r == &storage[1]);
+  if (!r)
+    return;
+  CU_ASSERT(coap_resource_get_handler(r, COAP_REQUEST_GET) == NULL);
+  CU_ASSERT(coap_resource_get_handler(r, COAP_REQUEST_POST) == t_static_get);
+
+  attr = coap_find_attr(&storage[0], (unsigned char *)"ct", 2);
+  CU_ASSERT(attr == &t_static_attrs[1]);
+  CU_ASSERT(coap_find_attr(r, (unsigned char *)"ct", 2) == NULL);
+
+  wellknown_filtered("rt=fw.version", buf, sizeof(buf));
+  CU_ASSERT(strcmp((char *)buf, "</fw/version>;rt=\"fw.version\";ct=0") == 0);
+
+  wellknown_filtered("href=/fw*", buf, sizeof(buf));
+  CU_ASSERT(strstr((char *)buf, "</fw/reset>") != NULL);
+
+  /* static resources stay registered */
+  CU_ASSERT(coap_delete_resource(ctx, key) == 0);
+  CU_ASSERT(coap_get_resource_from_key(ctx, key) == &storage[1]);
+}
+
+/* Only the first attribute of a name is matched, as coap_find_attr()
+ * returns it, whether or not the attribute index is used. */
+static void
+t_wellknown10(void) {
+  coap_resource_t *r;
+  unsigned char buf[120];
+  int incomplete;
+
+  r = coap_resource_init((unsigned char *)"dup", 3, 0);
+  coap_add_attr(r, (unsigned char *)"rt", 2, (unsigned char *)"old", 3, 0);
+  coap_add_resource(ctx, r);
+  coap_add_attr(r, (unsigned char *)"rt", 2, (unsigned char *)"new", 3, 0);
+
+  for (incomplete = 0; incomplete < 2; incomplete++) {
+    ctx->attr_index_incomplete = incomplete;
+
+    wellknown_filtered("rt=new", buf, sizeof(buf));
+    CU_ASSERT(strcmp((char *)buf, "</dup>;rt=new;rt=old") == 0);
+    CU_ASSERT(wellknown_filtered("rt=old", buf, sizeof(buf)) == 0);
+    CU_ASSERT(wellknown_filtered("rt=o*", buf, sizeof(buf)) == 0);
+  }
+
+  ctx->attr_index_incomplete = 0;
+  coap_delete_resource(ctx, r->key);
+}
+
 static int
 t_wkc_tests_create(void) {
   coap_address_t addr;
@@ -332,6 +545,10 @@ t_init_wellknown_tests(void) {
   WKC_TEST(suite, t_wellknown4);
   WKC_TEST(suite, t_wellknown5);
   WKC_TEST(suite, t_wellknown6);
+  WKC_TEST(suite, t_wellknown7);
+  WKC_TEST(suite, t_wellknown8);
+  WKC_TEST(suite, t_wellknown9);
+  WKC_TEST(suite, t_wellknown10);
 
   return suite;
 }
@@ -11,6 +11,18 @@
 #include "test_error_response.h"
 #include "test_sendqueue.h"
 #include "test_wellknown.h"
+#include "test_cache.h"
+#include "test_block.h"
+#include "test_q_block.h"
+#include "test_file.h"
+#include "test_pmtu.h"
+#include "test_jumbo.h"
+#include "test_async.h"
+#include "test_completion.h"
+#include "test_batch.h"
+#include "test_dtls.h"
+#include "test_keystore.h"
+#include "test_hello.h"
 #include "libcoap.h"
 
 #ifdef __GNUC__
@@ -36,6 +48,18 @@ main(int argc UNUSED_PARAM, char **argv UNUSED_PARAM) {
   t_init_error_response_tests();
   t_init_sendqueue_tests();
   t_init_wellknown_tests();
+  t_init_cache_tests();
+  t_init_block_tests();
+  t_init_q_block_tests();
+  t_init_file_tests();
+  t_init_pmtu_tests();
+  t_init_jumbo_tests();
+  t_init_async_tests();
+  t_init_completion_tests();
+  t_init_batch_tests();
+  t_init_dtls_tests();
+  t_init_keystore_tests();
+  t_init_hello_tests();
 
   CU_basic_set_mode(run_mode);
   result = CU_basic_run_tests();